@@ -0,0 +1,380 @@
+// Headless micro-benchmarks of ShellBeats' hot paths, built from the same
+// sources by "make bench". Synthetic playlists, downloaded files and queue
+// entries are generated in a temporary HOME, each path is timed over
+// repeated runs, and one JSON object per benchmark is printed to stdout:
+//
+//   {"bench": "load_playlist_songs", "runs": 10, "items": 5000,
+//    "min_us": ..., "median_us": ..., "mean_us": ..., "ns_per_item": ...}
+//
+// Progress notes go to stderr, so stdout can be saved and compared across
+// builds.
+
+#define SHELLBEATS_NO_MAIN
+
+// Functions only main() uses are unused here
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+#include "shellbeats.c"
+#include "youtube_playlist.c"
+
+#define BENCH_MAX_RUNS 1000
+
+typedef struct {
+    int runs;
+    int playlists;
+    int songs;       // per playlist
+    int files;       // downloaded files, spread over the playlists
+} BenchConfig;
+
+static long long bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Print the summary of runs timings (ns) of a benchmark covering items items
+static void bench_report(const char *name, long long *times, int runs, long items) {
+    qsort(times, (size_t)runs, sizeof(times[0]), compare_ll);
+
+    long long total = 0;
+    for (int i = 0; i < runs; i++) total += times[i];
+
+    long long median = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    double mean = (double)total / runs;
+
+    printf("{\"bench\": \"%s\", \"runs\": %d, \"items\": %ld, "
+           "\"min_us\": %.1f, \"median_us\": %.1f, \"mean_us\": %.1f, \"ns_per_item\": %.1f}\n",
+           name, runs, items, times[0] / 1000.0, median / 1000.0, mean / 1000.0,
+           items > 0 ? (double)median / items : 0.0);
+    fflush(stdout);
+}
+
+// Deterministic pseudo-random titles and ids, so every build sees the same data
+static unsigned int bench_seed = 12345;
+
+static unsigned int bench_rand(void) {
+    bench_seed = bench_seed * 1103515245u + 12345u;
+    return bench_seed >> 8;
+}
+
+static void bench_video_id(int n, char out[16]) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    // Four digits of n keep ids unique; the rest only look random
+    unsigned int h = (unsigned int)n * 2654435761u;
+    for (int i = 0; i < 11; i++) {
+        out[i] = alphabet[i < 4 ? ((unsigned int)n >> (6 * i)) % 64 : (h >> (i * 2)) % 64];
+    }
+    out[11] = '\0';
+}
+
+static void bench_title(char *out, size_t size) {
+    static const char *const words[] = {
+        "Love", "Night", "Dance", "Remix", "Live", "Official", "Video", "Summer",
+        "Heart", "Dream", "Fire", "Blue", "Radio", "Edit", "Acoustic", "Mix",
+    };
+    snprintf(out, size, "%s %s %s - %s (%u)", words[bench_rand() % 16], words[bench_rand() % 16],
+             words[bench_rand() % 16], words[bench_rand() % 16], bench_rand() % 1000);
+}
+
+// ============================================================================
+// Setup
+// ============================================================================
+
+static void bench_init_state(AppState *st, const char *home) {
+    setenv("HOME", home, 1);
+
+    st->playing_index = -1;
+    st->queued_index = -1;
+    st->playing_playlist_idx = -1;
+    st->current_playlist_idx = -1;
+    st->view = VIEW_SEARCH;
+
+    init_download_queue(&st->download_queue);
+    pthread_mutex_init(&st->local_files.mutex, NULL);
+    pthread_mutex_init(&st->import.mutex, NULL);
+    pthread_mutex_init(&st->search.mutex, NULL);
+    st->import.playlist_idx = -1;
+    g_app_state = st;
+
+    init_config_dirs(st);
+    load_config(st);
+    snprintf(st->config.download_path, sizeof(st->config.download_path), "%s/Music", home);
+    st->library.fd = -1;
+}
+
+// Playlists of songs saved as JSON, left unloaded
+static void bench_make_playlists(AppState *st, const BenchConfig *cfg) {
+    char title[128];
+
+    for (int p = 0; p < cfg->playlists; p++) {
+        char name[64];
+        snprintf(name, sizeof(name), "Bench Playlist %d", p);
+        int idx = create_playlist(st, name, false);
+        if (idx < 0) continue;
+
+        Playlist *pl = &st->playlists[idx];
+        for (int i = 0; i < cfg->songs; i++) {
+            Song song = {.title = title, .duration = 60 + (int)(bench_rand() % 400)};
+            bench_title(title, sizeof(title));
+            bench_video_id(p * cfg->songs + i, song.video_id);
+            playlist_append(pl, &song);
+        }
+        save_playlist(st, idx);
+        flush_pending_saves(st);
+
+        pl->stored_count = pl->count;
+        free_playlist_items(pl);
+    }
+}
+
+// Empty audio files named like real downloads, the first files songs of the
+// playlists in turn
+static void bench_make_files(AppState *st, const BenchConfig *cfg) {
+    int per_playlist = (cfg->files + cfg->playlists - 1) / cfg->playlists;
+    int made = 0;
+
+    for (int p = 0; p < cfg->playlists && made < cfg->files; p++) {
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%s/%s", st->config.download_path, st->playlists[p].name);
+        mkdir_p(dir);
+
+        for (int i = 0; i < per_playlist && made < cfg->files; i++, made++) {
+            char id[16], stem[512], path[4608];
+            bench_video_id(p * cfg->songs + i, id);
+            sanitize_title_for_filename("Bench Song", id, stem, sizeof(stem));
+            snprintf(path, sizeof(path), "%s/%s.mp3", dir, stem);
+
+            FILE *f = fopen(path, "w");
+            if (f) fclose(f);
+        }
+    }
+}
+
+// ============================================================================
+// Benchmarks
+// ============================================================================
+
+static void bench_load_playlist_songs(AppState *st, const BenchConfig *cfg, long long *times) {
+    long items = 0;
+    for (int r = 0; r < cfg->runs; r++) {
+        int idx = r % st->playlist_count;
+
+        long long start = bench_now_ns();
+        load_playlist_songs(st, idx);
+        times[r] = bench_now_ns() - start;
+
+        items = st->playlists[idx].count;
+        free_playlist_items(&st->playlists[idx]);
+    }
+    bench_report("load_playlist_songs", times, cfg->runs, items);
+}
+
+static void bench_parse_playlist_lines(const BenchConfig *cfg, long long *times) {
+    // What "yt-dlp --flat-playlist --print" writes for every entry
+    int count = cfg->songs;
+    char **lines = calloc((size_t)count, sizeof(char *));
+    char *scratch = malloc(1024);
+    if (!lines || !scratch) {
+        free(lines);
+        free(scratch);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        char title[128], id[16], line[512];
+        bench_title(title, sizeof(title));
+        bench_video_id(i, id);
+        snprintf(line, sizeof(line), "Bench Mix|||%s|||%s|||%d", title, id, 60 + i % 400);
+        lines[i] = strdup(line);
+    }
+
+    int parsed = 0;
+    for (int r = 0; r < cfg->runs; r++) {
+        parsed = 0;
+        long long start = bench_now_ns();
+        for (int i = 0; i < count; i++) {
+            if (!lines[i]) continue;
+            // The parser splits in place
+            snprintf(scratch, 1024, "%s", lines[i]);
+            char *playlist_title, *title, *video_id;
+            int duration;
+            if (parse_playlist_line(scratch, &playlist_title, &title, &video_id, &duration)) {
+                Song song = {.title = title, .duration = duration};
+                if (song_set_video_id(&song, video_id)) parsed++;
+            }
+        }
+        times[r] = bench_now_ns() - start;
+    }
+    bench_report("parse_playlist_line", times, cfg->runs, parsed);
+
+    for (int i = 0; i < count; i++) free(lines[i]);
+    free(lines);
+    free(scratch);
+}
+
+static void bench_local_files(AppState *st, const BenchConfig *cfg, long long *times) {
+    for (int r = 0; r < cfg->runs; r++) {
+        long long start = bench_now_ns();
+        build_local_file_index(st);
+        times[r] = bench_now_ns() - start;
+    }
+    bench_report("build_local_file_index", times, cfg->runs, st->local_files.count);
+
+    // Every song of the playlists that hold files, so most lookups miss
+    int per_playlist = (cfg->files + cfg->playlists - 1) / cfg->playlists;
+    int playlists = per_playlist > 0 ? (cfg->files + per_playlist - 1) / per_playlist : 0;
+    if (playlists < 1) playlists = 1;
+
+    int found = 0;
+    long lookups = 0;
+    for (int r = 0; r < cfg->runs; r++) {
+        found = 0;
+        lookups = 0;
+        long long start = bench_now_ns();
+        for (int p = 0; p < playlists && p < st->playlist_count; p++) {
+            for (int i = 0; i < cfg->songs; i++) {
+                char id[16], path[4096];
+                bench_video_id(p * cfg->songs + i, id);
+                if (get_local_file_path_for_song(st, st->playlists[p].name, id, path, sizeof(path))) {
+                    found++;
+                }
+                lookups++;
+            }
+        }
+        times[r] = bench_now_ns() - start;
+    }
+    bench_report("get_local_file_path_for_song", times, cfg->runs, lookups);
+    fprintf(stderr, "bench: %d of %ld lookups found a file\n", found, lookups);
+}
+
+static void bench_save_download_queue(AppState *st, const BenchConfig *cfg, long long *times) {
+    DownloadQueue *q = &st->download_queue;
+
+    pthread_mutex_lock(&q->mutex);
+    char title[128];
+    for (int i = 0; i < MAX_DOWNLOAD_QUEUE; i++) {
+        char id[16];
+        bench_title(title, sizeof(title));
+        bench_video_id(1000000 + i, id);
+        queue_add_task(st, id, title, i % 2 ? st->playlists[0].name : NULL);
+    }
+
+    for (int r = 0; r < cfg->runs; r++) {
+        long long start = bench_now_ns();
+        save_download_queue(st);
+        times[r] = bench_now_ns() - start;
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    bench_report("save_download_queue", times, cfg->runs, q->count);
+}
+
+// draw_ui on a terminal that writes to /dev/null
+static void bench_draw_ui(AppState *st, const BenchConfig *cfg, long long *times) {
+    FILE *out = fopen("/dev/null", "w");
+    FILE *in = fopen("/dev/null", "r");
+    const char *term = getenv("TERM");
+    SCREEN *screen = (out && in) ? newterm(term && term[0] ? term : "xterm", out, in) : NULL;
+    if (!screen) {
+        fprintf(stderr, "bench: no terminal for draw_ui, skipped\n");
+        if (out) fclose(out);
+        if (in) fclose(in);
+        return;
+    }
+    set_term(screen);
+    resizeterm(50, 160);
+
+    st->current_playlist_idx = 0;
+    ensure_playlist_loaded(st, 0);
+    st->view = VIEW_PLAYLIST_SONGS;
+    st->playlist_song_selected = 0;
+    int count = st->playlists[0].count;
+
+    // Everything: what a resize or a closed dialog costs
+    for (int r = 0; r < cfg->runs; r++) {
+        long long start = bench_now_ns();
+        ui_invalidate();
+        draw_ui(st, "Benchmark");
+        times[r] = bench_now_ns() - start;
+    }
+    bench_report("draw_ui_full", times, cfg->runs, ui_list_height());
+
+    // One step down the list: the common keypress
+    for (int r = 0; r < cfg->runs; r++) {
+        st->playlist_song_selected = (st->playlist_song_selected + 1) % (count > 0 ? count : 1);
+        long long start = bench_now_ns();
+        draw_ui(st, "Benchmark");
+        times[r] = bench_now_ns() - start;
+    }
+    bench_report("draw_ui_move", times, cfg->runs, 1);
+
+    endwin();
+    delscreen(screen);
+    fclose(out);
+    fclose(in);
+    st->view = VIEW_SEARCH;
+    st->current_playlist_idx = -1;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--runs N] [--playlists N] [--songs N] [--files N]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg = {.runs = 10, .playlists = 50, .songs = 5000, .files = 10000};
+
+    for (int i = 1; i < argc; i++) {
+        int *value = NULL;
+        if (strcmp(argv[i], "--runs") == 0) value = &cfg.runs;
+        else if (strcmp(argv[i], "--playlists") == 0) value = &cfg.playlists;
+        else if (strcmp(argv[i], "--songs") == 0) value = &cfg.songs;
+        else if (strcmp(argv[i], "--files") == 0) value = &cfg.files;
+
+        if (!value || i + 1 >= argc) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+        *value = atoi(argv[++i]);
+    }
+    if (cfg.runs < 1 || cfg.runs > BENCH_MAX_RUNS || cfg.playlists < 1 || cfg.songs < 1 ||
+        cfg.files < 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    char home[] = "/tmp/shellbeats-bench.XXXXXX";
+    if (!mkdtemp(home)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // Too big for the stack, like in shellbeats itself
+    static AppState st;
+    static long long times[BENCH_MAX_RUNS];
+    bench_init_state(&st, home);
+
+    fprintf(stderr, "bench: %d playlists x %d songs, %d files in %s\n",
+            cfg.playlists, cfg.songs, cfg.files, home);
+    bench_make_playlists(&st, &cfg);
+    bench_make_files(&st, &cfg);
+
+    bench_load_playlist_songs(&st, &cfg, times);
+    bench_parse_playlist_lines(&cfg, times);
+    bench_local_files(&st, &cfg, times);
+    bench_save_download_queue(&st, &cfg, times);
+    bench_draw_ui(&st, &cfg, times);
+
+    close_download_journal(&st);
+    delete_directory_recursive(home);
+    return 0;
+}
@@ -12,6 +12,7 @@
 #include <pthread.h>  // NEW: for download thread
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,21 +21,65 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <utime.h>
 #include <dirent.h>
 #include "youtube_playlist.h"
 
 #define MAX_RESULTS 50
-#define MAX_PLAYLISTS 50
-#define MAX_PLAYLIST_ITEMS 500
+#define PLAYLIST_RESIDENT_SONGS 20000  // songs kept in memory before idle playlists are unloaded
 #define IPC_SOCKET "/tmp/shellbeats_mpv.sock"
 #define CONFIG_DIR ".shellbeats"
 #define PLAYLISTS_DIR "playlists"
 #define PLAYLISTS_INDEX "playlists.json"
 #define CONFIG_FILE "config.json"  // NEW: config file name
 #define DOWNLOAD_QUEUE_FILE "download_queue.json"  // NEW: download queue file
+#define DOWNLOAD_JOURNAL_FILE "download_queue.journal"  // queue changes since the last snapshot
+#define DOWNLOAD_JOURNAL_COMPACT_AT 256  // journal lines before folding into a snapshot
+#define DOWNLOAD_STATS_FILE "download_stats.jsonl"  // one line of throughput figures per session
+#define DOWNLOAD_PROGRESS_NOTIFY_MS 250  // a worker wakes the UI at most this often for progress
+#define DOWNLOAD_MAX_ATTEMPTS 5          // tries of a throttled or network failure before giving up
+#define DOWNLOAD_RETRY_MAX_DELAY 1800    // seconds; cap of the exponential retry backoff
 #define MAX_DOWNLOAD_QUEUE 1000  // NEW: max download queue size
+#define MAX_DOWNLOAD_WORKERS 8  // upper bound for parallel downloads
+#define DEFAULT_DOWNLOAD_WORKERS 2
+#define DEFAULT_AUDIO_FORMAT "mp3"
+#define MAX_CONCURRENT_FRAGMENTS 16  // upper bound for yt-dlp --concurrent-fragments
+#define DOWNLOAD_ID_BUCKETS 2048  // hash buckets for queued video ids
+#define LOCAL_INDEX_BUCKETS 4096  // hash buckets for the downloaded-file index
+#define UI_HEADER_ROWS 4  // title, two lines of key help, separator
+#define UI_FOOTER_ROWS 2  // separator, now playing
+#define UI_LIST_TOP 3     // first list row inside the body
+#define LIBRARY_FILE "library.bin"  // binary playlist library, used instead of the JSON files if present
+#define LIBRARY_SLACK_SONGS 1024      // free song records left after a rewrite, for in-place appends
+#define LIBRARY_SLACK_STRINGS 65536   // free string table bytes left after a rewrite
+#define SAVE_DELAY_MS 500            // playlist edits are written this long after the first unsaved one
+#define SAVE_RETRY_MS 5000           // and tried again this long after a failed write
+#define SONG_INDEX_ID_BUCKETS 4096   // hash buckets for video ids in the library index
+#define SONG_INDEX_MAX_WORD 48        // longer title words are indexed by their first bytes
+#define SONG_INDEX_QUERY_WORDS 8      // words of a query that are matched
+#define SEARCH_CACHE_DIR "search_cache"  // one file per normalized query
+#define SEARCH_CACHE_MAX_ENTRIES 200  // least recently used queries are evicted past this
+#define DEFAULT_SEARCH_CACHE_TTL 1440  // minutes before a cached search is refreshed
+#define RESOLVE_CACHE_SIZE 64      // resolved stream URLs kept in memory
+#define RESOLVE_AHEAD 2            // neighbours of the selection resolved on each side
+#define RESOLVE_WANTED_MAX (2 * RESOLVE_AHEAD + 2)  // selection, neighbours, next to play
+#define RESOLVE_DEFAULT_TTL 3600   // seconds a URL without expire= is trusted
+#define RESOLVE_EXPIRY_MARGIN 600  // stop handing out a URL this long before it expires
+#define RESOLVE_RETRY_SECONDS 300  // wait before resolving a failed video again
+#define PERF_RING_SIZE 256         // recent samples per span, for p50/p99 (DEBUG builds)
+#define PERF_HISTOGRAM_BUCKETS 24  // bucket i: spans of [2^i, 2^(i+1)) us, bucket 0 from 0
+#define PERF_DUMP_FILE "perf.json" // written on exit with --perf-dump (DEBUG builds)
+#define CONTROL_SOCKET "control.sock"  // in CONFIG_DIR; the daemon listens here for commands
+#define INSTANCE_LOCK "shellbeats.lock"  // in CONFIG_DIR; flocked by the running TUI or daemon
+#define CONTROL_REQUEST_MAX 4096   // bytes of one control request line
+#define CONTROL_READ_TIMEOUT_MS 1000  // a whole control request must arrive within this
+#define CONTROL_MAX_ARGS 8         // words of a control request
+#define CONTROL_LIST_MAX 20        // queued downloads listed by the downloads command
 
 // ============================================================================
 // Data Structures
@@ -42,27 +87,183 @@
 
 // Song struct is defined in youtube_playlist.h
 
+// Bump allocator for song titles. Strings are never freed one by one, only
+// all together when the list that owns them goes away.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;  // older, full blocks
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;         // block being filled
+} StringArena;
+
+// Songs are read from disk the first time a playlist is needed, and may be
+// dropped again (they are always saved) when many playlists are loaded
 typedef struct {
     char *name;
     char *filename;
-    Song items[MAX_PLAYLIST_ITEMS];
+    Song *items;              // grown as songs are added
+    StringArena strings;      // titles of items
     int count;
+    int capacity;
+    int stored_count;         // songs on disk per the index, -1 if unknown
+    bool loaded;              // items holds the playlist's songs
+    unsigned int last_used;   // playlist_clock when last opened or played
     bool is_youtube_playlist;
+    int lib_index;            // playlist record in library.bin, -1 if none
+    int lib_songs;            // leading items already in library.bin, -1 after other edits
+    int *id_slots;            // hash set of items by video_id, -1 if free; NULL until needed
+    int id_slot_cap;          // power of two, at least twice count
+    bool dirty;               // songs changed since the playlist was last written
+    unsigned int songs_version;  // playlists_version when songs were loaded or removed;
+                                 // appends only grow count
 } Playlist;
 
+// library.bin, in host byte order:
+//   LibraryHeader | LibraryPlaylist[playlist_count] | LibrarySong[song_cap] | strings[strings_cap]
+// Song records are grouped by playlist up to sorted_count; songs appended
+// in place since the last rewrite follow in any order. Strings are
+// NUL-terminated and addressed by their offset in the string table.
+#define LIBRARY_MAGIC "SBLIBRY1"
+#define LIBRARY_VERSION 1
+#define LIBRARY_PLAYLIST_YOUTUBE 1u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t playlist_count;
+    uint32_t song_count;      // records in use
+    uint32_t song_cap;        // records there is room for
+    uint32_t sorted_count;    // records grouped by playlist
+    uint32_t strings_used;
+    uint32_t strings_cap;
+    uint32_t reserved;
+    uint64_t playlists_off;
+    uint64_t songs_off;
+    uint64_t strings_off;
+} LibraryHeader;
+
+typedef struct {
+    uint32_t name_off;
+    uint32_t filename_off;
+    uint32_t flags;           // LIBRARY_PLAYLIST_*
+    uint32_t first_song;      // its block of grouped records
+    uint32_t sorted_songs;
+    uint32_t reserved;
+} LibraryPlaylist;
+
+typedef struct {
+    uint32_t playlist;        // index into the playlist table
+    uint32_t title_off;
+    int32_t duration;
+    uint32_t reserved;
+    char video_id[SONG_VIDEO_ID_SIZE];
+} LibrarySong;
+
+typedef struct {
+    bool enabled;             // library.bin is used instead of the JSON files
+    int fd;                   // open read-write for in-place appends
+    const char *map;          // the whole file, shared so appends show up
+    size_t map_size;
+} Library;
+
+// One song of one playlist in the library index. Titles are copies, so
+// playlists can be unloaded without touching the index.
+typedef struct {
+    char video_id[SONG_VIDEO_ID_SIZE];
+    char *title;              // in the index arena
+    int duration;
+    int playlist;             // index into playlists, -1 once removed
+    int id_next;              // next song with the same id bucket, -1 at the end
+} IndexedSong;
+
+// A lowercase title word and the songs whose titles contain it
+typedef struct {
+    char *text;               // in the index arena
+    int *songs;               // ascending song indices
+    int count;
+    int cap;
+} IndexWord;
+
+// Inverted index over every playlist, for searching the whole library
+// without opening playlists. Built on the first local search.
+typedef struct {
+    bool built;
+    IndexedSong *songs;
+    int song_count;           // including removed ones
+    int song_cap;
+    int live;                 // songs still in a playlist
+    IndexWord *words;
+    int word_count;
+    int word_cap;
+    int *word_slots;          // open-addressing table of word indices, -1 if free
+    int slot_cap;             // power of two
+    int *word_order;          // word indices sorted by text, for prefix lookups
+    int ordered_count;        // words in word_order; newer ones are merged in on search
+    int id_buckets[SONG_INDEX_ID_BUCKETS];
+    StringArena strings;
+    int *hits;                // per song scratch for queries
+    int *matches;
+} SongIndex;
+
 // NEW: Configuration structure
 typedef struct {
     char download_path[1024];
+    int download_workers;  // number of parallel yt-dlp downloads
+    int search_cache_ttl;  // minutes a cached search stays fresh, 0 disables the cache
+    char audio_format[8];  // name of an audio_formats entry
+    int audio_bitrate;     // kbps when re-encoding, 0 for yt-dlp's default
+    int concurrent_fragments;  // yt-dlp --concurrent-fragments, 1 downloads one at a time
+    char rate_limit[16];   // yt-dlp --limit-rate value such as "2M", empty for no limit
 } Config;
 
+// What downloads are saved as
+typedef struct {
+    const char *name;
+    const char *ytdlp_args;   // stream selection and extraction options
+    const char *description;
+} AudioFormat;
+
+// Editable entries in the settings view
+typedef enum {
+    SETTING_DOWNLOAD_PATH,
+    SETTING_DOWNLOAD_WORKERS,
+    SETTING_SEARCH_CACHE_TTL,
+    SETTING_AUDIO_FORMAT,
+    SETTING_AUDIO_BITRATE,
+    SETTING_CONCURRENT_FRAGMENTS,
+    SETTING_RATE_LIMIT,
+    SETTING_COUNT
+} SettingId;
+
 // NEW: Download task status
 typedef enum {
     DOWNLOAD_PENDING,
     DOWNLOAD_ACTIVE,
     DOWNLOAD_COMPLETED,
-    DOWNLOAD_FAILED
+    DOWNLOAD_FAILED,
+    DOWNLOAD_RETRY     // failed transiently, waiting for retry_at
 } DownloadStatus;
 
+// Why yt-dlp failed, from the ERROR: lines it prints
+typedef enum {
+    DOWNLOAD_ERROR_NONE,
+    DOWNLOAD_ERROR_THROTTLED,    // HTTP 429/403, bot check: retried after a long backoff
+    DOWNLOAD_ERROR_NETWORK,      // timeouts, resets, DNS: retried after a short backoff
+    DOWNLOAD_ERROR_UNAVAILABLE,  // private, removed, blocked: never retried
+    DOWNLOAD_ERROR_OTHER,        // anything else, including yt-dlp missing: never retried
+    DOWNLOAD_ERROR_COUNT
+} DownloadError;
+
+// A piece of a yt-dlp error message, lowercase, and what it indicates
+typedef struct {
+    const char *text;
+    DownloadError error;
+} DownloadErrorPattern;
+
 // NEW: Download task
 typedef struct {
     char video_id[32];
@@ -70,22 +271,176 @@ typedef struct {
     char sanitized_filename[512];
     char playlist_name[256];  // empty string if not from playlist
     DownloadStatus status;
+    
+    // Live progress, reported by yt-dlp while a worker runs the task
+    long long bytes_done;
+    long long bytes_total;    // -1 until known (estimated for fragmented streams)
+    double speed;             // bytes per second, 0 when unknown
+    int eta;                  // seconds, -1 when unknown
+    long long started_ms;     // monotonic_ms when a worker claimed it, 0 before
+    long long elapsed_ms;     // time spent, final once the task finishes
+    
+    // Failed attempts so far; kept in the queue files
+    int attempts;
+    time_t retry_at;          // wall clock of the next try, for DOWNLOAD_RETRY
+    DownloadError error;      // class of the last failure
 } DownloadTask;
 
+// Downloaded file on disk, keyed by video_id
+typedef struct LocalFile {
+    char video_id[32];
+    char *playlist_name;      // empty string for files directly in download_path
+    char *path;
+    unsigned int added;       // LocalFileIndex.version when a worker added it, 0 if scanned
+    struct LocalFile *next;
+} LocalFile;
+
+// Index of downloaded files, so lookups never touch the filesystem.
+// Written by the download thread, read by the UI thread.
+typedef struct {
+    LocalFile *buckets[LOCAL_INDEX_BUCKETS];
+    int count;
+    unsigned int version;  // bumped on every change, so the UI knows to repaint
+    pthread_mutex_t mutex;
+} LocalFileIndex;
+
+struct AppState;
+
+// Download worker thread
+typedef struct {
+    struct AppState *st;
+    int id;
+    pthread_t thread;
+    bool started;     // pthread_create succeeded, needs a join
+    bool exited;      // thread function returned (retired or stopped)
+    int task_idx;     // task being downloaded, -1 when idle
+} DownloadWorker;
+
+// Throughput of the downloads run since startup, written to DOWNLOAD_STATS_FILE on exit
+typedef struct {
+    int done;                 // downloaded by yt-dlp (files already on disk are not counted)
+    int failed;               // given up on
+    int retries;              // failures rescheduled for another try
+    int skipped;              // already on disk
+    long long bytes;          // downloaded by successful tasks
+    long long task_ms;        // sum of per-task time of successful tasks
+    long long busy_ms;        // wall time with at least one download running
+    long long busy_since_ms;  // start of the current busy stretch, 0 when idle
+    time_t first_start;       // wall clock of the first download, 0 if none ran
+} DownloadStats;
+
 // NEW: Download queue
 typedef struct {
     DownloadTask tasks[MAX_DOWNLOAD_QUEUE];
     int count;
     int completed;
     int failed;
-    int current_idx;  // currently downloading
-    bool active;      // thread is running
+    int pending_count;    // tasks waiting in pending_fifo
+    int active_count;     // tasks being downloaded by a worker
+    int retry_tasks[MAX_DOWNLOAD_QUEUE];   // tasks in DOWNLOAD_RETRY, unordered
+    int retry_count;
+    unsigned int retry_seed;               // rand_r state for backoff jitter
+    int pending_fifo[MAX_DOWNLOAD_QUEUE];  // ring buffer of pending task indices
+    int fifo_head;
+    int fifo_len;
+    int id_buckets[DOWNLOAD_ID_BUCKETS];   // video_id -> queued task, chained through id_next
+    int id_next[MAX_DOWNLOAD_QUEUE];
+    FILE *journal;        // append-only log of changes since the snapshot
+    int journal_entries;
     pthread_mutex_t mutex;
-    pthread_t thread;
-    bool thread_running;
+    pthread_cond_t cond;  // signalled when work arrives or workers must exit
+    DownloadWorker workers[MAX_DOWNLOAD_WORKERS];
+    int worker_limit;     // workers with id >= limit retire after their task
+    bool thread_running;  // at least one worker was started
     bool should_stop;
+    DownloadStats stats;
 } DownloadQueue;
 
+// Background import of a YouTube playlist. The fetch thread only fills the
+// pending array; the UI thread moves songs into the playlist.
+typedef struct {
+    pthread_t thread;
+    bool running;          // thread started and not yet joined
+    bool done;             // fetch finished (set by the thread)
+    YtdlpProcess proc;
+    pthread_mutex_t mutex;
+    char url[512];
+    char name[256];        // requested playlist name, empty to use the YouTube title
+    char title[256];       // title reported by yt-dlp
+    bool stream_only;
+    Song *pending;         // fetched songs not yet added to the playlist
+    StringArena strings;   // titles of pending
+    int pending_count;
+    int pending_cap;
+    int fetched;
+    int playlist_idx;      // playlist being filled, -1 until created
+    int added;
+    bool cancelled;
+    bool failed;           // yt-dlp failed, possibly after some songs (set by the thread)
+    time_t last_save;
+} ImportJob;
+
+// Background YouTube search. The fetch thread parses results into pending;
+// the UI thread appends them to search_results as they arrive.
+typedef struct {
+    pthread_t thread;
+    bool running;          // thread started and not yet joined
+    bool done;             // fetch finished (set by the thread)
+    bool failed;           // yt-dlp could not be started or exited with an error
+    bool refresh;          // replacing cached results: swap them in only when complete
+    YtdlpProcess proc;
+    pthread_mutex_t mutex;
+    char cmd[2048];
+    char key[256];         // normalized query, names the cache entry
+    Song pending[MAX_RESULTS];
+    StringArena strings;   // titles of pending
+    int pending_count;
+    int fetched;
+} SearchJob;
+
+// Direct audio URL for a video, as printed by yt-dlp -g
+typedef struct {
+    char video_id[32];
+    char *url;             // NULL if resolving failed
+    time_t expires;        // unusable from then on
+} ResolvedUrl;
+
+// Background resolver of direct stream URLs for the songs the user is
+// likely to play next, so mpv can skip its own yt-dlp run
+typedef struct {
+    pthread_t thread;
+    bool started;
+    bool should_stop;
+    YtdlpProcess proc;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;   // signalled when wanted changes or on stop
+    char wanted[RESOLVE_WANTED_MAX][32];  // ids to resolve, most likely first
+    int wanted_count;
+    ResolvedUrl cache[RESOLVE_CACHE_SIZE];
+} StreamResolver;
+
+// A file to replace with data, queued for the writer thread
+typedef struct FileWriteJob {
+    struct FileWriteJob *next;
+    char *path;
+    char *data;
+    size_t len;
+} FileWriteJob;
+
+// Background writer, so slow disks never stall the UI thread. A newer
+// job for a path that is still queued replaces the older one.
+typedef struct {
+    pthread_t thread;
+    bool started;          // jobs go to the thread; otherwise they are written at once
+    bool should_stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;   // signalled when a job is queued or finished, and on stop
+    FileWriteJob *head;    // oldest first
+    FileWriteJob *tail;
+    char *active_path;     // being written, NULL when idle
+    FileWriteJob *failed;  // paths whose last write failed, without data
+} FileWriter;
+
 // NEW: Added VIEW_SETTINGS, VIEW_ABOUT
 typedef enum {
     VIEW_SEARCH,
@@ -93,22 +448,92 @@ typedef enum {
     VIEW_PLAYLIST_SONGS,
     VIEW_ADD_TO_PLAYLIST,
     VIEW_SETTINGS,
-    VIEW_ABOUT
+    VIEW_ABOUT,
+    VIEW_DOWNLOADS
 } ViewMode;
 
+// Matches of a type-to-filter over the search results or a playlist
+typedef struct {
+    bool active;
+    bool editing;             // keys go into the pattern
+    ViewMode view;            // VIEW_SEARCH or VIEW_PLAYLIST_SONGS
+    int playlist_idx;         // playlist filtered in VIEW_PLAYLIST_SONGS
+    char pattern[128];        // lowercase
+    int *rows;                // indices of matching songs, in display order
+    int count;
+    int selected;             // position in rows
+    int scroll;
+    unsigned int version;     // bumped whenever rows change
+    
+    // Lowercased titles of the filtered list, rebuilt when it changes
+    char *folded;
+    size_t *title_start;      // source_count + 1 offsets into folded
+    unsigned char *tier;      // per song: 0 no match, 1 substring, 2 in order
+    int source_count;
+    unsigned int source_version;
+} SongFilter;
+
+// What the body region showed when it was last drawn, apart from the
+// selected row and the status line
+typedef struct {
+    ViewMode view;
+    unsigned int search_version;
+    unsigned int playlists_version;
+    unsigned int local_version;
+    int current_playlist_idx;
+    int playing_index;
+    bool playing_from_playlist;
+    int playing_playlist_idx;
+    bool paused;
+    const Song *song_to_add;
+    unsigned int filter_version;
+    int scroll;
+    int count;
+} BodySnapshot;
+
+// Screen regions, each an ncurses window refreshed only when it changed
 typedef struct {
+    WINDOW *header;        // title, key help and separator
+    WINDOW *body;          // view title, status line and list
+    WINDOW *footer;        // now playing and download status
+    int rows, cols;        // terminal size the windows were laid out for
+    bool full_redraw;      // repaint everything (after modals, on resize)
+    
+    ViewMode header_view;
+    char footer_line[1024];
+    BodySnapshot body_state;
+    int body_selected;
+    char status_line[512];
+    bool status_dirty;
+} UiState;
+
+typedef struct AppState {
     // Search results
     Song search_results[MAX_RESULTS];
+    StringArena search_strings;      // titles of search_results
     int search_count;
     int search_selected;
     int search_scroll;
     char query[256];
+    SearchJob search;
+    unsigned int search_version;     // bumped whenever search_results change
+    bool search_local;               // search_results are hits from the playlists
+    const char *search_where[MAX_RESULTS];  // local hits: names of the playlists holding each
+    const char *search_from[MAX_RESULTS];   // local hits: first of them, for downloaded files
     
     // Playlists
-    Playlist playlists[MAX_PLAYLISTS];
+    Playlist *playlists;
     int playlist_count;
+    int playlist_capacity;
+    unsigned int playlist_clock;     // ticks on every use, orders playlists for unloading
     int playlist_selected;
     int playlist_scroll;
+    unsigned int playlists_version;  // bumped whenever playlists or their songs change
+    Library library;
+    SongIndex song_index;
+    bool playlists_index_dirty;      // playlist list changed since the index was last written
+    long long save_due_ms;           // monotonic time to write dirty playlists, 0 if none
+    FileWriter writer;
     
     // Current playlist view
     int current_playlist_idx;
@@ -120,12 +545,16 @@ typedef struct {
     bool playing_from_playlist;
     int playing_playlist_idx;
     bool paused;
+    int queued_index;              // song appended to mpv after playing_index, -1 if none
+    char queued_video_id[32];
     
     // UI state
     ViewMode view;
     int add_to_playlist_selected;
     int add_to_playlist_scroll;
     Song *song_to_add;
+    SongFilter filter;
+    ViewMode downloads_return_view;  // where Esc leaves the downloads view
     
     // NEW: Settings UI state
     int settings_selected;
@@ -133,15 +562,18 @@ typedef struct {
     char settings_edit_buffer[1024];
     int settings_edit_pos;
     
-    // Playback timing (to ignore false end events during loading)
-    time_t playback_started;
-    
     // Config paths
     char config_dir[16384];      // Significantly increased buffer size
     char playlists_dir[16384];   // Significantly increased buffer size
     char playlists_index[16384]; // Significantly increased buffer size
+    char library_file[16384];
     char config_file[16384];     // Significantly increased buffer size
     char download_queue_file[16384]; // Significantly increased buffer size
+    char download_stats_file[16384];
+    char download_journal_file[16384];
+    char search_cache_dir[16384];
+    char control_socket[16384];
+    char instance_lock[16384];
     
     // NEW: Configuration
     Config config;
@@ -149,19 +581,148 @@ typedef struct {
     // NEW: Download queue
     DownloadQueue download_queue;
     
+    // Downloaded files found under download_path
+    LocalFileIndex local_files;
+    
+    // YouTube playlist import in progress
+    ImportJob import;
+    
+    // Stream URLs resolved ahead of playback
+    StreamResolver resolver;
+    
     // NEW: Spinner state for download progress
     int spinner_frame;
     time_t last_spinner_update;
+    
+    bool perf_overlay;    // span timings shown over the body (DEBUG builds)
 } AppState;
 
+#ifdef DEBUG
+// Hot paths timed in DEBUG builds
+typedef enum {
+    PERF_DRAW_UI,
+    PERF_DOWNLOAD_LOCK,    // waiting for download_queue.mutex in the footer
+    PERF_LOCAL_LOOKUP,     // downloaded-file index lookups
+    PERF_PLAYLIST_LOAD,
+    PERF_PLAYLIST_SAVE,    // deferred playlist saves, on the UI thread
+    PERF_SEARCH,           // yt-dlp search, spawn to exit, on the search thread
+    PERF_SPAN_COUNT
+} PerfSpanId;
+
+// Timings of one span: every sample in the histogram, the latest in a ring
+typedef struct {
+    long long ring[PERF_RING_SIZE];   // nanoseconds
+    int ring_next;
+    long long count;
+    long long total_ns;
+    long long max_ns;
+    long long histogram[PERF_HISTOGRAM_BUCKETS];
+} PerfSpan;
+#endif
+
 // ============================================================================
 // Globals
 // ============================================================================
 
+#ifdef DEBUG
+static const char *const perf_span_names[PERF_SPAN_COUNT] = {
+    "draw_ui", "download_lock", "local_lookup", "playlist_load", "playlist_save", "search",
+};
+static PerfSpan perf_spans[PERF_SPAN_COUNT];
+static pthread_mutex_t perf_mutex = PTHREAD_MUTEX_INITIALIZER;  // spans end on several threads
+static bool perf_dump_on_exit = false;
+#endif
+
 static pid_t mpv_pid = -1;
 static int mpv_ipc_fd = -1;
+
+// Commands not written to mpv yet: it is still starting, or the socket was full
+static char mpv_tx_buf[64 * 1024];
+static size_t mpv_tx_len = 0;
+
+// Connecting to the socket file of an mpv that is still starting up
+static long long mpv_retry_at_ms = 0;   // no attempt before this (monotonic ms)
+static int mpv_retry_delay_ms = 0;      // doubles after each failed attempt
+
+// mpv we started gets one end of a socketpair (--input-ipc-client), so it
+// can be talked to the moment it is forked. Commands are kept until mpv
+// has answered once, to resend them if the option is not supported.
+static bool mpv_fd_ipc_unsupported = false;
+static bool mpv_spawned_via_fd = false;
+static bool mpv_confirmed = false;      // mpv replied on the current connection
+static char mpv_replay_buf[16 * 1024];
+static size_t mpv_replay_len = 0;
+
+// Bytes read from mpv that do not form a complete line yet
+static char mpv_rx_buf[64 * 1024];
+static size_t mpv_rx_len = 0;
+static bool mpv_rx_discarding = false;  // skipping the rest of an oversized line
+
+// mpv's playlist holds the playing song and, once queued, the one after it.
+// Events sent before mpv answered the last command that reshaped the
+// playlist describe the old one and are ignored.
+static int mpv_next_request_id = 1;
+static int mpv_sync_request = -1;     // request_id of the last loadfile replace / playlist-clear
+static bool mpv_synced = false;       // its reply has arrived
+
 static volatile sig_atomic_t got_sigchld = 0;
 
+// Self-pipe that background threads write to so the main loop wakes up
+static int ui_wake_fds[2] = {-1, -1};
+
+static UiState ui;
+
+// Only mp3 is re-encoded by ffmpeg. m4a and opus take the stream YouTube
+// publishes in that codec and only re-encode if there is none; best
+// keeps whatever stream is best.
+static const AudioFormat audio_formats[] = {
+    {"mp3",  "-x --audio-format mp3", "re-encoded to MP3"},
+    {"m4a",  "-f 'bestaudio[ext=m4a]/bestaudio' -x --audio-format m4a", "AAC, not re-encoded"},
+    {"opus", "-f 'bestaudio[acodec=opus]/bestaudio' -x --audio-format opus", "Opus, not re-encoded"},
+    {"best", "-f bestaudio -x --audio-format best", "best stream, never re-encoded"},
+};
+#define AUDIO_FORMAT_COUNT ((int)(sizeof(audio_formats) / sizeof(audio_formats[0])))
+
+// Extensions a finished download can have, whatever the format setting was
+static const char *const audio_extensions[] = {"mp3", "m4a", "opus", "ogg", "aac", "flac", "wav"};
+#define AUDIO_EXTENSION_COUNT ((int)(sizeof(audio_extensions) / sizeof(audio_extensions[0])))
+
+// DownloadError names, as stored in the queue files and shown in the downloads view
+static const char *const download_error_names[DOWNLOAD_ERROR_COUNT] = {
+    "", "throttled", "network", "unavailable", "other"
+};
+
+// Checked in order, so "confirm your age" is not taken for the bot check
+static const DownloadErrorPattern download_error_patterns[] = {
+    {"video unavailable", DOWNLOAD_ERROR_UNAVAILABLE},
+    {"private video", DOWNLOAD_ERROR_UNAVAILABLE},
+    {"has been removed", DOWNLOAD_ERROR_UNAVAILABLE},
+    {"is not available", DOWNLOAD_ERROR_UNAVAILABLE},
+    {"members-only", DOWNLOAD_ERROR_UNAVAILABLE},
+    {"confirm your age", DOWNLOAD_ERROR_UNAVAILABLE},
+    {"copyright", DOWNLOAD_ERROR_UNAVAILABLE},
+    {"premieres in", DOWNLOAD_ERROR_UNAVAILABLE},
+    {"http error 429", DOWNLOAD_ERROR_THROTTLED},
+    {"too many requests", DOWNLOAD_ERROR_THROTTLED},
+    {"http error 403", DOWNLOAD_ERROR_THROTTLED},
+    {"not a bot", DOWNLOAD_ERROR_THROTTLED},
+    {"rate limit", DOWNLOAD_ERROR_THROTTLED},
+    {"rate-limit", DOWNLOAD_ERROR_THROTTLED},
+    {"timed out", DOWNLOAD_ERROR_NETWORK},
+    {"connection reset", DOWNLOAD_ERROR_NETWORK},
+    {"connection refused", DOWNLOAD_ERROR_NETWORK},
+    {"name resolution", DOWNLOAD_ERROR_NETWORK},
+    {"name or service not known", DOWNLOAD_ERROR_NETWORK},
+    {"network is unreachable", DOWNLOAD_ERROR_NETWORK},
+    {"remote end closed", DOWNLOAD_ERROR_NETWORK},
+    {"incompleteread", DOWNLOAD_ERROR_NETWORK},
+    {"urlopen error", DOWNLOAD_ERROR_NETWORK},
+    {"http error 5", DOWNLOAD_ERROR_NETWORK},
+    {"unable to download", DOWNLOAD_ERROR_NETWORK},
+};
+#define DOWNLOAD_ERROR_PATTERN_COUNT \
+    ((int)(sizeof(download_error_patterns) / sizeof(download_error_patterns[0])))
+
 // NEW: Global pointer for download thread access
 static AppState *g_app_state = NULL;
 
@@ -172,15 +733,53 @@ static AppState *g_app_state = NULL;
 static void save_playlists_index(AppState *st);
 static void save_playlist(AppState *st, int idx);
 static void load_playlists(AppState *st);
+static bool library_write(AppState *st);
+static bool library_append_songs(AppState *st, int idx);
+static void library_load_songs(AppState *st, Playlist *pl);
+static void library_load_playlists(AppState *st);
 static void save_config(AppState *st);  // NEW
 static void load_config(AppState *st);  // NEW
 static void save_download_queue(AppState *st);  // NEW
 static void load_download_queue(AppState *st);  // NEW
+static const Song *playback_list(AppState *st, int *count);
+static void song_index_add(SongIndex *ix, int playlist, const Song *song);
+static void song_index_remove(SongIndex *ix, int playlist, const char *video_id);
+static void song_index_drop_playlist(SongIndex *ix, int playlist);
+static void mpv_stop_playback(void);
+static void filter_clear(AppState *st);
 
 // ============================================================================
 // Utility Functions
 // ============================================================================
 
+// Wake the main loop from any thread; safe to call before the pipe exists
+static void notify_ui(void) {
+    if (ui_wake_fds[1] < 0) return;
+    char c = 1;
+    ssize_t w = write(ui_wake_fds[1], &c, 1);  // a full pipe already means "wake up"
+    (void)w;
+}
+
+// Set by SIGTERM, SIGINT and SIGHUP; the main loop then stops the session
+// the normal way, so unsaved playlist edits are written
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_signal_handler(int sig) {
+    (void)sig;
+    stop_requested = 1;
+    notify_ui();  // write() is async-signal-safe
+}
+
+static void install_stop_handlers(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+}
+
 static char *trim_whitespace(char *s) {
     if (!s) return s;
     while (*s && isspace((unsigned char)*s)) s++;
@@ -191,6 +790,112 @@ static char *trim_whitespace(char *s) {
     return s;
 }
 
+static char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a hash, used by the in-memory lookup tables
+static unsigned int hash_string(const char *s) {
+    unsigned int h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+#define ARENA_BLOCK_SIZE 4096  // default block size; bigger strings get their own
+
+// Make sure the head block has room for size more bytes
+static bool arena_reserve(StringArena *a, size_t size) {
+    if (a->head && a->head->size - a->head->used >= size) return true;
+    
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + block_size);
+    if (!b) return false;
+    b->next = a->head;
+    b->used = 0;
+    b->size = block_size;
+    a->head = b;
+    return true;
+}
+
+static char *arena_alloc(StringArena *a, size_t size) {
+    if (!arena_reserve(a, size)) return NULL;
+    char *p = a->head->data + a->head->used;
+    a->head->used += size;
+    return p;
+}
+
+static char *arena_strdup(StringArena *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *p = arena_alloc(a, len);
+    if (p) memcpy(p, s, len);
+    return p;
+}
+
+static void arena_free(StringArena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+// Forget every string but keep the newest block for reuse
+static void arena_reset(StringArena *a) {
+    if (!a->head) return;
+    ArenaBlock *keep = a->head;
+    a->head = keep->next;
+    arena_free(a);
+    keep->next = NULL;
+    keep->used = 0;
+    a->head = keep;
+}
+
+// A whole file mapped read-only; data is not NUL-terminated
+typedef struct {
+    const char *data;
+    size_t size;
+} MappedFile;
+
+// Map path for reading. An empty file maps to size 0.
+// Returns false if it cannot be opened or mapped.
+static bool map_file(const char *path, MappedFile *mf) {
+    mf->data = NULL;
+    mf->size = 0;
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    
+    struct stat sb;
+    bool ok = fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode);
+    if (ok && sb.st_size > 0) {
+        void *data = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ok = false;
+        } else {
+            madvise(data, (size_t)sb.st_size, MADV_SEQUENTIAL);
+            mf->data = data;
+            mf->size = (size_t)sb.st_size;
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+static void unmap_file(MappedFile *mf) {
+    if (mf->data) munmap((void *)mf->data, mf->size);
+    mf->data = NULL;
+    mf->size = 0;
+}
+
 static bool file_exists(const char *path) {
     struct stat sb;
     return stat(path, &sb) == 0;
@@ -274,66 +979,24 @@ static void sanitize_title_for_filename(const char *title, const char *video_id,
         strcpy(sanitized, "download");
     }
     
-    // Truncate if too long (leave room for _[video_id].mp3)
+    // Truncate if too long (leave room for _[video_id].ext)
     if (strlen(sanitized) > 180) {
         sanitized[180] = '\0';
     }
     
-    // Build final filename: Title_[video_id].mp3
-    snprintf(out, out_size, "%s_[%s].mp3", sanitized, video_id);
-}
-
-// NEW: Check if a file for this video_id exists in directory
-static bool file_exists_for_video(const char *dir_path, const char *video_id) {
-    DIR *dir = opendir(dir_path);
-    if (!dir) return false;
-    
-    char pattern[64];
-    snprintf(pattern, sizeof(pattern), "[%s].mp3", video_id);
-    
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, pattern) != NULL) {
-            closedir(dir);
-            return true;
-        }
-    }
-    
-    closedir(dir);
-    return false;
+    // Build the name without extension: Title_[video_id]. yt-dlp adds the
+    // extension of the audio format.
+    snprintf(out, out_size, "%s_[%s]", sanitized, video_id);
 }
 
-// Get the full path to a local file for a song in a playlist
-// Returns true if file exists and fills out_path, false otherwise
-static bool get_local_file_path_for_song(AppState *st, const char *playlist_name,
-                                         const char *video_id, char *out_path, size_t out_size) {
-    if (!video_id || !video_id[0] || !out_path || out_size == 0) return false;
-
-    char dest_dir[4096]; // Increased buffer size
-    if (playlist_name && playlist_name[0]) {
-        snprintf(dest_dir, sizeof(dest_dir), "%s/%s", st->config.download_path, playlist_name);
-    } else {
-        snprintf(dest_dir, sizeof(dest_dir), "%s", st->config.download_path);
-    }
-
-    // Search for file with this video_id
-    DIR *dir = opendir(dest_dir);
-    if (!dir) return false;
-
-    char pattern[64];
-    snprintf(pattern, sizeof(pattern), "[%s].mp3", video_id);
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, pattern) != NULL) {
-            snprintf(out_path, out_size, "%s/%s", dest_dir, entry->d_name);
-            closedir(dir);
-            return true;
-        }
+// Known audio extension at the end of name (after the dot), or NULL
+static const char *audio_extension(const char *name) {
+    const char *dot = strrchr(name, '.');
+    if (!dot) return NULL;
+    for (int i = 0; i < AUDIO_EXTENSION_COUNT; i++) {
+        if (strcmp(dot + 1, audio_extensions[i]) == 0) return audio_extensions[i];
     }
-
-    closedir(dir);
-    return false;
+    return NULL;
 }
 
 // Recursively delete a directory and all its contents
@@ -411,2035 +1074,7732 @@ static char *json_escape_string(const char *s) {
     return out;
 }
 
-// Simple JSON string extraction (finds "key":"value" and returns value)
-static char *json_get_string(const char *json, const char *key) {
-    char pattern[256];
-    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
-    
-    const char *p = strstr(json, pattern);
-    if (!p) return NULL;
-    
-    p += strlen(pattern);
-    while (*p && (*p == ' ' || *p == ':' || *p == '\t')) p++;
-    
-    if (*p != '"') return NULL;
-    p++;
-    
-    const char *start = p;
-    while (*p && *p != '"') {
-        if (*p == '\\' && *(p+1)) p++;
-        p++;
-    }
-    
-    size_t len = p - start;
-    char *result = malloc(len + 1);
-    if (!result) return NULL;
-    
-    // Unescape
-    size_t j = 0;
-    for (size_t i = 0; i < len; i++) {
-        if (start[i] == '\\' && i + 1 < len) {
-            i++;
-            if (start[i] == 'n') result[j++] = '\n';
-            else if (start[i] == 'r') result[j++] = '\r';
-            else if (start[i] == 't') result[j++] = '\t';
-            else result[j++] = start[i];
-        } else {
-            result[j++] = start[i];
+// Write s to f as the body of a JSON string, without allocating
+static void json_write_escaped(FILE *f, const char *s) {
+    if (!s) return;
+    
+    for (; *s; s++) {
+        switch (*s) {
+            case '"':  fputs("\\\"", f); break;
+            case '\\': fputs("\\\\", f); break;
+            case '\n': fputs("\\n", f); break;
+            case '\r': fputs("\\r", f); break;
+            case '\t': fputs("\\t", f); break;
+            default:   fputc(*s, f); break;
         }
     }
-    result[j] = '\0';
-    return result;
 }
 
 // ============================================================================
-// Config Directory Management
+// Performance Spans
 // ============================================================================
 
-static bool init_config_dirs(AppState *st) {
-    const char *home = getenv("HOME");
-    if (!home) {
-        home = "/tmp";
+// PERF_BEGIN(t) ... PERF_END(PERF_X, t) times the code between them. Both
+// compile to nothing unless DEBUG is defined (make debug).
+#ifdef DEBUG
+#define PERF_BEGIN(var) long long var = perf_now_ns()
+#define PERF_END(id, var) perf_record((id), perf_now_ns() - (var))
+
+static long long perf_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void perf_record(PerfSpanId id, long long ns) {
+    int bucket = 0;
+    for (long long us = ns / 1000; us > 1 && bucket < PERF_HISTOGRAM_BUCKETS - 1; us >>= 1) {
+        bucket++;
     }
     
-    snprintf(st->config_dir, sizeof(st->config_dir), "%s/%s", home, CONFIG_DIR);
-    snprintf(st->playlists_dir, sizeof(st->playlists_dir), "%s/%s", st->config_dir, PLAYLISTS_DIR);
-    snprintf(st->playlists_index, sizeof(st->playlists_index), "%s/%s", st->config_dir, PLAYLISTS_INDEX);
-    snprintf(st->config_file, sizeof(st->config_file), "%s/%s", st->config_dir, CONFIG_FILE);  // NEW
-    snprintf(st->download_queue_file, sizeof(st->download_queue_file), "%s/%s", st->config_dir, DOWNLOAD_QUEUE_FILE);  // NEW
-    
-    st->config_dir[sizeof(st->config_dir) - 1] = '\0';
-    st->playlists_dir[sizeof(st->playlists_dir) - 1] = '\0';
-    st->playlists_index[sizeof(st->playlists_index) - 1] = '\0';
-    st->config_file[sizeof(st->config_file) - 1] = '\0';  // NEW
-    st->download_queue_file[sizeof(st->download_queue_file) - 1] = '\0';  // NEW
+    pthread_mutex_lock(&perf_mutex);
+    PerfSpan *span = &perf_spans[id];
+    span->ring[span->ring_next] = ns;
+    span->ring_next = (span->ring_next + 1) % PERF_RING_SIZE;
+    span->count++;
+    span->total_ns += ns;
+    if (ns > span->max_ns) span->max_ns = ns;
+    span->histogram[bucket]++;
+    pthread_mutex_unlock(&perf_mutex);
+}
+
+static int compare_long_long(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Copy of a span with its p50 and p99 over the ring, in nanoseconds
+static void perf_snapshot(PerfSpanId id, PerfSpan *out, long long *p50, long long *p99) {
+    pthread_mutex_lock(&perf_mutex);
+    *out = perf_spans[id];
+    pthread_mutex_unlock(&perf_mutex);
+    
+    int n = out->count < PERF_RING_SIZE ? (int)out->count : PERF_RING_SIZE;
+    *p50 = *p99 = 0;
+    if (n == 0) return;
+    
+    long long sorted[PERF_RING_SIZE];
+    memcpy(sorted, out->ring, (size_t)n * sizeof(sorted[0]));
+    qsort(sorted, (size_t)n, sizeof(sorted[0]), compare_long_long);
+    *p50 = sorted[(n - 1) / 2];
+    *p99 = sorted[(n - 1) * 99 / 100];
+}
+
+// Write every span to PERF_DUMP_FILE in config_dir
+static void perf_dump(const char *config_dir) {
+    char path[16400];
+    snprintf(path, sizeof(path), "%s/%s", config_dir, PERF_DUMP_FILE);
+    FILE *f = fopen(path, "w");
+    if (!f) return;
     
-    // Create config directory if not exists
-    if (!dir_exists(st->config_dir)) {
-        if (mkdir(st->config_dir, 0755) != 0) {
-            return false;
+    fprintf(f, "{\n  \"spans\": [");
+    for (int i = 0; i < PERF_SPAN_COUNT; i++) {
+        PerfSpan span;
+        long long p50, p99;
+        perf_snapshot((PerfSpanId)i, &span, &p50, &p99);
+        
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"count\": %lld, \"mean_us\": %.1f, "
+                "\"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, \"histogram_us\": [",
+                i ? "," : "", perf_span_names[i], span.count,
+                span.count ? span.total_ns / 1000.0 / span.count : 0.0,
+                p50 / 1000.0, p99 / 1000.0, span.max_ns / 1000.0);
+        for (int b = 0; b < PERF_HISTOGRAM_BUCKETS; b++) {
+            fprintf(f, "%s%lld", b ? ", " : "", span.histogram[b]);
         }
+        fprintf(f, "]}");
     }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+}
+#else
+#define PERF_BEGIN(var) ((void)0)
+#define PERF_END(id, var) ((void)0)
+#endif
+
+// ============================================================================
+// JSON Reading
+// ============================================================================
+
+// A JsonReader walks a buffer once, front to back. The buffer does not need
+// to be NUL-terminated, so mapped files are read in place; values come back
+// as spans into it and only strings that are kept get unescaped.
+
+// One member of a JSON object. Spans point into the parsed text;
+// values are raw JSON (strings keep their quotes, objects their braces).
+typedef struct {
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+} JsonField;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    bool error;       // malformed or truncated input; the reader stops
+} JsonReader;
+
+static void json_reader_init(JsonReader *r, const char *data, size_t size) {
+    r->p = data;
+    r->end = data + size;
+    r->error = false;
+}
+
+static void json_reader_fail(JsonReader *r) {
+    r->p = r->end;
+    r->error = true;
+}
+
+// Next non-space byte without consuming it, or '\0' at the end
+static char json_peek(JsonReader *r) {
+    while (r->p < r->end && isspace((unsigned char)*r->p)) r->p++;
+    return r->p < r->end ? *r->p : '\0';
+}
+
+// Skip over one JSON value, returns the first byte after it or NULL if truncated
+static const char *json_skip_value(const char *p, const char *end) {
+    if (p >= end) return NULL;
     
-    // Create playlists directory if not exists
-    if (!dir_exists(st->playlists_dir)) {
-        if (mkdir(st->playlists_dir, 0755) != 0) {
-            return false;
+    if (*p == '"') {
+        for (p++; p < end && *p != '"'; p++) {
+            if (*p == '\\' && p + 1 < end) p++;
         }
+        return p < end ? p + 1 : NULL;
     }
     
-    // Create empty playlists index if not exists
-    if (!file_exists(st->playlists_index)) {
-        FILE *f = fopen(st->playlists_index, "w");
-        if (f) {
-            fprintf(f, "{\"playlists\":[]}\n");
-            fclose(f);
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            if (*p == '"') {
+                p = json_skip_value(p, end);
+                if (!p) return NULL;
+                continue;
+            }
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (*p == '}' || *p == ']') {
+                if (--depth == 0) return p + 1;
+            }
+            p++;
         }
+        return NULL;
     }
     
-    return true;
+    // Number, true, false or null
+    const char *start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && !isspace((unsigned char)*p)) p++;
+    return p > start ? p : NULL;
 }
 
-// ============================================================================
-// NEW: Configuration Persistence
-// ============================================================================
+// Read the value at the cursor into f->value and step past it
+static bool json_read_value(JsonReader *r, JsonField *f) {
+    json_peek(r);
+    const char *end = json_skip_value(r->p, r->end);
+    if (!end) {
+        json_reader_fail(r);
+        return false;
+    }
+    f->value = r->p;
+    f->value_len = (size_t)(end - r->p);
+    r->p = end;
+    return true;
+}
 
-static void init_default_config(AppState *st) {
-    const char *home = getenv("HOME");
-    if (!home) home = "/tmp";
-    
-    // Default download path: ~/Music/shellbeats
-    snprintf(st->config.download_path, sizeof(st->config.download_path), 
-             "%s/Music/shellbeats", home);
+// Step into the object ('{') or array ('[') at the cursor
+static bool json_enter(JsonReader *r, char open) {
+    if (json_peek(r) != open) return false;
+    r->p++;
+    return true;
 }
 
-static void save_config(AppState *st) {
-    FILE *f = fopen(st->config_file, "w");
-    if (!f) return;
+// Move to the next member of the object being read. Sets f->key and leaves
+// the cursor on the value, which the caller must then read or enter.
+// Returns false after the closing brace, or on bad input.
+static bool json_next_member(JsonReader *r, JsonField *f) {
+    while (json_peek(r) == ',') r->p++;
     
-    char *escaped_path = json_escape_string(st->config.download_path);
+    char c = json_peek(r);
+    if (c == '}') {
+        r->p++;
+        return false;
+    }
     
-    fprintf(f, "{\n");
-    fprintf(f, "  \"download_path\": \"%s\"\n", escaped_path ? escaped_path : "");
-    fprintf(f, "}\n");
-    
-    free(escaped_path);
-    fclose(f);
+    const char *key_end = c == '"' ? json_skip_value(r->p, r->end) : NULL;
+    if (key_end) {
+        f->key = r->p + 1;
+        f->key_len = (size_t)(key_end - 1 - f->key);
+        r->p = key_end;
+        if (json_peek(r) == ':') {
+            r->p++;
+            return true;
+        }
+    }
+    json_reader_fail(r);
+    return false;
 }
 
-static void load_config(AppState *st) {
-    // Set defaults first
-    init_default_config(st);
-    
-    FILE *f = fopen(st->config_file, "r");
-    if (!f) {
-        // No config file, save defaults
-        save_config(st);
-        return;
-    }
+// Move to the next element of the array being read, leaving the cursor on
+// it. Returns false after the closing bracket or at the end of the input.
+static bool json_next_element(JsonReader *r) {
+    while (json_peek(r) == ',') r->p++;
     
-    // Read entire file
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    if (fsize <= 0 || fsize > 64 * 1024) {
-        fclose(f);
-        return;
+    char c = json_peek(r);
+    if (c == ']') {
+        r->p++;
+        return false;
     }
-    
-    char *content = malloc(fsize + 1);
-    if (!content) {
-        fclose(f);
-        return;
+    return c != '\0';
+}
+
+// Split the object at the cursor into its top-level members and step past
+// it. Members beyond max_fields are skipped. Returns the number of fields,
+// or -1 if the value is not a complete object.
+static int json_read_object(JsonReader *r, JsonField *fields, int max_fields) {
+    JsonField f;
+    if (!json_enter(r, '{')) {
+        json_read_value(r, &f);
+        return -1;
     }
     
-    size_t read_size = fread(content, 1, fsize, f);
-    content[read_size] = '\0';
-    fclose(f);
-    
-    // Parse download_path
-    char *download_path = json_get_string(content, "download_path");
-    if (download_path && download_path[0]) {
-        strncpy(st->config.download_path, download_path, sizeof(st->config.download_path) - 1);
-        st->config.download_path[sizeof(st->config.download_path) - 1] = '\0';
+    int n = 0;
+    while (json_next_member(r, &f)) {
+        if (!json_read_value(r, &f)) break;
+        if (n < max_fields) fields[n++] = f;
     }
-    free(download_path);
-    
-    free(content);
+    return r->error ? -1 : n;
 }
 
-// ============================================================================
-// NEW: Download Queue Persistence
-// ============================================================================
-
-// NOTE: Must be called with download_queue.mutex already locked
-static void save_download_queue(AppState *st) {
-    FILE *f = fopen(st->download_queue_file, "w");
-    if (!f) {
-        return;
-    }
+// Split a NUL-terminated JSON object into its top-level members.
+// Returns the number of fields found, or -1 if json is not an object.
+static int json_parse_fields(const char *json, JsonField *fields, int max_fields) {
+    JsonReader r;
+    json_reader_init(&r, json, strlen(json));
+    return json_read_object(&r, fields, max_fields);
+}
 
-    fprintf(f, "{\n  \"tasks\": [\n");
+static bool json_key_is(const JsonField *f, const char *key) {
+    size_t len = strlen(key);
+    return f->key_len == len && memcmp(f->key, key, len) == 0;
+}
 
-    bool first = true;
-    for (int i = 0; i < st->download_queue.count; i++) {
-        DownloadTask *task = &st->download_queue.tasks[i];
+static const JsonField *json_find_field(const JsonField *fields, int count, const char *key) {
+    for (int i = 0; i < count; i++) {
+        if (json_key_is(&fields[i], key)) return &fields[i];
+    }
+    return NULL;
+}
 
-        // Only save pending or failed tasks
-        if (task->status != DOWNLOAD_PENDING && task->status != DOWNLOAD_FAILED) {
-            continue;
-        }
+// True if the field is the JSON string s (no escapes expected)
+static bool json_field_equals(const JsonField *f, const char *s) {
+    size_t len = strlen(s);
+    return f && f->value_len == len + 2 && f->value[0] == '"' &&
+           memcmp(f->value + 1, s, len) == 0;
+}
 
-        char *escaped_title = json_escape_string(task->title);
-        char *escaped_filename = json_escape_string(task->sanitized_filename);
-        char *escaped_playlist = json_escape_string(task->playlist_name);
+static long json_field_long(const JsonField *f, long fallback) {
+    if (!f) return fallback;
+    
+    // The value is not NUL-terminated; numbers we write are short
+    char num[32];
+    size_t len = f->value_len < sizeof(num) - 1 ? f->value_len : sizeof(num) - 1;
+    memcpy(num, f->value, len);
+    num[len] = '\0';
+    
+    char *end;
+    long v = strtol(num, &end, 10);
+    return end == num ? fallback : v;
+}
 
-        const char *status_str = task->status == DOWNLOAD_FAILED ? "failed" : "pending";
+static int json_hex4(const char *p) {
+    int v = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = (unsigned char)p[i];
+        if (!isxdigit(c)) return -1;
+        v = v * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    return v;
+}
 
-        if (!first) fprintf(f, ",\n");
-        first = false;
+// Cut off a UTF-8 character left incomplete at the end of s by truncation
+static void utf8_trim_partial(char *s) {
+    size_t len = strlen(s);
+    size_t start = len;
+    while (start > 0 && len - start < 4 && ((unsigned char)s[start - 1] & 0xC0) == 0x80) start--;
+    if (start == 0) return;
+    
+    unsigned char lead = (unsigned char)s[start - 1];
+    size_t need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    if (len - (start - 1) < need) s[start - 1] = '\0';
+}
 
-        fprintf(f, "    {\"video_id\": \"%s\", \"title\": \"%s\", \"filename\": \"%s\", \"playlist\": \"%s\", \"status\": \"%s\"}",
-                task->video_id,
-                escaped_title ? escaped_title : "",
-                escaped_filename ? escaped_filename : "",
-                escaped_playlist ? escaped_playlist : "",
-                status_str);
+static size_t utf8_encode(long cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
 
-        free(escaped_title);
-        free(escaped_filename);
-        free(escaped_playlist);
+// Unescape the body of a JSON string (len bytes at src) into out, which
+// needs len + 1 bytes: unescaping never makes the text longer.
+static void json_unescape(const char *src, size_t len, char *out) {
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] != '\\' || i + 1 >= len) {
+            out[j++] = src[i];
+            continue;
+        }
+        
+        char c = src[++i];
+        switch (c) {
+            case 'n': out[j++] = '\n'; break;
+            case 'r': out[j++] = '\r'; break;
+            case 't': out[j++] = '\t'; break;
+            case 'b': out[j++] = '\b'; break;
+            case 'f': out[j++] = '\f'; break;
+            case 'u': {
+                long cp = i + 4 < len ? json_hex4(src + i + 1) : -1;
+                if (cp < 0) {
+                    out[j++] = c;
+                    break;
+                }
+                i += 4;
+                // A UTF-16 surrogate pair is two escapes for one character
+                if (cp >= 0xD800 && cp < 0xDC00 && i + 6 < len &&
+                    src[i + 1] == '\\' && src[i + 2] == 'u') {
+                    long lo = json_hex4(src + i + 3);
+                    if (lo >= 0xDC00 && lo < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        i += 6;
+                    }
+                }
+                j += utf8_encode(cp, out + j);
+                break;
+            }
+            default: out[j++] = c; break;  // \" \\ and \/
+        }
     }
+    out[j] = '\0';
+}
 
-    fprintf(f, "\n  ]\n}\n");
-    fclose(f);
+static bool json_field_is_string(const JsonField *f) {
+    return f && f->value_len >= 2 && f->value[0] == '"';
 }
 
-static void load_download_queue(AppState *st) {
-    FILE *f = fopen(st->download_queue_file, "r");
-    if (!f) return;
+// Unescape a JSON string field into the arena. NULL if f is not a string.
+static char *json_field_string(const JsonField *f, StringArena *a) {
+    if (!json_field_is_string(f)) return NULL;
+    
+    char *out = arena_alloc(a, f->value_len - 1);
+    if (out) json_unescape(f->value + 1, f->value_len - 2, out);
+    return out;
+}
+
+// Same, as a malloc'd string
+static char *json_field_dup(const JsonField *f) {
+    if (!json_field_is_string(f)) return NULL;
     
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    char *out = malloc(f->value_len - 1);
+    if (out) json_unescape(f->value + 1, f->value_len - 2, out);
+    return out;
+}
+
+// Unescape a JSON string field into out, truncating to fit
+static bool json_field_copy(const JsonField *f, char *out, size_t out_size) {
+    if (!json_field_is_string(f) || out_size == 0) return false;
     
-    if (fsize <= 0 || fsize > 1024 * 1024) {
-        fclose(f);
-        return;
+    size_t len = f->value_len - 2;
+    if (len < out_size) {
+        json_unescape(f->value + 1, len, out);
+        return true;
     }
     
-    char *content = malloc(fsize + 1);
-    if (!content) {
-        fclose(f);
-        return;
+    char *full = json_field_dup(f);
+    if (!full) return false;
+    snprintf(out, out_size, "%s", full);
+    if (strlen(full) >= out_size) utf8_trim_partial(out);
+    free(full);
+    return true;
+}
+
+// ============================================================================
+// Config Directory Management
+// ============================================================================
+
+static bool init_config_dirs(AppState *st) {
+    const char *home = getenv("HOME");
+    if (!home) {
+        home = "/tmp";
     }
     
-    size_t read_size = fread(content, 1, fsize, f);
-    content[read_size] = '\0';
-    fclose(f);
+    snprintf(st->config_dir, sizeof(st->config_dir), "%s/%s", home, CONFIG_DIR);
+    snprintf(st->playlists_dir, sizeof(st->playlists_dir), "%s/%s", st->config_dir, PLAYLISTS_DIR);
+    snprintf(st->playlists_index, sizeof(st->playlists_index), "%s/%s", st->config_dir, PLAYLISTS_INDEX);
+    snprintf(st->library_file, sizeof(st->library_file), "%s/%s", st->config_dir, LIBRARY_FILE);
+    snprintf(st->config_file, sizeof(st->config_file), "%s/%s", st->config_dir, CONFIG_FILE);  // NEW
+    snprintf(st->download_queue_file, sizeof(st->download_queue_file), "%s/%s", st->config_dir, DOWNLOAD_QUEUE_FILE);  // NEW
+    snprintf(st->download_journal_file, sizeof(st->download_journal_file), "%s/%s", st->config_dir, DOWNLOAD_JOURNAL_FILE);
+    snprintf(st->download_stats_file, sizeof(st->download_stats_file), "%s/%s", st->config_dir, DOWNLOAD_STATS_FILE);
+    snprintf(st->search_cache_dir, sizeof(st->search_cache_dir), "%s/%s", st->config_dir, SEARCH_CACHE_DIR);
+    snprintf(st->control_socket, sizeof(st->control_socket), "%s/%s", st->config_dir, CONTROL_SOCKET);
+    snprintf(st->instance_lock, sizeof(st->instance_lock), "%s/%s", st->config_dir, INSTANCE_LOCK);
     
-    const char *p = strstr(content, "\"tasks\"");
-    if (!p) {
-        free(content);
-        return;
+    st->config_dir[sizeof(st->config_dir) - 1] = '\0';
+    st->playlists_dir[sizeof(st->playlists_dir) - 1] = '\0';
+    st->playlists_index[sizeof(st->playlists_index) - 1] = '\0';
+    st->library_file[sizeof(st->library_file) - 1] = '\0';
+    st->config_file[sizeof(st->config_file) - 1] = '\0';  // NEW
+    st->download_queue_file[sizeof(st->download_queue_file) - 1] = '\0';  // NEW
+    st->download_journal_file[sizeof(st->download_journal_file) - 1] = '\0';
+    st->download_stats_file[sizeof(st->download_stats_file) - 1] = '\0';
+    st->search_cache_dir[sizeof(st->search_cache_dir) - 1] = '\0';
+    st->control_socket[sizeof(st->control_socket) - 1] = '\0';
+    st->instance_lock[sizeof(st->instance_lock) - 1] = '\0';
+    
+    // Create config directory if not exists
+    if (!dir_exists(st->config_dir)) {
+        if (mkdir(st->config_dir, 0755) != 0) {
+            return false;
+        }
     }
     
-    p = strchr(p, '[');
-    if (!p) {
-        free(content);
-        return;
+    // Create playlists directory if not exists
+    if (!dir_exists(st->playlists_dir)) {
+        if (mkdir(st->playlists_dir, 0755) != 0) {
+            return false;
+        }
     }
     
-    pthread_mutex_lock(&st->download_queue.mutex);
+    // Search cache is optional, so a failure here is not fatal
+    if (!dir_exists(st->search_cache_dir)) {
+        mkdir(st->search_cache_dir, 0755);
+    }
     
-    while (st->download_queue.count < MAX_DOWNLOAD_QUEUE) {
-        const char *obj_start = strchr(p, '{');
-        if (!obj_start) break;
-        
-        const char *obj_end = strchr(obj_start, '}');
-        if (!obj_end) break;
-        
-        size_t obj_len = obj_end - obj_start + 1;
-        char *obj = malloc(obj_len + 1);
-        if (!obj) break;
-        
-        memcpy(obj, obj_start, obj_len);
-        obj[obj_len] = '\0';
-        
-        char *video_id = json_get_string(obj, "video_id");
-        char *title = json_get_string(obj, "title");
-        char *filename = json_get_string(obj, "filename");
-        char *playlist = json_get_string(obj, "playlist");
-        char *status_str = json_get_string(obj, "status");
-        
-        if (video_id && video_id[0]) {
-            DownloadTask *task = &st->download_queue.tasks[st->download_queue.count];
-            
-            strncpy(task->video_id, video_id, sizeof(task->video_id) - 1);
-            strncpy(task->title, title ? title : "", sizeof(task->title) - 1);
-            strncpy(task->sanitized_filename, filename ? filename : "", sizeof(task->sanitized_filename) - 1);
-            strncpy(task->playlist_name, playlist ? playlist : "", sizeof(task->playlist_name) - 1);
-            
-            if (status_str && strcmp(status_str, "failed") == 0) {
-                task->status = DOWNLOAD_FAILED;
-                st->download_queue.failed++;
-            } else {
-                task->status = DOWNLOAD_PENDING;
-            }
-            
-            st->download_queue.count++;
+    // Create empty playlists index if not exists
+    if (!file_exists(st->playlists_index)) {
+        FILE *f = fopen(st->playlists_index, "w");
+        if (f) {
+            fprintf(f, "{\"playlists\":[]}\n");
+            fclose(f);
         }
-        
-        free(video_id);
-        free(title);
-        free(filename);
-        free(playlist);
-        free(status_str);
-        free(obj);
-        
-        p = obj_end + 1;
     }
     
-    pthread_mutex_unlock(&st->download_queue.mutex);
-    free(content);
+    return true;
 }
 
 // ============================================================================
-// NEW: Download Thread
+// NEW: Configuration Persistence
 // ============================================================================
 
-static void *download_thread_func(void *arg) {
-    AppState *st = (AppState *)arg;
-    
-    while (!st->download_queue.should_stop) {
-        pthread_mutex_lock(&st->download_queue.mutex);
-        
-        // Find next pending task
-        int task_idx = -1;
-        for (int i = 0; i < st->download_queue.count; i++) {
-            if (st->download_queue.tasks[i].status == DOWNLOAD_PENDING) {
-                task_idx = i;
-                st->download_queue.tasks[i].status = DOWNLOAD_ACTIVE;
-                st->download_queue.current_idx = i;
-                st->download_queue.active = true;
-                break;
-            }
-        }
-        
-        if (task_idx < 0) {
-            // No pending tasks
-            st->download_queue.active = false;
-            st->download_queue.current_idx = -1;
-            pthread_mutex_unlock(&st->download_queue.mutex);
-            usleep(500 * 1000);  // Sleep 500ms
-            continue;
-        }
-        
-        // Copy task data while holding lock
-        DownloadTask task;
-        memcpy(&task, &st->download_queue.tasks[task_idx], sizeof(DownloadTask));
-        
-        pthread_mutex_unlock(&st->download_queue.mutex);
-        
-        // Build destination path
-        char dest_dir[2048]; // Increased buffer size
-        char dest_path[2560]; // Increased buffer size
-        
-        if (task.playlist_name[0]) {
-            snprintf(dest_dir, sizeof(dest_dir), "%s/%s", 
-                     st->config.download_path, task.playlist_name);
-        } else {
-            snprintf(dest_dir, sizeof(dest_dir), "%s", st->config.download_path);
-        }
-        
-        // Create directory if needed
-        mkdir_p(dest_dir);
-        
-        snprintf(dest_path, sizeof(dest_path), "%s/%s", dest_dir, task.sanitized_filename);
-        
-        // Check if file already exists (double-check)
-        if (file_exists(dest_path)) {
-            pthread_mutex_lock(&st->download_queue.mutex);
-            st->download_queue.tasks[task_idx].status = DOWNLOAD_COMPLETED;
-            st->download_queue.completed++;
-            save_download_queue(st);
-            pthread_mutex_unlock(&st->download_queue.mutex);
-            continue;
-        }
-        
-        // Build yt-dlp command
-        char cmd[4096];
-        snprintf(cmd, sizeof(cmd),
-                 "yt-dlp -x --audio-format mp3 --no-playlist --quiet --no-warnings "
-                 "-o '%s' 'https://www.youtube.com/watch?v=%s' >/dev/null 2>&1",
-                 dest_path, task.video_id);
-        
-        // Execute download
-        int result = system(cmd);
-        
-        pthread_mutex_lock(&st->download_queue.mutex);
-        
-        if (result == 0 && file_exists(dest_path)) {
-            st->download_queue.tasks[task_idx].status = DOWNLOAD_COMPLETED;
-            st->download_queue.completed++;
-        } else {
-            st->download_queue.tasks[task_idx].status = DOWNLOAD_FAILED;
-            st->download_queue.failed++;
-        }
-        
-        save_download_queue(st);
-        pthread_mutex_unlock(&st->download_queue.mutex);
+static const AudioFormat *find_audio_format(const char *name) {
+    for (int i = 0; i < AUDIO_FORMAT_COUNT; i++) {
+        if (strcmp(audio_formats[i].name, name) == 0) return &audio_formats[i];
     }
-    
     return NULL;
 }
 
-static void start_download_thread(AppState *st) {
-    if (st->download_queue.thread_running) return;
-    
-    st->download_queue.should_stop = false;
-    
-    if (pthread_create(&st->download_queue.thread, NULL, download_thread_func, st) == 0) {
-        st->download_queue.thread_running = true;
+// A yt-dlp --limit-rate value: digits, an optional fraction and K, M or G
+static bool valid_rate_limit(const char *s) {
+    const char *p = s;
+    if (!isdigit((unsigned char)*p)) return false;
+    while (isdigit((unsigned char)*p)) p++;
+    if (*p == '.') {
+        p++;
+        if (!isdigit((unsigned char)*p)) return false;
+        while (isdigit((unsigned char)*p)) p++;
     }
+    if (*p && strchr("KkMmGg", *p)) p++;
+    return *p == '\0' && p - s < 16;
 }
 
-static void stop_download_thread(AppState *st) {
-    if (!st->download_queue.thread_running) return;
+static void init_default_config(AppState *st) {
+    const char *home = getenv("HOME");
+    if (!home) home = "/tmp";
+    
+    // Default download path: ~/Music/shellbeats
+    snprintf(st->config.download_path, sizeof(st->config.download_path), 
+             "%s/Music/shellbeats", home);
     
-    st->download_queue.should_stop = true;
-    pthread_join(st->download_queue.thread, NULL);
-    st->download_queue.thread_running = false;
+    st->config.download_workers = DEFAULT_DOWNLOAD_WORKERS;
+    st->config.search_cache_ttl = DEFAULT_SEARCH_CACHE_TTL;
+    snprintf(st->config.audio_format, sizeof(st->config.audio_format), "%s", DEFAULT_AUDIO_FORMAT);
+    st->config.audio_bitrate = 0;
+    st->config.concurrent_fragments = 1;
+    st->config.rate_limit[0] = '\0';
 }
 
-// ============================================================================
-// NEW: Download Queue Management
-// ============================================================================
+static void save_config(AppState *st) {
+    FILE *f = fopen(st->config_file, "w");
+    if (!f) return;
+    
+    char *escaped_path = json_escape_string(st->config.download_path);
+    
+    fprintf(f, "{\n");
+    fprintf(f, "  \"download_path\": \"%s\",\n", escaped_path ? escaped_path : "");
+    fprintf(f, "  \"download_workers\": %d,\n", st->config.download_workers);
+    fprintf(f, "  \"search_cache_ttl\": %d,\n", st->config.search_cache_ttl);
+    fprintf(f, "  \"audio_format\": \"%s\",\n", st->config.audio_format);
+    fprintf(f, "  \"audio_bitrate\": %d,\n", st->config.audio_bitrate);
+    fprintf(f, "  \"concurrent_fragments\": %d,\n", st->config.concurrent_fragments);
+    fprintf(f, "  \"rate_limit\": \"%s\"\n", st->config.rate_limit);
+    fprintf(f, "}\n");
+    
+    free(escaped_path);
+    fclose(f);
+}
 
-static int add_to_download_queue(AppState *st, const char *video_id, const char *title, 
-                                  const char *playlist_name) {
-    if (!video_id || !video_id[0]) return -1;
+static void load_config(AppState *st) {
+    // Set defaults first
+    init_default_config(st);
     
-    // Build destination directory
-    char dest_dir[2048]; // Increased buffer size
-    if (playlist_name && playlist_name[0]) {
-        snprintf(dest_dir, sizeof(dest_dir), "%s/%s", 
-                 st->config.download_path, playlist_name);
-    } else {
-        snprintf(dest_dir, sizeof(dest_dir), "%s", st->config.download_path);
+    MappedFile mf;
+    if (!map_file(st->config_file, &mf)) {
+        // No config file, save defaults
+        save_config(st);
+        return;
     }
     
-    // Check if already downloaded
-    if (file_exists_for_video(dest_dir, video_id)) {
-        return 0;  // Already exists
+    JsonReader r;
+    json_reader_init(&r, mf.data, mf.size);
+    JsonField fields[16];
+    int n = json_read_object(&r, fields, 16);
+    
+    // Parse download_path
+    char download_path[sizeof(st->config.download_path)];
+    if (json_field_copy(json_find_field(fields, n, "download_path"), download_path,
+                        sizeof(download_path)) && download_path[0]) {
+        memcpy(st->config.download_path, download_path, sizeof(download_path));
     }
     
-    pthread_mutex_lock(&st->download_queue.mutex);
+    long workers = json_field_long(json_find_field(fields, n, "download_workers"),
+                                   st->config.download_workers);
+    if (workers >= 1 && workers <= MAX_DOWNLOAD_WORKERS) {
+        st->config.download_workers = (int)workers;
+    }
     
-    // Check if already in queue
-    for (int i = 0; i < st->download_queue.count; i++) {
-        if (strcmp(st->download_queue.tasks[i].video_id, video_id) == 0 &&
-            st->download_queue.tasks[i].status == DOWNLOAD_PENDING) {
-            pthread_mutex_unlock(&st->download_queue.mutex);
-            return 0;  // Already queued
-        }
+    long ttl = json_field_long(json_find_field(fields, n, "search_cache_ttl"),
+                               st->config.search_cache_ttl);
+    if (ttl >= 0) {
+        st->config.search_cache_ttl = (int)ttl;
     }
     
-    // Check queue capacity
-    if (st->download_queue.count >= MAX_DOWNLOAD_QUEUE) {
-        pthread_mutex_unlock(&st->download_queue.mutex);
-        return -1;
+    // Older config files have none of these; unknown values keep the defaults
+    char format[sizeof(st->config.audio_format)];
+    if (json_field_copy(json_find_field(fields, n, "audio_format"), format, sizeof(format)) &&
+        find_audio_format(format)) {
+        memcpy(st->config.audio_format, format, sizeof(format));
     }
     
-    // Add new task
-    DownloadTask *task = &st->download_queue.tasks[st->download_queue.count];
+    long bitrate = json_field_long(json_find_field(fields, n, "audio_bitrate"), 0);
+    if (bitrate >= 0 && bitrate <= 512) {
+        st->config.audio_bitrate = (int)bitrate;
+    }
     
-    strncpy(task->video_id, video_id, sizeof(task->video_id) - 1);
-    task->video_id[sizeof(task->video_id) - 1] = '\0';
+    long fragments = json_field_long(json_find_field(fields, n, "concurrent_fragments"), 1);
+    if (fragments >= 1 && fragments <= MAX_CONCURRENT_FRAGMENTS) {
+        st->config.concurrent_fragments = (int)fragments;
+    }
     
-    strncpy(task->title, title ? title : "Unknown", sizeof(task->title) - 1);
-    task->title[sizeof(task->title) - 1] = '\0';
-    
-    sanitize_title_for_filename(title, video_id, task->sanitized_filename, 
-                                 sizeof(task->sanitized_filename));
-    
-    if (playlist_name) {
-        strncpy(task->playlist_name, playlist_name, sizeof(task->playlist_name) - 1);
-        task->playlist_name[sizeof(task->playlist_name) - 1] = '\0';
-    } else {
-        task->playlist_name[0] = '\0';
+    char rate[sizeof(st->config.rate_limit)];
+    if (json_field_copy(json_find_field(fields, n, "rate_limit"), rate, sizeof(rate)) &&
+        valid_rate_limit(rate)) {
+        memcpy(st->config.rate_limit, rate, sizeof(rate));
     }
     
-    task->status = DOWNLOAD_PENDING;
-    st->download_queue.count++;
+    unmap_file(&mf);
+}
+
+// ============================================================================
+// Download Queue Bookkeeping
+// ============================================================================
+
+// Pending/active tasks are tracked in a FIFO of indices plus a video_id hash
+// set, so dispatch, dedup and counting never scan tasks[].
+// NOTE: All helpers below must be called with download_queue.mutex locked
+
+static void init_download_queue(DownloadQueue *q) {
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    for (int i = 0; i < DOWNLOAD_ID_BUCKETS; i++) {
+        q->id_buckets[i] = -1;
+    }
+    for (int i = 0; i < MAX_DOWNLOAD_WORKERS; i++) {
+        q->workers[i].task_idx = -1;
+    }
+    q->retry_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+}
+
+static void destroy_download_queue(DownloadQueue *q) {
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->mutex);
+}
+
+// Find the pending or active task for a video, -1 if not queued
+static int queue_find_video(DownloadQueue *q, const char *video_id) {
+    unsigned int b = hash_string(video_id) % DOWNLOAD_ID_BUCKETS;
+    for (int i = q->id_buckets[b]; i >= 0; i = q->id_next[i]) {
+        if (strcmp(q->tasks[i].video_id, video_id) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void queue_forget_video(DownloadQueue *q, int task_idx) {
+    unsigned int b = hash_string(q->tasks[task_idx].video_id) % DOWNLOAD_ID_BUCKETS;
+    int *pp = &q->id_buckets[b];
+    while (*pp >= 0) {
+        if (*pp == task_idx) {
+            *pp = q->id_next[task_idx];
+            return;
+        }
+        pp = &q->id_next[*pp];
+    }
+}
+
+static void queue_remember_video(DownloadQueue *q, int task_idx) {
+    unsigned int b = hash_string(q->tasks[task_idx].video_id) % DOWNLOAD_ID_BUCKETS;
+    q->id_next[task_idx] = q->id_buckets[b];
+    q->id_buckets[b] = task_idx;
+}
+
+// Append a task already in the id set to the pending FIFO
+static void queue_append_pending(DownloadQueue *q, int task_idx) {
+    q->tasks[task_idx].status = DOWNLOAD_PENDING;
+    q->pending_fifo[(q->fifo_head + q->fifo_len) % MAX_DOWNLOAD_QUEUE] = task_idx;
+    q->fifo_len++;
+    q->pending_count++;
+}
+
+// Mark a task pending and make it visible to workers and dedup
+static void queue_push_pending(DownloadQueue *q, int task_idx) {
+    queue_remember_video(q, task_idx);
+    queue_append_pending(q, task_idx);
+}
+
+// Park a task until its retry_at. It stays in the id set, so it is not
+// queued twice meanwhile.
+static void queue_park_retry(DownloadQueue *q, int task_idx) {
+    q->tasks[task_idx].status = DOWNLOAD_RETRY;
+    q->retry_tasks[q->retry_count++] = task_idx;
+}
+
+// Move retries that are due to the back of the pending FIFO, so they never
+// get ahead of work queued while they waited
+static void queue_promote_retries(DownloadQueue *q, time_t now) {
+    for (int i = 0; i < q->retry_count; ) {
+        int task_idx = q->retry_tasks[i];
+        if (q->tasks[task_idx].retry_at <= now) {
+            q->retry_tasks[i] = q->retry_tasks[--q->retry_count];
+            queue_append_pending(q, task_idx);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Earliest retry_at of the parked tasks, 0 if there are none
+static time_t queue_next_retry(DownloadQueue *q) {
+    time_t next = 0;
+    for (int i = 0; i < q->retry_count; i++) {
+        time_t at = q->tasks[q->retry_tasks[i]].retry_at;
+        if (next == 0 || at < next) next = at;
+    }
+    return next;
+}
+
+// Claim the oldest pending task, -1 if none
+static int queue_pop_pending(DownloadQueue *q) {
+    if (q->fifo_len == 0) return -1;
     
-    save_download_queue(st);
+    int task_idx = q->pending_fifo[q->fifo_head];
+    q->fifo_head = (q->fifo_head + 1) % MAX_DOWNLOAD_QUEUE;
+    q->fifo_len--;
+    q->pending_count--;
     
-    pthread_mutex_unlock(&st->download_queue.mutex);
+    q->tasks[task_idx].status = DOWNLOAD_ACTIVE;
+    q->active_count++;
+    return task_idx;
+}
+
+// Record the outcome of an active task: DOWNLOAD_COMPLETED, DOWNLOAD_FAILED,
+// or DOWNLOAD_RETRY with retry_at already set
+static void queue_finish_task(DownloadQueue *q, int task_idx, DownloadStatus outcome) {
+    q->active_count--;
     
-    // Start download thread if not running
-    start_download_thread(st);
+    if (outcome == DOWNLOAD_RETRY) {
+        queue_park_retry(q, task_idx);
+        return;
+    }
     
-    return 1;  // Added to queue
+    queue_forget_video(q, task_idx);
+    if (outcome == DOWNLOAD_COMPLETED) {
+        q->tasks[task_idx].status = DOWNLOAD_COMPLETED;
+        q->completed++;
+    } else {
+        q->tasks[task_idx].status = DOWNLOAD_FAILED;
+        q->failed++;
+    }
 }
 
-static int get_pending_download_count(AppState *st) {
-    pthread_mutex_lock(&st->download_queue.mutex);
-    int count = 0;
-    for (int i = 0; i < st->download_queue.count; i++) {
-        if (st->download_queue.tasks[i].status == DOWNLOAD_PENDING ||
-            st->download_queue.tasks[i].status == DOWNLOAD_ACTIVE) {
-            count++;
+// Give the slots of completed tasks back, and of failed ones too with
+// drop_failed; the rest keep their order. Every index into tasks[] is
+// remapped, workers[].task_idx included, so a worker looks its task up
+// again whenever it retakes the mutex.
+static void queue_compact(DownloadQueue *q, bool drop_failed) {
+    int remap[MAX_DOWNLOAD_QUEUE];
+    int kept = 0;
+    for (int i = 0; i < q->count; i++) {
+        DownloadStatus status = q->tasks[i].status;
+        if (status == DOWNLOAD_COMPLETED || (drop_failed && status == DOWNLOAD_FAILED)) {
+            remap[i] = -1;
+            continue;
         }
+        if (kept != i) q->tasks[kept] = q->tasks[i];
+        remap[i] = kept++;
+    }
+    if (kept == q->count) return;
+    q->count = kept;
+    
+    int fifo[MAX_DOWNLOAD_QUEUE];
+    int fifo_len = 0;
+    for (int i = 0; i < q->fifo_len; i++) {
+        int task_idx = remap[q->pending_fifo[(q->fifo_head + i) % MAX_DOWNLOAD_QUEUE]];
+        if (task_idx >= 0) fifo[fifo_len++] = task_idx;
+    }
+    memcpy(q->pending_fifo, fifo, fifo_len * sizeof(int));
+    q->fifo_head = 0;
+    q->fifo_len = fifo_len;
+    
+    for (int i = 0; i < q->retry_count; i++) {
+        q->retry_tasks[i] = remap[q->retry_tasks[i]];
+    }
+    for (int i = 0; i < MAX_DOWNLOAD_WORKERS; i++) {
+        if (q->workers[i].task_idx >= 0) q->workers[i].task_idx = remap[q->workers[i].task_idx];
+    }
+    
+    for (int i = 0; i < DOWNLOAD_ID_BUCKETS; i++) {
+        q->id_buckets[i] = -1;
+    }
+    for (int i = 0; i < kept; i++) {
+        DownloadStatus status = q->tasks[i].status;
+        if (status != DOWNLOAD_COMPLETED && status != DOWNLOAD_FAILED) queue_remember_video(q, i);
     }
-    pthread_mutex_unlock(&st->download_queue.mutex);
-    return count;
 }
 
 // ============================================================================
-// Playlist Persistence
+// NEW: Download Queue Persistence
 // ============================================================================
 
-static void free_playlist_items(Playlist *pl) {
-    for (int i = 0; i < pl->count; i++) {
-        free(pl->items[i].title);
-        free(pl->items[i].video_id);
-        free(pl->items[i].url);
-        pl->items[i].title = NULL;
-        pl->items[i].video_id = NULL;
-        pl->items[i].url = NULL;
+// ", attempts, retry_at, error" members of a task that has failed before
+static void write_download_attempts(FILE *f, const DownloadTask *task) {
+    if (task->attempts == 0) return;
+    fprintf(f, ", \"attempts\": %d, \"retry_at\": %lld, \"error\": \"%s\"",
+            task->attempts, (long long)task->retry_at, download_error_names[task->error]);
+}
+
+static DownloadError download_error_from_field(const JsonField *f) {
+    for (int i = DOWNLOAD_ERROR_NONE + 1; i < DOWNLOAD_ERROR_COUNT; i++) {
+        if (json_field_equals(f, download_error_names[i])) return (DownloadError)i;
     }
-    pl->count = 0;
+    return f ? DOWNLOAD_ERROR_OTHER : DOWNLOAD_ERROR_NONE;
 }
 
-static void free_playlist(Playlist *pl) {
-    free(pl->name);
-    free(pl->filename);
-    pl->name = NULL;
-    pl->filename = NULL;
-    free_playlist_items(pl);
+static void read_download_attempts(DownloadTask *task, const JsonField *fields, int n) {
+    task->attempts = (int)json_field_long(json_find_field(fields, n, "attempts"), 0);
+    task->retry_at = (time_t)json_field_long(json_find_field(fields, n, "retry_at"), 0);
+    task->error = download_error_from_field(json_find_field(fields, n, "error"));
 }
 
-static void free_all_playlists(AppState *st) {
-    for (int i = 0; i < st->playlist_count; i++) {
-        free_playlist(&st->playlists[i]);
+// Write one queue entry as a JSON object (no trailing newline)
+static void write_download_task(FILE *f, const char *op, const DownloadTask *task) {
+    fprintf(f, "{");
+    if (op) {
+        fprintf(f, "\"op\": \"%s\", ", op);
     }
-    st->playlist_count = 0;
+    fprintf(f, "\"video_id\": \"");
+    json_write_escaped(f, task->video_id);
+    fprintf(f, "\", \"title\": \"");
+    json_write_escaped(f, task->title);
+    fprintf(f, "\", \"filename\": \"");
+    json_write_escaped(f, task->sanitized_filename);
+    fprintf(f, "\", \"playlist\": \"");
+    json_write_escaped(f, task->playlist_name);
+    fprintf(f, "\"");
+    if (!op) {
+        const char *status = "pending";
+        if (task->status == DOWNLOAD_FAILED) status = "failed";
+        else if (task->status == DOWNLOAD_RETRY) status = "retry";
+        fprintf(f, ", \"status\": \"%s\"", status);
+    }
+    write_download_attempts(f, task);
+    fprintf(f, "}");
 }
 
-static char *sanitize_filename(const char *name) {
-    size_t len = strlen(name);
-    char *out = malloc(len + 6); // .json + null
-    if (!out) return NULL;
+// Write a full snapshot of the queue and start a fresh journal.
+// The snapshot is written to a temp file and renamed into place.
+// NOTE: Must be called with download_queue.mutex already locked
+static void save_download_queue(AppState *st) {
+    // Completed tasks are not saved; their slots are reclaimed as well
+    queue_compact(&st->download_queue, false);
     
-    size_t j = 0;
-    for (size_t i = 0; i < len && j < len; i++) {
-        char c = name[i];
-        if (isalnum((unsigned char)c) || c == '-' || c == '_') {
-            out[j++] = tolower((unsigned char)c);
-        } else if (c == ' ') {
-            out[j++] = '_';
+    char tmp_path[16400];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", st->download_queue_file);
+    
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        return;
+    }
+
+    fprintf(f, "{\n  \"tasks\": [\n");
+
+    bool first = true;
+    for (int i = 0; i < st->download_queue.count; i++) {
+        DownloadTask *task = &st->download_queue.tasks[i];
+
+        // Save pending, active (resumed next time) and failed tasks
+        if (task->status == DOWNLOAD_COMPLETED) {
+            continue;
         }
+
+        if (!first) fprintf(f, ",\n");
+        first = false;
+
+        fprintf(f, "    ");
+        write_download_task(f, NULL, task);
     }
-    out[j] = '\0';
-    
-    strcat(out, ".json");
-    return out;
-}
 
-static void save_playlists_index(AppState *st) {
-    FILE *f = fopen(st->playlists_index, "w");
-    if (!f) return;
+    fprintf(f, "\n  ]\n}\n");
     
-    fprintf(f, "{\n  \"playlists\": [\n");
+    bool ok = (fflush(f) == 0 && fsync(fileno(f)) == 0);
+    fclose(f);
     
-    for (int i = 0; i < st->playlist_count; i++) {
-        char *escaped_name = json_escape_string(st->playlists[i].name);
-        char *escaped_file = json_escape_string(st->playlists[i].filename);
-        
-        fprintf(f, "    {\"name\": \"%s\", \"filename\": \"%s\"}%s\n",
-                escaped_name ? escaped_name : "",
-                escaped_file ? escaped_file : "",
-                (i < st->playlist_count - 1) ? "," : "");
-        
-        free(escaped_name);
-        free(escaped_file);
+    if (!ok || rename(tmp_path, st->download_queue_file) != 0) {
+        unlink(tmp_path);
+        return;
     }
     
-    fprintf(f, "  ]\n}\n");
-    fclose(f);
+    // Everything in the journal is now part of the snapshot
+    if (st->download_queue.journal) {
+        fclose(st->download_queue.journal);
+    }
+    st->download_queue.journal = fopen(st->download_journal_file, "w");
+    st->download_queue.journal_entries = 0;
 }
 
-static void save_playlist(AppState *st, int idx) {
-    if (idx < 0 || idx >= st->playlist_count) return;
+// Push journal records to disk, so a crash or power cut cannot lose a change
+// the UI already showed. Batches of adds are synced once.
+// NOTE: Must be called with download_queue.mutex already locked
+static void sync_download_journal(DownloadQueue *q) {
+    if (!q->journal) return;
+    if (fflush(q->journal) == 0) fdatasync(fileno(q->journal));
+}
+
+// Append one state transition to the journal, compacting when it grows large.
+// op is "add" (full task follows), "done", "failed" or "retry".
+// NOTE: Must be called with download_queue.mutex already locked
+static void journal_download_task(AppState *st, const char *op, const DownloadTask *task,
+                                  bool flush) {
+    DownloadQueue *q = &st->download_queue;
     
-    Playlist *pl = &st->playlists[idx];
+    if (!q->journal) {
+        q->journal = fopen(st->download_journal_file, "a");
+        if (!q->journal) return;
+    }
     
-    char path[4096]; // Increased buffer size
-    snprintf(path, sizeof(path), "%s/%s", st->playlists_dir, pl->filename);
+    if (strcmp(op, "add") == 0) {
+        write_download_task(q->journal, op, task);
+    } else {
+        fprintf(q->journal, "{\"op\": \"%s\", \"video_id\": \"", op);
+        json_write_escaped(q->journal, task->video_id);
+        fprintf(q->journal, "\"");
+        write_download_attempts(q->journal, task);
+        fprintf(q->journal, "}");
+    }
+    fputc('\n', q->journal);
+    q->journal_entries++;
     
-    FILE *f = fopen(path, "w");
-    if (!f) return;
+    if (q->journal_entries >= DOWNLOAD_JOURNAL_COMPACT_AT) {
+        save_download_queue(st);
+    } else if (flush) {
+        sync_download_journal(q);
+    }
+}
+
+// Flush the journal into a final snapshot and close it
+static void close_download_journal(AppState *st) {
+    pthread_mutex_lock(&st->download_queue.mutex);
+    if (st->download_queue.journal_entries > 0) {
+        save_download_queue(st);
+    }
+    if (st->download_queue.journal) {
+        fclose(st->download_queue.journal);
+        st->download_queue.journal = NULL;
+    }
+    pthread_mutex_unlock(&st->download_queue.mutex);
+}
+
+// Apply one snapshot or journal object to the queue being loaded.
+// Tasks are only linked into the id set here; the pending FIFO is built
+// once replay is complete.
+static void replay_download_entry(DownloadQueue *q, const JsonField *fields, int n) {
+    char video_id[sizeof(q->tasks[0].video_id)];
+    if (!json_field_copy(json_find_field(fields, n, "video_id"), video_id, sizeof(video_id)) ||
+        !video_id[0]) {
+        return;
+    }
     
-    fprintf(f, "{\n  \"name\": \"%s\",\n  \"type\": \"%s\",\n  \"songs\": [\n",
-            pl->name, pl->is_youtube_playlist ? "youtube" : "local");
+    const JsonField *op = json_find_field(fields, n, "op");
+    int task_idx = queue_find_video(q, video_id);
     
-    for (int i = 0; i < pl->count; i++) {
-        char *escaped_title = json_escape_string(pl->items[i].title);
-        char *escaped_id = json_escape_string(pl->items[i].video_id);
-        
-        fprintf(f, "    {\"title\": \"%s\", \"video_id\": \"%s\"}%s\n",
-                escaped_title ? escaped_title : "",
-                escaped_id ? escaped_id : "",
-                (i < pl->count - 1) ? "," : "");
+    if (!op || json_field_equals(op, "add")) {
+        if (task_idx < 0 && q->count < MAX_DOWNLOAD_QUEUE) {
+            task_idx = q->count++;
+            unsigned int b = hash_string(video_id) % DOWNLOAD_ID_BUCKETS;
+            q->id_next[task_idx] = q->id_buckets[b];
+            q->id_buckets[b] = task_idx;
+        }
         
-        free(escaped_title);
-        free(escaped_id);
+        if (task_idx >= 0) {
+            DownloadTask *task = &q->tasks[task_idx];
+            memset(task, 0, sizeof(*task));
+            memcpy(task->video_id, video_id, sizeof(task->video_id));
+            json_field_copy(json_find_field(fields, n, "title"), task->title, sizeof(task->title));
+            json_field_copy(json_find_field(fields, n, "filename"), task->sanitized_filename,
+                            sizeof(task->sanitized_filename));
+            json_field_copy(json_find_field(fields, n, "playlist"), task->playlist_name,
+                            sizeof(task->playlist_name));
+            const JsonField *status = json_find_field(fields, n, "status");
+            task->status = DOWNLOAD_PENDING;
+            if (json_field_equals(status, "failed")) task->status = DOWNLOAD_FAILED;
+            else if (json_field_equals(status, "retry")) task->status = DOWNLOAD_RETRY;
+            read_download_attempts(task, fields, n);
+        }
+    } else if (task_idx >= 0) {
+        DownloadTask *task = &q->tasks[task_idx];
+        if (json_field_equals(op, "done")) {
+            task->status = DOWNLOAD_COMPLETED;
+        } else if (json_field_equals(op, "failed")) {
+            task->status = DOWNLOAD_FAILED;
+            read_download_attempts(task, fields, n);
+        } else if (json_field_equals(op, "retry")) {
+            task->status = DOWNLOAD_RETRY;
+            read_download_attempts(task, fields, n);
+        }
     }
-    
-    fprintf(f, "  ]\n}\n");
-    fclose(f);
 }
 
-static void load_playlist_songs(AppState *st, int idx) {
-    if (idx < 0 || idx >= st->playlist_count) return;
-    
-    Playlist *pl = &st->playlists[idx];
-    free_playlist_items(pl);
-    
-    char path[16384]; // Significantly increased buffer size
-    snprintf(path, sizeof(path), "%s/%s", st->playlists_dir, pl->filename);
-    
-    FILE *f = fopen(path, "r");
-    if (!f) return;
+// Replay every entry of the "tasks" array in a queue snapshot
+static void replay_download_snapshot(DownloadQueue *q, const MappedFile *mf) {
+    JsonReader r;
+    json_reader_init(&r, mf->data, mf->size);
+    if (!json_enter(&r, '{')) return;
     
-    // Read entire file
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    if (fsize <= 0 || fsize > 1024 * 1024) {
-        fclose(f);
-        return;
+    JsonField member;
+    while (json_next_member(&r, &member)) {
+        if (!json_key_is(&member, "tasks") || !json_enter(&r, '[')) {
+            json_read_value(&r, &member);
+            continue;
+        }
+        while (json_next_element(&r)) {
+            JsonField fields[16];
+            int n = json_read_object(&r, fields, 16);
+            if (n > 0) replay_download_entry(q, fields, n);
+        }
     }
+}
+
+// Replay a journal, one object per line. A line torn by a crash does not
+// parse as a complete object and is skipped.
+static void replay_download_journal(DownloadQueue *q, const MappedFile *mf) {
+    const char *p = mf->data;
+    const char *end = p + mf->size;
     
-    char *content = malloc(fsize + 1);
-    if (!content) {
-        fclose(f);
-        return;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *line_end = nl ? nl : end;
+        
+        JsonReader r;
+        json_reader_init(&r, p, (size_t)(line_end - p));
+        JsonField fields[16];
+        int n = json_read_object(&r, fields, 16);
+        if (n > 0) replay_download_entry(q, fields, n);
+        
+        if (!nl) break;
+        p = nl + 1;
     }
+}
+
+// Load the snapshot, replay the journal on top of it and compact both
+static void load_download_queue(AppState *st) {
+    DownloadQueue *q = &st->download_queue;
     
-    size_t read_size = fread(content, 1, fsize, f);
-    content[read_size] = '\0';
-    fclose(f);
-    
-    // Parse type
-    char *type = json_get_string(content, "type");
-    pl->is_youtube_playlist = (type && strcmp(type, "youtube") == 0);
-    free(type);
+    pthread_mutex_lock(&q->mutex);
     
-    // Parse songs array - simple approach
-    const char *p = strstr(content, "\"songs\"");
-    if (!p) {
-        free(content);
-        return;
+    MappedFile mf;
+    if (map_file(st->download_queue_file, &mf)) {
+        replay_download_snapshot(q, &mf);
+        unmap_file(&mf);
     }
     
-    p = strchr(p, '[');
-    if (!p) {
-        free(content);
-        return;
+    bool had_journal = map_file(st->download_journal_file, &mf) && mf.size > 0;
+    if (had_journal) replay_download_journal(q, &mf);
+    unmap_file(&mf);
+    
+    // Drop completed tasks and rebuild the pending FIFO in queue order;
+    // retries keep their retry_at
+    int loaded = q->count;
+    q->count = 0;
+    for (int i = 0; i < DOWNLOAD_ID_BUCKETS; i++) {
+        q->id_buckets[i] = -1;
     }
     
-    // Find each song object
-    while (pl->count < MAX_PLAYLIST_ITEMS) {
-        const char *obj_start = strchr(p, '{');
-        if (!obj_start) break;
-        
-        const char *obj_end = strchr(obj_start, '}');
-        if (!obj_end) break;
-        
-        // Extract this object
-        size_t obj_len = obj_end - obj_start + 1;
-        char *obj = malloc(obj_len + 1);
-        if (!obj) break;
+    for (int i = 0; i < loaded; i++) {
+        if (q->tasks[i].status == DOWNLOAD_COMPLETED) continue;
         
-        memcpy(obj, obj_start, obj_len);
-        obj[obj_len] = '\0';
-        
-        char *title = json_get_string(obj, "title");
-        char *video_id = json_get_string(obj, "video_id");
+        int task_idx = q->count++;
+        if (task_idx != i) {
+            q->tasks[task_idx] = q->tasks[i];
+        }
         
-        if (title && video_id && video_id[0]) {
-            pl->items[pl->count].title = title;
-            pl->items[pl->count].video_id = video_id;
-            
-            char url[256];
-            snprintf(url, sizeof(url), "https://www.youtube.com/watch?v=%s", video_id);
-            pl->items[pl->count].url = strdup(url);
-            pl->items[pl->count].duration = 0;
-            
-            pl->count++;
+        if (q->tasks[task_idx].status == DOWNLOAD_FAILED) {
+            q->failed++;
+        } else if (q->tasks[task_idx].status == DOWNLOAD_RETRY) {
+            queue_remember_video(q, task_idx);
+            queue_park_retry(q, task_idx);
         } else {
-            free(title);
-            free(video_id);
+            queue_push_pending(q, task_idx);
         }
-        
-        free(obj);
-        p = obj_end + 1;
     }
     
-    free(content);
+    if (had_journal) {
+        save_download_queue(st);
+    }
+    
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
 }
 
-static void load_playlists(AppState *st) {
-    free_all_playlists(st);
-    
-    FILE *f = fopen(st->playlists_index, "r");
-    if (!f) return;
+// ============================================================================
+// Downloaded File Index
+// ============================================================================
+
+// Extract the video id from a "Title_[video_id].ext" audio filename
+static bool video_id_from_filename(const char *name, char *out, size_t out_size) {
+    const char *ext = audio_extension(name);
+    if (!ext) return false;
     
-    // Read entire file
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    size_t len = strlen(name);
+    if (len < strlen(ext) + 4) return false;  // at least "[x].ext"
+    const char *close = name + len - strlen(ext) - 2;
+    if (*close != ']') return false;
     
-    if (fsize <= 0 || fsize > 1024 * 1024) {
-        fclose(f);
-        return;
-    }
+    const char *open = close;
+    while (open > name && *open != '[') open--;
+    if (*open != '[') return false;
     
-    char *content = malloc(fsize + 1);
-    if (!content) {
-        fclose(f);
-        return;
-    }
+    size_t id_len = close - open - 1;
+    if (id_len == 0 || id_len >= out_size) return false;
     
-    size_t read_size = fread(content, 1, fsize, f);
-    content[read_size] = '\0';
-    fclose(f);
+    memcpy(out, open + 1, id_len);
+    out[id_len] = '\0';
+    return true;
+}
+
+static void free_local_file(LocalFile *lf) {
+    free(lf->playlist_name);
+    free(lf->path);
+    free(lf);
+}
+
+static LocalFile *local_table_find(LocalFile *const *buckets, const char *playlist_name,
+                                   const char *video_id) {
+    if (!playlist_name) playlist_name = "";
     
-    // Parse playlists array
-    const char *p = strstr(content, "\"playlists\"");
-    if (!p) {
-        free(content);
-        return;
+    unsigned int b = hash_string(video_id) % LOCAL_INDEX_BUCKETS;
+    for (LocalFile *lf = buckets[b]; lf; lf = lf->next) {
+        if (strcmp(lf->video_id, video_id) == 0 && strcmp(lf->playlist_name, playlist_name) == 0) {
+            return lf;
+        }
     }
-    
-    p = strchr(p, '[');
-    if (!p) {
-        free(content);
-        return;
+    return NULL;
+}
+
+// Add or update an entry in buckets. Returns the entry, or NULL if out of
+// memory; *added is set when it is new.
+static LocalFile *local_table_put(LocalFile **buckets, const char *playlist_name,
+                                  const char *video_id, const char *path, bool *added) {
+    if (!playlist_name) playlist_name = "";
+    *added = false;
+    
+    LocalFile *lf = local_table_find(buckets, playlist_name, video_id);
+    if (lf) {
+        char *new_path = strdup(path);
+        if (!new_path) return NULL;
+        free(lf->path);
+        lf->path = new_path;
+        return lf;
     }
     
-    while (st->playlist_count < MAX_PLAYLISTS) {
-        const char *obj_start = strchr(p, '{');
-        if (!obj_start) break;
-        
-        const char *obj_end = strchr(obj_start, '}');
-        if (!obj_end) break;
-        
-        size_t obj_len = obj_end - obj_start + 1;
-        char *obj = malloc(obj_len + 1);
-        if (!obj) break;
-        
-        memcpy(obj, obj_start, obj_len);
-        obj[obj_len] = '\0';
-        
-        char *name = json_get_string(obj, "name");
-        char *filename = json_get_string(obj, "filename");
-        
-        if (name && filename && name[0] && filename[0]) {
-            st->playlists[st->playlist_count].name = name;
-            st->playlists[st->playlist_count].filename = filename;
-            st->playlists[st->playlist_count].count = 0;
-            st->playlist_count++;
-        } else {
-            free(name);
-            free(filename);
-        }
-        
-        free(obj);
-        p = obj_end + 1;
+    lf = calloc(1, sizeof(LocalFile));
+    if (!lf) return NULL;
+    snprintf(lf->video_id, sizeof(lf->video_id), "%s", video_id);
+    lf->playlist_name = strdup(playlist_name);
+    lf->path = strdup(path);
+    if (!lf->playlist_name || !lf->path) {
+        free_local_file(lf);
+        return NULL;
     }
     
-    free(content);
+    unsigned int b = hash_string(video_id) % LOCAL_INDEX_BUCKETS;
+    lf->next = buckets[b];
+    buckets[b] = lf;
+    *added = true;
+    return lf;
 }
 
-static int create_playlist(AppState *st, const char *name, bool is_youtube) {
-    if (st->playlist_count >= MAX_PLAYLISTS) return -1;
-    if (!name || !name[0]) return -1;
-    
-    // Check for duplicate name
-    for (int i = 0; i < st->playlist_count; i++) {
-        if (strcasecmp(st->playlists[i].name, name) == 0) {
-            return -2; // Already exists
+static void local_table_free(LocalFile **buckets) {
+    for (int b = 0; b < LOCAL_INDEX_BUCKETS; b++) {
+        LocalFile *lf = buckets[b];
+        while (lf) {
+            LocalFile *next = lf->next;
+            free_local_file(lf);
+            lf = next;
         }
+        buckets[b] = NULL;
     }
+}
+
+// NOTE: Must be called with local_files.mutex already locked
+static LocalFile *local_index_find(AppState *st, const char *playlist_name, const char *video_id) {
+    return local_table_find(st->local_files.buckets, playlist_name, video_id);
+}
+
+static void local_index_add(AppState *st, const char *playlist_name, const char *video_id,
+                            const char *path) {
+    if (!video_id || !video_id[0] || !path) return;
     
-    char *filename = sanitize_filename(name);
-    if (!filename) return -1;
+    pthread_mutex_lock(&st->local_files.mutex);
     
-    // Check for duplicate filename
-    for (int i = 0; i < st->playlist_count; i++) {
-        if (strcmp(st->playlists[i].filename, filename) == 0) {
-            // Add number suffix
-            char *new_filename = malloc(strlen(filename) + 10);
-            if (!new_filename) {
-                free(filename);
-                return -1;
-            }
-            snprintf(new_filename, strlen(filename) + 10, "%d_%s", 
-                     st->playlist_count, filename);
-            free(filename);
-            filename = new_filename;
-            break;
-        }
+    bool added;
+    LocalFile *lf = local_table_put(st->local_files.buckets, playlist_name, video_id, path, &added);
+    if (lf) {
+        if (added) st->local_files.count++;
+        lf->added = ++st->local_files.version;
     }
     
-    int idx = st->playlist_count;
-    st->playlists[idx].name = strdup(name);
-    st->playlists[idx].filename = filename;
-    st->playlists[idx].count = 0;
-    st->playlists[idx].is_youtube_playlist = is_youtube;
-    st->playlist_count++;
-    
-    save_playlists_index(st);
-    save_playlist(st, idx);
-    
-    return idx;
+    pthread_mutex_unlock(&st->local_files.mutex);
 }
 
-static bool delete_playlist(AppState *st, int idx) {
-    if (idx < 0 || idx >= st->playlist_count) return false;
-
-    // Save playlist name before freeing (needed for directory deletion)
-    char playlist_name[256];
-    strncpy(playlist_name, st->playlists[idx].name, sizeof(playlist_name) - 1);
-    playlist_name[sizeof(playlist_name) - 1] = '\0';
-
-    // Delete the playlist JSON file
-    char path[16384]; // Significantly increased buffer size
-    snprintf(path, sizeof(path), "%s/%s", st->playlists_dir, st->playlists[idx].filename);
-    unlink(path);
-
-    // Delete the download directory and all downloaded songs
-    char download_dir[16384]; // Significantly increased buffer size
-    snprintf(download_dir, sizeof(download_dir), "%s/%s", st->config.download_path, playlist_name);
-    if (dir_exists(download_dir)) {
-        delete_directory_recursive(download_dir);
+// Drop every entry belonging to a playlist (its directory was deleted)
+static void local_index_remove_playlist(AppState *st, const char *playlist_name) {
+    if (!playlist_name) playlist_name = "";
+    
+    pthread_mutex_lock(&st->local_files.mutex);
+    
+    for (int b = 0; b < LOCAL_INDEX_BUCKETS; b++) {
+        LocalFile **pp = &st->local_files.buckets[b];
+        while (*pp) {
+            LocalFile *lf = *pp;
+            if (strcmp(lf->playlist_name, playlist_name) == 0) {
+                *pp = lf->next;
+                free_local_file(lf);
+                st->local_files.count--;
+                st->local_files.version++;
+            } else {
+                pp = &lf->next;
+            }
+        }
     }
+    
+    pthread_mutex_unlock(&st->local_files.mutex);
+}
 
-    // Free memory
-    free_playlist(&st->playlists[idx]);
+static void free_local_file_index(AppState *st) {
+    pthread_mutex_lock(&st->local_files.mutex);
+    local_table_free(st->local_files.buckets);
+    st->local_files.count = 0;
+    st->local_files.version++;
+    pthread_mutex_unlock(&st->local_files.mutex);
+}
 
-    // Shift remaining playlists
-    for (int i = idx; i < st->playlist_count - 1; i++) {
-        st->playlists[i] = st->playlists[i + 1];
+// Index all downloaded files in one directory into buckets
+static void local_index_scan_dir(LocalFile **buckets, int *count, const char *dir_path,
+                                 const char *playlist_name) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) return;
+    
+    char video_id[32];
+    char path[4096];
+    
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!video_id_from_filename(entry->d_name, video_id, sizeof(video_id))) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        bool added;
+        local_table_put(buckets, playlist_name, video_id, path, &added);
+        if (added) (*count)++;
     }
-    st->playlist_count--;
-
-    // Clear the last slot
-    memset(&st->playlists[st->playlist_count], 0, sizeof(Playlist));
-
-    save_playlists_index(st);
-    return true;
+    
+    closedir(dir);
 }
 
-static bool add_song_to_playlist(AppState *st, int playlist_idx, Song *song) {
-    if (playlist_idx < 0 || playlist_idx >= st->playlist_count) return false;
-    if (!song || !song->video_id) return false;
+// Scan download_path and its per-playlist subdirectories. The scan fills a
+// table of its own, so lookups and workers are not held up, and is swapped
+// in at the end.
+static void build_local_file_index(AppState *st) {
+    LocalFile **buckets = calloc(LOCAL_INDEX_BUCKETS, sizeof(LocalFile *));
+    if (!buckets) return;
+    int count = 0;
     
-    Playlist *pl = &st->playlists[playlist_idx];
+    pthread_mutex_lock(&st->local_files.mutex);
+    unsigned int scan_start = st->local_files.version;
+    pthread_mutex_unlock(&st->local_files.mutex);
     
-    // Load songs if not loaded
-    if (pl->count == 0 && file_exists(st->playlists_dir)) {
-        load_playlist_songs(st, playlist_idx);
-    }
+    const char *root = st->config.download_path;
+    local_index_scan_dir(buckets, &count, root, NULL);
     
-    if (pl->count >= MAX_PLAYLIST_ITEMS) return false;
+    DIR *dir = opendir(root);
+    if (dir) {
+        char subdir[4096];
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            snprintf(subdir, sizeof(subdir), "%s/%s", root, entry->d_name);
+            if (dir_exists(subdir)) {
+                local_index_scan_dir(buckets, &count, subdir, entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
     
-    // Check for duplicate
-    for (int i = 0; i < pl->count; i++) {
-        if (pl->items[i].video_id && strcmp(pl->items[i].video_id, song->video_id) == 0) {
-            return false; // Already in playlist
+    pthread_mutex_lock(&st->local_files.mutex);
+    
+    // Keep files a worker finished while the scan ran and it did not see
+    for (int b = 0; b < LOCAL_INDEX_BUCKETS; b++) {
+        LocalFile *lf = st->local_files.buckets[b];
+        while (lf) {
+            LocalFile *next = lf->next;
+            if ((int)(lf->added - scan_start) > 0 &&
+                !local_table_find(buckets, lf->playlist_name, lf->video_id)) {
+                unsigned int nb = hash_string(lf->video_id) % LOCAL_INDEX_BUCKETS;
+                lf->next = buckets[nb];
+                buckets[nb] = lf;
+                count++;
+            } else {
+                free_local_file(lf);
+            }
+            lf = next;
         }
     }
     
-    int idx = pl->count;
-    pl->items[idx].title = song->title ? strdup(song->title) : strdup("Unknown");
-    pl->items[idx].video_id = strdup(song->video_id);
-
-    char url[256];
-    snprintf(url, sizeof(url), "https://www.youtube.com/watch?v=%s", song->video_id);
-    pl->items[idx].url = strdup(url);
-    pl->items[idx].duration = song->duration;
-
-    pl->count++;
-
-    save_playlist(st, playlist_idx);
-
-    // Automatically queue song for download
-    add_to_download_queue(st, song->video_id, song->title, pl->name);
-
-    return true;
+    memcpy(st->local_files.buckets, buckets, LOCAL_INDEX_BUCKETS * sizeof(LocalFile *));
+    st->local_files.count = count;
+    st->local_files.version++;
+    
+    pthread_mutex_unlock(&st->local_files.mutex);
+    free(buckets);
 }
 
-static bool remove_song_from_playlist(AppState *st, int playlist_idx, int song_idx) {
-    if (playlist_idx < 0 || playlist_idx >= st->playlist_count) return false;
+// Check if a file for this video_id has been downloaded
+static bool file_exists_for_video(AppState *st, const char *playlist_name, const char *video_id) {
+    if (!video_id || !video_id[0]) return false;
     
-    Playlist *pl = &st->playlists[playlist_idx];
-    if (song_idx < 0 || song_idx >= pl->count) return false;
+    PERF_BEGIN(perf_start);
+    pthread_mutex_lock(&st->local_files.mutex);
+    bool found = local_index_find(st, playlist_name, video_id) != NULL;
+    pthread_mutex_unlock(&st->local_files.mutex);
+    PERF_END(PERF_LOCAL_LOOKUP, perf_start);
+    
+    return found;
+}
+
+// Get the full path to a local file for a song in a playlist
+// Returns true if file exists and fills out_path, false otherwise
+static bool get_local_file_path_for_song(AppState *st, const char *playlist_name,
+                                         const char *video_id, char *out_path, size_t out_size) {
+    if (!video_id || !video_id[0] || !out_path || out_size == 0) return false;
     
-    // Free song data
-    free(pl->items[song_idx].title);
-    free(pl->items[song_idx].video_id);
-    free(pl->items[song_idx].url);
+    PERF_BEGIN(perf_start);
+    pthread_mutex_lock(&st->local_files.mutex);
     
-    // Shift remaining songs
-    for (int i = song_idx; i < pl->count - 1; i++) {
-        pl->items[i] = pl->items[i + 1];
+    LocalFile *lf = local_index_find(st, playlist_name, video_id);
+    if (lf) {
+        snprintf(out_path, out_size, "%s", lf->path);
     }
-    pl->count--;
-    
-    // Clear last slot
-    memset(&pl->items[pl->count], 0, sizeof(Song));
     
-    save_playlist(st, playlist_idx);
-    return true;
+    pthread_mutex_unlock(&st->local_files.mutex);
+    PERF_END(PERF_LOCAL_LOOKUP, perf_start);
+    return lf != NULL;
 }
 
 // ============================================================================
-// MPV IPC Communication
+// NEW: Download Thread
 // ============================================================================
 
-static void mpv_disconnect(void) {
-    if (mpv_ipc_fd >= 0) {
-        close(mpv_ipc_fd);
-        mpv_ipc_fd = -1;
+// Find the downloaded file "<dir>/<stem>.<ext>" for any audio extension,
+// preferring ext
+static bool find_downloaded_file(const char *dir, const char *stem, const char *ext,
+                                 char *out, size_t out_size) {
+    snprintf(out, out_size, "%s/%s.%s", dir, stem, ext);
+    if (file_exists(out)) return true;
+    
+    for (int i = 0; i < AUDIO_EXTENSION_COUNT; i++) {
+        if (strcmp(audio_extensions[i], ext) == 0) continue;
+        snprintf(out, out_size, "%s/%s.%s", dir, stem, audio_extensions[i]);
+        if (file_exists(out)) return true;
     }
+    return false;
 }
 
-static bool mpv_connect(void) {
-    if (mpv_ipc_fd >= 0) return true;
-    if (!file_exists(IPC_SOCKET)) return false;
-    
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) return false;
-    
-    // Set non-blocking
-    int flags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-    
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, IPC_SOCKET, sizeof(addr.sun_path) - 1);
+// The yt-dlp command downloading video_id to "<dir>/<stem>.<ext>" with the
+// configured format, bitrate, fragments and rate limit
+static void build_download_command(const Config *config, const char *dir, const char *stem,
+                                   const char *video_id, char *cmd, size_t cmd_size) {
+    const AudioFormat *format = find_audio_format(config->audio_format);
+    if (!format) format = &audio_formats[0];
+    
+    char options[256] = "";
+    size_t len = 0;
+    if (config->audio_bitrate > 0) {
+        len += snprintf(options + len, sizeof(options) - len, " --audio-quality %dK",
+                        config->audio_bitrate);
+    }
+    if (config->concurrent_fragments > 1 && len < sizeof(options)) {
+        len += snprintf(options + len, sizeof(options) - len, " --concurrent-fragments %d",
+                        config->concurrent_fragments);
+    }
+    if (config->rate_limit[0] && valid_rate_limit(config->rate_limit) && len < sizeof(options)) {
+        snprintf(options + len, sizeof(options) - len, " --limit-rate %s", config->rate_limit);
+    }
     
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        close(fd);
+    // With --quiet, yt-dlp prints progress to stderr, one SBPROG line per update
+    snprintf(cmd, cmd_size,
+             "yt-dlp %s%s --no-playlist --quiet --no-warnings "
+             "--newline --progress --progress-template 'download:SBPROG "
+             "%%(progress.downloaded_bytes)s %%(progress.total_bytes)s "
+             "%%(progress.total_bytes_estimate)s %%(progress.speed)s %%(progress.eta)s' "
+             "-o '%s/%s.%%(ext)s' 'https://www.youtube.com/watch?v=%s' 2>&1",
+             format->ytdlp_args, options, dir, stem, video_id);
+}
+
+// Parse "SBPROG <downloaded> <total> <estimate> <speed> <eta>"; fields yt-dlp
+// does not know are printed as "NA" and come back negative
+static bool parse_progress_line(const char *line, long long *done, long long *total,
+                                double *speed, int *eta) {
+    char field[5][32];
+    if (sscanf(line, "SBPROG %31s %31s %31s %31s %31s",
+               field[0], field[1], field[2], field[3], field[4]) != 5) {
         return false;
     }
     
-    mpv_ipc_fd = fd;
-    
-    // Enable end-file event observation
-    const char *observe_cmd = "{\"command\":[\"observe_property\",1,\"eof-reached\"]}\n";
-    ssize_t w = write(mpv_ipc_fd, observe_cmd, strlen(observe_cmd));
-    (void)w;
+    double value[5];
+    for (int i = 0; i < 5; i++) {
+        char *end;
+        value[i] = strtod(field[i], &end);
+        if (end == field[i]) value[i] = -1;
+    }
     
+    *done = value[0] < 0 ? 0 : (long long)value[0];
+    *total = (long long)(value[1] > 0 ? value[1] : value[2]);
+    *speed = value[3] < 0 ? 0 : value[3];
+    *eta = (int)value[4];
     return true;
 }
 
-static void mpv_send_command(const char *cmd) {
-    if (!mpv_connect()) {
-        // Try one-shot connection
-        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (fd < 0) return;
-        
-        struct sockaddr_un addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, IPC_SOCKET, sizeof(addr.sun_path) - 1);
-        
-        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
-            ssize_t w = write(fd, cmd, strlen(cmd));
-            w = write(fd, "\n", 1);
-            (void)w;
-        }
-        close(fd);
-        return;
+// Class of one "ERROR: ..." line printed by yt-dlp
+static DownloadError classify_download_error(const char *line) {
+    char lower[512];
+    size_t len = 0;
+    for (; line[len] && len < sizeof(lower) - 1; len++) {
+        lower[len] = ascii_lower(line[len]);
     }
+    lower[len] = '\0';
     
-    ssize_t w = write(mpv_ipc_fd, cmd, strlen(cmd));
-    w = write(mpv_ipc_fd, "\n", 1);
-    (void)w;
-}
-
-static void mpv_toggle_pause(void) {
-    mpv_send_command("{\"command\":[\"cycle\",\"pause\"]}");
+    for (int i = 0; i < DOWNLOAD_ERROR_PATTERN_COUNT; i++) {
+        if (strstr(lower, download_error_patterns[i].text)) {
+            return download_error_patterns[i].error;
+        }
+    }
+    return DOWNLOAD_ERROR_OTHER;
 }
 
-static void mpv_stop_playback(void) {
-    mpv_send_command("{\"command\":[\"stop\"]}");
+static bool download_error_transient(DownloadError error) {
+    return error == DOWNLOAD_ERROR_THROTTLED || error == DOWNLOAD_ERROR_NETWORK;
 }
 
-static void mpv_load_url(const char *url) {
-    char *escaped = NULL;
-    size_t n = 0;
-    FILE *mem = open_memstream(&escaped, &n);
-    if (!mem) return;
-    
-    fputc('"', mem);
-    for (const char *p = url; *p; p++) {
-        if (*p == '"' || *p == '\\') fputc('\\', mem);
-        fputc(*p, mem);
+// Seconds before retry number attempts: doubling from a base that depends on
+// the error, capped, and jittered down by up to half so tasks that failed in
+// the same burst do not all come back together
+// NOTE: Must be called with download_queue.mutex already locked
+static int download_retry_delay(DownloadQueue *q, DownloadError error, int attempts) {
+    int delay = error == DOWNLOAD_ERROR_THROTTLED ? 60 : 15;
+    for (int i = 1; i < attempts && delay < DOWNLOAD_RETRY_MAX_DELAY; i++) {
+        delay *= 2;
     }
-    fputc('"', mem);
-    fclose(mem);
+    if (delay > DOWNLOAD_RETRY_MAX_DELAY) delay = DOWNLOAD_RETRY_MAX_DELAY;
     
-    char cmd[4096];
-    snprintf(cmd, sizeof(cmd),
-             "{\"command\":[\"loadfile\",%s,\"replace\"]}", escaped);
-    free(escaped);
-    
-    mpv_send_command(cmd);
+    int half = delay / 2;
+    return delay - (int)(rand_r(&q->retry_seed) % (unsigned int)(half + 1));
 }
 
-static void mpv_start_if_needed(void) {
-    if (file_exists(IPC_SOCKET) && mpv_connect()) return;
-    
-    unlink(IPC_SOCKET);
-    mpv_disconnect();
+// Run a download command, copying the progress it prints into the task of
+// worker and the class of the first error it reports into *error.
+// Returns the exit status of yt-dlp, -1 if it could not be run.
+static int run_download_command(AppState *st, DownloadWorker *worker, const char *cmd,
+                                DownloadError *error) {
+    DownloadQueue *q = &st->download_queue;
     
-    pid_t pid = fork();
-    if (pid == 0) {
-        int fd = open("/dev/null", O_WRONLY);
-        if (fd >= 0) {
-            dup2(fd, STDOUT_FILENO);
-            dup2(fd, STDERR_FILENO);
-            close(fd);
-        }
-        execlp("mpv", "mpv",
-               "--no-video",
-               "--idle=yes",
-               "--force-window=no",
-               "--really-quiet",
-               "--input-ipc-server=" IPC_SOCKET,
-               (char *)NULL);
-        _exit(127);
-    }
+    YtdlpProcess proc;
+    ytdlp_process_init(&proc);
     
-    if (pid > 0) {
-        mpv_pid = pid;
-        for (int i = 0; i < 100; i++) {
-            if (file_exists(IPC_SOCKET)) {
-                usleep(50 * 1000);
-                mpv_connect();
-                break;
+    int result = -1;
+    FILE *fp = ytdlp_spawn(cmd, &proc);
+    if (fp) {
+        char *line = NULL;
+        size_t cap = 0;
+        long long last_notify = 0;
+        
+        while (getline(&line, &cap, fp) != -1) {
+            if (strncmp(line, "ERROR:", 6) == 0) {
+                if (*error == DOWNLOAD_ERROR_NONE) *error = classify_download_error(line + 6);
+                continue;
+            }
+            
+            long long done, total;
+            double speed;
+            int eta;
+            if (!parse_progress_line(line, &done, &total, &speed, &eta)) continue;
+            
+            pthread_mutex_lock(&q->mutex);
+            DownloadTask *task = &q->tasks[worker->task_idx];
+            task->bytes_done = done;
+            task->bytes_total = total;
+            task->speed = speed;
+            task->eta = eta;
+            pthread_mutex_unlock(&q->mutex);
+            
+            // Progress arrives several times a second per worker; keep the
+            // repaints to a few
+            long long now = monotonic_ms();
+            if (now - last_notify >= DOWNLOAD_PROGRESS_NOTIFY_MS) {
+                last_notify = now;
+                notify_ui();
             }
-            usleep(50 * 1000);
         }
+        
+        free(line);
+        result = ytdlp_finish(fp, &proc);
     }
+    
+    ytdlp_process_destroy(&proc);
+    return result;
 }
 
-static void mpv_quit(void) {
-    mpv_send_command("{\"command\":[\"quit\"]}");
-    usleep(100 * 1000);
-    
-    mpv_disconnect();
-    
-    if (mpv_pid > 0) {
-        kill(mpv_pid, SIGTERM);
-        waitpid(mpv_pid, NULL, WNOHANG);
-        mpv_pid = -1;
-    }
-    unlink(IPC_SOCKET);
+// Start timing a task a worker just claimed
+// NOTE: Must be called with download_queue.mutex already locked
+static void download_task_started(DownloadQueue *q, int task_idx) {
+    DownloadTask *task = &q->tasks[task_idx];
+    long long now = monotonic_ms();
+    
+    task->bytes_done = 0;
+    task->bytes_total = -1;
+    task->speed = 0;
+    task->eta = -1;
+    task->started_ms = now;
+    task->elapsed_ms = 0;
+    
+    if (q->stats.busy_since_ms == 0) q->stats.busy_since_ms = now;
+    if (q->stats.first_start == 0) q->stats.first_start = time(NULL);
 }
 
-// Check if mpv finished playing (returns true if track ended)
-// Only returns true for genuine end-of-file, not loading states
-static bool mpv_check_track_end(void) {
-    if (mpv_ipc_fd < 0) return false;
-    
-    char buf[4096];
-    ssize_t n = read(mpv_ipc_fd, buf, sizeof(buf) - 1);
-    
-    if (n <= 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            // Connection lost
-            mpv_disconnect();
+// Fold a finished task into the session figures, before queue_finish_task
+// NOTE: Must be called with download_queue.mutex already locked
+static void download_task_finished(DownloadQueue *q, int task_idx, DownloadStatus outcome,
+                                   bool skipped) {
+    DownloadTask *task = &q->tasks[task_idx];
+    long long now = monotonic_ms();
+    DownloadStats *stats = &q->stats;
+    
+    task->elapsed_ms = now - task->started_ms;
+    task->speed = 0;
+    task->eta = -1;
+    
+    if (skipped) {
+        stats->skipped++;
+    } else if (outcome == DOWNLOAD_RETRY) {
+        stats->retries++;
+    } else if (outcome == DOWNLOAD_COMPLETED) {
+        stats->done++;
+        if (task->bytes_done > 0) {
+            stats->bytes += task->bytes_done;
+        } else if (task->bytes_total > 0) {
+            stats->bytes += task->bytes_total;
         }
-        return false;
+        stats->task_ms += task->elapsed_ms;
+    } else {
+        stats->failed++;
     }
     
-    buf[n] = '\0';
-    
-    // Only trigger on end-file event with reason "eof" (not "error" or "stop")
-    // Format: {"event":"end-file","reason":"eof",...}
-    if (strstr(buf, "\"event\":\"end-file\"") && strstr(buf, "\"reason\":\"eof\"")) {
-        return true;
+    // This is the last running download: close the busy stretch
+    if (q->active_count == 1 && stats->busy_since_ms) {
+        stats->busy_ms += now - stats->busy_since_ms;
+        stats->busy_since_ms = 0;
     }
-    
-    return false;
 }
 
-// ============================================================================
-// Search Functions
-// ============================================================================
-
-static void free_search_results(AppState *st) {
-    for (int i = 0; i < st->search_count; i++) {
-        free(st->search_results[i].title);
-        free(st->search_results[i].video_id);
-        free(st->search_results[i].url);
-        st->search_results[i].title = NULL;
-        st->search_results[i].video_id = NULL;
-        st->search_results[i].url = NULL;
-    }
-    st->search_count = 0;
-    st->search_selected = 0;
-    st->search_scroll = 0;
+// Busy time so far, including a stretch still running
+static long long download_stats_busy_ms(const DownloadStats *stats) {
+    long long busy = stats->busy_ms;
+    if (stats->busy_since_ms) busy += monotonic_ms() - stats->busy_since_ms;
+    return busy;
 }
 
-static int run_search(AppState *st, const char *raw_query) {
-    free_search_results(st);
-    
-    char query_buf[256];
-    strncpy(query_buf, raw_query, sizeof(query_buf) - 1);
-    query_buf[sizeof(query_buf) - 1] = '\0';
-    char *query = trim_whitespace(query_buf);
-    
-    if (!query[0]) return 0;
-    
-    // Escape for shell
-    char escaped_query[512];
-    size_t j = 0;
-    for (size_t i = 0; query[i] && j < sizeof(escaped_query) - 5; i++) {
-        char c = query[i];
-        if (c == '"' || c == '\\' || c == '$' || c == '`') {
-            escaped_query[j++] = '\\';
-        }
-        escaped_query[j++] = c;
-    }
-    escaped_query[j] = '\0';
-    
-    char cmd[2048];
-    snprintf(cmd, sizeof(cmd),
-             "yt-dlp --flat-playlist --quiet --no-warnings "
-             "--print '%%(title)s|||%%(id)s' "
-             "\"ytsearch%d:%s\" 2>/dev/null",
-             MAX_RESULTS, escaped_query);
-    
-    FILE *fp = popen(cmd, "r");
-    if (!fp) return -1;
+static void *download_thread_func(void *arg) {
+    DownloadWorker *worker = (DownloadWorker *)arg;
+    AppState *st = worker->st;
     
-    char *line = NULL;
-    size_t cap = 0;
-    int count = 0;
+    pthread_mutex_lock(&st->download_queue.mutex);
     
-    while (count < MAX_RESULTS && getline(&line, &cap, fp) != -1) {
-        size_t len = strlen(line);
-        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
-            line[--len] = '\0';
+    while (!st->download_queue.should_stop &&
+           worker->id < st->download_queue.worker_limit) {
+        // Claim next pending task, after queueing retries that are due
+        queue_promote_retries(&st->download_queue, time(NULL));
+        int task_idx = queue_pop_pending(&st->download_queue);
+        
+        if (task_idx < 0) {
+            // No pending tasks, sleep until something is queued or the
+            // first retry is due
+            time_t next_retry = queue_next_retry(&st->download_queue);
+            if (next_retry) {
+                struct timespec until = {.tv_sec = next_retry, .tv_nsec = 0};
+                pthread_cond_timedwait(&st->download_queue.cond, &st->download_queue.mutex, &until);
+            } else {
+                pthread_cond_wait(&st->download_queue.cond, &st->download_queue.mutex);
+            }
+            continue;
         }
         
-        if (!line[0]) continue;
-        if (strncmp(line, "ERROR", 5) == 0) continue;
-        if (strncmp(line, "WARNING", 7) == 0) continue;
+        worker->task_idx = task_idx;
+        download_task_started(&st->download_queue, task_idx);
         
-        char *sep = strstr(line, "|||");
-        if (!sep) continue;
-        *sep = '\0';
+        // Copy task data and the settings it runs with while holding lock;
+        // the settings view changes st->config under the same lock
+        DownloadTask task;
+        memcpy(&task, &st->download_queue.tasks[task_idx], sizeof(DownloadTask));
+        Config config = st->config;
         
-        const char *title = line;
-        const char *video_id = sep + 3;
-        if (!video_id[0]) continue;
+        pthread_mutex_unlock(&st->download_queue.mutex);
+        notify_ui();
+        
+        // Build destination path
+        char dest_dir[2048]; // Increased buffer size
+        char dest_path[2560]; // Increased buffer size
+        
+        if (task.playlist_name[0]) {
+            snprintf(dest_dir, sizeof(dest_dir), "%s/%s", 
+                     config.download_path, task.playlist_name);
+        } else {
+            snprintf(dest_dir, sizeof(dest_dir), "%s", config.download_path);
+        }
+        
+        // Create directory if needed
+        mkdir_p(dest_dir);
         
-        size_t id_len = strlen(video_id);
-        if (id_len < 5 || id_len > 20) continue;
+        // Queue files from older versions stored the name with ".mp3"
+        char stem[512];
+        snprintf(stem, sizeof(stem), "%s", task.sanitized_filename);
+        const char *old_ext = audio_extension(stem);
+        if (old_ext) stem[strlen(stem) - strlen(old_ext) - 1] = '\0';
         
-        st->search_results[count].title = strdup(title);
-        st->search_results[count].video_id = strdup(video_id);
+        // "best" keeps the stream's own codec; its extension shows up afterwards
+        const char *ext = config.audio_format;
+        if (strcmp(ext, "best") == 0) ext = "opus";
         
-        char fullurl[256];
-        snprintf(fullurl, sizeof(fullurl), 
-                 "https://www.youtube.com/watch?v=%s", video_id);
-        st->search_results[count].url = strdup(fullurl);
-        st->search_results[count].duration = 0;
+        bool ok;
+        bool skipped = false;
+        DownloadError error = DOWNLOAD_ERROR_NONE;
         
-        if (st->search_results[count].title && 
-            st->search_results[count].video_id &&
-            st->search_results[count].url) {
-            count++;
+        // Check if file already exists (double-check), in any format
+        if (find_downloaded_file(dest_dir, stem, ext, dest_path, sizeof(dest_path))) {
+            ok = true;
+            skipped = true;
         } else {
-            free(st->search_results[count].title);
-            free(st->search_results[count].video_id);
-            free(st->search_results[count].url);
+            char cmd[4096];
+            build_download_command(&config, dest_dir, stem, task.video_id, cmd, sizeof(cmd));
+            
+            // Execute download
+            int result = run_download_command(st, worker, cmd, &error);
+            ok = (result == 0 &&
+                  find_downloaded_file(dest_dir, stem, ext, dest_path, sizeof(dest_path)));
+            if (!ok && error == DOWNLOAD_ERROR_NONE) error = DOWNLOAD_ERROR_OTHER;
+        }
+        
+        if (ok) {
+            local_index_add(st, task.playlist_name, task.video_id, dest_path);
+        }
+        
+        pthread_mutex_lock(&st->download_queue.mutex);
+        task_idx = worker->task_idx;  // queue_compact may have moved it
+        
+        // Throttling and network trouble are tried again later; the task
+        // waits outside the FIFO so pending work goes first
+        DownloadTask *finished = &st->download_queue.tasks[task_idx];
+        DownloadStatus outcome = ok ? DOWNLOAD_COMPLETED : DOWNLOAD_FAILED;
+        if (!ok) {
+            finished->error = error;
+            finished->attempts++;
+            if (download_error_transient(error) && finished->attempts < DOWNLOAD_MAX_ATTEMPTS) {
+                finished->retry_at = time(NULL) +
+                                     download_retry_delay(&st->download_queue, error,
+                                                          finished->attempts);
+                outcome = DOWNLOAD_RETRY;
+            }
         }
+        
+        download_task_finished(&st->download_queue, task_idx, outcome, skipped);
+        queue_finish_task(&st->download_queue, task_idx, outcome);
+        worker->task_idx = -1;
+        
+        const char *op = outcome == DOWNLOAD_COMPLETED ? "done" :
+                         outcome == DOWNLOAD_RETRY ? "retry" : "failed";
+        journal_download_task(st, op, finished, true);
+        notify_ui();
     }
     
-    free(line);
-    pclose(fp);
-    
-    st->search_count = count;
-    st->search_selected = 0;
-    st->search_scroll = 0;
-    strncpy(st->query, query, sizeof(st->query) - 1);
-    st->query[sizeof(st->query) - 1] = '\0';
+    worker->exited = true;
+    pthread_mutex_unlock(&st->download_queue.mutex);
     
-    return count;
+    return NULL;
 }
 
-// ============================================================================
-// Playback Functions
-// ============================================================================
-
-static void play_search_result(AppState *st, int idx) {
-    if (idx < 0 || idx >= st->search_count) return;
-    if (!st->search_results[idx].url) return;
+// Start workers up to the configured concurrency; already running ones are kept
+static void start_download_thread(AppState *st) {
+    DownloadQueue *q = &st->download_queue;
     
-    mpv_start_if_needed();
-    mpv_load_url(st->search_results[idx].url);
+    int limit = st->config.download_workers;
+    if (limit < 1) limit = 1;
+    if (limit > MAX_DOWNLOAD_WORKERS) limit = MAX_DOWNLOAD_WORKERS;
     
-    st->playing_index = idx;
-    st->playing_from_playlist = false;
-    st->playing_playlist_idx = -1;
-    st->paused = false;
-    st->playback_started = time(NULL);
-}
-
-static void play_playlist_song(AppState *st, int playlist_idx, int song_idx) {
-    if (playlist_idx < 0 || playlist_idx >= st->playlist_count) return;
-
-    Playlist *pl = &st->playlists[playlist_idx];
-    if (song_idx < 0 || song_idx >= pl->count) return;
-    if (!pl->items[song_idx].url) return;
-
-    mpv_start_if_needed();
-
-    // Check if YouTube playlist - always stream
-    if (pl->is_youtube_playlist) {
-        mpv_load_url(pl->items[song_idx].url);
-    } else {
-        // Check if local file exists for this song
-        char local_path[2048];
-        if (get_local_file_path_for_song(st, pl->name, pl->items[song_idx].video_id,
-                                          local_path, sizeof(local_path))) {
-            // Play from local file
-            mpv_load_url(local_path);
-        } else {
-            // Stream from YouTube
-            mpv_load_url(pl->items[song_idx].url);
+    pthread_mutex_lock(&q->mutex);
+    q->should_stop = false;
+    q->worker_limit = limit;
+    pthread_mutex_unlock(&q->mutex);
+    
+    for (int i = 0; i < limit; i++) {
+        DownloadWorker *w = &q->workers[i];
+        
+        pthread_mutex_lock(&q->mutex);
+        bool running = w->started && !w->exited;
+        bool retired = w->started && w->exited;
+        pthread_mutex_unlock(&q->mutex);
+        
+        if (running) continue;
+        if (retired) {
+            pthread_join(w->thread, NULL);
+            w->started = false;
+        }
+        
+        w->st = st;
+        w->id = i;
+        w->exited = false;
+        w->task_idx = -1;
+        if (pthread_create(&w->thread, NULL, download_thread_func, w) == 0) {
+            w->started = true;
+            q->thread_running = true;
         }
     }
-
-    st->playing_index = song_idx;
-    st->playing_from_playlist = true;
-    st->playing_playlist_idx = playlist_idx;
-    st->paused = false;
-    st->playback_started = time(NULL);
 }
 
-static void play_next(AppState *st) {
-    if (st->playing_from_playlist && st->playing_playlist_idx >= 0) {
-        Playlist *pl = &st->playlists[st->playing_playlist_idx];
-        int next = st->playing_index + 1;
-        if (next < pl->count) {
-            play_playlist_song(st, st->playing_playlist_idx, next);
-            st->playlist_song_selected = next;
-        }
-    } else if (st->search_count > 0) {
-        int next = st->playing_index + 1;
-        if (next < st->search_count) {
-            play_search_result(st, next);
-            st->search_selected = next;
-        }
+// Apply a changed worker count: extra workers retire after their current task
+static void resize_download_workers(AppState *st) {
+    pthread_mutex_lock(&st->download_queue.mutex);
+    st->download_queue.worker_limit = st->config.download_workers;
+    bool running = st->download_queue.thread_running;
+    pthread_cond_broadcast(&st->download_queue.cond);  // let idle extra workers retire
+    pthread_mutex_unlock(&st->download_queue.mutex);
+    
+    if (running) {
+        start_download_thread(st);
     }
 }
 
-static void play_prev(AppState *st) {
-    if (st->playing_from_playlist && st->playing_playlist_idx >= 0) {
-        int prev = st->playing_index - 1;
-        if (prev >= 0) {
-            play_playlist_song(st, st->playing_playlist_idx, prev);
-            st->playlist_song_selected = prev;
-        }
-    } else if (st->search_count > 0) {
-        int prev = st->playing_index - 1;
-        if (prev >= 0) {
-            play_search_result(st, prev);
-            st->search_selected = prev;
+static void stop_download_thread(AppState *st) {
+    DownloadQueue *q = &st->download_queue;
+    if (!q->thread_running) return;
+    
+    pthread_mutex_lock(&q->mutex);
+    q->should_stop = true;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    
+    for (int i = 0; i < MAX_DOWNLOAD_WORKERS; i++) {
+        if (q->workers[i].started) {
+            pthread_join(q->workers[i].thread, NULL);
+            q->workers[i].started = false;
         }
     }
+    q->thread_running = false;
+}
+
+// Append this session's download figures to DOWNLOAD_STATS_FILE, one JSON
+// object per line. Sessions that downloaded nothing leave no line.
+static void write_download_stats(AppState *st) {
+    pthread_mutex_lock(&st->download_queue.mutex);
+    DownloadStats stats = st->download_queue.stats;
+    pthread_mutex_unlock(&st->download_queue.mutex);
+    
+    int tasks = stats.done + stats.failed;
+    if (tasks == 0 && stats.retries == 0) return;
+    
+    FILE *f = fopen(st->download_stats_file, "a");
+    if (!f) return;
+    
+    double busy = download_stats_busy_ms(&stats) / 1000.0;
+    double mb = stats.bytes / (1024.0 * 1024.0);
+    
+    fprintf(f, "{\"started\": %lld, \"ended\": %lld, ",
+            (long long)stats.first_start, (long long)time(NULL));
+    fprintf(f, "\"done\": %d, \"failed\": %d, \"retries\": %d, \"skipped\": %d, \"bytes\": %lld, ",
+            stats.done, stats.failed, stats.retries, stats.skipped, stats.bytes);
+    fprintf(f, "\"busy_seconds\": %.1f, \"mb_per_second\": %.3f, ",
+            busy, busy > 0 ? mb / busy : 0.0);
+    fprintf(f, "\"seconds_per_track\": %.1f, \"failure_rate\": %.3f}\n",
+            stats.done > 0 ? stats.task_ms / 1000.0 / stats.done : 0.0,
+            tasks > 0 ? (double)stats.failed / tasks : 0.0);
+    fclose(f);
 }
 
 // ============================================================================
-// UI Drawing
+// NEW: Download Queue Management
 // ============================================================================
 
-static void format_duration(int sec, char out[16]) {
-    if (sec <= 0) {
-        snprintf(out, 16, "--:--");
-        return;
+// Queue one task without persisting or waking workers.
+// Returns 1 if added, 0 if already queued, -1 if the queue is full.
+// NOTE: Must be called with download_queue.mutex already locked
+static int queue_add_task(AppState *st, const char *video_id, const char *title,
+                          const char *playlist_name) {
+    // Check if already in queue
+    if (queue_find_video(&st->download_queue, video_id) >= 0) {
+        return 0;  // Already queued
     }
-    int h = sec / 3600;
-    int m = (sec % 3600) / 60;
-    int s = sec % 60;
-    if (h > 0) {
-        snprintf(out, 16, "%d:%02d:%02d", h, m, s);
+    
+    // Check queue capacity. Finished tasks give their slots back first,
+    // so only pending, active and retrying ones count against the limit.
+    DownloadQueue *q = &st->download_queue;
+    if (q->count >= MAX_DOWNLOAD_QUEUE) queue_compact(q, false);
+    if (q->count >= MAX_DOWNLOAD_QUEUE) queue_compact(q, true);
+    if (q->count >= MAX_DOWNLOAD_QUEUE) {
+        return -1;
+    }
+    
+    // Add new task
+    int task_idx = st->download_queue.count;
+    DownloadTask *task = &st->download_queue.tasks[task_idx];
+    
+    strncpy(task->video_id, video_id, sizeof(task->video_id) - 1);
+    task->video_id[sizeof(task->video_id) - 1] = '\0';
+    
+    strncpy(task->title, title ? title : "Unknown", sizeof(task->title) - 1);
+    task->title[sizeof(task->title) - 1] = '\0';
+    
+    sanitize_title_for_filename(task->title, video_id, task->sanitized_filename, 
+                                 sizeof(task->sanitized_filename));
+    
+    if (playlist_name) {
+        strncpy(task->playlist_name, playlist_name, sizeof(task->playlist_name) - 1);
+        task->playlist_name[sizeof(task->playlist_name) - 1] = '\0';
     } else {
-        snprintf(out, 16, "%02d:%02d", m, s);
+        task->playlist_name[0] = '\0';
     }
+    
+    task->attempts = 0;
+    task->retry_at = 0;
+    task->error = DOWNLOAD_ERROR_NONE;
+    
+    st->download_queue.count++;
+    queue_push_pending(&st->download_queue, task_idx);
+    
+    journal_download_task(st, "add", task, false);
+    
+    return 1;  // Added to queue
 }
 
-// NEW: Updated draw_header to include VIEW_SETTINGS
-static void draw_header(int cols, ViewMode view) {
-    // Line 1: Title
-    attron(A_BOLD);
-    mvprintw(0, 0, " ShellBeats v0.4 ");
-    attroff(A_BOLD);
-
-    // Line 2-3: Shortcuts (two lines)
-    switch (view) {
-        case VIEW_SEARCH:
-            mvprintw(1, 0, "  /,s: search | Enter: play | Space: pause | n: next | p: prev | x: stop");
-            mvprintw(2, 0, "  a: add to playlist | d: download | c: create playlist | f: playlists | S: settings | i: about | q: quit");
-            break;
-        case VIEW_PLAYLISTS:
-            mvprintw(1, 0, "  Enter: open | d: download all | c: create | p: add YouTube | x: delete");
-            mvprintw(2, 0, "  Esc: back | i: about | q: quit");
-            break;
-        case VIEW_PLAYLIST_SONGS:
-            mvprintw(1, 0, "  Enter: play | Space: pause | n: next | p: prev | x: stop");
-            mvprintw(2, 0, "  a: add song | d: download | r: remove | D: download all (YT) | Esc: back | i: about | q: quit");
-            break;
-        case VIEW_ADD_TO_PLAYLIST:
-            mvprintw(1, 0, "  Enter: add to playlist | c: create new playlist");
-            mvprintw(2, 0, "  Esc: cancel");
-            break;
-        case VIEW_SETTINGS:
-            mvprintw(1, 0, "  Enter: edit download path");
-            mvprintw(2, 0, "  Esc: back | i: about | q: quit");
-            break;
-        case VIEW_ABOUT:
-            mvprintw(1, 0, "  Press any key to close");
-            move(2, 0);
-            break;
+static int add_to_download_queue(AppState *st, const char *video_id, const char *title, 
+                                  const char *playlist_name) {
+    if (!video_id || !video_id[0]) return -1;
+    
+    // Check if already downloaded
+    if (file_exists_for_video(st, playlist_name, video_id)) {
+        return 0;  // Already exists
     }
-
-    mvhline(3, 0, ACS_HLINE, cols);
-}
-
-// NEW: Get spinner character for download animation
-static char get_spinner_char(int frame) {
-    const char spinner[] = {'|', '/', '-', '\\'};
-    return spinner[frame % 4];
-}
-
-// NEW: Draw download status in status bar area
-static void draw_download_status(AppState *st, int rows, int cols) {
-    pthread_mutex_lock(&st->download_queue.mutex);
     
-    int pending_count = 0;
-    int completed = st->download_queue.completed;
-    int failed = st->download_queue.failed;
+    pthread_mutex_lock(&st->download_queue.mutex);
     
-    for (int i = 0; i < st->download_queue.count; i++) {
-        if (st->download_queue.tasks[i].status == DOWNLOAD_PENDING ||
-            st->download_queue.tasks[i].status == DOWNLOAD_ACTIVE) {
-            pending_count++;
-        }
+    int result = queue_add_task(st, video_id, title, playlist_name);
+    if (result > 0) {
+        sync_download_journal(&st->download_queue);
+        pthread_cond_signal(&st->download_queue.cond);
     }
     
     pthread_mutex_unlock(&st->download_queue.mutex);
     
-    if (pending_count == 0) return;
-    
-    // Draw at the right side of the now playing bar
-    char dl_status[64];
-    char spinner = get_spinner_char(st->spinner_frame);
-    
-    if (failed > 0) {
-        snprintf(dl_status, sizeof(dl_status), "[%c %d/%d %d!]", 
-                 spinner, completed, completed + pending_count, failed);
-    } else {
-        snprintf(dl_status, sizeof(dl_status), "[%c %d/%d]", 
-                 spinner, completed, completed + pending_count);
+    // Start download thread if not running
+    if (result > 0) {
+        start_download_thread(st);
     }
     
-    int x = cols - strlen(dl_status) - 1;
-    if (x > 0) {
-        mvprintw(rows - 1, x, "%s", dl_status);
-    }
+    return result;
 }
 
-static void draw_now_playing(AppState *st, int rows, int cols) {
-    mvhline(rows - 2, 0, ACS_HLINE, cols);
+// Queue many songs at once: one index pass, one lock, one journal flush and
+// one worker wakeup. Returns the number of songs added, or -1 if none could
+// be added because the queue is full. skipped_out (optional) receives the
+// number of songs already downloaded or queued.
+static int add_many_to_download_queue(AppState *st, const Song *songs, int count,
+                                      const char *playlist_name, int *skipped_out) {
+    int added = 0;
+    int skipped = 0;
+    bool full = false;
+    
+    if (skipped_out) *skipped_out = 0;
+    if (!songs || count <= 0) return 0;
+    
+    bool *have = calloc(count, sizeof(bool));
+    if (!have) return -1;
+    
+    // Check which songs are already downloaded
+    pthread_mutex_lock(&st->local_files.mutex);
+    for (int i = 0; i < count; i++) {
+        have[i] = !songs[i].video_id[0] ||
+                  local_index_find(st, playlist_name, songs[i].video_id) != NULL;
+    }
+    pthread_mutex_unlock(&st->local_files.mutex);
     
-    const char *title = NULL;
+    pthread_mutex_lock(&st->download_queue.mutex);
     
-    if (st->playing_from_playlist && st->playing_playlist_idx >= 0 &&
-        st->playing_playlist_idx < st->playlist_count) {
-        Playlist *pl = &st->playlists[st->playing_playlist_idx];
-        if (st->playing_index >= 0 && st->playing_index < pl->count) {
-            title = pl->items[st->playing_index].title;
+    for (int i = 0; i < count; i++) {
+        if (have[i]) {
+            skipped++;
+            continue;
         }
-    } else if (st->playing_index >= 0 && st->playing_index < st->search_count) {
-        title = st->search_results[st->playing_index].title;
-    }
-    
-    if (title) {
-        mvprintw(rows - 1, 0, " Now playing: ");
-        attron(A_BOLD);
-        
-        int max_np = cols - 35;  // Leave room for download status
-        char npbuf[512];
-        strncpy(npbuf, title, sizeof(npbuf) - 1);
-        npbuf[sizeof(npbuf) - 1] = '\0';
-        if ((int)strlen(npbuf) > max_np && max_np > 3) {
-            npbuf[max_np - 3] = '.';
-            npbuf[max_np - 2] = '.';
-            npbuf[max_np - 1] = '.';
-            npbuf[max_np] = '\0';
-        }
-        printw("%s", npbuf);
-        attroff(A_BOLD);
         
-        if (st->paused) {
-            printw(" [PAUSED]");
+        int result = queue_add_task(st, songs[i].video_id, songs[i].title, playlist_name);
+        if (result > 0) {
+            added++;
+        } else if (result == 0) {
+            skipped++;
+        } else {
+            full = true;
+            break;
         }
     }
     
-    // NEW: Draw download status
-    draw_download_status(st, rows, cols);
+    if (added > 0) {
+        sync_download_journal(&st->download_queue);
+        pthread_cond_broadcast(&st->download_queue.cond);
+    }
+    
+    pthread_mutex_unlock(&st->download_queue.mutex);
+    free(have);
+    
+    if (added > 0) {
+        start_download_thread(st);
+    }
+    
+    if (skipped_out) *skipped_out = skipped;
+    return (full && added == 0) ? -1 : added;
 }
 
-static void draw_search_view(AppState *st, const char *status, int rows, int cols) {
-    mvprintw(4, 0, "Query: ");
-    attron(A_BOLD);
-    printw("%s", st->query[0] ? st->query : "(none)");
-    attroff(A_BOLD);
-
-    mvprintw(4, cols - 20, "Results: %d", st->search_count);
-
-    if (status && status[0]) {
-        mvprintw(5, 0, ">>> %s", status);
-    }
+static int add_playlist_to_download_queue(AppState *st, const Playlist *pl, int *skipped_out) {
+    return add_many_to_download_queue(st, pl->items, pl->count, pl->name, skipped_out);
+}
 
-    mvhline(6, 0, ACS_HLINE, cols);
+static int get_pending_download_count(AppState *st) {
+    pthread_mutex_lock(&st->download_queue.mutex);
+    int count = st->download_queue.pending_count + st->download_queue.active_count +
+                st->download_queue.retry_count;
+    pthread_mutex_unlock(&st->download_queue.mutex);
+    return count;
+}
 
-    int list_top = 7;
-    int list_height = rows - list_top - 2;
-    if (list_height < 1) list_height = 1;
+// ============================================================================
+// Background File Writer
+// ============================================================================
 
-    // Adjust scroll
-    if (st->search_selected < st->search_scroll) {
-        st->search_scroll = st->search_selected;
-    } else if (st->search_selected >= st->search_scroll + list_height) {
-        st->search_scroll = st->search_selected - list_height + 1;
+// Write data to path.tmp and rename it over path, so readers see either
+// the old file or the new one
+static bool write_file_atomic(const char *path, const char *data, size_t len) {
+    char tmp_path[16400];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) return false;
+    
+    bool ok = fwrite(data, 1, len, f) == len;
+    ok = (fflush(f) == 0 && fsync(fileno(f)) == 0) && ok;
+    fclose(f);
+    
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
     }
+    return true;
+}
 
-    for (int i = 0; i < list_height && (st->search_scroll + i) < st->search_count; i++) {
-        int idx = st->search_scroll + i;
-        bool is_selected = (idx == st->search_selected);
-        bool is_playing = (!st->playing_from_playlist && idx == st->playing_index);
-
-        int y = list_top + i;
-        move(y, 0);
-        clrtoeol();
+static void free_file_write_job(FileWriteJob *job) {
+    free(job->path);
+    free(job->data);
+    free(job);
+}
 
-        char mark = ' ';
-        if (is_playing) {
-            mark = st->paused ? '|' : '>';
-            attron(A_BOLD);
-        }
-        if (is_selected) {
-            attron(A_REVERSE);
+// NOTE: Must be called with w->mutex locked, if the thread is running
+static void file_writer_forget_failure(FileWriter *w, const char *path) {
+    FileWriteJob **link = &w->failed;
+    while (*link) {
+        FileWriteJob *job = *link;
+        if (strcmp(job->path, path) == 0) {
+            *link = job->next;
+            free_file_write_job(job);
+        } else {
+            link = &job->next;
         }
+    }
+}
 
-        char dur[16];
-        format_duration(st->search_results[idx].duration, dur);
-
-        // Check if song is downloaded
-        char local_path[2048];
-        bool is_downloaded = get_local_file_path_for_song(st, NULL,
-                                                           st->search_results[idx].video_id,
-                                                           local_path, sizeof(local_path));
-        const char *dl_mark = is_downloaded ? "[D]" : "   ";
-
-        int max_title = cols - 20;
-        if (max_title < 20) max_title = 20;
-
-        char titlebuf[1024];
-        const char *title = st->search_results[idx].title ? st->search_results[idx].title : "(no title)";
-        strncpy(titlebuf, title, sizeof(titlebuf) - 1);
-        titlebuf[sizeof(titlebuf) - 1] = '\0';
+// NOTE: Must be called with w->mutex locked, if the thread is running
+static void file_writer_add_failure(FileWriter *w, FileWriteJob *job) {
+    free(job->data);
+    job->data = NULL;
+    job->next = w->failed;
+    w->failed = job;
+}
 
-        if ((int)strlen(titlebuf) > max_title && max_title > 3) {
-            titlebuf[max_title - 3] = '.';
-            titlebuf[max_title - 2] = '.';
-            titlebuf[max_title - 1] = '.';
-            titlebuf[max_title] = '\0';
+static void *file_writer_thread_func(void *arg) {
+    FileWriter *w = arg;
+    
+    pthread_mutex_lock(&w->mutex);
+    for (;;) {
+        while (!w->head && !w->should_stop) {
+            pthread_cond_wait(&w->cond, &w->mutex);
         }
-
-        mvprintw(y, 0, " %c %3d. %s [%s] %s", mark, idx + 1, dl_mark, dur, titlebuf);
+        if (!w->head) break;  // stopping, and everything is written
         
-        if (is_selected) {
-            attroff(A_REVERSE);
+        FileWriteJob *job = w->head;
+        w->head = job->next;
+        if (!w->head) w->tail = NULL;
+        w->active_path = job->path;
+        pthread_mutex_unlock(&w->mutex);
+        
+        bool ok = write_file_atomic(job->path, job->data, job->len);
+        
+        pthread_mutex_lock(&w->mutex);
+        w->active_path = NULL;
+        file_writer_forget_failure(w, job->path);
+        if (ok) {
+            free_file_write_job(job);
+        } else {
+            file_writer_add_failure(w, job);
+            notify_ui();  // the owner of the data queues it again
+        }
+        pthread_cond_broadcast(&w->cond);  // wake anyone waiting for this path
+    }
+    pthread_mutex_unlock(&w->mutex);
+    
+    return NULL;
+}
+
+static void start_file_writer(FileWriter *w) {
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->head = w->tail = NULL;
+    w->active_path = NULL;
+    w->failed = NULL;
+    w->should_stop = false;
+    w->started = (pthread_create(&w->thread, NULL, file_writer_thread_func, w) == 0);
+}
+
+// Write whatever is queued, then stop the thread. Later writes are
+// done at once by the caller.
+static void stop_file_writer(FileWriter *w) {
+    if (!w->started) return;
+    
+    pthread_mutex_lock(&w->mutex);
+    w->should_stop = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    
+    pthread_join(w->thread, NULL);
+    w->started = false;
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+}
+
+// Replace path with data (malloc'd, owned by the writer from now on).
+// Without a writer thread the file is written before returning, and
+// false means it failed. A failed write in the thread is reported by
+// file_writer_take_failure instead.
+static bool file_writer_submit(FileWriter *w, const char *path, char *data, size_t len) {
+    if (!w->started) {
+        bool ok = write_file_atomic(path, data, len);
+        free(data);
+        return ok;
+    }
+    
+    pthread_mutex_lock(&w->mutex);
+    for (FileWriteJob *job = w->head; job; job = job->next) {
+        if (strcmp(job->path, path) == 0) {
+            free(job->data);
+            job->data = data;
+            job->len = len;
+            pthread_mutex_unlock(&w->mutex);
+            return true;
+        }
+    }
+    
+    FileWriteJob *job = calloc(1, sizeof(*job));
+    char *path_copy = strdup(path);
+    if (!job || !path_copy) {
+        pthread_mutex_unlock(&w->mutex);
+        free(job);
+        free(path_copy);
+        bool ok = write_file_atomic(path, data, len);
+        free(data);
+        return ok;
+    }
+    job->path = path_copy;
+    job->data = data;
+    job->len = len;
+    if (w->tail) {
+        w->tail->next = job;
+    } else {
+        w->head = job;
+    }
+    w->tail = job;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    return true;
+}
+
+// NOTE: Must be called with w->mutex locked
+static bool file_writer_busy_with(FileWriter *w, const char *path) {
+    if (w->active_path && strcmp(w->active_path, path) == 0) return true;
+    for (FileWriteJob *job = w->head; job; job = job->next) {
+        if (strcmp(job->path, path) == 0) return true;
+    }
+    return false;
+}
+
+// Wait until path has been written, so reading it sees the latest data.
+// False if that write failed.
+static bool file_writer_wait(FileWriter *w, const char *path) {
+    if (!w->started) return true;
+    
+    pthread_mutex_lock(&w->mutex);
+    while (file_writer_busy_with(w, path)) {
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    bool ok = true;
+    for (FileWriteJob *job = w->failed; job; job = job->next) {
+        if (strcmp(job->path, path) == 0) ok = false;
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return ok;
+}
+
+// Copy one path whose write failed into path and forget it. False when
+// there are none left.
+static bool file_writer_take_failure(FileWriter *w, char *path, size_t size) {
+    if (w->started) pthread_mutex_lock(&w->mutex);
+    FileWriteJob *job = w->failed;
+    bool found = job != NULL;
+    if (found) {
+        w->failed = job->next;
+        snprintf(path, size, "%s", job->path);
+        free_file_write_job(job);
+    }
+    if (w->started) pthread_mutex_unlock(&w->mutex);
+    return found;
+}
+
+// Forget queued writes of path and wait out one in progress, before the
+// file is deleted
+static void file_writer_drop(FileWriter *w, const char *path) {
+    if (!w->started) return;
+    
+    pthread_mutex_lock(&w->mutex);
+    FileWriteJob **link = &w->head;
+    w->tail = NULL;
+    while (*link) {
+        FileWriteJob *job = *link;
+        if (strcmp(job->path, path) == 0) {
+            *link = job->next;
+            free_file_write_job(job);
+        } else {
+            w->tail = job;
+            link = &job->next;
+        }
+    }
+    while (w->active_path && strcmp(w->active_path, path) == 0) {
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    file_writer_forget_failure(w, path);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+// ============================================================================
+// Playlist Persistence
+// ============================================================================
+
+static void free_playlist_items(Playlist *pl) {
+    arena_free(&pl->strings);
+    free(pl->items);
+    free(pl->id_slots);
+    pl->id_slots = NULL;
+    pl->id_slot_cap = 0;
+    pl->items = NULL;
+    pl->count = 0;
+    pl->capacity = 0;
+    pl->loaded = false;
+}
+
+static void free_playlist(Playlist *pl) {
+    free(pl->name);
+    free(pl->filename);
+    pl->name = NULL;
+    pl->filename = NULL;
+    free_playlist_items(pl);
+}
+
+static void free_all_playlists(AppState *st) {
+    for (int i = 0; i < st->playlist_count; i++) {
+        free_playlist(&st->playlists[i]);
+    }
+    free(st->playlists);
+    st->playlists = NULL;
+    st->playlist_count = 0;
+    st->playlist_capacity = 0;
+    st->playlists_version++;
+}
+
+// Append a zeroed playlist. Returns its index, or -1 if out of memory.
+static int new_playlist_slot(AppState *st) {
+    if (st->playlist_count >= st->playlist_capacity) {
+        int cap = st->playlist_capacity ? st->playlist_capacity * 2 : 16;
+        Playlist *grown = realloc(st->playlists, cap * sizeof(Playlist));
+        if (!grown) return -1;
+        st->playlists = grown;
+        st->playlist_capacity = cap;
+    }
+    int idx = st->playlist_count++;
+    memset(&st->playlists[idx], 0, sizeof(Playlist));
+    st->playlists[idx].stored_count = -1;
+    st->playlists[idx].lib_index = -1;
+    return idx;
+}
+
+// Make room for at least capacity songs
+static bool playlist_reserve(Playlist *pl, int capacity) {
+    if (capacity <= pl->capacity) return true;
+    Song *grown = realloc(pl->items, capacity * sizeof(Song));
+    if (!grown) return false;
+    pl->items = grown;
+    pl->capacity = capacity;
+    return true;
+}
+
+// Slot of pl's id set holding video_id, or the free slot where it would go
+static int playlist_id_slot(const Playlist *pl, const char *video_id) {
+    unsigned int mask = (unsigned int)pl->id_slot_cap - 1;
+    unsigned int i = hash_string(video_id) & mask;
+    while (pl->id_slots[i] >= 0 && strcmp(pl->items[pl->id_slots[i]].video_id, video_id) != 0) {
+        i = (i + 1) & mask;
+    }
+    return (int)i;
+}
+
+// Rebuild the id set of pl from its items. On failure the set is dropped
+// and rebuilt on the next lookup.
+static bool playlist_index_ids(Playlist *pl) {
+    int cap = 16;
+    while (cap < pl->count * 2 + 2) cap *= 2;
+    
+    if (cap != pl->id_slot_cap) {
+        int *slots = realloc(pl->id_slots, cap * sizeof(int));
+        if (!slots) {
+            free(pl->id_slots);
+            pl->id_slots = NULL;
+            pl->id_slot_cap = 0;
+            return false;
+        }
+        pl->id_slots = slots;
+        pl->id_slot_cap = cap;
+    }
+    
+    memset(pl->id_slots, 0xff, cap * sizeof(int));
+    for (int i = 0; i < pl->count; i++) {
+        int slot = playlist_id_slot(pl, pl->items[i].video_id);
+        if (pl->id_slots[slot] < 0) pl->id_slots[slot] = i;  // first of any duplicates
+    }
+    return true;
+}
+
+// Index of the song with video_id in a loaded playlist, or -1
+static int playlist_find_song(Playlist *pl, const char *video_id) {
+    if (!video_id || !video_id[0] || pl->count == 0) return -1;
+    if (!pl->id_slots && !playlist_index_ids(pl)) {
+        for (int i = 0; i < pl->count; i++) {
+            if (strcmp(pl->items[i].video_id, video_id) == 0) return i;
+        }
+        return -1;
+    }
+    return pl->id_slots[playlist_id_slot(pl, video_id)];
+}
+
+// Add a copy of song (title copied into the playlist's arena) to the end of pl
+static bool playlist_append(Playlist *pl, const Song *song) {
+    if (pl->count >= pl->capacity &&
+        !playlist_reserve(pl, pl->capacity ? pl->capacity * 2 : 16)) {
+        return false;
+    }
+    
+    char *title = arena_strdup(&pl->strings, song->title ? song->title : "Unknown");
+    if (!title) return false;
+    
+    int idx = pl->count++;
+    Song *dst = &pl->items[idx];
+    *dst = *song;
+    dst->title = title;
+    
+    // Keep the id set current once there is one
+    if (pl->id_slots) {
+        if (pl->count * 2 + 2 > pl->id_slot_cap) {
+            playlist_index_ids(pl);
+        } else {
+            int slot = playlist_id_slot(pl, dst->video_id);
+            if (pl->id_slots[slot] < 0) pl->id_slots[slot] = idx;
+        }
+    }
+    return true;
+}
+
+// Songs in a playlist, whether or not they are loaded
+static int playlist_song_count(const Playlist *pl) {
+    if (pl->loaded || pl->stored_count < 0) return pl->count;
+    return pl->stored_count;
+}
+
+static char *sanitize_filename(const char *name) {
+    size_t len = strlen(name);
+    char *out = malloc(len + 6); // .json + null
+    if (!out) return NULL;
+    
+    size_t j = 0;
+    for (size_t i = 0; i < len && j < len; i++) {
+        char c = name[i];
+        if (isalnum((unsigned char)c) || c == '-' || c == '_') {
+            out[j++] = tolower((unsigned char)c);
+        } else if (c == ' ') {
+            out[j++] = '_';
+        }
+    }
+    out[j] = '\0';
+    
+    strcat(out, ".json");
+    return out;
+}
+
+static void write_playlists_index_json(FILE *f, AppState *st) {
+    fprintf(f, "{\n  \"playlists\": [\n");
+    
+    for (int i = 0; i < st->playlist_count; i++) {
+        Playlist *pl = &st->playlists[i];
+        
+        // Count and type let the playlist list show without loading songs
+        fprintf(f, "    {\"name\": \"");
+        json_write_escaped(f, pl->name);
+        fprintf(f, "\", \"filename\": \"");
+        json_write_escaped(f, pl->filename);
+        fprintf(f, "\", \"type\": \"%s\", \"count\": %d}%s\n",
+                pl->is_youtube_playlist ? "youtube" : "local",
+                playlist_song_count(pl),
+                (i < st->playlist_count - 1) ? "," : "");
+    }
+    
+    fprintf(f, "  ]\n}\n");
+}
+
+static void write_playlist_json(FILE *f, const Playlist *pl) {
+    fprintf(f, "{\n  \"name\": \"");
+    json_write_escaped(f, pl->name);
+    fprintf(f, "\",\n  \"type\": \"%s\",\n  \"songs\": [\n",
+            pl->is_youtube_playlist ? "youtube" : "local");
+    
+    for (int i = 0; i < pl->count; i++) {
+        fprintf(f, "    {\"title\": \"");
+        json_write_escaped(f, pl->items[i].title);
+        fprintf(f, "\", \"video_id\": \"");
+        json_write_escaped(f, pl->items[i].video_id);
+        fprintf(f, "\"}%s\n", (i < pl->count - 1) ? "," : "");
+    }
+    
+    fprintf(f, "  ]\n}\n");
+}
+
+// The files are built in memory here and written by the writer thread.
+// False if that could not be started; see collect_failed_saves for
+// writes that fail later.
+static bool save_playlists_index_json(AppState *st) {
+    char *data = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&data, &len);
+    if (!f) return false;
+    
+    write_playlists_index_json(f, st);
+    if (fclose(f) != 0) {
+        free(data);
+        return false;
+    }
+    return file_writer_submit(&st->writer, st->playlists_index, data, len);
+}
+
+static void playlist_json_path(const AppState *st, const Playlist *pl, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", st->playlists_dir, pl->filename);
+}
+
+static bool save_playlist_json(AppState *st, int idx) {
+    Playlist *pl = &st->playlists[idx];
+    if (!pl->loaded) return true;  // nothing in memory that the file lacks
+    
+    char path[4096]; // Increased buffer size
+    playlist_json_path(st, pl, path, sizeof(path));
+    
+    char *data = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&data, &len);
+    if (!f) return false;
+    
+    write_playlist_json(f, pl);
+    if (fclose(f) != 0) {
+        free(data);
+        return false;
+    }
+    if (!file_writer_submit(&st->writer, path, data, len)) return false;
+    
+    // Keep the count in the index current
+    if (pl->stored_count != pl->count) {
+        pl->stored_count = pl->count;
+        st->playlists_index_dirty = true;
+    }
+    return true;
+}
+
+// Edits only mark what changed; flush_pending_saves writes it all
+// SAVE_DELAY_MS after the first unsaved edit, so a burst of edits is one
+// write per file
+static void schedule_save(AppState *st) {
+    if (st->save_due_ms == 0) st->save_due_ms = monotonic_ms() + SAVE_DELAY_MS;
+}
+
+static void save_playlists_index(AppState *st) {
+    st->playlists_index_dirty = true;
+    schedule_save(st);
+}
+
+static void save_playlist(AppState *st, int idx) {
+    if (idx < 0 || idx >= st->playlist_count) return;
+    
+    Playlist *pl = &st->playlists[idx];
+    if (!pl->loaded) return;
+    
+    pl->dirty = true;
+    schedule_save(st);
+}
+
+// Write the songs of playlist idx now if they changed. It stays dirty
+// when that fails.
+static bool flush_playlist(AppState *st, int idx) {
+    Playlist *pl = &st->playlists[idx];
+    if (!pl->dirty || !pl->loaded) return true;
+    
+    if (st->library.enabled) {
+        if (!library_append_songs(st, idx) && !library_write(st)) return false;
+        pl->stored_count = pl->count;
+    } else if (!save_playlist_json(st, idx)) {
+        return false;
+    }
+    pl->dirty = false;
+    return true;
+}
+
+// Write every unsaved change. JSON files are handed to the writer thread;
+// library.bin is mapped by this thread and written here. What could not
+// be written stays marked and is tried again SAVE_RETRY_MS later; false
+// if there was any.
+static bool flush_pending_saves(AppState *st) {
+    bool ok = true;
+    if (st->library.enabled && st->playlists_index_dirty) {
+        // A rewrite takes every playlist with it
+        ok = library_write(st);
+        if (ok) {
+            for (int i = 0; i < st->playlist_count; i++) {
+                Playlist *pl = &st->playlists[i];
+                pl->dirty = false;
+                if (pl->loaded) pl->stored_count = pl->count;
+            }
+            st->playlists_index_dirty = false;
+        }
+    } else {
+        for (int i = 0; i < st->playlist_count; i++) {
+            if (!flush_playlist(st, i)) ok = false;
+        }
+        if (st->playlists_index_dirty) {
+            if (save_playlists_index_json(st)) {
+                st->playlists_index_dirty = false;
+            } else {
+                ok = false;
+            }
+        }
+    }
+    st->save_due_ms = ok ? 0 : monotonic_ms() + SAVE_RETRY_MS;
+    return ok;
+}
+
+// Mark the files the writer thread failed to write as unsaved again, so
+// the next save writes them. True if there were any.
+static bool collect_failed_saves(AppState *st) {
+    char failed[16400];
+    bool any = false;
+    while (file_writer_take_failure(&st->writer, failed, sizeof(failed))) {
+        any = true;
+        if (strcmp(failed, st->playlists_index) == 0) {
+            st->playlists_index_dirty = true;
+            continue;
+        }
+        for (int i = 0; i < st->playlist_count; i++) {
+            Playlist *pl = &st->playlists[i];
+            char path[16400];
+            playlist_json_path(st, pl, path, sizeof(path));
+            if (pl->loaded && strcmp(failed, path) == 0) pl->dirty = true;
+        }
+    }
+    if (any && st->save_due_ms == 0) st->save_due_ms = monotonic_ms() + SAVE_RETRY_MS;
+    return any;
+}
+
+// Wait until the writer thread is done with every playlist file, so
+// what is in memory can be dropped. False if some write failed; those
+// playlists are dirty again.
+static bool wait_for_saves(AppState *st) {
+    file_writer_wait(&st->writer, st->playlists_index);
+    for (int i = 0; i < st->playlist_count; i++) {
+        char path[16400];
+        playlist_json_path(st, &st->playlists[i], path, sizeof(path));
+        file_writer_wait(&st->writer, path);
+    }
+    return !collect_failed_saves(st);
+}
+
+// Flush once the save delay is over; call from the UI thread on every tick.
+// A failed write is reported in status.
+static void poll_pending_saves(AppState *st, char *status, size_t status_size) {
+    bool failed = collect_failed_saves(st);
+    if (st->save_due_ms != 0 && monotonic_ms() >= st->save_due_ms) {
+        PERF_BEGIN(perf_start);
+        if (!flush_pending_saves(st)) failed = true;
+        PERF_END(PERF_PLAYLIST_SAVE, perf_start);
+    }
+    if (failed) {
+        snprintf(status, status_size, "Could not save playlist changes, trying again in %d s",
+                 SAVE_RETRY_MS / 1000);
+    }
+}
+
+static void load_playlist_songs_json(AppState *st, Playlist *pl) {
+    char path[16384]; // Significantly increased buffer size
+    snprintf(path, sizeof(path), "%s/%s", st->playlists_dir, pl->filename);
+    file_writer_wait(&st->writer, path);
+    
+    MappedFile mf;
+    if (!map_file(path, &mf)) {
+        // Never saved yet: an empty playlist. Otherwise leave it unloaded so
+        // nothing overwrites a file we could not read.
+        pl->loaded = !file_exists(path);
+        return;
+    }
+    pl->loaded = true;
+    pl->is_youtube_playlist = false;
+    
+    // Titles go into one arena block sized for the whole file, and the song
+    // array is sized from the index, so a load is two allocations
+    arena_reserve(&pl->strings, mf.size + 1);
+    if (pl->stored_count > 0) playlist_reserve(pl, pl->stored_count);
+    
+    JsonReader r;
+    json_reader_init(&r, mf.data, mf.size);
+    JsonField member;
+    
+    if (json_enter(&r, '{')) {
+        while (json_next_member(&r, &member)) {
+            if (json_key_is(&member, "songs") && json_enter(&r, '[')) {
+                while (json_next_element(&r)) {
+                    JsonField fields[8];
+                    int n = json_read_object(&r, fields, 8);
+                    
+                    Song song = {0};
+                    char video_id[64];
+                    if (n > 0 &&
+                        json_field_copy(json_find_field(fields, n, "video_id"),
+                                        video_id, sizeof(video_id)) &&
+                        song_set_video_id(&song, video_id)) {
+                        song.title = json_field_string(json_find_field(fields, n, "title"),
+                                                       &pl->strings);
+                    }
+                    if (!song.title) continue;
+                    
+                    if (pl->count >= pl->capacity &&
+                        !playlist_reserve(pl, pl->capacity ? pl->capacity * 2 : 16)) {
+                        break;
+                    }
+                    pl->items[pl->count++] = song;
+                }
+            } else if (json_read_value(&r, &member) && json_key_is(&member, "type")) {
+                pl->is_youtube_playlist = json_field_equals(&member, "youtube");
+            }
+        }
+    }
+    
+    unmap_file(&mf);
+}
+
+static void load_playlist_songs(AppState *st, int idx) {
+    if (idx < 0 || idx >= st->playlist_count) return;
+    
+    Playlist *pl = &st->playlists[idx];
+    if (pl->count > 0) st->playlists_version++;
+    free_playlist_items(pl);
+    
+    PERF_BEGIN(perf_start);
+    if (st->library.enabled) {
+        library_load_songs(st, pl);
+    } else {
+        load_playlist_songs_json(st, pl);
+    }
+    PERF_END(PERF_PLAYLIST_LOAD, perf_start);
+    
+    pl->songs_version = ++st->playlists_version;
+    if (pl->loaded) {
+        // Read, even if it holds no songs: counts as loaded from now on
+        pl->stored_count = pl->count;
+        playlist_index_ids(pl);
+    } else if (pl->stored_count < 0) {
+        // Unreadable: keep the count from the index if there is one, and
+        // never leave it unknown, or every redraw would try again
+        pl->stored_count = 0;
+    }
+}
+
+// Read the saved songs of playlist idx into scratch, leaving the playlist
+// itself unloaded. Free them with free_playlist_items.
+static void read_playlist_songs(AppState *st, int idx, Playlist *scratch) {
+    const Playlist *pl = &st->playlists[idx];
+    memset(scratch, 0, sizeof(*scratch));
+    scratch->name = pl->name;
+    scratch->filename = pl->filename;
+    scratch->stored_count = pl->stored_count;
+    scratch->lib_index = pl->lib_index;
+    
+    if (st->library.enabled) {
+        library_load_songs(st, scratch);
+    } else {
+        load_playlist_songs_json(st, scratch);
+    }
+}
+
+// Unload the least recently used playlists while more than
+// PLAYLIST_RESIDENT_SONGS songs are in memory. Playlists that are open,
+// playing or being imported into stay; unsaved songs are written first.
+static void release_idle_playlists(AppState *st) {
+    for (;;) {
+        long resident = 0;
+        int victim = -1;
+        for (int i = 0; i < st->playlist_count; i++) {
+            Playlist *pl = &st->playlists[i];
+            if (!pl->loaded) continue;
+            resident += pl->count;
+            
+            bool pinned = (i == st->current_playlist_idx) ||
+                          (st->playing_from_playlist && i == st->playing_playlist_idx) ||
+                          (st->import.running && i == st->import.playlist_idx);
+            if (pinned || pl->count == 0) continue;
+            if (victim < 0 || pl->last_used < st->playlists[victim].last_used) victim = i;
+        }
+        
+        if (resident <= PLAYLIST_RESIDENT_SONGS || victim < 0) return;
+        
+        // Songs that could not be written stay in memory for the next save
+        Playlist *pl = &st->playlists[victim];
+        if (!flush_playlist(st, victim)) return;
+        if (!st->library.enabled) {
+            char path[16400];
+            playlist_json_path(st, pl, path, sizeof(path));
+            if (!file_writer_wait(&st->writer, path)) {
+                collect_failed_saves(st);
+                return;
+            }
+        }
+        pl->stored_count = pl->count;
+        free_playlist_items(pl);
+    }
+}
+
+// Make sure the songs of a playlist are in memory before using them
+static void ensure_playlist_loaded(AppState *st, int idx) {
+    if (idx < 0 || idx >= st->playlist_count) return;
+    
+    Playlist *pl = &st->playlists[idx];
+    pl->last_used = ++st->playlist_clock;
+    if (pl->loaded) return;
+    
+    load_playlist_songs(st, idx);
+    release_idle_playlists(st);
+}
+
+static void load_playlists_json(AppState *st) {
+    file_writer_wait(&st->writer, st->playlists_index);
+    
+    MappedFile mf;
+    if (!map_file(st->playlists_index, &mf)) return;
+    
+    JsonReader r;
+    json_reader_init(&r, mf.data, mf.size);
+    JsonField member;
+    
+    if (json_enter(&r, '{')) {
+        while (json_next_member(&r, &member)) {
+            if (!json_key_is(&member, "playlists") || !json_enter(&r, '[')) {
+                json_read_value(&r, &member);
+                continue;
+            }
+            
+            while (json_next_element(&r)) {
+                JsonField fields[8];
+                int n = json_read_object(&r, fields, 8);
+                if (n <= 0) continue;
+                
+                char *name = json_field_dup(json_find_field(fields, n, "name"));
+                char *filename = json_field_dup(json_find_field(fields, n, "filename"));
+                
+                int idx = -1;
+                if (name && filename && name[0] && filename[0]) {
+                    idx = new_playlist_slot(st);
+                }
+                if (idx < 0) {
+                    free(name);
+                    free(filename);
+                    continue;
+                }
+                
+                Playlist *pl = &st->playlists[idx];
+                pl->name = name;
+                pl->filename = filename;
+                
+                // Older index files have neither; the songs are loaded to find out
+                pl->is_youtube_playlist = json_field_equals(json_find_field(fields, n, "type"),
+                                                            "youtube");
+                pl->stored_count = (int)json_field_long(json_find_field(fields, n, "count"), -1);
+            }
+        }
+    }
+    
+    unmap_file(&mf);
+}
+
+static void load_playlists(AppState *st) {
+    // Edits in memory would be lost otherwise; while some cannot be
+    // written the playlists stay as they are
+    if (!flush_pending_saves(st) || !wait_for_saves(st)) return;
+    free_all_playlists(st);
+    
+    if (st->library.enabled) {
+        library_load_playlists(st);
+    } else {
+        load_playlists_json(st);
+    }
+}
+
+static int create_playlist(AppState *st, const char *name, bool is_youtube) {
+    if (!name || !name[0]) return -1;
+    
+    // Check for duplicate name
+    for (int i = 0; i < st->playlist_count; i++) {
+        if (strcasecmp(st->playlists[i].name, name) == 0) {
+            return -2; // Already exists
+        }
+    }
+    
+    char *filename = sanitize_filename(name);
+    if (!filename) return -1;
+    
+    // Check for duplicate filename
+    for (int i = 0; i < st->playlist_count; i++) {
+        if (strcmp(st->playlists[i].filename, filename) == 0) {
+            // Add number suffix
+            char *new_filename = malloc(strlen(filename) + 10);
+            if (!new_filename) {
+                free(filename);
+                return -1;
+            }
+            snprintf(new_filename, strlen(filename) + 10, "%d_%s", 
+                     st->playlist_count, filename);
+            free(filename);
+            filename = new_filename;
+            break;
+        }
+    }
+    
+    int idx = new_playlist_slot(st);
+    if (idx < 0) {
+        free(filename);
+        return -1;
+    }
+    st->playlists[idx].name = strdup(name);
+    st->playlists[idx].filename = filename;
+    st->playlists[idx].is_youtube_playlist = is_youtube;
+    st->playlists[idx].loaded = true;
+    st->playlists[idx].stored_count = 0;
+    st->playlists[idx].last_used = ++st->playlist_clock;
+    st->playlists[idx].songs_version = ++st->playlists_version;
+    
+    save_playlists_index(st);
+    save_playlist(st, idx);
+    
+    return idx;
+}
+
+static bool delete_playlist(AppState *st, int idx) {
+    if (idx < 0 || idx >= st->playlist_count) return false;
+    if (st->import.running && st->import.playlist_idx == idx) return false;  // still importing
+
+    // Save playlist name before freeing (needed for directory deletion)
+    char playlist_name[256];
+    strncpy(playlist_name, st->playlists[idx].name, sizeof(playlist_name) - 1);
+    playlist_name[sizeof(playlist_name) - 1] = '\0';
+
+    // Delete the playlist JSON file
+    char path[16384]; // Significantly increased buffer size
+    snprintf(path, sizeof(path), "%s/%s", st->playlists_dir, st->playlists[idx].filename);
+    file_writer_drop(&st->writer, path);
+    unlink(path);
+
+    // Delete the download directory and all downloaded songs
+    char download_dir[16384]; // Significantly increased buffer size
+    snprintf(download_dir, sizeof(download_dir), "%s/%s", st->config.download_path, playlist_name);
+    if (dir_exists(download_dir)) {
+        delete_directory_recursive(download_dir);
+    }
+    local_index_remove_playlist(st, playlist_name);
+    song_index_drop_playlist(&st->song_index, idx);
+
+    // Free memory
+    free_playlist(&st->playlists[idx]);
+
+    // Shift remaining playlists
+    for (int i = idx; i < st->playlist_count - 1; i++) {
+        st->playlists[i] = st->playlists[i + 1];
+    }
+    st->playlist_count--;
+    
+    // Later playlists moved down one. What pointed at the deleted one
+    // stops: playback, the open playlist and its filter.
+    if (st->import.playlist_idx > idx) {
+        st->import.playlist_idx--;
+    }
+    if (st->playing_playlist_idx == idx) {
+        if (st->playing_from_playlist) {
+            mpv_stop_playback();
+            st->playing_index = -1;
+            st->queued_index = -1;
+            st->paused = false;
+        }
+        st->playing_from_playlist = false;
+        st->playing_playlist_idx = -1;
+    } else if (st->playing_playlist_idx > idx) {
+        st->playing_playlist_idx--;
+    }
+    if (st->current_playlist_idx == idx) {
+        st->current_playlist_idx = -1;
+        st->playlist_song_selected = 0;
+        st->playlist_song_scroll = 0;
+    } else if (st->current_playlist_idx > idx) {
+        st->current_playlist_idx--;
+    }
+    if (st->filter.view == VIEW_PLAYLIST_SONGS) {
+        if (st->filter.playlist_idx == idx) {
+            filter_clear(st);
+        } else if (st->filter.playlist_idx > idx) {
+            st->filter.playlist_idx--;
+        }
+    }
+
+    // Clear the last slot
+    memset(&st->playlists[st->playlist_count], 0, sizeof(Playlist));
+    st->playlists_version++;
+
+    save_playlists_index(st);
+    return true;
+}
+
+static bool add_song_to_playlist(AppState *st, int playlist_idx, Song *song) {
+    if (playlist_idx < 0 || playlist_idx >= st->playlist_count) return false;
+    if (!song || !song->video_id[0]) return false;
+    
+    Playlist *pl = &st->playlists[playlist_idx];
+    
+    ensure_playlist_loaded(st, playlist_idx);
+    if (!pl->loaded) return false;
+    
+    if (playlist_find_song(pl, song->video_id) >= 0) {
+        return false; // Already in playlist
+    }
+    
+    if (!playlist_append(pl, song)) return false;
+    song_index_add(&st->song_index, playlist_idx, song);
+    st->playlists_version++;
+
+    save_playlist(st, playlist_idx);
+
+    // Automatically queue song for download
+    add_to_download_queue(st, song->video_id, song->title, pl->name);
+
+    return true;
+}
+
+static bool remove_song_from_playlist(AppState *st, int playlist_idx, int song_idx) {
+    if (playlist_idx < 0 || playlist_idx >= st->playlist_count) return false;
+    
+    Playlist *pl = &st->playlists[playlist_idx];
+    if (song_idx < 0 || song_idx >= pl->count) return false;
+    
+    song_index_remove(&st->song_index, playlist_idx, pl->items[song_idx].video_id);
+    
+    // Shift remaining songs; the title stays in the arena until the
+    // playlist is unloaded
+    for (int i = song_idx; i < pl->count - 1; i++) {
+        pl->items[i] = pl->items[i + 1];
+    }
+    pl->count--;
+    pl->lib_songs = -1;  // library.bin only takes appends in place
+    
+    // Clear last slot
+    memset(&pl->items[pl->count], 0, sizeof(Song));
+    if (pl->id_slots) playlist_index_ids(pl);  // later songs moved down one
+    pl->songs_version = ++st->playlists_version;
+    
+    save_playlist(st, playlist_idx);
+    return true;
+}
+
+static int find_song_by_video_id(const Song *songs, int count, const char *video_id) {
+    if (!video_id) return -1;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(songs[i].video_id, video_id) == 0) return i;
+    }
+    return -1;
+}
+
+// ============================================================================
+// Library Search Index
+// ============================================================================
+
+// Title words map to the songs containing them, so a query is answered
+// from the index alone. Removed songs stay in place with playlist -1 until
+// there are more of them than live ones; then the index is dropped and
+// rebuilt on the next search.
+
+static void song_index_free(SongIndex *ix) {
+    for (int i = 0; i < ix->word_count; i++) {
+        free(ix->words[i].songs);
+    }
+    free(ix->words);
+    free(ix->word_slots);
+    free(ix->word_order);
+    free(ix->songs);
+    free(ix->hits);
+    free(ix->matches);
+    arena_free(&ix->strings);
+    memset(ix, 0, sizeof(*ix));
+}
+
+// Copy the next word of s at or after *pos into word, lowercased and cut
+// to size - 1 bytes. Words are runs of ASCII letters and digits and of
+// non-ASCII bytes. Returns false at the end of s.
+static bool next_word(const char *s, size_t *pos, char *word, size_t size) {
+    size_t i = *pos;
+    while (s[i] && !isalnum((unsigned char)s[i]) && (unsigned char)s[i] < 0x80) i++;
+    if (!s[i]) {
+        *pos = i;
+        return false;
+    }
+    
+    size_t len = 0;
+    for (; s[i] && (isalnum((unsigned char)s[i]) || (unsigned char)s[i] >= 0x80); i++) {
+        if (len + 1 < size) word[len++] = ascii_lower(s[i]);
+    }
+    word[len] = '\0';
+    *pos = i;
+    return true;
+}
+
+// Slot holding word, or the free slot where it would go
+static int song_index_slot(const SongIndex *ix, const char *word) {
+    unsigned int mask = (unsigned int)ix->slot_cap - 1;
+    unsigned int i = hash_string(word) & mask;
+    while (ix->word_slots[i] >= 0 && strcmp(ix->words[ix->word_slots[i]].text, word) != 0) {
+        i = (i + 1) & mask;
+    }
+    return (int)i;
+}
+
+static bool song_index_grow_slots(SongIndex *ix) {
+    int cap = ix->slot_cap ? ix->slot_cap * 2 : 4096;
+    int *slots = malloc(cap * sizeof(int));
+    if (!slots) return false;
+    memset(slots, 0xff, cap * sizeof(int));
+    
+    free(ix->word_slots);
+    ix->word_slots = slots;
+    ix->slot_cap = cap;
+    for (int w = 0; w < ix->word_count; w++) {
+        ix->word_slots[song_index_slot(ix, ix->words[w].text)] = w;
+    }
+    return true;
+}
+
+// The entry for word, added if it is new. NULL if out of memory.
+static IndexWord *song_index_word(SongIndex *ix, const char *word) {
+    if ((ix->word_count + 1) * 4 > ix->slot_cap * 3 && !song_index_grow_slots(ix)) {
+        return NULL;
+    }
+    
+    int slot = song_index_slot(ix, word);
+    if (ix->word_slots[slot] >= 0) return &ix->words[ix->word_slots[slot]];
+    
+    if (ix->word_count >= ix->word_cap) {
+        int cap = ix->word_cap ? ix->word_cap * 2 : 1024;
+        IndexWord *grown = realloc(ix->words, cap * sizeof(IndexWord));
+        if (!grown) return NULL;
+        ix->words = grown;
+        ix->word_cap = cap;
+    }
+    
+    char *text = arena_strdup(&ix->strings, word);
+    if (!text) return NULL;
+    
+    IndexWord *w = &ix->words[ix->word_count];
+    memset(w, 0, sizeof(*w));
+    w->text = text;
+    ix->word_slots[slot] = ix->word_count++;
+    return w;
+}
+
+static bool index_word_add(IndexWord *w, int song) {
+    if (w->count > 0 && w->songs[w->count - 1] == song) return true;  // word repeated in the title
+    if (w->count >= w->cap) {
+        int cap = w->cap ? w->cap * 2 : 4;
+        int *grown = realloc(w->songs, cap * sizeof(int));
+        if (!grown) return false;
+        w->songs = grown;
+        w->cap = cap;
+    }
+    w->songs[w->count++] = song;
+    return true;
+}
+
+// Index song as a member of playlist. Does nothing before the index is
+// built, since building reads every playlist anyway.
+static void song_index_add(SongIndex *ix, int playlist, const Song *song) {
+    if (!ix->built || !song->video_id[0]) return;
+    
+    if (ix->song_count >= ix->song_cap) {
+        int cap = ix->song_cap ? ix->song_cap * 2 : 1024;
+        IndexedSong *grown = realloc(ix->songs, cap * sizeof(IndexedSong));
+        if (!grown) return;
+        ix->songs = grown;
+        ix->song_cap = cap;
+    }
+    
+    const char *title = song->title ? song->title : "";
+    char *copy = arena_strdup(&ix->strings, title);
+    if (!copy) return;
+    
+    int n = ix->song_count++;
+    IndexedSong *e = &ix->songs[n];
+    memcpy(e->video_id, song->video_id, sizeof(e->video_id));
+    e->title = copy;
+    e->duration = song->duration;
+    e->playlist = playlist;
+    
+    unsigned int b = hash_string(e->video_id) % SONG_INDEX_ID_BUCKETS;
+    e->id_next = ix->id_buckets[b];
+    ix->id_buckets[b] = n;
+    ix->live++;
+    
+    char word[SONG_INDEX_MAX_WORD];
+    size_t pos = 0;
+    while (next_word(title, &pos, word, sizeof(word))) {
+        IndexWord *w = song_index_word(ix, word);
+        if (w) index_word_add(w, n);
+    }
+}
+
+// Too many removed songs: drop the index so the next search rebuilds it
+static void song_index_check_garbage(SongIndex *ix) {
+    int dead = ix->song_count - ix->live;
+    if (dead > 1024 && dead > ix->live) song_index_free(ix);
+}
+
+static void song_index_remove(SongIndex *ix, int playlist, const char *video_id) {
+    if (!ix->built) return;
+    
+    unsigned int b = hash_string(video_id) % SONG_INDEX_ID_BUCKETS;
+    for (int i = ix->id_buckets[b]; i >= 0; i = ix->songs[i].id_next) {
+        IndexedSong *e = &ix->songs[i];
+        if (e->playlist == playlist && strcmp(e->video_id, video_id) == 0) {
+            e->playlist = -1;
+            ix->live--;
+            break;
+        }
+    }
+    song_index_check_garbage(ix);
+}
+
+static bool song_index_contains(const SongIndex *ix, int playlist, const char *video_id) {
+    if (!ix->built) return false;
+    unsigned int b = hash_string(video_id) % SONG_INDEX_ID_BUCKETS;
+    for (int i = ix->id_buckets[b]; i >= 0; i = ix->songs[i].id_next) {
+        if (ix->songs[i].playlist == playlist && strcmp(ix->songs[i].video_id, video_id) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Forget the songs of a deleted playlist; later playlists move down one
+static void song_index_drop_playlist(SongIndex *ix, int playlist) {
+    if (!ix->built) return;
+    
+    for (int i = 0; i < ix->song_count; i++) {
+        IndexedSong *e = &ix->songs[i];
+        if (e->playlist == playlist) {
+            e->playlist = -1;
+            ix->live--;
+        } else if (e->playlist > playlist) {
+            e->playlist--;
+        }
+    }
+    song_index_check_garbage(ix);
+}
+
+// Index every playlist. Loaded playlists are taken from memory, the rest
+// are read from disk without loading them.
+static void song_index_build(AppState *st) {
+    SongIndex *ix = &st->song_index;
+    song_index_free(ix);
+    memset(ix->id_buckets, 0xff, sizeof(ix->id_buckets));
+    ix->built = true;
+    
+    for (int i = 0; i < st->playlist_count; i++) {
+        Playlist *pl = &st->playlists[i];
+        if (pl->loaded) {
+            for (int k = 0; k < pl->count; k++) song_index_add(ix, i, &pl->items[k]);
+            continue;
+        }
+        
+        Playlist scratch;
+        read_playlist_songs(st, i, &scratch);
+        for (int k = 0; k < scratch.count; k++) song_index_add(ix, i, &scratch.items[k]);
+        free_playlist_items(&scratch);
+    }
+}
+
+static int index_word_cmp(const void *a, const void *b, void *arg) {
+    const SongIndex *ix = arg;
+    return strcmp(ix->words[*(const int *)a].text, ix->words[*(const int *)b].text);
+}
+
+// Bring word_order up to date: sort the words added since the last search
+// and merge them into the sorted ones
+static bool song_index_order_words(SongIndex *ix) {
+    int old = ix->ordered_count, total = ix->word_count;
+    if (old == total) return true;
+    
+    int added = total - old;
+    int *fresh = malloc(added * sizeof(int));
+    if (!fresh) return false;
+    for (int i = 0; i < added; i++) fresh[i] = old + i;
+    qsort_r(fresh, added, sizeof(int), index_word_cmp, ix);
+    
+    int *merged = malloc(total * sizeof(int));
+    if (!merged) {
+        free(fresh);
+        return false;
+    }
+    int a = 0, b = 0, n = 0;
+    while (a < old && b < added) {
+        merged[n++] = index_word_cmp(&ix->word_order[a], &fresh[b], ix) <= 0 ?
+                      ix->word_order[a++] : fresh[b++];
+    }
+    while (a < old) merged[n++] = ix->word_order[a++];
+    while (b < added) merged[n++] = fresh[b++];
+    
+    free(fresh);
+    free(ix->word_order);
+    ix->word_order = merged;
+    ix->ordered_count = total;
+    return true;
+}
+
+// First position in word_order whose word is not less than prefix
+static int song_index_lower_bound(const SongIndex *ix, const char *prefix) {
+    int lo = 0, hi = ix->ordered_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(ix->words[ix->word_order[mid]].text, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Songs whose title has a word starting with each word of query, plus any
+// song whose video id is query. Their indices go to ix->matches, in
+// playlist order with id matches first. Returns how many.
+static int song_index_search(SongIndex *ix, const char *query) {
+    if (ix->song_count == 0) return 0;
+    
+    free(ix->hits);
+    free(ix->matches);
+    ix->hits = calloc(ix->song_count, sizeof(int));
+    ix->matches = malloc(ix->song_count * sizeof(int));
+    if (!ix->hits || !ix->matches || !song_index_order_words(ix)) return 0;
+    int count = 0;
+    
+    unsigned int b = hash_string(query) % SONG_INDEX_ID_BUCKETS;
+    for (int i = ix->id_buckets[b]; i >= 0; i = ix->songs[i].id_next) {
+        if (ix->songs[i].playlist >= 0 && strcmp(ix->songs[i].video_id, query) == 0) {
+            ix->hits[i] = -1;
+            ix->matches[count++] = i;
+        }
+    }
+    
+    // hits[i] counts the query words song i matched so far; a song is
+    // only credited for word k if it matched all words before it
+    char word[SONG_INDEX_MAX_WORD];
+    size_t pos = 0;
+    int words = 0;
+    while (words < SONG_INDEX_QUERY_WORDS && next_word(query, &pos, word, sizeof(word))) {
+        // Words starting with word are one run of the sorted order
+        size_t len = strlen(word);
+        for (int o = song_index_lower_bound(ix, word); o < ix->ordered_count; o++) {
+            IndexWord *iw = &ix->words[ix->word_order[o]];
+            if (strncmp(iw->text, word, len) != 0) break;
+            for (int k = 0; k < iw->count; k++) {
+                if (ix->hits[iw->songs[k]] == words) ix->hits[iw->songs[k]] = words + 1;
+            }
+        }
+        words++;
+    }
+    
+    if (words == 0) return count;
+    for (int i = 0; i < ix->song_count; i++) {
+        if (ix->hits[i] == words && ix->songs[i].playlist >= 0) ix->matches[count++] = i;
+    }
+    return count;
+}
+
+// ============================================================================
+// Binary Library
+// ============================================================================
+
+// library.bin replaces playlists.json and playlists/*.json once it exists
+// (shellbeats --import-json creates it). It stays mapped read-only; adding
+// songs writes them into the free records and string space in place, and
+// anything else rewrites the whole file with fresh free space.
+
+static const LibraryHeader *library_header(const Library *lib) {
+    return (const LibraryHeader *)lib->map;
+}
+
+static const LibraryPlaylist *library_playlists(const Library *lib) {
+    return (const LibraryPlaylist *)(lib->map + library_header(lib)->playlists_off);
+}
+
+static const LibrarySong *library_songs(const Library *lib) {
+    return (const LibrarySong *)(lib->map + library_header(lib)->songs_off);
+}
+
+// String at off in the string table, or NULL if off is out of range.
+// Validation guarantees the table ends with a NUL.
+static const char *library_string(const Library *lib, uint32_t off) {
+    const LibraryHeader *h = library_header(lib);
+    if (off >= h->strings_used) return NULL;
+    return lib->map + h->strings_off + off;
+}
+
+// Check that every table lies inside the file
+static bool library_valid(const char *map, size_t size) {
+    if (size < sizeof(LibraryHeader)) return false;
+    
+    const LibraryHeader *h = (const LibraryHeader *)map;
+    if (memcmp(h->magic, LIBRARY_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != LIBRARY_VERSION) {
+        return false;
+    }
+    
+    if (h->playlists_off % 8 || h->songs_off % 8 ||
+        h->playlists_off + (uint64_t)h->playlist_count * sizeof(LibraryPlaylist) > size ||
+        h->songs_off + (uint64_t)h->song_cap * sizeof(LibrarySong) > size ||
+        h->strings_off + (uint64_t)h->strings_cap > size ||
+        h->song_count > h->song_cap || h->sorted_count > h->song_count ||
+        h->strings_used > h->strings_cap) {
+        return false;
+    }
+    
+    if (h->strings_used > 0 && map[h->strings_off + h->strings_used - 1] != '\0') return false;
+    
+    const LibraryPlaylist *lp = (const LibraryPlaylist *)(map + h->playlists_off);
+    for (uint32_t i = 0; i < h->playlist_count; i++) {
+        if ((uint64_t)lp[i].first_song + lp[i].sorted_songs > h->sorted_count) return false;
+    }
+    return true;
+}
+
+static void library_close(Library *lib) {
+    if (lib->map) munmap((void *)lib->map, lib->map_size);
+    if (lib->fd >= 0) close(lib->fd);
+    lib->map = NULL;
+    lib->map_size = 0;
+    lib->fd = -1;
+}
+
+// Open and map path. Returns false (leaving lib closed) if it is missing
+// or not a valid library.
+static bool library_open(Library *lib, const char *path) {
+    lib->fd = open(path, O_RDWR | O_CLOEXEC);
+    lib->map = NULL;
+    lib->map_size = 0;
+    if (lib->fd < 0) return false;
+    
+    struct stat sb;
+    if (fstat(lib->fd, &sb) == 0 && sb.st_size > 0) {
+        void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, lib->fd, 0);
+        if (map != MAP_FAILED) {
+            lib->map = map;
+            lib->map_size = (size_t)sb.st_size;
+        }
+    }
+    
+    if (!lib->map || !library_valid(lib->map, lib->map_size)) {
+        library_close(lib);
+        return false;
+    }
+    return true;
+}
+
+// Walks the records of one playlist: its grouped block, then any records
+// appended for it since. Zero-initialize before the first call.
+typedef struct {
+    bool started;
+    uint32_t next;
+    uint32_t block_end;
+} LibraryCursor;
+
+static const LibrarySong *library_next_song(const Library *lib, uint32_t playlist,
+                                            LibraryCursor *c) {
+    const LibraryHeader *h = library_header(lib);
+    const LibrarySong *songs = library_songs(lib);
+    
+    if (!c->started) {
+        c->started = true;
+        if (playlist >= h->playlist_count) {
+            c->next = c->block_end = h->song_count;
+            return NULL;
+        }
+        const LibraryPlaylist *lp = &library_playlists(lib)[playlist];
+        c->next = lp->first_song;
+        c->block_end = lp->first_song + lp->sorted_songs;
+    }
+    
+    if (c->next < c->block_end) return &songs[c->next++];
+    if (c->next < h->sorted_count) c->next = h->sorted_count;
+    
+    while (c->next < h->song_count) {
+        const LibrarySong *rec = &songs[c->next++];
+        if (rec->playlist == playlist) return rec;
+    }
+    return NULL;
+}
+
+// NUL-terminated copy of a record's id; false if it is not a usable id
+static bool library_song_id(const LibrarySong *rec, char *out) {
+    size_t len = strnlen(rec->video_id, sizeof(rec->video_id));
+    if (len == 0 || len >= sizeof(rec->video_id)) return false;
+    memcpy(out, rec->video_id, len + 1);
+    return true;
+}
+
+static void library_load_playlists(AppState *st) {
+    Library *lib = &st->library;
+    const LibraryHeader *h = library_header(lib);
+    const LibraryPlaylist *lp = library_playlists(lib);
+    
+    // Songs appended since the last rewrite are not in the grouped counts
+    uint32_t *appended = calloc(h->playlist_count ? h->playlist_count : 1, sizeof(uint32_t));
+    if (!appended) return;
+    const LibrarySong *songs = library_songs(lib);
+    for (uint32_t i = h->sorted_count; i < h->song_count; i++) {
+        if (songs[i].playlist < h->playlist_count) appended[songs[i].playlist]++;
+    }
+    
+    for (uint32_t k = 0; k < h->playlist_count; k++) {
+        const char *name = library_string(lib, lp[k].name_off);
+        const char *filename = library_string(lib, lp[k].filename_off);
+        if (!name || !filename || !name[0] || !filename[0]) continue;
+        
+        int idx = new_playlist_slot(st);
+        if (idx < 0) break;
+        
+        Playlist *pl = &st->playlists[idx];
+        pl->name = strdup(name);
+        pl->filename = strdup(filename);
+        if (!pl->name || !pl->filename) {
+            free_playlist(pl);
+            st->playlist_count--;
+            continue;
+        }
+        pl->is_youtube_playlist = (lp[k].flags & LIBRARY_PLAYLIST_YOUTUBE) != 0;
+        pl->stored_count = (int)(lp[k].sorted_songs + appended[k]);
+        pl->lib_index = (int)k;
+    }
+    
+    free(appended);
+}
+
+static void library_load_songs(AppState *st, Playlist *pl) {
+    Library *lib = &st->library;
+    pl->loaded = true;
+    pl->lib_songs = 0;
+    if (pl->lib_index < 0) return;
+    
+    // Size the arena and the array first, so a load is two allocations
+    LibraryCursor c = {0};
+    const LibrarySong *rec;
+    size_t bytes = 0;
+    int n = 0;
+    while ((rec = library_next_song(lib, (uint32_t)pl->lib_index, &c)) != NULL) {
+        const char *title = library_string(lib, rec->title_off);
+        bytes += (title ? strlen(title) : 0) + 1;
+        n++;
+    }
+    arena_reserve(&pl->strings, bytes);
+    playlist_reserve(pl, n);
+    
+    memset(&c, 0, sizeof(c));
+    while ((rec = library_next_song(lib, (uint32_t)pl->lib_index, &c)) != NULL) {
+        char video_id[SONG_VIDEO_ID_SIZE];
+        const char *title = library_string(lib, rec->title_off);
+        if (!title || !library_song_id(rec, video_id)) continue;
+        
+        Song song = { .title = (char *)title, .duration = rec->duration };
+        song_set_video_id(&song, video_id);
+        if (!playlist_append(pl, &song)) break;
+    }
+    pl->lib_songs = pl->count;
+}
+
+static bool pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        len -= (size_t)w;
+        off += w;
+    }
+    return true;
+}
+
+// Write the songs added to a loaded playlist since it was last saved into
+// the free space of library.bin. Returns false if they do not fit or the
+// playlist was changed in other ways; the library must be rewritten then.
+static bool library_append_songs(AppState *st, int idx) {
+    Library *lib = &st->library;
+    Playlist *pl = &st->playlists[idx];
+    if (!lib->map || pl->lib_index < 0 || pl->lib_songs < 0 || pl->count < pl->lib_songs) {
+        return false;
+    }
+    if (pl->count == pl->lib_songs) return true;
+    
+    LibraryHeader h = *library_header(lib);
+    uint32_t n = (uint32_t)(pl->count - pl->lib_songs);
+    size_t bytes = 0;
+    for (int i = pl->lib_songs; i < pl->count; i++) {
+        bytes += strlen(pl->items[i].title) + 1;
+    }
+    if ((uint64_t)h.song_count + n > h.song_cap ||
+        (uint64_t)h.strings_used + bytes > h.strings_cap) {
+        return false;
+    }
+    
+    char *strings = malloc(bytes);
+    LibrarySong *recs = calloc(n, sizeof(LibrarySong));
+    bool ok = strings && recs;
+    
+    if (ok) {
+        size_t off = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            const Song *song = &pl->items[pl->lib_songs + (int)i];
+            size_t len = strlen(song->title) + 1;
+            memcpy(strings + off, song->title, len);
+            recs[i].playlist = (uint32_t)pl->lib_index;
+            recs[i].title_off = h.strings_used + (uint32_t)off;
+            recs[i].duration = song->duration;
+            memcpy(recs[i].video_id, song->video_id, sizeof(recs[i].video_id));
+            off += len;
+        }
+        
+        // Data first, header last: until the header is written the new
+        // records are just free space
+        ok = pwrite_all(lib->fd, strings, bytes, (off_t)(h.strings_off + h.strings_used)) &&
+             pwrite_all(lib->fd, recs, n * sizeof(LibrarySong),
+                        (off_t)(h.songs_off + (uint64_t)h.song_count * sizeof(LibrarySong)));
+        if (ok) {
+            h.song_count += n;
+            h.strings_used += (uint32_t)bytes;
+            ok = pwrite_all(lib->fd, &h, sizeof(h), 0);
+        }
+    }
+    
+    free(strings);
+    free(recs);
+    if (ok) pl->lib_songs = pl->count;
+    return ok;
+}
+
+// One song as it goes into a rewritten library: from memory if the
+// playlist is loaded, otherwise copied from the current file
+static bool library_next_entry(AppState *st, int idx, LibraryCursor *c,
+                               const char **title, LibrarySong *rec) {
+    Playlist *pl = &st->playlists[idx];
+    
+    if (pl->loaded) {
+        if (c->next >= (uint32_t)pl->count) return false;
+        const Song *song = &pl->items[c->next++];
+        *title = song->title;
+        rec->duration = song->duration;
+        memcpy(rec->video_id, song->video_id, sizeof(rec->video_id));
+        return true;
+    }
+    
+    if (pl->lib_index < 0 || !st->library.map) return false;
+    
+    const LibrarySong *old;
+    while ((old = library_next_song(&st->library, (uint32_t)pl->lib_index, c)) != NULL) {
+        *title = library_string(&st->library, old->title_off);
+        if (!*title) continue;
+        rec->duration = old->duration;
+        memcpy(rec->video_id, old->video_id, sizeof(rec->video_id));
+        rec->video_id[sizeof(rec->video_id) - 1] = '\0';
+        return true;
+    }
+    return false;
+}
+
+// Rewrite library.bin from all playlists, grouped by playlist and with
+// free space for appends, then map the new file
+static bool library_write(AppState *st) {
+    Library *lib = &st->library;
+    int count = st->playlist_count;
+    
+    // Unloaded playlists are copied from the current mapping; without it
+    // they would be written back empty. Stop using the library instead:
+    // edits then go to the JSON files and library.bin is left as it was.
+    if (!lib->map) {
+        for (int i = 0; i < count; i++) {
+            if (!st->playlists[i].loaded && st->playlists[i].lib_index >= 0) {
+                lib->enabled = false;
+                return false;
+            }
+        }
+    }
+    
+    uint32_t *songs_in = calloc(count ? count : 1, sizeof(uint32_t));
+    if (!songs_in) return false;
+    
+    // Sizes first: names, then titles in record order
+    uint64_t song_total = 0, names_size = 0, titles_size = 0;
+    for (int i = 0; i < count; i++) {
+        names_size += strlen(st->playlists[i].name) + 1 + strlen(st->playlists[i].filename) + 1;
+        
+        LibraryCursor c = {0};
+        LibrarySong rec;
+        const char *title;
+        while (library_next_entry(st, i, &c, &title, &rec)) {
+            titles_size += strlen(title) + 1;
+            songs_in[i]++;
+        }
+        song_total += songs_in[i];
+    }
+    
+    uint64_t song_cap = song_total + song_total / 2 + LIBRARY_SLACK_SONGS;
+    uint64_t strings_cap = names_size + titles_size + (names_size + titles_size) / 2 +
+                           LIBRARY_SLACK_STRINGS;
+    if (song_cap > UINT32_MAX || strings_cap > UINT32_MAX) {
+        free(songs_in);
+        return false;
+    }
+    
+    LibraryHeader h = {0};
+    memcpy(h.magic, LIBRARY_MAGIC, sizeof(h.magic));
+    h.version = LIBRARY_VERSION;
+    h.playlist_count = (uint32_t)count;
+    h.song_count = (uint32_t)song_total;
+    h.song_cap = (uint32_t)song_cap;
+    h.sorted_count = (uint32_t)song_total;
+    h.strings_used = (uint32_t)(names_size + titles_size);
+    h.strings_cap = (uint32_t)strings_cap;
+    h.playlists_off = sizeof(LibraryHeader);
+    h.songs_off = (h.playlists_off + (uint64_t)count * sizeof(LibraryPlaylist) + 7) & ~(uint64_t)7;
+    h.strings_off = h.songs_off + song_cap * sizeof(LibrarySong);
+    
+    char tmp_path[16384 + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", st->library_file);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        free(songs_in);
+        return false;
+    }
+    
+    fwrite(&h, sizeof(h), 1, f);
+    
+    uint32_t str_off = 0, first_song = 0;
+    for (int i = 0; i < count; i++) {
+        Playlist *pl = &st->playlists[i];
+        LibraryPlaylist lp = {0};
+        lp.name_off = str_off;
+        str_off += (uint32_t)strlen(pl->name) + 1;
+        lp.filename_off = str_off;
+        str_off += (uint32_t)strlen(pl->filename) + 1;
+        lp.flags = pl->is_youtube_playlist ? LIBRARY_PLAYLIST_YOUTUBE : 0;
+        lp.first_song = first_song;
+        lp.sorted_songs = songs_in[i];
+        first_song += songs_in[i];
+        fwrite(&lp, sizeof(lp), 1, f);
+    }
+    
+    fseeko(f, (off_t)h.songs_off, SEEK_SET);
+    for (int i = 0; i < count; i++) {
+        LibraryCursor c = {0};
+        LibrarySong rec = { .playlist = (uint32_t)i };
+        const char *title;
+        while (library_next_entry(st, i, &c, &title, &rec)) {
+            rec.title_off = str_off;
+            str_off += (uint32_t)strlen(title) + 1;
+            fwrite(&rec, sizeof(rec), 1, f);
+        }
+    }
+    
+    fseeko(f, (off_t)h.strings_off, SEEK_SET);
+    for (int i = 0; i < count; i++) {
+        fwrite(st->playlists[i].name, 1, strlen(st->playlists[i].name) + 1, f);
+        fwrite(st->playlists[i].filename, 1, strlen(st->playlists[i].filename) + 1, f);
+    }
+    for (int i = 0; i < count; i++) {
+        LibraryCursor c = {0};
+        LibrarySong rec;
+        const char *title;
+        while (library_next_entry(st, i, &c, &title, &rec)) {
+            fwrite(title, 1, strlen(title) + 1, f);
+        }
+    }
+    free(songs_in);
+    
+    // The free space at the end of both tables reads as zeros
+    bool ok = fflush(f) == 0 && !ferror(f) &&
+              ftruncate(fileno(f), (off_t)(h.strings_off + strings_cap)) == 0 &&
+              fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = false;
+    
+    // Map the new file before it replaces the old one; the mapping stays
+    // valid across the rename. Until both succeed the old file and mapping
+    // are left alone, so unloaded playlists can still be copied from them.
+    Library fresh = { .fd = -1 };
+    if (!ok || !library_open(&fresh, tmp_path)) {
+        unlink(tmp_path);
+        return false;
+    }
+    if (rename(tmp_path, st->library_file) != 0) {
+        library_close(&fresh);
+        unlink(tmp_path);
+        return false;
+    }
+    
+    library_close(lib);
+    lib->fd = fresh.fd;
+    lib->map = fresh.map;
+    lib->map_size = fresh.map_size;
+    
+    for (int i = 0; i < count; i++) {
+        Playlist *pl = &st->playlists[i];
+        pl->lib_index = i;
+        pl->lib_songs = pl->loaded ? pl->count : 0;
+    }
+    return true;
+}
+
+// --import-json: build library.bin from playlists.json and playlists/*.json
+static int import_json_library(AppState *st, bool force) {
+    // Once the library is in use the JSON files are no longer updated, so
+    // rebuilding from them would throw away every edit made since
+    if (file_exists(st->library_file) && !force) {
+        fprintf(stderr, "%s already exists and has the current playlists; the JSON files\n"
+                "may be older. Run --export-json first to bring them up to date, or add\n"
+                "--force to rebuild the library from the JSON files anyway.\n",
+                st->library_file);
+        return 1;
+    }
+    
+    library_close(&st->library);
+    st->library.enabled = false;
+    load_playlists(st);
+    
+    long songs = 0;
+    for (int i = 0; i < st->playlist_count; i++) {
+        load_playlist_songs(st, i);
+        if (!st->playlists[i].loaded) {
+            fprintf(stderr, "Could not read playlist '%s' (%s/%s)\n", st->playlists[i].name,
+                    st->playlists_dir, st->playlists[i].filename);
+            return 1;
+        }
+        songs += st->playlists[i].count;
+    }
+    
+    st->library.enabled = true;
+    if (!library_write(st)) {
+        fprintf(stderr, "Failed to write %s\n", st->library_file);
+        return 1;
+    }
+    
+    printf("Imported %d playlists (%ld songs) into %s\n", st->playlist_count, songs,
+           st->library_file);
+    printf("The JSON files are left in place; shellbeats now uses the library.\n");
+    return 0;
+}
+
+// --export-json: write playlists.json and playlists/*.json from library.bin
+static int export_json_library(AppState *st) {
+    if (!st->library.enabled) {
+        fprintf(stderr, "No library at %s\n", st->library_file);
+        return 1;
+    }
+    
+    load_playlists(st);
+    
+    long songs = 0;
+    for (int i = 0; i < st->playlist_count; i++) {
+        load_playlist_songs(st, i);
+        if (!save_playlist_json(st, i)) {
+            fprintf(stderr, "Failed to write %s/%s\n", st->playlists_dir,
+                    st->playlists[i].filename);
+            return 1;
+        }
+        songs += st->playlists[i].count;
+        free_playlist_items(&st->playlists[i]);
+    }
+    if (!save_playlists_index_json(st)) {
+        fprintf(stderr, "Failed to write %s\n", st->playlists_index);
+        return 1;
+    }
+    
+    printf("Exported %d playlists (%ld songs) to %s\n", st->playlist_count, songs,
+           st->playlists_dir);
+    printf("Remove %s to use the JSON files again.\n", st->library_file);
+    return 0;
+}
+
+// ============================================================================
+// MPV IPC Communication
+// ============================================================================
+
+// observe_property ids
+#define MPV_OBSERVE_PAUSE         1
+#define MPV_OBSERVE_PLAYLIST_POS  2
+#define MPV_OBSERVE_IDLE          3
+
+// What mpv_process_events saw, as a bit mask
+#define MPV_TRACK_ADVANCED  1  // mpv moved on to the queued song
+#define MPV_TRACK_FINISHED  2  // mpv ran out of songs and went idle
+
+#define MPV_RETRY_MIN_MS 20     // first reconnect delay
+#define MPV_RETRY_MAX_MS 2000   // reconnect delay cap
+
+static void mpv_disconnect(void) {
+    if (mpv_ipc_fd >= 0) {
+        close(mpv_ipc_fd);
+        mpv_ipc_fd = -1;
+    }
+    mpv_rx_len = 0;
+    mpv_rx_discarding = false;
+    mpv_confirmed = false;
+}
+
+// Add bytes to the send buffer, in front of what is already queued if
+// urgent. Returns false (and drops them) if they don't fit.
+static bool mpv_queue(const char *data, size_t len, bool urgent) {
+    if (len > sizeof(mpv_tx_buf) - mpv_tx_len) return false;
+    if (urgent) {
+        memmove(mpv_tx_buf + len, mpv_tx_buf, mpv_tx_len);
+        memcpy(mpv_tx_buf, data, len);
+    } else {
+        memcpy(mpv_tx_buf + mpv_tx_len, data, len);
+    }
+    mpv_tx_len += len;
+    return true;
+}
+
+// Write as much of the send buffer as the socket takes
+static void mpv_flush(void) {
+    while (mpv_tx_len > 0 && mpv_ipc_fd >= 0) {
+        ssize_t n = send(mpv_ipc_fd, mpv_tx_buf, mpv_tx_len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            mpv_disconnect();
+            return;
+        }
+        mpv_tx_len -= (size_t)n;
+        memmove(mpv_tx_buf, mpv_tx_buf + n, mpv_tx_len);
+    }
+}
+
+// Take over a connected socket: subscribe to what we follow, then send
+// anything queued while we were not connected
+static void mpv_attach(int fd, bool via_fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    
+    mpv_ipc_fd = fd;
+    mpv_confirmed = false;
+    mpv_retry_delay_ms = 0;
+    mpv_retry_at_ms = 0;
+    if (!via_fd) mpv_replay_len = 0;
+    
+    // Keep the pause indicator and the playing song in sync with mpv
+    char observe_cmd[512];
+    int len = snprintf(observe_cmd, sizeof(observe_cmd),
+             "{\"command\":[\"observe_property\",%d,\"pause\"]}\n"
+             "{\"command\":[\"observe_property\",%d,\"playlist-pos\"]}\n"
+             "{\"command\":[\"observe_property\",%d,\"idle-active\"]}\n",
+             MPV_OBSERVE_PAUSE, MPV_OBSERVE_PLAYLIST_POS, MPV_OBSERVE_IDLE);
+    mpv_queue(observe_cmd, (size_t)len, true);
+    mpv_flush();
+}
+
+// Connect to the socket file, unless the last attempt was too recent.
+// Failed attempts back off from MPV_RETRY_MIN_MS to MPV_RETRY_MAX_MS.
+static bool mpv_connect(void) {
+    if (mpv_ipc_fd >= 0) return true;
+    
+    long long now = monotonic_ms();
+    if (now < mpv_retry_at_ms) return false;
+    
+    int fd = -1;
+    if (file_exists(IPC_SOCKET)) {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (fd >= 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, IPC_SOCKET, sizeof(addr.sun_path) - 1);
+        
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    
+    if (fd < 0) {
+        mpv_retry_delay_ms = mpv_retry_delay_ms ? mpv_retry_delay_ms * 2 : MPV_RETRY_MIN_MS;
+        if (mpv_retry_delay_ms > MPV_RETRY_MAX_MS) mpv_retry_delay_ms = MPV_RETRY_MAX_MS;
+        mpv_retry_at_ms = now + mpv_retry_delay_ms;
+        return false;
+    }
+    
+    mpv_attach(fd, false);
+    return true;
+}
+
+// Send one command line. It goes out in a single write when the socket
+// takes it; otherwise it waits in the send buffer until mpv is reachable.
+static void mpv_send_command(const char *cmd) {
+    size_t len = strlen(cmd);
+    
+    // Nothing to talk to and nothing starting up
+    if (!mpv_connect() && mpv_pid <= 0) return;
+    
+    if (mpv_spawned_via_fd && !mpv_confirmed &&
+        len + 1 <= sizeof(mpv_replay_buf) - mpv_replay_len) {
+        memcpy(mpv_replay_buf + mpv_replay_len, cmd, len);
+        mpv_replay_buf[mpv_replay_len + len] = '\n';
+        mpv_replay_len += len + 1;
+    }
+    
+    size_t sent = 0;
+    if (mpv_ipc_fd >= 0 && mpv_tx_len == 0) {
+        struct iovec iov[2] = {
+            { .iov_base = (void *)cmd, .iov_len = len },
+            { .iov_base = "\n", .iov_len = 1 },
+        };
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+        ssize_t n;
+        do {
+            n = sendmsg(mpv_ipc_fd, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        
+        if (n == (ssize_t)(len + 1)) return;
+        if (n > 0) {
+            sent = (size_t)n;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            mpv_disconnect();
+        }
+    }
+    
+    // Keep the rest, in order, for mpv_flush
+    if (len + 1 - sent > sizeof(mpv_tx_buf) - mpv_tx_len) return;
+    if (sent < len) mpv_queue(cmd + sent, len - sent, false);
+    mpv_queue("\n", 1, false);
+}
+
+static void mpv_toggle_pause(void) {
+    mpv_send_command("{\"command\":[\"cycle\",\"pause\"]}");
+}
+
+static void mpv_stop_playback(void) {
+    mpv_send_command("{\"command\":[\"stop\"]}");
+    mpv_sync_request = -1;
+    mpv_synced = false;
+}
+
+// Send a command that reshapes mpv's playlist; events are ignored until
+// its reply arrives. command is the JSON array of the command.
+static void mpv_send_playlist_command(const char *command) {
+    mpv_sync_request = mpv_next_request_id++;
+    mpv_synced = false;
+    
+    char cmd[8448];
+    snprintf(cmd, sizeof(cmd), "{\"command\":%s,\"request_id\":%d}",
+             command, mpv_sync_request);
+    mpv_send_command(cmd);
+}
+
+// mode is "replace" to play url now or "append" to play it after the
+// current file
+static void mpv_loadfile(const char *url, const char *mode) {
+    char *escaped = json_escape_string(url);
+    if (!escaped) return;
+    
+    // Resolved stream URLs run to a couple of kilobytes
+    char command[8192];
+    snprintf(command, sizeof(command), "[\"loadfile\",\"%s\",\"%s\"]", escaped, mode);
+    free(escaped);
+    
+    if (strcmp(mode, "replace") == 0) {
+        mpv_send_playlist_command(command);
+    } else {
+        char cmd[8448];
+        snprintf(cmd, sizeof(cmd), "{\"command\":%s}", command);
+        mpv_send_command(cmd);
+    }
+}
+
+static void mpv_load_url(const char *url) {
+    mpv_loadfile(url, "replace");
+    
+    // mpv keeps the pause state across loadfile; a newly chosen song should play
+    mpv_send_command("{\"command\":[\"set_property\",\"pause\",false]}");
+}
+
+// Drop every entry but the playing one, so the next append follows it
+static void mpv_trim_playlist(void) {
+    mpv_send_playlist_command("[\"playlist-clear\"]");
+}
+
+// Full path of an executable on PATH, into out. execvp may allocate, so
+// the path is looked up before forking and the child uses execv.
+static bool find_executable(const char *name, char *out, size_t out_size) {
+    const char *path = getenv("PATH");
+    if (!path || !path[0]) path = "/usr/local/bin:/usr/bin:/bin";
+    
+    while (*path) {
+        const char *end = strchr(path, ':');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if (len > 0) {
+            snprintf(out, out_size, "%.*s/%s", (int)len, path, name);
+            if (access(out, X_OK) == 0) return true;
+        }
+        path += len;
+        if (*path == ':') path++;
+    }
+    return false;
+}
+
+// Fork mpv. It gets one end of a socketpair as its IPC client connection,
+// so commands can be written right away; older mpv versions without
+// --input-ipc-client are reached through the socket file once it appears.
+static void mpv_spawn(void) {
+    char mpv_path[4096];
+    if (!find_executable("mpv", mpv_path, sizeof(mpv_path))) return;
+    
+    int sv[2] = {-1, -1};
+    bool via_fd = !mpv_fd_ipc_unsupported &&
+                  socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0;
+    
+    unlink(IPC_SOCKET);
+    
+    // Everything the child needs is prepared here: between fork and exec
+    // only async-signal-safe calls are allowed, as other threads may hold
+    // the malloc or stdio locks
+    char client_opt[64];
+    const char *argv[10];
+    int argc = 0;
+    argv[argc++] = "mpv";
+    argv[argc++] = "--no-video";
+    argv[argc++] = "--idle=yes";
+    argv[argc++] = "--force-window=no";
+    argv[argc++] = "--really-quiet";
+    argv[argc++] = "--prefetch-playlist=yes";
+    argv[argc++] = "--input-ipc-server=" IPC_SOCKET;
+    if (via_fd) {
+        snprintf(client_opt, sizeof(client_opt), "--input-ipc-client=fd://%d", sv[1]);
+        argv[argc++] = client_opt;
+    }
+    argv[argc] = NULL;
+    
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        // mpv's end of the socket pair must survive the exec
+        if (via_fd) fcntl(sv[1], F_SETFD, 0);
+        
+        execv(mpv_path, (char *const *)argv);
+        _exit(127);
+    }
+    
+    if (null_fd >= 0) close(null_fd);
+    if (via_fd) close(sv[1]);
+    
+    if (pid < 0) {
+        if (via_fd) close(sv[0]);
+        return;
+    }
+    
+    mpv_pid = pid;
+    mpv_spawned_via_fd = via_fd;
+    mpv_replay_len = 0;
+    mpv_retry_delay_ms = 0;
+    mpv_retry_at_ms = 0;
+    
+    if (via_fd) {
+        mpv_attach(sv[0], true);
+    } else {
+        mpv_connect();
+    }
+}
+
+// Reap mpv if it exited. If it died before ever answering on the
+// socketpair it probably doesn't know --input-ipc-client: start it the old
+// way and resend what it missed.
+static void mpv_check_process(void) {
+    if (mpv_pid <= 0) return;
+    if (waitpid(mpv_pid, NULL, WNOHANG) != mpv_pid) return;
+    
+    bool retry = mpv_spawned_via_fd && !mpv_confirmed && !mpv_fd_ipc_unsupported;
+    mpv_pid = -1;
+    mpv_spawned_via_fd = false;
+    mpv_disconnect();
+    mpv_tx_len = 0;
+    
+    if (retry) {
+        mpv_fd_ipc_unsupported = true;
+        size_t replay_len = mpv_replay_len;
+        mpv_spawn();
+        mpv_queue(mpv_replay_buf, replay_len, false);
+        mpv_flush();
+    }
+    mpv_replay_len = 0;
+}
+
+// Keep the connection going; call every tick
+static void mpv_maintain(void) {
+    mpv_check_process();
+    if (mpv_ipc_fd < 0 && mpv_pid > 0) mpv_connect();
+    mpv_flush();
+}
+
+// How long poll() may sleep before mpv_maintain has a reconnect to try
+static int mpv_poll_timeout_ms(void) {
+    if (mpv_ipc_fd >= 0 || mpv_pid <= 0) return -1;
+    long long wait = mpv_retry_at_ms - monotonic_ms();
+    return wait > 0 ? (int)wait : 0;
+}
+
+static void mpv_start_if_needed(void) {
+    mpv_check_process();
+    if (mpv_ipc_fd >= 0) return;
+    
+    // Still starting up: commands wait in the send buffer
+    if (mpv_pid > 0) {
+        mpv_connect();
+        return;
+    }
+    
+    // An mpv left running by an earlier session
+    mpv_retry_at_ms = 0;
+    if (mpv_connect()) return;
+    
+    mpv_spawn();
+}
+
+static void mpv_quit(void) {
+    mpv_send_command("{\"command\":[\"quit\"]}");
+    
+    // Let mpv exit by itself: wait (briefly) for it to close the connection
+    long long deadline = monotonic_ms() + 500;
+    while (mpv_ipc_fd >= 0) {
+        mpv_flush();
+        long long left = deadline - monotonic_ms();
+        if (mpv_ipc_fd < 0 || left <= 0) break;
+        
+        struct pollfd pfd = { .fd = mpv_ipc_fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int)left) <= 0) break;
+        
+        char drain[4096];
+        ssize_t n = read(mpv_ipc_fd, drain, sizeof(drain));
+        if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) break;
+    }
+    
+    mpv_disconnect();
+    mpv_tx_len = 0;
+    
+    if (mpv_pid > 0) {
+        if (waitpid(mpv_pid, NULL, WNOHANG) != mpv_pid) {
+            kill(mpv_pid, SIGTERM);
+            waitpid(mpv_pid, NULL, WNOHANG);
+        }
+        mpv_pid = -1;
+    }
+    unlink(IPC_SOCKET);
+}
+
+// Reply to a command we sent: {"request_id":N,"error":"success","data":...}
+static void mpv_handle_reply(const JsonField *fields, int count) {
+    long request_id = json_field_long(json_find_field(fields, count, "request_id"), 0);
+    if (request_id > 0 && request_id == mpv_sync_request) {
+        mpv_synced = true;
+    }
+}
+
+// mpv started the song queued after the playing one
+static void playback_advance(AppState *st) {
+    int count = 0;
+    const Song *songs = playback_list(st, &count);
+    
+    // The list may have been edited since the song was queued
+    int idx = st->queued_index;
+    if (!songs || idx >= count ||
+        strcmp(songs[idx].video_id, st->queued_video_id) != 0) {
+        if (st->playing_from_playlist && songs) {
+            idx = playlist_find_song(&st->playlists[st->playing_playlist_idx], st->queued_video_id);
+        } else {
+            idx = songs ? find_song_by_video_id(songs, count, st->queued_video_id) : -1;
+        }
+    }
+    st->queued_index = -1;
+    if (idx < 0) return;
+    
+    st->playing_index = idx;
+    if (st->playing_from_playlist) {
+        st->playlist_song_selected = idx;
+    } else {
+        st->search_selected = idx;
+    }
+    
+    // Forget the finished song so the playing one is first again
+    mpv_trim_playlist();
+}
+
+// Returns MPV_TRACK_* bits for what changed
+static int mpv_handle_event(AppState *st, const JsonField *event, const JsonField *fields, int count) {
+    if (!json_field_equals(event, "property-change")) return 0;
+    
+    long id = json_field_long(json_find_field(fields, count, "id"), 0);
+    const JsonField *data = json_find_field(fields, count, "data");
+    if (!data) return 0;
+    
+    bool is_true = (data->value_len == 4 && memcmp(data->value, "true", 4) == 0);
+    
+    if (id == MPV_OBSERVE_PAUSE) {
+        st->paused = is_true;
+        return 0;
+    }
+    
+    // Anything else older than our last playlist change is stale
+    if (!mpv_synced || st->playing_index < 0) return 0;
+    
+    if (id == MPV_OBSERVE_PLAYLIST_POS) {
+        // The playing song is at position 0; a later one means mpv moved on
+        if (json_field_long(data, -1) > 0 && st->queued_index >= 0) {
+            playback_advance(st);
+            return MPV_TRACK_ADVANCED;
+        }
+    } else if (id == MPV_OBSERVE_IDLE && is_true) {
+        // Played to the end of everything queued (or the file failed)
+        mpv_synced = false;
+        st->queued_index = -1;
+        return MPV_TRACK_FINISHED;
+    }
+    
+    return 0;
+}
+
+// Parse one line from mpv and hand it to the matching handler
+static int mpv_dispatch_line(AppState *st, const char *line) {
+    JsonField fields[16];
+    int count = json_parse_fields(line, fields, 16);
+    if (count <= 0) return 0;
+    
+    const JsonField *event = json_find_field(fields, count, "event");
+    if (event) {
+        return mpv_handle_event(st, event, fields, count);
+    }
+    
+    if (json_find_field(fields, count, "request_id") || json_find_field(fields, count, "error")) {
+        mpv_handle_reply(fields, count);
+    }
+    return 0;
+}
+
+// Read everything mpv has sent and dispatch each complete line.
+// Returns the MPV_TRACK_* bits of everything that happened.
+static int mpv_process_events(AppState *st) {
+    if (mpv_ipc_fd < 0) return 0;
+    
+    int changes = 0;
+    
+    for (;;) {
+        if (mpv_rx_len == sizeof(mpv_rx_buf) - 1) {
+            // A single line larger than the buffer: drop it up to its newline
+            mpv_rx_len = 0;
+            mpv_rx_discarding = true;
+        }
+        
+        ssize_t n = read(mpv_ipc_fd, mpv_rx_buf + mpv_rx_len,
+                         sizeof(mpv_rx_buf) - 1 - mpv_rx_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                // Connection lost
+                mpv_disconnect();
+            }
+            break;
+        }
+        
+        // mpv is listening; nothing needs resending any more
+        if (!mpv_confirmed) {
+            mpv_confirmed = true;
+            mpv_replay_len = 0;
+        }
+        
+        size_t end = mpv_rx_len + (size_t)n;
+        size_t start = 0;
+        
+        for (size_t i = mpv_rx_len; i < end; i++) {
+            if (mpv_rx_buf[i] != '\n') continue;
+            
+            mpv_rx_buf[i] = '\0';
+            if (!mpv_rx_discarding) {
+                changes |= mpv_dispatch_line(st, mpv_rx_buf + start);
+            }
+            mpv_rx_discarding = false;
+            start = i + 1;
+        }
+        
+        // Keep the partial line for the next read
+        mpv_rx_len = end - start;
+        memmove(mpv_rx_buf, mpv_rx_buf + start, mpv_rx_len);
+    }
+    
+    return changes;
+}
+
+// ============================================================================
+// Search Cache
+// ============================================================================
+
+// Cache key for a query: lowercase, trimmed, runs of whitespace collapsed
+static void normalize_query(const char *query, char *out, size_t out_size) {
+    size_t j = 0;
+    bool pending_space = false;
+    
+    for (const char *p = query; *p && j + 1 < out_size; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (isspace(c)) {
+            pending_space = (j > 0);
+            continue;
+        }
+        if (pending_space && j + 2 < out_size) {
+            out[j++] = ' ';
+        }
+        pending_space = false;
+        out[j++] = (char)tolower(c);
+    }
+    out[j] = '\0';
+}
+
+static void search_cache_path(AppState *st, const char *key, char *out, size_t out_size) {
+    snprintf(out, out_size, "%s/%08x.json", st->search_cache_dir, hash_string(key));
+}
+
+// Load cached results for key into search_results. Returns the number of
+// results and sets *fetched_at, or -1 if there is no entry for key.
+static int load_search_cache(AppState *st, const char *key, time_t *fetched_at) {
+    char path[16384];
+    search_cache_path(st, key, path, sizeof(path));
+    
+    MappedFile mf;
+    if (!map_file(path, &mf)) return -1;
+    
+    JsonReader r;
+    json_reader_init(&r, mf.data, mf.size);
+    JsonField member;
+    
+    // The query is written first; it guards against hash collisions
+    // between different queries
+    bool match = false;
+    int count = 0;
+    *fetched_at = 0;
+    
+    if (json_enter(&r, '{')) {
+        while (json_next_member(&r, &member)) {
+            if (match && json_key_is(&member, "results") && json_enter(&r, '[')) {
+                while (json_next_element(&r)) {
+                    JsonField fields[8];
+                    int n = json_read_object(&r, fields, 8);
+                    if (n <= 0 || count >= MAX_RESULTS) continue;
+                    
+                    Song *song = &st->search_results[count];
+                    char video_id[64];
+                    if (!json_field_copy(json_find_field(fields, n, "video_id"),
+                                         video_id, sizeof(video_id)) ||
+                        !song_set_video_id(song, video_id)) {
+                        continue;
+                    }
+                    song->title = json_field_string(json_find_field(fields, n, "title"),
+                                                    &st->search_strings);
+                    song->duration = (int)json_field_long(json_find_field(fields, n, "duration"), 0);
+                    if (song->title) count++;
+                }
+                continue;
+            }
+            
+            if (!json_read_value(&r, &member)) break;
+            if (json_key_is(&member, "query")) {
+                char *query = json_field_dup(&member);
+                match = query && strcmp(query, key) == 0;
+                free(query);
+                if (!match) break;
+            } else if (json_key_is(&member, "fetched")) {
+                *fetched_at = (time_t)json_field_long(&member, 0);
+            }
+        }
+    }
+    
+    unmap_file(&mf);
+    if (!match) return -1;
+    
+    st->search_count = count;
+    st->search_version++;
+    
+    // Mark the entry as recently used for LRU eviction
+    utime(path, NULL);
+    
+    return count;
+}
+
+typedef struct {
+    struct timespec mtime;
+    char name[64];
+} CacheEntry;
+
+static int compare_cache_entries(const void *a, const void *b) {
+    const CacheEntry *ea = a, *eb = b;
+    if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+        return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+    if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+        return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Delete the least recently used entries beyond SEARCH_CACHE_MAX_ENTRIES
+static void evict_search_cache(AppState *st) {
+    DIR *dir = opendir(st->search_cache_dir);
+    if (!dir) return;
+    
+    CacheEntry *entries = NULL;
+    int count = 0, cap = 0;
+    
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len < 6 || len >= sizeof(entries->name) ||
+            strcmp(ent->d_name + len - 5, ".json") != 0) continue;
+        
+        char path[16384];
+        snprintf(path, sizeof(path), "%s/%s", st->search_cache_dir, ent->d_name);
+        
+        struct stat sb;
+        if (stat(path, &sb) != 0) continue;
+        
+        if (count >= cap) {
+            int new_cap = cap ? cap * 2 : 256;
+            CacheEntry *grown = realloc(entries, new_cap * sizeof(CacheEntry));
+            if (!grown) break;
+            entries = grown;
+            cap = new_cap;
+        }
+        entries[count].mtime = sb.st_mtim;
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s", ent->d_name);
+        count++;
+    }
+    closedir(dir);
+    
+    if (count > SEARCH_CACHE_MAX_ENTRIES) {
+        qsort(entries, count, sizeof(CacheEntry), compare_cache_entries);
+        for (int i = 0; i < count - SEARCH_CACHE_MAX_ENTRIES; i++) {
+            char path[16384];
+            snprintf(path, sizeof(path), "%s/%s", st->search_cache_dir, entries[i].name);
+            unlink(path);
+        }
+    }
+    
+    free(entries);
+}
+
+// Store results under key (write to temp file, then rename)
+static void save_search_cache(AppState *st, const char *key, const Song *songs, int count) {
+    if (st->config.search_cache_ttl <= 0 || !key[0] || count == 0) return;
+    
+    char path[16384], tmp_path[16384 + 8];
+    search_cache_path(st, key, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) return;
+    
+    fprintf(f, "{\n  \"query\": \"");
+    json_write_escaped(f, key);
+    fprintf(f, "\",\n  \"fetched\": %ld,\n  \"results\": [\n", (long)time(NULL));
+    
+    for (int i = 0; i < count; i++) {
+        const Song *song = &songs[i];
+        fprintf(f, "    {\"title\": \"");
+        json_write_escaped(f, song->title);
+        fprintf(f, "\", \"video_id\": \"");
+        json_write_escaped(f, song->video_id);
+        fprintf(f, "\", \"duration\": %d}%s\n", song->duration,
+                i + 1 < count ? "," : "");
+    }
+    
+    fprintf(f, "  ]\n}\n");
+    
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return;
+    }
+    
+    evict_search_cache(st);
+}
+
+// ============================================================================
+// Search Functions
+// ============================================================================
+
+static void free_search_results(AppState *st) {
+    arena_reset(&st->search_strings);
+    memset(st->search_results, 0, st->search_count * sizeof(Song));
+    memset(st->search_where, 0, sizeof(st->search_where));
+    memset(st->search_from, 0, sizeof(st->search_from));
+    st->search_local = false;
+    st->search_count = 0;
+    st->search_selected = 0;
+    st->search_scroll = 0;
+    st->search_version++;
+}
+
+static void *search_thread_func(void *arg) {
+    SearchJob *job = arg;
+    
+    PERF_BEGIN(perf_start);
+    FILE *fp = ytdlp_spawn(job->cmd, &job->proc);
+    if (!fp) {
+        pthread_mutex_lock(&job->mutex);
+        job->failed = true;
+        job->done = true;
+        pthread_mutex_unlock(&job->mutex);
+        notify_ui();
+        return NULL;
+    }
+    
+    char *line = NULL;
+    size_t cap = 0;
+    int count = 0;
+    
+    while (count < MAX_RESULTS && getline(&line, &cap, fp) != -1) {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        
+        if (!line[0]) continue;
+        if (strncmp(line, "ERROR", 5) == 0) continue;
+        if (strncmp(line, "WARNING", 7) == 0) continue;
+        
+        // Split "title|||id|||duration" from the right, so titles may contain "|||"
+        char *id_sep = NULL, *dur_sep = NULL;
+        for (char *p = strstr(line, "|||"); p; p = strstr(p + 3, "|||")) {
+            id_sep = dur_sep;
+            dur_sep = p;
+        }
+        if (!id_sep) continue;
+        *id_sep = '\0';
+        *dur_sep = '\0';
+        
+        const char *title = line;
+        const char *video_id = id_sep + 3;
+        if (!video_id[0]) continue;
+        
+        Song song = { .duration = atoi(dur_sep + 3) };
+        if (strlen(video_id) < 5 || !song_set_video_id(&song, video_id)) continue;
+        
+        pthread_mutex_lock(&job->mutex);
+        song.title = arena_strdup(&job->strings, title);
+        if (song.title) {
+            job->pending[job->pending_count++] = song;
+            job->fetched++;
+        }
+        pthread_mutex_unlock(&job->mutex);
+        notify_ui();
+        count++;
+    }
+    
+    free(line);
+    
+    // Stop yt-dlp early if we already have every result we asked for; it
+    // then exits nonzero, which is fine
+    if (count >= MAX_RESULTS) ytdlp_cancel(&job->proc);
+    int exit_status = ytdlp_finish(fp, &job->proc);
+    PERF_END(PERF_SEARCH, perf_start);
+    
+    pthread_mutex_lock(&job->mutex);
+    job->failed = count < MAX_RESULTS && exit_status != 0;
+    job->done = true;
+    pthread_mutex_unlock(&job->mutex);
+    notify_ui();
+    return NULL;
+}
+
+// Kill the search in flight (if any) and drop results it has not delivered
+static void cancel_search(AppState *st) {
+    SearchJob *job = &st->search;
+    if (!job->running) return;
+    
+    ytdlp_cancel(&job->proc);
+    pthread_join(job->thread, NULL);
+    ytdlp_process_destroy(&job->proc);
+    job->running = false;
+    
+    job->pending_count = 0;
+    arena_reset(&job->strings);
+}
+
+// Start a search, replacing the current results. A fresh cache entry is
+// shown without touching the network; a stale one is shown immediately and
+// refreshed in the background. Writes a status message to status.
+// Returns false if the query is empty or the search could not be started.
+static bool start_search(AppState *st, const char *raw_query, char *status, size_t status_size) {
+    cancel_search(st);
+    free_search_results(st);
+    
+    char query_buf[256];
+    strncpy(query_buf, raw_query, sizeof(query_buf) - 1);
+    query_buf[sizeof(query_buf) - 1] = '\0';
+    char *query = trim_whitespace(query_buf);
+    
+    if (!query[0]) return false;
+    
+    // Escape for shell
+    char escaped_query[512];
+    size_t j = 0;
+    for (size_t i = 0; query[i] && j < sizeof(escaped_query) - 5; i++) {
+        char c = query[i];
+        if (c == '"' || c == '\\' || c == '$' || c == '`') {
+            escaped_query[j++] = '\\';
+        }
+        escaped_query[j++] = c;
+    }
+    escaped_query[j] = '\0';
+    
+    SearchJob *job = &st->search;
+    snprintf(job->cmd, sizeof(job->cmd),
+             "yt-dlp --flat-playlist --quiet --no-warnings "
+             "--print '%%(title)s|||%%(id)s|||%%(duration)s' "
+             "\"ytsearch%d:%s\" 2>/dev/null",
+             MAX_RESULTS, escaped_query);
+    job->done = false;
+    job->failed = false;
+    job->refresh = false;
+    job->pending_count = 0;
+    arena_reset(&job->strings);
+    job->fetched = 0;
+    
+    snprintf(st->query, sizeof(st->query), "%s", query);
+    normalize_query(query, job->key, sizeof(job->key));
+    
+    if (st->config.search_cache_ttl > 0) {
+        time_t fetched_at;
+        int cached = load_search_cache(st, job->key, &fetched_at);
+        if (cached > 0) {
+            snprintf(status, status_size, "Found %d results for: %s (cached)", cached, st->query);
+            
+            time_t age = time(NULL) - fetched_at;
+            if (age >= 0 && age < (time_t)st->config.search_cache_ttl * 60) {
+                return true;
+            }
+            job->refresh = true;
+        }
+    }
+    
+    ytdlp_process_init(&job->proc);
+    
+    if (pthread_create(&job->thread, NULL, search_thread_func, job) != 0) {
+        ytdlp_process_destroy(&job->proc);
+        if (job->refresh) return true;  // the stale results are still usable
+        snprintf(status, status_size, "Search error!");
+        return false;
+    }
+    job->running = true;
+    
+    if (!job->refresh) {
+        snprintf(status, status_size, "Searching: %s ...", st->query);
+    }
+    return true;
+}
+
+// Search the playlists instead of YouTube and show one result per video,
+// with the names of the playlists holding it. With nothing saved in any
+// playlist the search goes to YouTube. Writes a status message to status.
+// Returns false if the query is empty or no search could be started.
+static bool start_local_search(AppState *st, const char *raw_query,
+                               char *status, size_t status_size) {
+    cancel_search(st);
+    free_search_results(st);
+    
+    char query_buf[256];
+    snprintf(query_buf, sizeof(query_buf), "%s", raw_query);
+    char *query = trim_whitespace(query_buf);
+    if (!query[0]) return false;
+    
+    SongIndex *ix = &st->song_index;
+    if (!ix->built) song_index_build(st);
+    if (ix->live == 0) return start_search(st, query, status, status_size);
+    
+    snprintf(st->query, sizeof(st->query), "%s", query);
+    st->search_local = true;
+    st->search_version++;
+    
+    int matches = song_index_search(ix, query);
+    
+    // Playlist names per result, joined once all matches are seen
+    char where[MAX_RESULTS][256];
+    int shown = 0;
+    bool more = false;
+    for (int m = 0; m < matches; m++) {
+        const IndexedSong *e = &ix->songs[ix->matches[m]];
+        const char *name = st->playlists[e->playlist].name;
+        
+        int r = find_song_by_video_id(st->search_results, shown, e->video_id);
+        if (r >= 0) {
+            size_t len = strlen(where[r]);
+            snprintf(where[r] + len, sizeof(where[r]) - len, ", %s", name);
+            continue;
+        }
+        if (shown >= MAX_RESULTS) {
+            more = true;
+            continue;
+        }
+        
+        Song *dst = &st->search_results[shown];
+        memcpy(dst->video_id, e->video_id, sizeof(dst->video_id));
+        dst->title = arena_strdup(&st->search_strings, e->title);
+        dst->duration = e->duration;
+        st->search_from[shown] = arena_strdup(&st->search_strings, name);
+        if (!dst->title || !st->search_from[shown]) break;
+        snprintf(where[shown], sizeof(where[shown]), "%s", name);
+        shown++;
+    }
+    st->search_count = shown;
+    for (int r = 0; r < shown; r++) {
+        st->search_where[r] = arena_strdup(&st->search_strings, where[r]);
+    }
+    
+    if (shown == 0) {
+        snprintf(status, status_size, "Not in your playlists: %s (o: search YouTube)", st->query);
+    } else {
+        snprintf(status, status_size, "Found %d%s songs in your playlists for: %s (o: search YouTube)",
+                 shown, more ? "+" : "", st->query);
+    }
+    return true;
+}
+
+// Replace the shown results with a completed background refresh, keeping
+// the playing and selected songs by video_id. If the playing song is no
+// longer in the results, the stale list stays up so playback is undisturbed.
+static void apply_search_refresh(AppState *st) {
+    SearchJob *job = &st->search;
+    
+    bool tracking = !st->playing_from_playlist && st->playing_index >= 0 &&
+                    st->playing_index < st->search_count;
+    int playing = -1;
+    if (tracking) {
+        playing = find_song_by_video_id(job->pending, job->pending_count,
+                                        st->search_results[st->playing_index].video_id);
+    }
+    
+    if (!tracking || playing >= 0) {
+        int selected = -1;
+        if (st->search_selected < st->search_count) {
+            selected = find_song_by_video_id(job->pending, job->pending_count,
+                                             st->search_results[st->search_selected].video_id);
+        }
+        
+        free_search_results(st);
+        memcpy(st->search_results, job->pending, job->pending_count * sizeof(Song));
+        st->search_count = job->pending_count;
+        st->search_selected = selected >= 0 ? selected : 0;
+        if (tracking) st->playing_index = playing;
+        st->search_version++;
+        
+        // The titles move with the songs; the old ones get reused by the job
+        StringArena old = st->search_strings;
+        st->search_strings = job->strings;
+        job->strings = old;
+    }
+    job->pending_count = 0;
+    arena_reset(&job->strings);
+}
+
+// Append newly parsed results; call from the UI thread on every tick.
+// Updates status while the search runs and when it finishes.
+static void poll_search(AppState *st, char *status, size_t status_size) {
+    SearchJob *job = &st->search;
+    if (!job->running) return;
+    
+    pthread_mutex_lock(&job->mutex);
+    bool done = job->done;
+    bool failed = job->failed;
+    bool got_new = false;
+    
+    // A refresh keeps its results in pending until the whole list is in
+    if (!job->refresh) {
+        for (int i = 0; i < job->pending_count && st->search_count < MAX_RESULTS; i++) {
+            Song *dst = &st->search_results[st->search_count];
+            *dst = job->pending[i];
+            dst->title = arena_strdup(&st->search_strings, job->pending[i].title);
+            if (dst->title) st->search_count++;
+        }
+        got_new = job->pending_count > 0;
+        job->pending_count = 0;
+        arena_reset(&job->strings);
+        if (got_new) st->search_version++;
+    }
+    pthread_mutex_unlock(&job->mutex);
+    
+    if (!done) {
+        if (got_new) {
+            snprintf(status, status_size, "Searching: %s ... %d results",
+                     st->query, st->search_count);
+        }
+        return;
+    }
+    
+    // Don't free results while the add-to-playlist view points into them
+    if (job->refresh && st->song_to_add >= st->search_results &&
+        st->song_to_add < st->search_results + MAX_RESULTS) {
+        return;
+    }
+    
+    pthread_join(job->thread, NULL);
+    ytdlp_process_destroy(&job->proc);
+    job->running = false;
+    
+    if (job->refresh) {
+        // Quiet refresh: a failed or empty result (e.g. offline) keeps the
+        // cached list
+        if (!failed && job->pending_count > 0) {
+            save_search_cache(st, job->key, job->pending, job->pending_count);
+            apply_search_refresh(st);
+        }
+        return;
+    }
+    
+    if (!failed) {
+        save_search_cache(st, job->key, st->search_results, st->search_count);
+    }
+    
+    if (failed && st->search_count > 0) {
+        snprintf(status, status_size, "Search error after %d results for: %s",
+                 st->search_count, st->query);
+    } else if (failed) {
+        snprintf(status, status_size, "Search error!");
+    } else if (st->search_count == 0) {
+        snprintf(status, status_size, "No results for: %s", st->query);
+    } else {
+        snprintf(status, status_size, "Found %d results for: %s", st->search_count, st->query);
+    }
+}
+
+// ============================================================================
+// Stream URL Resolver
+// ============================================================================
+
+// Video ids end up in a shell command; only accept what YouTube uses
+static bool is_safe_video_id(const char *id) {
+    if (!id || !id[0] || strlen(id) >= 32) return false;
+    for (const char *p = id; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '-' && *p != '_') return false;
+    }
+    return true;
+}
+
+// Cache slot for video_id that is still valid, or NULL. Caller holds the mutex.
+static ResolvedUrl *resolver_find(StreamResolver *r, const char *video_id, time_t now) {
+    for (int i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+        ResolvedUrl *e = &r->cache[i];
+        if (e->expires > now && strcmp(e->video_id, video_id) == 0) return e;
+    }
+    return NULL;
+}
+
+// Record a result, reusing the slot of the same video, an expired slot or
+// the one that expires first. Caller holds the mutex.
+static void resolver_store(StreamResolver *r, const char *video_id, char *url, time_t expires) {
+    ResolvedUrl *slot = NULL;
+    for (int i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+        ResolvedUrl *e = &r->cache[i];
+        if (strcmp(e->video_id, video_id) == 0) {
+            slot = e;
+            break;
+        }
+        if (!slot || e->expires < slot->expires) slot = e;
+    }
+    
+    free(slot->url);
+    strncpy(slot->video_id, video_id, sizeof(slot->video_id) - 1);
+    slot->video_id[sizeof(slot->video_id) - 1] = '\0';
+    slot->url = url;
+    slot->expires = expires;
+}
+
+// When a googlevideo URL stops working, from its expire= parameter
+static time_t stream_url_expiry(const char *url, time_t now) {
+    const char *p = strstr(url, "expire=");
+    if (!p) p = strstr(url, "/expire/");
+    if (p) {
+        p += (*p == 'e') ? 7 : 8;
+        long long t = strtoll(p, NULL, 10);
+        if (t > now) return (time_t)t;
+    }
+    return now + RESOLVE_DEFAULT_TTL + RESOLVE_EXPIRY_MARGIN;
+}
+
+// Run yt-dlp -g for one video. Returns the URL (malloc'd) or NULL.
+static char *resolve_stream_url(StreamResolver *r, const char *video_id) {
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "yt-dlp -g -f bestaudio --no-playlist --no-warnings "
+             "'https://www.youtube.com/watch?v=%s' 2>/dev/null", video_id);
+    
+    FILE *fp = ytdlp_spawn(cmd, &r->proc);
+    if (!fp) return NULL;
+    
+    char *line = NULL;
+    size_t cap = 0;
+    char *url = NULL;
+    if (getline(&line, &cap, fp) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "http", 4) == 0) {
+            url = line;
+            line = NULL;
+        }
+    }
+    free(line);
+    
+    if (ytdlp_finish(fp, &r->proc) != 0) {
+        free(url);
+        url = NULL;
+    }
+    return url;
+}
+
+static void *resolver_thread_func(void *arg) {
+    StreamResolver *r = arg;
+    
+    pthread_mutex_lock(&r->mutex);
+    while (!r->should_stop) {
+        // Most likely to be played first
+        time_t now = time(NULL);
+        char video_id[32] = "";
+        for (int i = 0; i < r->wanted_count; i++) {
+            if (!resolver_find(r, r->wanted[i], now)) {
+                strcpy(video_id, r->wanted[i]);
+                break;
+            }
+        }
+        
+        if (!video_id[0]) {
+            pthread_cond_wait(&r->cond, &r->mutex);
+            continue;
+        }
+        
+        pthread_mutex_unlock(&r->mutex);
+        char *url = resolve_stream_url(r, video_id);
+        pthread_mutex_lock(&r->mutex);
+        
+        now = time(NULL);
+        if (url) {
+            resolver_store(r, video_id, url, stream_url_expiry(url, now) - RESOLVE_EXPIRY_MARGIN);
+        } else if (!r->should_stop) {
+            // Remember the failure so the same video is not retried in a loop
+            resolver_store(r, video_id, NULL, now + RESOLVE_RETRY_SECONDS);
+        }
+    }
+    pthread_mutex_unlock(&r->mutex);
+    
+    return NULL;
+}
+
+static void start_stream_resolver(StreamResolver *r) {
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    ytdlp_process_init(&r->proc);
+    r->should_stop = false;
+    r->started = (pthread_create(&r->thread, NULL, resolver_thread_func, r) == 0);
+}
+
+static void stop_stream_resolver(StreamResolver *r) {
+    pthread_mutex_lock(&r->mutex);
+    r->should_stop = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    
+    // Don't wait for a slow yt-dlp to finish
+    ytdlp_cancel(&r->proc);
+    if (r->started) {
+        pthread_join(r->thread, NULL);
+        r->started = false;
+    }
+    
+    for (int i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+        free(r->cache[i].url);
+        r->cache[i].url = NULL;
+    }
+    ytdlp_process_destroy(&r->proc);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+}
+
+// Copy the resolved stream URL for video_id into out. Returns false if it
+// is not resolved (yet), so the caller falls back to the watch URL.
+static bool resolver_lookup(StreamResolver *r, const char *video_id, char *out, size_t out_size) {
+    if (!r->started || !video_id) return false;
+    
+    bool found = false;
+    pthread_mutex_lock(&r->mutex);
+    ResolvedUrl *e = resolver_find(r, video_id, time(NULL));
+    if (e && e->url && strlen(e->url) < out_size) {
+        strcpy(out, e->url);
+        found = true;
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return found;
+}
+
+static void add_wanted_song(char wanted[][32], int *count, const Song *song) {
+    if (*count >= RESOLVE_WANTED_MAX || !is_safe_video_id(song->video_id)) return;
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(wanted[i], song->video_id) == 0) return;
+    }
+    strcpy(wanted[(*count)++], song->video_id);
+}
+
+// Collect the songs around the selection in the shown list, plus the one
+// after the playing song
+static int collect_wanted_songs(AppState *st, char wanted[][32]) {
+    int count = 0;
+    const Song *songs = NULL;
+    int song_count = 0;
+    int selected = 0;
+    Playlist *pl = NULL;
+    
+    if (st->view == VIEW_SEARCH) {
+        songs = st->search_results;
+        song_count = st->search_count;
+        selected = st->search_selected;
+    } else if (st->view == VIEW_PLAYLIST_SONGS && st->current_playlist_idx >= 0 &&
+               st->current_playlist_idx < st->playlist_count) {
+        pl = &st->playlists[st->current_playlist_idx];
+        songs = pl->items;
+        song_count = pl->count;
+        selected = st->playlist_song_selected;
+    }
+    
+    // Selection first, then outwards
+    for (int d = 0; songs && d <= RESOLVE_AHEAD; d++) {
+        for (int sign = 1; sign >= -1; sign -= 2) {
+            int idx = selected + d * sign;
+            if (idx < 0 || idx >= song_count) continue;
+            // Downloaded songs play from disk
+            if (pl && !pl->is_youtube_playlist &&
+                file_exists_for_video(st, pl->name, songs[idx].video_id)) continue;
+            add_wanted_song(wanted, &count, &songs[idx]);
+            if (d == 0) break;
+        }
+    }
+    
+    int play_count = 0;
+    const Song *playing = playback_list(st, &play_count);
+    if (playing && st->playing_index + 1 < play_count) {
+        add_wanted_song(wanted, &count, &playing[st->playing_index + 1]);
+    }
+    
+    return count;
+}
+
+// Point the resolver at what the user is looking at; call every tick
+static void update_stream_resolver(AppState *st) {
+    StreamResolver *r = &st->resolver;
+    if (!r->started) return;
+    
+    char wanted[RESOLVE_WANTED_MAX][32];
+    int count = collect_wanted_songs(st, wanted);
+    
+    pthread_mutex_lock(&r->mutex);
+    bool changed = (count != r->wanted_count);
+    for (int i = 0; i < count && !changed; i++) {
+        changed = (strcmp(wanted[i], r->wanted[i]) != 0);
+    }
+    if (changed) {
+        memcpy(r->wanted, wanted, (size_t)count * sizeof(wanted[0]));
+        r->wanted_count = count;
+        pthread_cond_signal(&r->cond);
+    }
+    pthread_mutex_unlock(&r->mutex);
+}
+
+// ============================================================================
+// Playback Functions
+// ============================================================================
+
+// The list playback walks through, or NULL when nothing is playing
+static const Song *playback_list(AppState *st, int *count) {
+    *count = 0;
+    if (st->playing_index < 0) return NULL;
+    
+    if (!st->playing_from_playlist) {
+        *count = st->search_count;
+        return st->search_results;
+    }
+    if (st->playing_playlist_idx < 0 || st->playing_playlist_idx >= st->playlist_count) {
+        return NULL;
+    }
+    Playlist *pl = &st->playlists[st->playing_playlist_idx];
+    *count = pl->count;
+    return pl->items;
+}
+
+// What mpv should stream for song: the pre-resolved audio URL if there is
+// one, otherwise the watch URL for mpv's own yt-dlp hook
+static const char *song_stream_location(AppState *st, const Song *song,
+                                        char *buf, size_t buf_size) {
+    if (!resolver_lookup(&st->resolver, song->video_id, buf, buf_size)) {
+        youtube_watch_url(song->video_id, buf, buf_size);
+    }
+    return buf;
+}
+
+// What mpv should open for a playlist song: the downloaded file if there
+// is one, otherwise a stream
+static const char *playlist_song_location(AppState *st, Playlist *pl, int song_idx,
+                                          char *buf, size_t buf_size) {
+    // YouTube playlists always stream
+    if (!pl->is_youtube_playlist &&
+        get_local_file_path_for_song(st, pl->name, pl->items[song_idx].video_id,
+                                     buf, buf_size)) {
+        return buf;
+    }
+    return song_stream_location(st, &pl->items[song_idx], buf, buf_size);
+}
+
+// What mpv should open for a search result: a local hit plays the file
+// downloaded for its playlist, if there is one
+static const char *search_result_location(AppState *st, int idx, char *buf, size_t buf_size) {
+    const char *video_id = st->search_results[idx].video_id;
+    if (st->search_from[idx] &&
+        get_local_file_path_for_song(st, st->search_from[idx], video_id, buf, buf_size)) {
+        return buf;
+    }
+    return song_stream_location(st, &st->search_results[idx], buf, buf_size);
+}
+
+static void play_search_result(AppState *st, int idx) {
+    if (idx < 0 || idx >= st->search_count) return;
+    if (!st->search_results[idx].video_id[0]) return;
+    
+    mpv_start_if_needed();
+    
+    char location[4096];
+    mpv_load_url(search_result_location(st, idx, location, sizeof(location)));
+    
+    st->playing_index = idx;
+    st->playing_from_playlist = false;
+    st->playing_playlist_idx = -1;
+    st->paused = false;
+    st->queued_index = -1;
+}
+
+static void play_playlist_song(AppState *st, int playlist_idx, int song_idx) {
+    if (playlist_idx < 0 || playlist_idx >= st->playlist_count) return;
+
+    Playlist *pl = &st->playlists[playlist_idx];
+    if (song_idx < 0 || song_idx >= pl->count) return;
+    if (!pl->items[song_idx].video_id[0]) return;
+
+    mpv_start_if_needed();
+
+    char location[4096];
+    mpv_load_url(playlist_song_location(st, pl, song_idx, location, sizeof(location)));
+
+    st->playing_index = song_idx;
+    st->playing_from_playlist = true;
+    st->playing_playlist_idx = playlist_idx;
+    st->paused = false;
+    st->queued_index = -1;
+}
+
+// Keep the song after the playing one appended to mpv's playlist, so mpv
+// resolves and buffers it while the current one plays. Call every tick;
+// it also notices when edits to the list changed which song comes next.
+static void queue_next_song(AppState *st) {
+    int count = 0;
+    const Song *songs = playback_list(st, &count);
+    if (!songs || mpv_ipc_fd < 0) {
+        st->queued_index = -1;
+        return;
+    }
+    
+    int next = st->playing_index + 1;
+    
+    if (st->queued_index >= 0) {
+        if (st->queued_index == next && next < count &&
+            strcmp(songs[next].video_id, st->queued_video_id) == 0) {
+            return;
+        }
+        // Something else comes next now; take the stale entry back out
+        mpv_trim_playlist();
+        st->queued_index = -1;
+    }
+    
+    if (next >= count || !songs[next].video_id[0]) return;
+    
+    char buf[4096];
+    const char *location;
+    if (st->playing_from_playlist) {
+        location = playlist_song_location(st, &st->playlists[st->playing_playlist_idx],
+                                          next, buf, sizeof(buf));
+    } else {
+        location = search_result_location(st, next, buf, sizeof(buf));
+    }
+    mpv_loadfile(location, "append");
+    
+    st->queued_index = next;
+    strncpy(st->queued_video_id, songs[next].video_id, sizeof(st->queued_video_id) - 1);
+    st->queued_video_id[sizeof(st->queued_video_id) - 1] = '\0';
+}
+
+static void play_next(AppState *st) {
+    // Already queued and probably buffered: let mpv switch to it
+    if (st->queued_index >= 0 && st->queued_index == st->playing_index + 1 && mpv_synced) {
+        mpv_send_command("{\"command\":[\"playlist-next\",\"force\"]}");
+        mpv_send_command("{\"command\":[\"set_property\",\"pause\",false]}");
+        return;
+    }
+    
+    if (st->playing_from_playlist && st->playing_playlist_idx >= 0) {
+        Playlist *pl = &st->playlists[st->playing_playlist_idx];
+        int next = st->playing_index + 1;
+        if (next < pl->count) {
+            play_playlist_song(st, st->playing_playlist_idx, next);
+            st->playlist_song_selected = next;
+        }
+    } else if (st->search_count > 0) {
+        int next = st->playing_index + 1;
+        if (next < st->search_count) {
+            play_search_result(st, next);
+            st->search_selected = next;
+        }
+    }
+}
+
+static void play_prev(AppState *st) {
+    if (st->playing_from_playlist && st->playing_playlist_idx >= 0) {
+        int prev = st->playing_index - 1;
+        if (prev >= 0) {
+            play_playlist_song(st, st->playing_playlist_idx, prev);
+            st->playlist_song_selected = prev;
+        }
+    } else if (st->search_count > 0) {
+        int prev = st->playing_index - 1;
+        if (prev >= 0) {
+            play_search_result(st, prev);
+            st->search_selected = prev;
+        }
+    }
+}
+
+// ============================================================================
+// Settings
+// ============================================================================
+
+static const char *setting_label(SettingId id) {
+    switch (id) {
+        case SETTING_DOWNLOAD_PATH:    return "Download Path";
+        case SETTING_DOWNLOAD_WORKERS: return "Parallel Downloads";
+        case SETTING_SEARCH_CACHE_TTL: return "Search Cache TTL (minutes, 0 = off)";
+        case SETTING_AUDIO_FORMAT:     return "Audio Format (mp3, m4a, opus, best)";
+        case SETTING_AUDIO_BITRATE:    return "Re-encode Bitrate (kbps, 0 = yt-dlp default)";
+        case SETTING_CONCURRENT_FRAGMENTS: return "Fragments per Download (1-16)";
+        case SETTING_RATE_LIMIT:       return "Download Rate Limit (e.g. 500K, 2M; empty = none)";
+        default:                       return "";
+    }
+}
+
+static void setting_get_value(AppState *st, SettingId id, char *out, size_t out_size) {
+    switch (id) {
+        case SETTING_DOWNLOAD_PATH:
+            snprintf(out, out_size, "%s", st->config.download_path);
+            break;
+        case SETTING_DOWNLOAD_WORKERS:
+            snprintf(out, out_size, "%d", st->config.download_workers);
+            break;
+        case SETTING_SEARCH_CACHE_TTL:
+            snprintf(out, out_size, "%d", st->config.search_cache_ttl);
+            break;
+        case SETTING_AUDIO_FORMAT:
+            snprintf(out, out_size, "%s", st->config.audio_format);
+            break;
+        case SETTING_AUDIO_BITRATE:
+            snprintf(out, out_size, "%d", st->config.audio_bitrate);
+            break;
+        case SETTING_CONCURRENT_FRAGMENTS:
+            snprintf(out, out_size, "%d", st->config.concurrent_fragments);
+            break;
+        case SETTING_RATE_LIMIT:
+            snprintf(out, out_size, "%s", st->config.rate_limit);
+            break;
+        default:
+            if (out_size > 0) out[0] = '\0';
+            break;
+    }
+}
+
+// Validate and apply an edited value, writing a status message to msg.
+// Settings the download workers use change under download_queue.mutex.
+static bool setting_set_value(AppState *st, SettingId id, const char *value,
+                              char *msg, size_t msg_size) {
+    switch (id) {
+        case SETTING_DOWNLOAD_PATH:
+            if (!value[0]) {
+                snprintf(msg, msg_size, "Download path cannot be empty");
+                return false;
+            }
+            pthread_mutex_lock(&st->download_queue.mutex);
+            strncpy(st->config.download_path, value, sizeof(st->config.download_path) - 1);
+            st->config.download_path[sizeof(st->config.download_path) - 1] = '\0';
+            pthread_mutex_unlock(&st->download_queue.mutex);
+            save_config(st);
+            build_local_file_index(st);
+            snprintf(msg, msg_size, "Download path saved");
+            return true;
+        
+        case SETTING_DOWNLOAD_WORKERS: {
+            char *end;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end || n < 1 || n > MAX_DOWNLOAD_WORKERS) {
+                snprintf(msg, msg_size, "Parallel downloads must be between 1 and %d",
+                         MAX_DOWNLOAD_WORKERS);
+                return false;
+            }
+            pthread_mutex_lock(&st->download_queue.mutex);
+            st->config.download_workers = (int)n;
+            pthread_mutex_unlock(&st->download_queue.mutex);
+            save_config(st);
+            resize_download_workers(st);
+            snprintf(msg, msg_size, "Parallel downloads set to %d", st->config.download_workers);
+            return true;
+        }
+        
+        case SETTING_SEARCH_CACHE_TTL: {
+            char *end;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end || n < 0 || n > 525600) {
+                snprintf(msg, msg_size, "Search cache TTL must be between 0 and 525600 minutes");
+                return false;
+            }
+            st->config.search_cache_ttl = (int)n;
+            save_config(st);
+            if (n == 0) {
+                snprintf(msg, msg_size, "Search cache disabled");
+            } else {
+                snprintf(msg, msg_size, "Search cache TTL set to %d minutes", st->config.search_cache_ttl);
+            }
+            return true;
+        }
+        
+        // Downloads already on disk are still found after a format change
+        case SETTING_AUDIO_FORMAT: {
+            char name[sizeof(st->config.audio_format)];
+            size_t i = 0;
+            for (; value[i] && i < sizeof(name) - 1; i++) name[i] = ascii_lower(value[i]);
+            name[i] = '\0';
+            
+            const AudioFormat *format = value[i] ? NULL : find_audio_format(name);
+            if (!format) {
+                snprintf(msg, msg_size, "Audio format must be mp3, m4a, opus or best");
+                return false;
+            }
+            pthread_mutex_lock(&st->download_queue.mutex);
+            memcpy(st->config.audio_format, name, sizeof(name));
+            pthread_mutex_unlock(&st->download_queue.mutex);
+            save_config(st);
+            snprintf(msg, msg_size, "Audio format set to %s (%s)", format->name, format->description);
+            return true;
+        }
+        
+        case SETTING_AUDIO_BITRATE: {
+            char *end;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end || n < 0 || n > 512) {
+                snprintf(msg, msg_size, "Bitrate must be between 0 and 512 kbps");
+                return false;
+            }
+            pthread_mutex_lock(&st->download_queue.mutex);
+            st->config.audio_bitrate = (int)n;
+            pthread_mutex_unlock(&st->download_queue.mutex);
+            save_config(st);
+            if (n == 0) {
+                snprintf(msg, msg_size, "Re-encoding uses yt-dlp's default quality");
+            } else {
+                snprintf(msg, msg_size, "Re-encoding at %d kbps", st->config.audio_bitrate);
+            }
+            return true;
+        }
+        
+        case SETTING_CONCURRENT_FRAGMENTS: {
+            char *end;
+            long n = strtol(value, &end, 10);
+            if (end == value || *end || n < 1 || n > MAX_CONCURRENT_FRAGMENTS) {
+                snprintf(msg, msg_size, "Fragments must be between 1 and %d",
+                         MAX_CONCURRENT_FRAGMENTS);
+                return false;
+            }
+            pthread_mutex_lock(&st->download_queue.mutex);
+            st->config.concurrent_fragments = (int)n;
+            pthread_mutex_unlock(&st->download_queue.mutex);
+            save_config(st);
+            snprintf(msg, msg_size, "Downloading %d fragments at a time",
+                     st->config.concurrent_fragments);
+            return true;
+        }
+        
+        case SETTING_RATE_LIMIT:
+            if (value[0] && !valid_rate_limit(value)) {
+                snprintf(msg, msg_size, "Rate limit must look like 500K or 2M");
+                return false;
+            }
+            pthread_mutex_lock(&st->download_queue.mutex);
+            snprintf(st->config.rate_limit, sizeof(st->config.rate_limit), "%s", value);
+            pthread_mutex_unlock(&st->download_queue.mutex);
+            save_config(st);
+            if (value[0]) {
+                snprintf(msg, msg_size, "Downloads limited to %s/s", st->config.rate_limit);
+            } else {
+                snprintf(msg, msg_size, "Download rate limit removed");
+            }
+            return true;
+        
+        default:
+            return false;
+    }
+}
+
+// ============================================================================
+// Song Filter
+// ============================================================================
+
+// Type-to-filter over the search results or the open playlist. The list
+// itself is left alone: the filter holds the indices of matching songs,
+// titles containing the pattern first, then titles containing its
+// characters in order, each group in list order. The real selection
+// (search_selected / playlist_song_selected) always follows the filter's.
+
+static bool filter_shown(const AppState *st) {
+    const SongFilter *f = &st->filter;
+    if (!f->active || st->view != f->view) return false;
+    if (f->view == VIEW_PLAYLIST_SONGS) {
+        return st->current_playlist_idx == f->playlist_idx &&
+               f->playlist_idx >= 0 && f->playlist_idx < st->playlist_count;
+    }
+    return true;
+}
+
+static const Song *filter_source(AppState *st, int *count, unsigned int *version) {
+    if (st->filter.view == VIEW_SEARCH) {
+        *count = st->search_count;
+        *version = st->search_version;
+        return st->search_results;
+    }
+    // Appends leave songs_version alone; filter_sync folds just the new songs
+    Playlist *pl = &st->playlists[st->filter.playlist_idx];
+    *count = pl->count;
+    *version = pl->songs_version;
+    return pl->items;
+}
+
+static int *filter_real_selected(AppState *st) {
+    return st->filter.view == VIEW_SEARCH ? &st->search_selected : &st->playlist_song_selected;
+}
+
+static void filter_clear(AppState *st) {
+    SongFilter *f = &st->filter;
+    free(f->folded);
+    free(f->title_start);
+    free(f->tier);
+    free(f->rows);
+    unsigned int version = f->version;
+    memset(f, 0, sizeof(*f));
+    f->version = version + 1;
+}
+
+// Lowercase songs[from..count) onto the end of folded
+static bool filter_fold_range(SongFilter *f, const Song *songs, int from, int count) {
+    size_t pos = from > 0 ? f->title_start[from] : 0;
+    size_t total = pos;
+    for (int i = from; i < count; i++) {
+        total += (songs[i].title ? strlen(songs[i].title) : 0) + 1;
+    }
+    
+    char *folded = realloc(f->folded, total ? total : 1);
+    size_t *title_start = realloc(f->title_start, (count + 1) * sizeof(size_t));
+    if (folded) f->folded = folded;
+    if (title_start) f->title_start = title_start;
+    unsigned char *tier = realloc(f->tier, count ? count : 1);
+    if (tier) f->tier = tier;
+    int *rows = realloc(f->rows, (count ? count : 1) * sizeof(int));
+    if (rows) f->rows = rows;
+    if (!folded || !title_start || !tier || !rows) return false;
+    
+    for (int i = from; i < count; i++) {
+        f->title_start[i] = pos;
+        f->tier[i] = 0;
+        for (const char *s = songs[i].title ? songs[i].title : ""; *s; s++) {
+            f->folded[pos++] = ascii_lower(*s);
+        }
+        f->folded[pos++] = '\0';
+    }
+    f->title_start[count] = pos;
+    f->source_count = count;
+    return true;
+}
+
+// Lowercase copies of all titles, back to back, for the matcher
+static bool filter_fold_titles(SongFilter *f, const Song *songs, int count) {
+    free(f->folded);
+    free(f->title_start);
+    free(f->tier);
+    free(f->rows);
+    f->folded = NULL;
+    f->title_start = NULL;
+    f->tier = NULL;
+    f->rows = NULL;
+    f->count = 0;
+    f->source_count = 0;
+    return filter_fold_range(f, songs, 0, count);
+}
+
+// True if the bytes of pattern appear in title in order
+static bool is_subsequence(const char *title, size_t len, const char *pattern) {
+    const char *p = title, *end = title + len;
+    for (; *pattern; pattern++) {
+        p = memchr(p, *pattern, (size_t)(end - p));
+        if (!p) return false;
+        p++;
+    }
+    return true;
+}
+
+// Match titles from index first on against the pattern and rebuild rows;
+// earlier titles keep their result. narrow: the pattern only grew, so
+// titles that did not match before cannot match now.
+static void filter_match_from(AppState *st, int first, bool narrow) {
+    SongFilter *f = &st->filter;
+    size_t plen = strlen(f->pattern);
+    int *real = filter_real_selected(st);
+    int keep = *real;
+    
+    for (int i = first; i < f->source_count; i++) {
+        if (narrow && !f->tier[i]) continue;
+        const char *title = f->folded + f->title_start[i];
+        size_t len = f->title_start[i + 1] - f->title_start[i] - 1;
+        if (memmem(title, len, f->pattern, plen)) {
+            f->tier[i] = 1;
+        } else {
+            f->tier[i] = is_subsequence(title, len, f->pattern) ? 2 : 0;
+        }
+    }
+    
+    f->count = 0;
+    for (unsigned char tier = 1; tier <= 2; tier++) {
+        for (int i = 0; i < f->source_count; i++) {
+            if (f->tier[i] == tier) f->rows[f->count++] = i;
+        }
+    }
+    
+    // Stay on the selected song if it still matches
+    f->selected = 0;
+    for (int r = 0; r < f->count; r++) {
+        if (f->rows[r] == keep) {
+            f->selected = r;
+            break;
+        }
+    }
+    if (f->count > 0) *real = f->rows[f->selected];
+    f->version++;
+}
+
+static void filter_match(AppState *st, bool narrow) {
+    filter_match_from(st, 0, narrow);
+}
+
+// Start filtering the list shown in the current view
+static void filter_start(AppState *st) {
+    filter_clear(st);
+    SongFilter *f = &st->filter;
+    f->view = st->view;
+    f->playlist_idx = st->view == VIEW_PLAYLIST_SONGS ? st->current_playlist_idx : -1;
+    
+    int count;
+    unsigned int version;
+    const Song *songs = filter_source(st, &count, &version);
+    if (!filter_fold_titles(f, songs, count)) {
+        filter_clear(st);
+        return;
+    }
+    f->source_version = version;
+    f->active = true;
+    f->editing = true;
+    filter_match(st, false);
+}
+
+// Catch up with changes to the list and to the real selection
+static void filter_sync(AppState *st) {
+    if (!filter_shown(st)) return;
+    
+    SongFilter *f = &st->filter;
+    int count;
+    unsigned int version;
+    const Song *songs = filter_source(st, &count, &version);
+    
+    // Songs only appended (adds, a running import): fold and match the new ones
+    if (version == f->source_version && count > f->source_count) {
+        int first = f->source_count;
+        if (!filter_fold_range(f, songs, first, count)) {
+            filter_clear(st);
+            return;
+        }
+        filter_match_from(st, first, false);
+        return;
+    }
+    
+    if (version != f->source_version || count != f->source_count) {
+        if (!filter_fold_titles(f, songs, count)) {
+            filter_clear(st);
+            return;
+        }
+        f->source_version = version;
+        filter_match(st, false);
+        return;
+    }
+    
+    // Playback moved the selection: follow it if the song is shown,
+    // otherwise point the selection back at the highlighted row
+    int *real = filter_real_selected(st);
+    if (f->count == 0 || f->rows[f->selected] == *real) return;
+    for (int r = 0; r < f->count; r++) {
+        if (f->rows[r] == *real) {
+            f->selected = r;
+            return;
+        }
+    }
+    *real = f->rows[f->selected];
+}
+
+// Move through the matching rows. letters: also take j/k/g, which are
+// text while typing the pattern. Returns false if ch is not a move.
+static bool filter_move(AppState *st, int ch, int list_height, bool letters) {
+    SongFilter *f = &st->filter;
+    int sel = f->selected;
+    
+    switch (ch) {
+        case KEY_UP:    sel--; break;
+        case KEY_DOWN:  sel++; break;
+        case KEY_PPAGE: sel -= list_height; break;
+        case KEY_NPAGE: sel += list_height; break;
+        case KEY_HOME:  sel = 0; break;
+        case KEY_END:   sel = f->count - 1; break;
+        default:
+            if (!letters) return false;
+            if (ch == 'k') sel--;
+            else if (ch == 'j') sel++;
+            else if (ch == 'g') sel = 0;
+            else return false;
+            break;
+    }
+    
+    if (sel >= f->count) sel = f->count - 1;
+    if (sel < 0) sel = 0;
+    f->selected = sel;
+    if (f->count > 0) *filter_real_selected(st) = f->rows[sel];
+    return true;
+}
+
+static void filter_status(AppState *st, char *status, size_t status_size) {
+    SongFilter *f = &st->filter;
+    if (f->editing) {
+        snprintf(status, status_size, "Filter: %s_  (%d of %d, Enter: keep, Esc: clear)",
+                 f->pattern, f->count, f->source_count);
+    } else {
+        snprintf(status, status_size, "Filter: %s  (%d of %d, F: edit, Esc: clear)",
+                 f->pattern, f->count, f->source_count);
+    }
+}
+
+// A key while the filter pattern is being typed
+static void filter_handle_key(AppState *st, int ch, int list_height,
+                              char *status, size_t status_size) {
+    SongFilter *f = &st->filter;
+    filter_sync(st);
+    if (!filter_shown(st)) {
+        filter_clear(st);
+        return;
+    }
+    
+    size_t len = strlen(f->pattern);
+    
+    switch (ch) {
+        case 27: // Escape
+            filter_clear(st);
+            snprintf(status, status_size, "Filter cleared");
+            return;
+        
+        case '\n':
+        case KEY_ENTER:
+            f->editing = false;
+            if (len == 0 || f->count == 0) {
+                filter_clear(st);
+                snprintf(status, status_size, len ? "No matches, filter cleared" : "Filter cleared");
+                return;
+            }
+            break;
+        
+        case KEY_BACKSPACE:
+        case 127:
+        case 8:
+            // Drop a whole UTF-8 character
+            while (len > 0 && ((unsigned char)f->pattern[len - 1] & 0xC0) == 0x80) len--;
+            if (len > 0) len--;
+            f->pattern[len] = '\0';
+            filter_match(st, false);
+            break;
+        
+        default:
+            if (filter_move(st, ch, list_height, false)) break;
+            if (ch >= 32 && ch < 256 && ch != 127 && len + 1 < sizeof(f->pattern)) {
+                f->pattern[len] = ascii_lower((char)ch);
+                f->pattern[len + 1] = '\0';
+                filter_match(st, true);
+            }
+            break;
+    }
+    
+    filter_status(st, status, status_size);
+}
+
+// ============================================================================
+// Screen Regions
+// ============================================================================
+
+// Create or resize the header/body/footer windows to the terminal size
+static void ui_layout(void) {
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    if (ui.header && rows == ui.rows && cols == ui.cols) return;
+    
+    if (ui.header) delwin(ui.header);
+    if (ui.body) delwin(ui.body);
+    if (ui.footer) delwin(ui.footer);
+    
+    int body_rows = rows - UI_HEADER_ROWS - UI_FOOTER_ROWS;
+    if (body_rows < 1) body_rows = 1;
+    
+    ui.header = newwin(UI_HEADER_ROWS, cols, 0, 0);
+    ui.body = newwin(body_rows, cols, UI_HEADER_ROWS, 0);
+    ui.footer = newwin(UI_FOOTER_ROWS, cols, UI_HEADER_ROWS + body_rows, 0);
+    ui.rows = rows;
+    ui.cols = cols;
+    ui.full_redraw = true;
+}
+
+// Repaint every region on the next draw_ui, e.g. after something drew
+// over them directly on stdscr
+static void ui_invalidate(void) {
+    ui.full_redraw = true;
+}
+
+static void ui_shutdown(void) {
+    if (ui.header) delwin(ui.header);
+    if (ui.body) delwin(ui.body);
+    if (ui.footer) delwin(ui.footer);
+    ui.header = ui.body = ui.footer = NULL;
+}
+
+// Rows available for list entries in the body
+static int ui_list_height(void) {
+    int h = ui.rows - UI_HEADER_ROWS - UI_FOOTER_ROWS - UI_LIST_TOP;
+    return h < 1 ? 1 : h;
+}
+
+// ============================================================================
+// UI Drawing
+// ============================================================================
+
+static void format_duration(int sec, char out[16]) {
+    if (sec <= 0) {
+        snprintf(out, 16, "--:--");
+        return;
+    }
+    int h = sec / 3600;
+    int m = (sec % 3600) / 60;
+    int s = sec % 60;
+    if (h > 0) {
+        snprintf(out, 16, "%d:%02d:%02d", h, m, s);
+    } else {
+        snprintf(out, 16, "%02d:%02d", m, s);
+    }
+}
+
+// Print s using at most max bytes, ending in "..." when it does not fit
+static void wprint_truncated(WINDOW *w, const char *s, int max) {
+    if (max <= 0) return;
+    
+    int len = (int)strlen(s);
+    if (len <= max) {
+        wprintw(w, "%s", s);
+    } else if (max > 3) {
+        wprintw(w, "%.*s...", max - 3, s);
+    } else {
+        wprintw(w, "%.*s", max, s);
+    }
+}
+
+// NEW: Updated draw_header to include VIEW_SETTINGS
+static void draw_header(WINDOW *w, int cols, ViewMode view) {
+    // Line 1: Title
+    wattron(w, A_BOLD);
+    mvwprintw(w, 0, 0, " ShellBeats v0.4 ");
+    wattroff(w, A_BOLD);
+
+    // Line 2-3: Shortcuts (two lines)
+    switch (view) {
+        case VIEW_SEARCH:
+            mvwprintw(w, 1, 0, "  /,s: search playlists | o: search YouTube | F: filter | Enter: play | Space: pause | n/p: next/prev");
+            mvwprintw(w, 2, 0, "  a: add to playlist | d: download | c: create playlist | f: playlists | w: downloads | S: settings | i: about | q: quit");
+            break;
+        case VIEW_PLAYLISTS:
+            mvwprintw(w, 1, 0, "  Enter: open | d: download all | c: create | p: add YouTube (again: cancel) | x: delete");
+            mvwprintw(w, 2, 0, "  Esc: back | i: about | q: quit");
+            break;
+        case VIEW_PLAYLIST_SONGS:
+            mvwprintw(w, 1, 0, "  Enter: play | F: filter | Space: pause | n: next | p: prev | x: stop");
+            mvwprintw(w, 2, 0, "  a: add song | d: download | r: remove | D: download all (YT) | Esc: back | i: about | q: quit");
+            break;
+        case VIEW_ADD_TO_PLAYLIST:
+            mvwprintw(w, 1, 0, "  Enter: add to playlist | c: create new playlist");
+            mvwprintw(w, 2, 0, "  Esc: cancel");
+            break;
+        case VIEW_SETTINGS:
+            mvwprintw(w, 1, 0, "  Enter: edit setting | j/k: select setting");
+            mvwprintw(w, 2, 0, "  Esc: back | i: about | q: quit");
+            break;
+        case VIEW_ABOUT:
+            mvwprintw(w, 1, 0, "  Press any key to close");
+            break;
+        case VIEW_DOWNLOADS:
+            mvwprintw(w, 1, 0, "  Live progress of the download workers and this session's throughput");
+            mvwprintw(w, 2, 0, "  w/Esc: back | Space: pause | n/p: next/prev | i: about | q: quit");
+            break;
+    }
+
+    mvwhline(w, 3, 0, ACS_HLINE, cols);
+}
+
+// NEW: Get spinner character for download animation
+static char get_spinner_char(int frame) {
+    const char spinner[] = {'|', '/', '-', '\\'};
+    return spinner[frame % 4];
+}
+
+// NEW: Format download status for the status bar, empty when idle
+static void format_download_status(AppState *st, char *out, size_t out_size) {
+    PERF_BEGIN(perf_start);
+    pthread_mutex_lock(&st->download_queue.mutex);
+    PERF_END(PERF_DOWNLOAD_LOCK, perf_start);
+    
+    int pending_count = st->download_queue.pending_count + st->download_queue.active_count +
+                        st->download_queue.retry_count;
+    int completed = st->download_queue.completed;
+    int failed = st->download_queue.failed;
+    
+    // One mark per worker: '#' downloading, '.' idle
+    char workers[MAX_DOWNLOAD_WORKERS + 1];
+    int nworkers = 0;
+    for (int i = 0; i < st->download_queue.worker_limit && i < MAX_DOWNLOAD_WORKERS; i++) {
+        workers[nworkers++] = st->download_queue.workers[i].task_idx >= 0 ? '#' : '.';
+    }
+    workers[nworkers] = '\0';
+    
+    pthread_mutex_unlock(&st->download_queue.mutex);
+    
+    out[0] = '\0';
+    if (pending_count == 0) return;
+    
+    char spinner = get_spinner_char(st->spinner_frame);
+    
+    if (failed > 0) {
+        snprintf(out, out_size, "[%c %d/%d %d! %s]", 
+                 spinner, completed, completed + pending_count, failed, workers);
+    } else {
+        snprintf(out, out_size, "[%c %d/%d %s]", 
+                 spinner, completed, completed + pending_count, workers);
+    }
+}
+
+static const char *now_playing_title(AppState *st) {
+    if (st->playing_from_playlist && st->playing_playlist_idx >= 0 &&
+        st->playing_playlist_idx < st->playlist_count) {
+        Playlist *pl = &st->playlists[st->playing_playlist_idx];
+        if (st->playing_index >= 0 && st->playing_index < pl->count) {
+            return pl->items[st->playing_index].title;
+        }
+    } else if (st->playing_index >= 0 && st->playing_index < st->search_count) {
+        return st->search_results[st->playing_index].title;
+    }
+    return NULL;
+}
+
+// Now-playing bar and download status; repainted only when their text changes
+static void draw_footer(AppState *st, bool force) {
+    const char *title = now_playing_title(st);
+    
+    char dl_status[64];
+    format_download_status(st, dl_status, sizeof(dl_status));
+    
+    char line[sizeof(ui.footer_line)];
+    snprintf(line, sizeof(line), "%s\n%d\n%s", title ? title : "", st->paused, dl_status);
+    if (!force && strcmp(line, ui.footer_line) == 0) return;
+    memcpy(ui.footer_line, line, sizeof(line));
+    
+    WINDOW *w = ui.footer;
+    int cols = ui.cols;
+    
+    werase(w);
+    mvwhline(w, 0, 0, ACS_HLINE, cols);
+    
+    if (title) {
+        mvwprintw(w, 1, 0, " Now playing: ");
+        wattron(w, A_BOLD);
+        wprint_truncated(w, title, cols - 35);  // Leave room for download status
+        wattroff(w, A_BOLD);
+        
+        if (st->paused) {
+            wprintw(w, " [PAUSED]");
+        }
+    }
+    
+    // Draw at the right side of the now playing bar
+    int x = cols - (int)strlen(dl_status) - 1;
+    if (dl_status[0] && x > 0) {
+        mvwprintw(w, 1, x, "%s", dl_status);
+    }
+    
+    wnoutrefresh(w);
+}
+
+#ifdef DEBUG
+// Span timings in a box at the bottom right of the body, above the now
+// playing bar. Drawn last on every frame so body repaints do not cover it.
+static void draw_perf_overlay(void) {
+    static WINDOW *w = NULL;
+    int height = PERF_SPAN_COUNT + 3;
+    int width = 62;
+    if (ui.rows < UI_HEADER_ROWS + UI_FOOTER_ROWS + height || ui.cols < width) return;
+    
+    int y = ui.rows - UI_FOOTER_ROWS - height;
+    int x = ui.cols - width;
+    if (!w || getbegy(w) != y || getbegx(w) != x) {
+        if (w) delwin(w);
+        w = newwin(height, width, y, x);
+        if (!w) return;
+    }
+    
+    werase(w);
+    box(w, 0, 0);
+    mvwprintw(w, 0, 2, " Timings (us, last %d) ", PERF_RING_SIZE);
+    mvwprintw(w, 1, 2, "%-14s %8s %9s %9s %9s", "span", "count", "p50", "p99", "max");
+    for (int i = 0; i < PERF_SPAN_COUNT; i++) {
+        PerfSpan span;
+        long long p50, p99;
+        perf_snapshot((PerfSpanId)i, &span, &p50, &p99);
+        mvwprintw(w, 2 + i, 2, "%-14s %8lld %9.1f %9.1f %9.1f", perf_span_names[i], span.count,
+                  p50 / 1000.0, p99 / 1000.0, span.max_ns / 1000.0);
+    }
+    wnoutrefresh(w);
+}
+#endif
+
+// One song row, shared by the search results and playlist views
+// where: playlists to name after the title, or NULL
+static void draw_song_row(AppState *st, int y, int idx, const Song *song,
+                          const char *playlist_name, const char *where,
+                          bool is_selected, bool is_playing) {
+    WINDOW *w = ui.body;
+    int cols = ui.cols;
+    
+    wmove(w, y, 0);
+    wclrtoeol(w);
+    
+    char mark = ' ';
+    if (is_playing) {
+        mark = st->paused ? '|' : '>';
+        wattron(w, A_BOLD);
+    }
+    if (is_selected) {
+        wattron(w, A_REVERSE);
+    }
+    
+    char dur[16];
+    format_duration(song->duration, dur);
+    
+    // Check if song is downloaded
+    bool is_downloaded = file_exists_for_video(st, playlist_name, song->video_id);
+    const char *dl_mark = is_downloaded ? "[D]" : "   ";
+    
+    mvwprintw(w, y, 0, " %c %3d. %s [%s] ", mark, idx + 1, dl_mark, dur);
+    
+    // Never wrap into the next row, which may not be repainted. The
+    // playlist names get at most a third of the room.
+    int room = cols - getcurx(w);
+    int where_room = 0;
+    if (where && where[0]) {
+        where_room = (int)strlen(where) + 6;
+        if (where_room > room / 3) where_room = room / 3;
+    }
+    wprint_truncated(w, song->title ? song->title : "(no title)", room - where_room);
+    if (where_room > 6) {
+        wprintw(w, "  in: ");
+        wprint_truncated(w, where, cols - getcurx(w));
+    }
+    
+    if (is_selected) {
+        wattroff(w, A_REVERSE);
+    }
+    if (is_playing) {
+        wattroff(w, A_BOLD);
+    }
+}
+
+static void draw_playlist_row(AppState *st, int y, int idx, bool is_selected) {
+    WINDOW *w = ui.body;
+    
+    wmove(w, y, 0);
+    wclrtoeol(w);
+    
+    if (is_selected) {
+        wattron(w, A_REVERSE);
+    }
+    
+    Playlist *pl = &st->playlists[idx];
+    
+    // Unloaded playlists are only known to hold the song if the library
+    // index is built; they are not loaded just for the mark
+    bool has_song = false;
+    if (st->view == VIEW_ADD_TO_PLAYLIST && st->song_to_add) {
+        const char *video_id = st->song_to_add->video_id;
+        has_song = pl->loaded ? playlist_find_song(pl, video_id) >= 0
+                              : song_index_contains(&st->song_index, idx, video_id);
+    }
+    
+    char songs[64];
+    snprintf(songs, sizeof(songs), " (%d songs)%s", playlist_song_count(pl),
+             has_song ? " - already added" : "");
+    
+    mvwprintw(w, y, 0, "   %3d. ", idx + 1);
+    wprint_truncated(w, pl->name, ui.cols - getcurx(w) - (int)strlen(songs));
+    wprint_truncated(w, songs, ui.cols - getcurx(w));
+    
+    if (is_selected) {
+        wattroff(w, A_REVERSE);
+    }
+}
+
+// Selection, scroll offset and length of the list shown by the current view.
+// Returns false for views without a list.
+static bool view_list(AppState *st, int **selected, int **scroll, int *count) {
+    if (filter_shown(st)) {
+        *selected = &st->filter.selected;
+        *scroll = &st->filter.scroll;
+        *count = st->filter.count;
+        return true;
+    }
+    
+    switch (st->view) {
+        case VIEW_SEARCH:
+            *selected = &st->search_selected;
+            *scroll = &st->search_scroll;
+            *count = st->search_count;
+            return true;
+        case VIEW_PLAYLISTS:
+            *selected = &st->playlist_selected;
+            *scroll = &st->playlist_scroll;
+            *count = st->playlist_count;
+            return true;
+        case VIEW_PLAYLIST_SONGS:
+            if (st->current_playlist_idx < 0 || st->current_playlist_idx >= st->playlist_count) {
+                return false;
+            }
+            *selected = &st->playlist_song_selected;
+            *scroll = &st->playlist_song_scroll;
+            *count = st->playlists[st->current_playlist_idx].count;
+            return true;
+        case VIEW_ADD_TO_PLAYLIST:
+            *selected = &st->add_to_playlist_selected;
+            *scroll = &st->add_to_playlist_scroll;
+            *count = st->playlist_count;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Draw list entry idx of the current view at its on-screen row
+static void draw_list_row(AppState *st, int idx, int scroll, int selected) {
+    int y = UI_LIST_TOP + idx - scroll;
+    bool is_selected = (idx == selected);
+    int item = filter_shown(st) ? st->filter.rows[idx] : idx;
+    
+    switch (st->view) {
+        case VIEW_SEARCH: {
+            bool is_playing = (!st->playing_from_playlist && item == st->playing_index);
+            draw_song_row(st, y, item, &st->search_results[item], st->search_from[item],
+                          st->search_where[item], is_selected, is_playing);
+            break;
+        }
+        case VIEW_PLAYLIST_SONGS: {
+            Playlist *pl = &st->playlists[st->current_playlist_idx];
+            bool is_playing = (st->playing_from_playlist && 
+                               st->playing_playlist_idx == st->current_playlist_idx &&
+                               st->playing_index == item);
+            draw_song_row(st, y, item, &pl->items[item], pl->name, NULL, is_selected, is_playing);
+            break;
+        }
+        case VIEW_PLAYLISTS:
+        case VIEW_ADD_TO_PLAYLIST:
+            draw_playlist_row(st, y, idx, is_selected);
+            break;
+        default:
+            break;
+    }
+}
+
+// Draw the visible part of the current view's list
+static void draw_list_rows(AppState *st) {
+    int *selected, *scroll, count;
+    if (!view_list(st, &selected, &scroll, &count)) return;
+    
+    int list_height = ui_list_height();
+    if (count == 0 && filter_shown(st)) {
+        mvwprintw(ui.body, UI_LIST_TOP + 1, 2, "No songs match the filter.");
+        return;
+    }
+    for (int i = 0; i < list_height && (*scroll + i) < count; i++) {
+        draw_list_row(st, *scroll + i, *scroll, *selected);
+    }
+}
+
+static void draw_status_line(const char *status) {
+    wmove(ui.body, 1, 0);
+    wclrtoeol(ui.body);
+    if (status && status[0]) {
+        wprintw(ui.body, ">>> ");
+        wprint_truncated(ui.body, status, ui.cols - 4);
+    }
+}
+
+static void draw_search_view(AppState *st, int cols) {
+    WINDOW *w = ui.body;
+    
+    mvwprintw(w, 0, 0, "Query: ");
+    wattron(w, A_BOLD);
+    wprintw(w, "%s", st->query[0] ? st->query : "(none)");
+    wattroff(w, A_BOLD);
+    if (st->search_local) wprintw(w, " (your playlists)");
+
+    if (filter_shown(st)) {
+        mvwprintw(w, 0, cols - 20, "Results: %d/%d", st->filter.count, st->search_count);
+    } else {
+        mvwprintw(w, 0, cols - 20, "Results: %d", st->search_count);
+    }
+    mvwhline(w, 2, 0, ACS_HLINE, cols);
+
+    draw_list_rows(st);
+}
+
+static void draw_playlists_view(AppState *st, int cols) {
+    WINDOW *w = ui.body;
+    
+    mvwprintw(w, 0, 0, "Playlists");
+    mvwprintw(w, 0, cols - 20, "Total: %d", st->playlist_count);
+    mvwhline(w, 2, 0, ACS_HLINE, cols);
+    
+    if (st->playlist_count == 0) {
+        mvwprintw(w, UI_LIST_TOP + 1, 2, "No playlists yet. Press 'c' to create one.");
+        return;
+    }
+    
+    draw_list_rows(st);
+}
+
+static void draw_playlist_songs_view(AppState *st, int cols) {
+    if (st->current_playlist_idx < 0 || st->current_playlist_idx >= st->playlist_count) {
+        return;
+    }
+    
+    WINDOW *w = ui.body;
+    Playlist *pl = &st->playlists[st->current_playlist_idx];
+
+    mvwprintw(w, 0, 0, "Playlist: ");
+    wattron(w, A_BOLD);
+    wprintw(w, "%s", pl->name);
+    if (pl->is_youtube_playlist) wprintw(w, " [YT]");
+    wattroff(w, A_BOLD);
+
+    if (filter_shown(st)) {
+        mvwprintw(w, 0, cols - 20, "Songs: %d/%d", st->filter.count, pl->count);
+    } else {
+        mvwprintw(w, 0, cols - 20, "Songs: %d", pl->count);
+    }
+    mvwhline(w, 2, 0, ACS_HLINE, cols);
+    
+    if (pl->count == 0) {
+        mvwprintw(w, UI_LIST_TOP + 1, 2, "Playlist is empty. Search for songs and press 'a' to add.");
+        return;
+    }
+    
+    draw_list_rows(st);
+}
+
+static void draw_add_to_playlist_view(AppState *st, int cols) {
+    WINDOW *w = ui.body;
+    
+    mvwprintw(w, 0, 0, "Add to playlist: ");
+    if (st->song_to_add && st->song_to_add->title) {
+        wattron(w, A_BOLD);
+        wprint_truncated(w, st->song_to_add->title, cols - 20);
+        wattroff(w, A_BOLD);
+    }
+    
+    mvwhline(w, 2, 0, ACS_HLINE, cols);
+
+    if (st->playlist_count == 0) {
+        mvwprintw(w, UI_LIST_TOP + 1, 2, "No playlists yet. Press 'c' to create one.");
+        return;
+    }
+    
+    draw_list_rows(st);
+}
+
+// NEW: Draw settings view
+static void draw_settings_view(AppState *st, int cols) {
+    WINDOW *w = ui.body;
+    
+    mvwprintw(w, 0, 0, "Settings");
+    mvwhline(w, 2, 0, ACS_HLINE, cols);
+
+    // A blank line between settings only if there is room for it
+    int gap = (getmaxy(w) >= 4 + SETTING_COUNT * 3 + 2) ? 2 : 1;
+    int y = gap == 2 ? 4 : 3;
+    int cursor_y = -1;
+    
+    for (int i = 0; i < SETTING_COUNT; i++) {
+        bool is_selected = (st->settings_selected == i);
+        
+        mvwprintw(w, y, 2, "%s:", setting_label((SettingId)i));
+        y++;
+        
+        if (is_selected) {
+            wattron(w, A_REVERSE);
+        }
+        
+        if (st->settings_editing && is_selected) {
+            // Show edit buffer with cursor
+            mvwprintw(w, y, 4, "%-*s", cols - 8, st->settings_edit_buffer);
+            cursor_y = y;
+        } else {
+            // Show current value
+            int max_value = cols - 8;
+            char valuebuf[1024];
+            setting_get_value(st, (SettingId)i, valuebuf, sizeof(valuebuf));
+            
+            int len = (int)strlen(valuebuf);
+            if (len > max_value && max_value > 3) {
+                // Truncate from the beginning to show the end of the path
+                mvwprintw(w, y, 4, "...%s", valuebuf + len - max_value + 3);
+            } else {
+                mvwprintw(w, y, 4, "%s", valuebuf);
+            }
+        }
+        
+        if (is_selected) {
+            wattroff(w, A_REVERSE);
+        }
+        
+        y += gap;
+    }
+    
+    // Help text
+    mvwprintw(w, y, 2, "Press Enter to edit, Esc to go back");
+    y++;
+    
+    if (st->settings_editing) {
+        mvwprintw(w, y, 2, "Editing: Enter to save, Esc to cancel");
+    }
+    
+    // Position cursor; stdscr gets the same position because getch()
+    // moves the terminal cursor to it
+    if (cursor_y >= 0) {
+        wmove(w, cursor_y, 4 + st->settings_edit_pos);
+        move(UI_HEADER_ROWS + cursor_y, 4 + st->settings_edit_pos);
+        curs_set(1);
+    } else {
+        curs_set(0);
+    }
+}
+
+// Live progress of each worker, the next queued songs and the session's figures.
+// Redrawn as a whole on every repaint, like Settings.
+static void draw_downloads_view(AppState *st, int rows, int cols) {
+    WINDOW *w = ui.body;
+    DownloadQueue *q = &st->download_queue;
+    
+    // Copy what is shown, so drawing does not hold up the workers
+    DownloadTask active[MAX_DOWNLOAD_WORKERS];
+    bool busy[MAX_DOWNLOAD_WORKERS];
+    char next_titles[MAX_DOWNLOAD_WORKERS * 4][128];
+    int next_count = 0;
+    DownloadTask waiting[4];
+    int waiting_count = 0;
+    
+    pthread_mutex_lock(&q->mutex);
+    
+    int nworkers = q->worker_limit;
+    if (nworkers < 1) nworkers = st->config.download_workers;
+    if (nworkers > MAX_DOWNLOAD_WORKERS) nworkers = MAX_DOWNLOAD_WORKERS;
+    for (int i = 0; i < nworkers; i++) {
+        int task_idx = q->workers[i].task_idx;
+        busy[i] = task_idx >= 0;
+        if (busy[i]) active[i] = q->tasks[task_idx];
+    }
+    
+    // Retries first, up to a few rows, then as much of the FIFO as fits
+    for (int i = 0; i < q->retry_count && waiting_count < 4; i++) {
+        waiting[waiting_count++] = q->tasks[q->retry_tasks[i]];
+    }
+    int retrying = q->retry_count;
+    
+    int max_next = rows - UI_LIST_TOP - nworkers - 4;
+    if (waiting_count > 0) max_next -= waiting_count + 3;
+    int max_titles = (int)(sizeof(next_titles) / sizeof(next_titles[0]));
+    if (max_next > max_titles) max_next = max_titles;
+    for (int i = 0; i < q->fifo_len && next_count < max_next; i++) {
+        int task_idx = q->pending_fifo[(q->fifo_head + i) % MAX_DOWNLOAD_QUEUE];
+        if (q->tasks[task_idx].status != DOWNLOAD_PENDING) continue;
+        snprintf(next_titles[next_count], sizeof(next_titles[0]), "%s", q->tasks[task_idx].title);
+        next_count++;
+    }
+    
+    int pending = q->pending_count;
+    int completed = q->completed;
+    int failed = q->failed;
+    DownloadStats stats = q->stats;
+    
+    pthread_mutex_unlock(&q->mutex);
+    
+    int downloading = 0;
+    for (int i = 0; i < nworkers; i++) {
+        if (busy[i]) downloading++;
+    }
+    mvwprintw(w, 0, 0, "Downloads (%d downloading, %d queued, %d retrying, %d done, %d failed)",
+              downloading, pending, retrying, completed, failed);
+    mvwhline(w, 2, 0, ACS_HLINE, cols);
+    
+    int y = UI_LIST_TOP;
+    long long now = monotonic_ms();
+    for (int i = 0; i < nworkers; i++, y++) {
+        if (!busy[i]) {
+            mvwprintw(w, y, 2, "#%d  idle", i + 1);
+            continue;
+        }
+        
+        DownloadTask *task = &active[i];
+        char eta[16], elapsed[16], size[32], percent[8];
+        format_duration(task->eta, eta);
+        format_duration((int)((now - task->started_ms) / 1000), elapsed);
+        
+        double done_mb = task->bytes_done / (1024.0 * 1024.0);
+        if (task->bytes_total > 0) {
+            snprintf(size, sizeof(size), "%.1f/%.1f MB", done_mb,
+                     task->bytes_total / (1024.0 * 1024.0));
+            int pct = (int)(task->bytes_done * 100 / task->bytes_total);
+            snprintf(percent, sizeof(percent), "%d%%", pct > 100 ? 100 : pct);
+        } else {
+            snprintf(size, sizeof(size), "%.1f MB", done_mb);
+            snprintf(percent, sizeof(percent), "--");
+        }
+        
+        mvwprintw(w, y, 2, "#%d %4s %15s %6.2f MB/s  ETA %5s  %5s  ",
+                  i + 1, percent, size, task->speed / (1024.0 * 1024.0), eta, elapsed);
+        int x = getcurx(w);
+        wprint_truncated(w, task->title, cols - x - 1);
+    }
+    
+    if (waiting_count > 0) {
+        y++;
+        mvwprintw(w, y++, 2, "Waiting to retry:");
+        time_t wall = time(NULL);
+        for (int i = 0; i < waiting_count; i++, y++) {
+            char in[16];
+            format_duration((int)(waiting[i].retry_at - wall), in);
+            mvwprintw(w, y, 6, "%-11s try %d/%d in %5s  ", download_error_names[waiting[i].error],
+                      waiting[i].attempts + 1, DOWNLOAD_MAX_ATTEMPTS, in);
+            wprint_truncated(w, waiting[i].title, cols - getcurx(w) - 1);
+        }
+        if (retrying > waiting_count) {
+            mvwprintw(w, y++, 6, "... and %d more", retrying - waiting_count);
+        }
+    }
+    
+    if (next_count > 0) {
+        y++;
+        mvwprintw(w, y++, 2, "Up next:");
+        for (int i = 0; i < next_count; i++, y++) {
+            wmove(w, y, 6);
+            wprint_truncated(w, next_titles[i], cols - 7);
+        }
+        if (pending > next_count) {
+            mvwprintw(w, y++, 6, "... and %d more", pending - next_count);
+        }
+    }
+    
+    // Session figures on the last row
+    int tasks = stats.done + stats.failed;
+    if (tasks > 0 || stats.retries > 0 || stats.skipped > 0) {
+        double busy_s = download_stats_busy_ms(&stats) / 1000.0;
+        double mb = stats.bytes / (1024.0 * 1024.0);
+        char busy_time[16];
+        format_duration((int)busy_s, busy_time);
+        
+        wmove(w, rows - 1, 2);
+        wclrtoeol(w);
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "Session: %d done, %d failed (%.0f%%), %d retried, %d already on disk | "
+                 "%.1f MB in %s, %.2f MB/s | %.1f s per track",
+                 stats.done, stats.failed, tasks > 0 ? 100.0 * stats.failed / tasks : 0.0,
+                 stats.retries, stats.skipped, mb, busy_time, busy_s > 0 ? mb / busy_s : 0.0,
+                 stats.done > 0 ? stats.task_ms / 1000.0 / stats.done : 0.0);
+        wprint_truncated(w, line, cols - 3);
+    }
+}
+
+// NEW: Draw exit confirmation dialog when downloads are pending
+static void draw_exit_dialog(AppState *st, int pending_count) {
+    (void)st; // Suppress unused parameter warning
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    
+    int dialog_w = 50;
+    int dialog_h = 8;
+    int start_x = (cols - dialog_w) / 2;
+    int start_y = (rows - dialog_h) / 2;
+    
+    // Draw box background
+    for (int y = start_y; y < start_y + dialog_h; y++) {
+        mvhline(y, start_x, ' ', dialog_w);
+    }
+    
+    // Draw title bar
+    attron(A_REVERSE);
+    mvprintw(start_y, start_x, "%-*s", dialog_w, "");
+    mvprintw(start_y, start_x + (dialog_w - 16) / 2, " Download Queue ");
+    attroff(A_REVERSE);
+    
+    // Draw content
+    mvprintw(start_y + 2, start_x + 2, "Downloads in progress: %d remaining", pending_count);
+    mvprintw(start_y + 4, start_x + 2, "Downloads will resume on next startup.");
+    
+    // Draw options
+    attron(A_BOLD);
+    mvprintw(start_y + 6, start_x + 2, "[q] Quit anyway    [Esc] Cancel");
+    attroff(A_BOLD);
+    
+    refresh();
+    
+    // The dialog was drawn over the regions
+    ui_invalidate();
+}
+
+// NEW: Draw About overlay, centered in the body
+static void draw_about_view(AppState *st, int rows, int cols) {
+    (void)st; // Unused
+
+    WINDOW *w = ui.body;
+    int dialog_w = 60;
+    int dialog_h = 16;
+    int start_x = (cols - dialog_w) / 2;
+    int start_y = (rows - dialog_h) / 2;
+    if (start_y < 0) start_y = 0;
+
+    // Draw box background
+    wattron(w, A_BOLD);
+    for (int y = start_y; y < start_y + dialog_h; y++) {
+        mvwhline(w, y, start_x, ' ', dialog_w);
+    }
+    wattroff(w, A_BOLD);
+
+    // Draw border
+    wattron(w, A_BOLD);
+    mvwaddch(w, start_y, start_x, ACS_ULCORNER);
+    mvwaddch(w, start_y, start_x + dialog_w - 1, ACS_URCORNER);
+    mvwaddch(w, start_y + dialog_h - 1, start_x, ACS_LLCORNER);
+    mvwaddch(w, start_y + dialog_h - 1, start_x + dialog_w - 1, ACS_LRCORNER);
+    mvwhline(w, start_y, start_x + 1, ACS_HLINE, dialog_w - 2);
+    mvwhline(w, start_y + dialog_h - 1, start_x + 1, ACS_HLINE, dialog_w - 2);
+    mvwvline(w, start_y + 1, start_x, ACS_VLINE, dialog_h - 2);
+    mvwvline(w, start_y + 1, start_x + dialog_w - 1, ACS_VLINE, dialog_h - 2);
+    wattroff(w, A_BOLD);
+
+    // Title
+    wattron(w, A_BOLD | A_REVERSE);
+    mvwprintw(w, start_y + 2, start_x + (dialog_w - 15) / 2, " ShellBeats v0.4");
+    wattroff(w, A_BOLD | A_REVERSE);
+
+    // Version and description
+    mvwprintw(w, start_y + 4, start_x + (dialog_w - 28) / 2, "made by Lalo for Nami & Elia");
+    mvwprintw(w, start_y + 6, start_x + (dialog_w - 44) / 2, "A terminal-based music player for YouTube");
+
+    // Features
+    mvwprintw(w, start_y + 8, start_x + 4, "Features:");
+    mvwprintw(w, start_y + 9, start_x + 6, "* Search and stream music from YouTube");
+    mvwprintw(w, start_y + 10, start_x + 6, "* Download songs as MP3");
+    mvwprintw(w, start_y + 11, start_x + 6, "* Create and manage playlists");
+    mvwprintw(w, start_y + 12, start_x + 6, "* Offline playback from local files");
+
+    // Footer
+    wattron(w, A_DIM);
+    mvwprintw(w, start_y + 14, start_x + (dialog_w - 40) / 2, "Built with mpv, yt-dlp, and ncurses");
+    wattroff(w, A_DIM);
+}
+
+// Everything the body shows apart from the selected row and status line.
+// When this is unchanged, only rows whose selection changed need repainting.
+static void snapshot_body(AppState *st, BodySnapshot *snap) {
+    memset(snap, 0, sizeof(*snap));
+    snap->view = st->view;
+    snap->search_version = st->search_version;
+    snap->playlists_version = st->playlists_version;
+    pthread_mutex_lock(&st->local_files.mutex);
+    snap->local_version = st->local_files.version;
+    pthread_mutex_unlock(&st->local_files.mutex);
+    snap->current_playlist_idx = st->current_playlist_idx;
+    snap->playing_index = st->playing_index;
+    snap->playing_from_playlist = st->playing_from_playlist;
+    snap->playing_playlist_idx = st->playing_playlist_idx;
+    snap->paused = st->paused;
+    snap->song_to_add = st->song_to_add;
+    snap->filter_version = filter_shown(st) ? st->filter.version : 0;
+    
+    int *selected, *scroll, count;
+    if (view_list(st, &selected, &scroll, &count)) {
+        snap->scroll = *scroll;
+        snap->count = count;
+    }
+}
+
+// Bring the body up to date, repainting as little as possible
+static void draw_body(AppState *st, const char *status) {
+    int body_rows = ui.rows - UI_HEADER_ROWS - UI_FOOTER_ROWS;
+    int list_height = ui_list_height();
+    
+    filter_sync(st);
+    
+    // Adjust scroll
+    int *selected = NULL, *scroll = NULL, count = 0;
+    bool has_list = view_list(st, &selected, &scroll, &count);
+    if (has_list) {
+        if (*selected < *scroll) {
+            *scroll = *selected;
+        } else if (*selected >= *scroll + list_height) {
+            *scroll = *selected - list_height + 1;
+        }
+    }
+    
+    // Playlists missing from an old index have their songs counted on display
+    if (has_list && st->view == VIEW_PLAYLISTS) {
+        for (int i = *scroll; i < count && i < *scroll + list_height; i++) {
+            if (!st->playlists[i].loaded && st->playlists[i].stored_count < 0) {
+                ensure_playlist_loaded(st, i);
+            }
+        }
+    }
+    
+    BodySnapshot snap;
+    snapshot_body(st, &snap);
+    
+    // Settings, About and Downloads hold no list and change as a whole
+    bool same = !ui.full_redraw && has_list &&
+                memcmp(&snap, &ui.body_state, sizeof(snap)) == 0;
+    bool touched = false;
+    
+    if (same) {
+        int old_sel = ui.body_selected;
+        if (*selected != old_sel) {
+            // Only the selection moved: repaint the two affected rows
+            if (old_sel >= *scroll && old_sel < *scroll + list_height && old_sel < count) {
+                draw_list_row(st, old_sel, *scroll, *selected);
+            }
+            if (*selected >= *scroll && *selected < count) {
+                draw_list_row(st, *selected, *scroll, *selected);
+            }
+            touched = true;
+        }
+    } else {
+        werase(ui.body);
+        switch (st->view) {
+            case VIEW_SEARCH:
+                draw_search_view(st, ui.cols);
+                break;
+            case VIEW_PLAYLISTS:
+                draw_playlists_view(st, ui.cols);
+                break;
+            case VIEW_PLAYLIST_SONGS:
+                draw_playlist_songs_view(st, ui.cols);
+                break;
+            case VIEW_ADD_TO_PLAYLIST:
+                draw_add_to_playlist_view(st, ui.cols);
+                break;
+            case VIEW_SETTINGS:
+                draw_settings_view(st, ui.cols);
+                break;
+            case VIEW_ABOUT:
+                draw_about_view(st, body_rows, ui.cols);
+                break;
+            case VIEW_DOWNLOADS:
+                draw_downloads_view(st, body_rows, ui.cols);
+                break;
+        }
+        ui.status_dirty = true;
+        touched = true;
+    }
+    
+    if (st->view != VIEW_ABOUT) {
+        const char *s = status ? status : "";
+        if (ui.status_dirty || strcmp(s, ui.status_line) != 0) {
+            draw_status_line(s);
+            snprintf(ui.status_line, sizeof(ui.status_line), "%s", s);
+            ui.status_dirty = false;
+            touched = true;
+        }
+    }
+    
+    ui.body_state = snap;
+    ui.body_selected = has_list ? *selected : -1;
+    
+    if (touched || st->view == VIEW_SETTINGS) {
+        wnoutrefresh(ui.body);
+    }
+}
+
+static void draw_ui(AppState *st, const char *status) {
+    PERF_BEGIN(perf_start);
+    ui_layout();
+    
+    bool force = ui.full_redraw;
+    
+    if (force || ui.header_view != st->view) {
+        werase(ui.header);
+        draw_header(ui.header, ui.cols, st->view);
+        ui.header_view = st->view;
+        wnoutrefresh(ui.header);
+    }
+    
+    draw_footer(st, force);
+    
+    // Body last, so the settings editor keeps the cursor
+    draw_body(st, status);
+    
+#ifdef DEBUG
+    if (st->perf_overlay) draw_perf_overlay();
+#endif
+    
+    ui.full_redraw = false;
+    doupdate();
+    PERF_END(PERF_DRAW_UI, perf_start);
+}
+
+// ============================================================================
+// YouTube Playlist Import
+// ============================================================================
+
+static void import_on_title(const char *title, void *user_data) {
+    ImportJob *job = user_data;
+    pthread_mutex_lock(&job->mutex);
+    strncpy(job->title, title, sizeof(job->title) - 1);
+    job->title[sizeof(job->title) - 1] = '\0';
+    pthread_mutex_unlock(&job->mutex);
+    notify_ui();
+}
+
+static bool import_on_song(const Song *song, void *user_data) {
+    ImportJob *job = user_data;
+    
+    pthread_mutex_lock(&job->mutex);
+    
+    if (job->pending_count >= job->pending_cap) {
+        int new_cap = job->pending_cap ? job->pending_cap * 2 : 64;
+        Song *grown = realloc(job->pending, new_cap * sizeof(Song));
+        if (!grown) {
+            pthread_mutex_unlock(&job->mutex);
+            return true;
+        }
+        job->pending = grown;
+        job->pending_cap = new_cap;
+    }
+    
+    Song copy = *song;
+    copy.title = arena_strdup(&job->strings, song->title);
+    if (copy.title) {
+        job->pending[job->pending_count++] = copy;
+        job->fetched++;
+    }
+    
+    pthread_mutex_unlock(&job->mutex);
+    notify_ui();
+    
+    return true;
+}
+
+static void *import_thread_func(void *arg) {
+    ImportJob *job = arg;
+    
+    int count = stream_youtube_playlist(job->url, &job->proc, import_on_title, import_on_song, job);
+    
+    pthread_mutex_lock(&job->mutex);
+    job->failed = count < 0;
+    job->done = true;
+    pthread_mutex_unlock(&job->mutex);
+    notify_ui();
+    return NULL;
+}
+
+static bool start_youtube_import(AppState *st, const char *url, const char *name, bool stream_only) {
+    ImportJob *job = &st->import;
+    if (job->running) return false;
+    
+    snprintf(job->url, sizeof(job->url), "%s", url);
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->title[0] = '\0';
+    job->stream_only = stream_only;
+    job->done = false;
+    job->cancelled = false;
+    job->failed = false;
+    job->fetched = 0;
+    job->added = 0;
+    job->playlist_idx = -1;
+    job->last_save = 0;
+    
+    ytdlp_process_init(&job->proc);
+    
+    if (pthread_create(&job->thread, NULL, import_thread_func, job) != 0) {
+        ytdlp_process_destroy(&job->proc);
+        return false;
+    }
+    job->running = true;
+    return true;
+}
+
+static void cancel_youtube_import(AppState *st) {
+    if (!st->import.running) return;
+    st->import.cancelled = true;
+    ytdlp_cancel(&st->import.proc);
+}
+
+// Move fetched songs into the playlist; call from the UI thread on every tick.
+// Updates status while the import runs and when it finishes.
+static void poll_youtube_import(AppState *st, char *status, size_t status_size) {
+    ImportJob *job = &st->import;
+    if (!job->running) return;
+    
+    // The fetch thread writes the title; copy it while holding the lock
+    char title[sizeof(job->title)];
+    pthread_mutex_lock(&job->mutex);
+    bool done = job->done;
+    bool failed = job->failed;
+    snprintf(title, sizeof(title), "%s", job->title);
+    pthread_mutex_unlock(&job->mutex);
+    
+    // Create the playlist once we know what to call it
+    if (job->playlist_idx < 0 && !job->cancelled && (job->name[0] || title[0] || done)) {
+        const char *name = job->name[0] ? job->name : (title[0] ? title : "YouTube Playlist");
+        int idx = create_playlist(st, name, true);
+        if (idx >= 0) {
+            job->playlist_idx = idx;
+        } else {
+            snprintf(status, status_size, idx == -2 ? "Playlist already exists: %s" :
+                     "Failed to create playlist: %s", name);
+            cancel_youtube_import(st);
+        }
+    }
+    
+    int first_new = 0;
+    Playlist *pl = NULL;
+    if (job->playlist_idx >= 0) {
+        pl = &st->playlists[job->playlist_idx];
+        first_new = pl->count;
+    }
+    
+    // Copy the fetched songs over; their titles are then done with
+    pthread_mutex_lock(&job->mutex);
+    for (int i = 0; pl && i < job->pending_count; i++) {
+        // A video listed twice, or already in the playlist, is added once
+        if (playlist_find_song(pl, job->pending[i].video_id) >= 0) continue;
+        if (!playlist_append(pl, &job->pending[i])) break;
+        song_index_add(&st->song_index, job->playlist_idx, &job->pending[i]);
+    }
+    job->pending_count = 0;
+    arena_reset(&job->strings);
+    pthread_mutex_unlock(&job->mutex);
+    
+    if (pl && pl->count > first_new) {
+        st->playlists_version++;
+        job->added += pl->count - first_new;
+        if (!job->stream_only) {
+            add_many_to_download_queue(st, &pl->items[first_new], pl->count - first_new,
+                                       pl->name, NULL);
+        }
+        
+        // Save at most once per second while streaming
+        time_t now = time(NULL);
+        if (now != job->last_save) {
+            save_playlist(st, job->playlist_idx);
+            job->last_save = now;
+        }
+    }
+    
+    if (!done) {
+        if (pl && !job->cancelled) {
+            snprintf(status, status_size, "Importing '%s': %d songs...", pl->name, job->added);
+        }
+        return;
+    }
+    
+    pthread_join(job->thread, NULL);
+    ytdlp_process_destroy(&job->proc);
+    job->running = false;
+    
+    free(job->pending);
+    job->pending = NULL;
+    job->pending_cap = 0;
+    arena_free(&job->strings);
+    
+    if (pl) {
+        save_playlist(st, job->playlist_idx);
+        if (job->cancelled) {
+            snprintf(status, status_size, "Import cancelled, kept %d songs in '%s'",
+                     job->added, pl->name);
+        } else if (failed && job->added > 0) {
+            snprintf(status, status_size, "yt-dlp failed, kept the %d songs fetched in '%s'",
+                     job->added, pl->name);
+        } else if (!failed && job->added > 0) {
+            snprintf(status, status_size, "Imported %d songs into '%s'", job->added, pl->name);
+        } else {
+            snprintf(status, status_size, "Failed to fetch playlist");
+        }
+    } else if (!job->cancelled) {
+        snprintf(status, status_size, "Failed to fetch playlist");
+    }
+}
+
+// Cancel a running import and keep whatever was already fetched
+static void stop_youtube_import(AppState *st) {
+    if (!st->import.running) return;
+    
+    char status[512];
+    cancel_youtube_import(st);
+    while (st->import.running) {
+        poll_youtube_import(st, status, sizeof(status));
+        if (st->import.running) usleep(10 * 1000);
+    }
+}
+
+// ============================================================================
+// Input Handling
+// ============================================================================
+
+static int get_string_input(char *buf, size_t bufsz, const char *prompt) {
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    
+    int y = rows - 1;
+    move(y, 0);
+    clrtoeol();
+    
+    attron(A_BOLD);
+    mvprintw(y, 0, "%s", prompt);
+    attroff(A_BOLD);
+    refresh();
+    
+    int prompt_len = strlen(prompt);
+    int max_input = cols - prompt_len - 2;
+    if (max_input > (int)bufsz - 1) max_input = bufsz - 1;
+    if (max_input < 1) max_input = 1;
+    
+    // Disable timeout for blocking input
+    timeout(-1);
+    
+    echo();
+    curs_set(1);
+    move(y, prompt_len);
+    
+    getnstr(buf, max_input);
+    
+    noecho();
+    curs_set(0);
+    
+    // Back to non-blocking input for the poll() loop
+    timeout(0);
+    
+    char *trimmed = trim_whitespace(buf);
+    if (trimmed != buf) {
+        memmove(buf, trimmed, strlen(trimmed) + 1);
+    }
+    
+    // The prompt was drawn over the now-playing bar
+    ui_invalidate();
+    
+    return strlen(buf);
+}
+
+static void show_help(void) {
+    erase();
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    (void)cols;
+    
+    int y = 2;
+    attron(A_BOLD);
+    mvprintw(y++, 2, "ShellBeats v0.4 | Help");
+    attroff(A_BOLD);
+    y++;
+    
+    mvprintw(y++, 4, "GLOBAL CONTROLS:");
+    mvprintw(y++, 6, "/           Search your playlists");
+    mvprintw(y++, 6, "o           Search YouTube for the same query");
+    mvprintw(y++, 6, "F           Filter the results or playlist as you type");
+    mvprintw(y++, 6, "Enter       Play selected / Open playlist");
+    mvprintw(y++, 6, "Space       Pause/Resume playback");
+    mvprintw(y++, 6, "n           Next track");
+    mvprintw(y++, 6, "p           Previous track");
+    mvprintw(y++, 6, "x           Stop playback");
+    mvprintw(y++, 6, "Up/Down/j/k Navigate list");
+    mvprintw(y++, 6, "PgUp/PgDn   Page up/down");
+    mvprintw(y++, 6, "g/G         Go to start/end");
+    mvprintw(y++, 6, "S           Settings");  // NEW
+    mvprintw(y++, 6, "w           Download progress");
+    mvprintw(y++, 6, "h or ?      Show this help");
+#ifdef DEBUG
+    mvprintw(y++, 6, "P           Show hot-path timings");
+#endif
+    mvprintw(y++, 6, "q           Quit");
+    y++;
+    
+    mvprintw(y++, 4, "PLAYLIST CONTROLS:");
+    mvprintw(y++, 6, "f           Open playlists menu");
+    mvprintw(y++, 6, "a           Add song to playlist");
+    mvprintw(y++, 6, "c           Create new playlist");
+    mvprintw(y++, 6, "d           Remove song from playlist");
+    mvprintw(y++, 6, "x           Delete playlist");
+    mvprintw(y++, 6, "Esc         Go back");
+    y++;
+    
+    mvprintw(y++, 4, "Requirements: yt-dlp, mpv");
+    
+    attron(A_REVERSE);
+    mvprintw(rows - 2, 2, " Press any key to continue... ");
+    attroff(A_REVERSE);
+    
+    refresh();
+    timeout(-1);
+    getch();
+    timeout(0);
+    ui_invalidate();
+}
+
+static bool check_dependencies(char *errmsg, size_t errsz) {
+    FILE *fp = popen("which yt-dlp 2>/dev/null", "r");
+    if (fp) {
+        char buf[256];
+        bool found = (fgets(buf, sizeof(buf), fp) != NULL && buf[0] == '/');
+        pclose(fp);
+        if (!found) {
+            snprintf(errmsg, errsz, "yt-dlp not found! Install with: pip install yt-dlp");
+            return false;
         }
-        if (is_playing) {
-            attroff(A_BOLD);
+    }
+    
+    fp = popen("which mpv 2>/dev/null", "r");
+    if (fp) {
+        char buf[256];
+        bool found = (fgets(buf, sizeof(buf), fp) != NULL && buf[0] == '/');
+        pclose(fp);
+        if (!found) {
+            snprintf(errmsg, errsz, "mpv not found! Install with: apt install mpv");
+            return false;
         }
     }
+    
+    return true;
 }
 
-static void draw_playlists_view(AppState *st, const char *status, int rows, int cols) {
-    mvprintw(4, 0, "Playlists");
-    mvprintw(4, cols - 20, "Total: %d", st->playlist_count);
+// ============================================================================
+// Event Loop
+// ============================================================================
 
-    if (status && status[0]) {
-        mvprintw(5, 0, ">>> %s", status);
+// Sleep until input_fd (the terminal, or the daemon's control socket) is
+// readable, an mpv message or a background thread notification arrives.
+// While downloads are running, also wake on the next second so the spinner
+// keeps turning; otherwise there is nothing to redraw on a timer.
+static void wait_for_events(AppState *st, int input_fd) {
+    struct pollfd fds[3];
+    int nfds = 0;
+    
+    fds[nfds].fd = input_fd;
+    fds[nfds].events = POLLIN;
+    nfds++;
+    
+    int wake_slot = -1;
+    if (ui_wake_fds[0] >= 0) {
+        wake_slot = nfds;
+        fds[nfds].fd = ui_wake_fds[0];
+        fds[nfds].events = POLLIN;
+        nfds++;
     }
-
-    mvhline(6, 0, ACS_HLINE, cols);
-
-    int list_top = 7;
-    int list_height = rows - list_top - 2;
-    if (list_height < 1) list_height = 1;
     
-    if (st->playlist_count == 0) {
-        mvprintw(list_top + 1, 2, "No playlists yet. Press 'c' to create one.");
-        return;
+    if (mpv_ipc_fd >= 0) {
+        fds[nfds].fd = mpv_ipc_fd;
+        fds[nfds].events = POLLIN | (mpv_tx_len > 0 ? POLLOUT : 0);
+        nfds++;
     }
     
-    // Adjust scroll
-    if (st->playlist_selected < st->playlist_scroll) {
-        st->playlist_scroll = st->playlist_selected;
-    } else if (st->playlist_selected >= st->playlist_scroll + list_height) {
-        st->playlist_scroll = st->playlist_selected - list_height + 1;
+    int timeout_ms = -1;
+    if (wake_slot < 0) {
+        timeout_ms = 100;  // no wake pipe: fall back to polling
+    } else if (get_pending_download_count(st) > 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        timeout_ms = 1000 - (int)(ts.tv_nsec / 1000000) + 1;
     }
     
-    for (int i = 0; i < list_height && (st->playlist_scroll + i) < st->playlist_count; i++) {
-        int idx = st->playlist_scroll + i;
-        bool is_selected = (idx == st->playlist_selected);
-        
-        int y = list_top + i;
-        move(y, 0);
-        clrtoeol();
-        
-        if (is_selected) {
-            attron(A_REVERSE);
-        }
-        
-        // Load song count if needed
-        Playlist *pl = &st->playlists[idx];
-        if (pl->count == 0) {
-            load_playlist_songs(st, idx);
-        }
-        
-        mvprintw(y, 0, "   %3d. %s (%d songs)", idx + 1, pl->name, pl->count);
-        
-        if (is_selected) {
-            attroff(A_REVERSE);
-        }
+    // Wake up in time to write unsaved playlist edits
+    if (st->save_due_ms != 0) {
+        long long wait = st->save_due_ms - monotonic_ms();
+        int save_wait = wait > 0 ? (int)wait : 0;
+        if (timeout_ms < 0 || save_wait < timeout_ms) timeout_ms = save_wait;
     }
-}
-
-static void draw_playlist_songs_view(AppState *st, const char *status, int rows, int cols) {
-    if (st->current_playlist_idx < 0 || st->current_playlist_idx >= st->playlist_count) {
-        return;
+    
+    // An mpv that is still starting up gets connected to as soon as it can be
+    int mpv_wait = mpv_poll_timeout_ms();
+    if (mpv_wait >= 0 && (timeout_ms < 0 || mpv_wait < timeout_ms)) {
+        timeout_ms = mpv_wait;
     }
     
-    Playlist *pl = &st->playlists[st->current_playlist_idx];
-
-    mvprintw(4, 0, "Playlist: ");
-    attron(A_BOLD);
-    printw("%s", pl->name);
-    if (pl->is_youtube_playlist) printw(" [YT]");
-    attroff(A_BOLD);
-
-    mvprintw(4, cols - 20, "Songs: %d", pl->count);
-
-    if (status && status[0]) {
-        mvprintw(5, 0, ">>> %s", status);
+    // EINTR (e.g. SIGWINCH) just returns; getch() then reports KEY_RESIZE
+    int r = poll(fds, nfds, timeout_ms);
+    
+    if (r > 0 && wake_slot >= 0 && (fds[wake_slot].revents & POLLIN)) {
+        char drain[64];
+        while (read(ui_wake_fds[0], drain, sizeof(drain)) > 0) {
+            // Notifications carry no data
+        }
     }
+}
 
-    mvhline(6, 0, ACS_HLINE, cols);
+// ============================================================================
+// Session Setup
+// ============================================================================
 
-    int list_top = 7;
-    int list_height = rows - list_top - 2;
-    if (list_height < 1) list_height = 1;
+// Load everything and start the background threads; shared by the TUI and
+// the daemon
+static void start_session(AppState *st) {
+    // Index already downloaded files
+    build_local_file_index(st);
     
-    if (pl->count == 0) {
-        mvprintw(list_top + 1, 2, "Playlist is empty. Search for songs and press 'a' to add.");
-        return;
-    }
+    // Load playlists
+    load_playlists(st);
     
-    // Adjust scroll
-    if (st->playlist_song_selected < st->playlist_song_scroll) {
-        st->playlist_song_scroll = st->playlist_song_selected;
-    } else if (st->playlist_song_selected >= st->playlist_song_scroll + list_height) {
-        st->playlist_song_scroll = st->playlist_song_selected - list_height + 1;
+    // Playlist files are written in the background from here on
+    start_file_writer(&st->writer);
+    
+    // NEW: Load pending downloads from previous session
+    load_download_queue(st);
+    
+    // NEW: Start download thread if there are pending downloads
+    if (get_pending_download_count(st) > 0) {
+        start_download_thread(st);
     }
     
-    for (int i = 0; i < list_height && (st->playlist_song_scroll + i) < pl->count; i++) {
-        int idx = st->playlist_song_scroll + i;
-        bool is_selected = (idx == st->playlist_song_selected);
-        bool is_playing = (st->playing_from_playlist && 
-                          st->playing_playlist_idx == st->current_playlist_idx &&
-                          st->playing_index == idx);
-        
-        int y = list_top + i;
-        move(y, 0);
-        clrtoeol();
-        
-        char mark = ' ';
-        if (is_playing) {
-            mark = st->paused ? '|' : '>';
-            attron(A_BOLD);
-        }
-        if (is_selected) {
-            attron(A_REVERSE);
-        }
-        
-        char dur[16];
-        format_duration(pl->items[idx].duration, dur);
-
-        // Check if song is downloaded
-        char local_path[2048];
-        bool is_downloaded = get_local_file_path_for_song(st, pl->name,
-                                                           pl->items[idx].video_id,
-                                                           local_path, sizeof(local_path));
-        const char *dl_mark = is_downloaded ? "[D]" : "   ";
-
-        int max_title = cols - 20;
-        if (max_title < 20) max_title = 20;
-
-        char titlebuf[1024];
-        const char *title = pl->items[idx].title ? pl->items[idx].title : "(no title)";
-        strncpy(titlebuf, title, sizeof(titlebuf) - 1);
-        titlebuf[sizeof(titlebuf) - 1] = '\0';
-
-        if ((int)strlen(titlebuf) > max_title && max_title > 3) {
-            titlebuf[max_title - 3] = '.';
-            titlebuf[max_title - 2] = '.';
-            titlebuf[max_title - 1] = '.';
-            titlebuf[max_title] = '\0';
-        }
+    start_stream_resolver(&st->resolver);
+}
 
-        mvprintw(y, 0, " %c %3d. %s [%s] %s", mark, idx + 1, dl_mark, dur, titlebuf);
-        
-        if (is_selected) {
-            attroff(A_REVERSE);
+// Handle what mpv reported since the last tick and keep the next song
+// queued. Call every tick of the TUI or daemon loop.
+static void service_playback(AppState *st, char *status, size_t status_size) {
+    // Handle everything mpv reported since the last tick
+    mpv_maintain();
+    int mpv_changes = mpv_process_events(st);
+    if (mpv_changes & MPV_TRACK_ADVANCED) {
+        // mpv moved on to the queued song by itself
+        const char *title = now_playing_title(st);
+        if (title) {
+            snprintf(status, status_size, "Auto-playing: %s", title);
         }
-        if (is_playing) {
-            attroff(A_BOLD);
+    }
+    if ((mpv_changes & MPV_TRACK_FINISHED) && st->playing_index >= 0) {
+        // Nothing was queued (the list grew since, or the song failed):
+        // load the next one ourselves
+        int finished = st->playing_index;
+        play_next(st);
+        if (st->playing_index != finished) {
+            const char *title = now_playing_title(st);
+            if (title) {
+                snprintf(status, status_size, "Auto-playing: %s", title);
+            }
+        } else {
+            // Last song finished and mpv is idle
+            st->playing_index = -1;
+            st->playing_from_playlist = false;
+            st->playing_playlist_idx = -1;
+            st->paused = false;
+            snprintf(status, status_size, "Playback finished");
         }
     }
+    queue_next_song(st);
+    update_stream_resolver(st);
 }
 
-static void draw_add_to_playlist_view(AppState *st, const char *status, int rows, int cols) {
-    mvprintw(2, 0, "Add to playlist: ");
-    if (st->song_to_add && st->song_to_add->title) {
-        attron(A_BOLD);
-        int max_title = cols - 20;
-        char titlebuf[256];
-        strncpy(titlebuf, st->song_to_add->title, sizeof(titlebuf) - 1);
-        titlebuf[sizeof(titlebuf) - 1] = '\0';
-        if ((int)strlen(titlebuf) > max_title && max_title > 3) {
-            titlebuf[max_title - 3] = '.';
-            titlebuf[max_title - 2] = '.';
-            titlebuf[max_title - 1] = '.';
-            titlebuf[max_title] = '\0';
-        }
-        printw("%s", titlebuf);
-        attroff(A_BOLD);
-    }
+// Stop the background threads and write everything that is still unsaved.
+// False if some playlist edits could not be written.
+static bool stop_session(AppState *st) {
+    // Keep whatever a running import has fetched so far
+    stop_youtube_import(st);
+    pthread_mutex_destroy(&st->import.mutex);
+    cancel_search(st);
+    pthread_mutex_destroy(&st->search.mutex);
+    stop_stream_resolver(&st->resolver);
     
-    if (status && status[0]) {
-        mvprintw(5, 0, ">>> %s", status);
+    // NEW: Stop download thread
+    stop_download_thread(st);
+    write_download_stats(st);
+#ifdef DEBUG
+    if (perf_dump_on_exit) perf_dump(st->config_dir);
+#endif
+    
+    // Write unsaved playlist edits and wait until they are on disk; what
+    // the writer thread failed to write gets one more try from here
+    bool saved = flush_pending_saves(st);
+    stop_file_writer(&st->writer);
+    if (collect_failed_saves(st)) saved = flush_pending_saves(st);
+    close_download_journal(st);
+    destroy_download_queue(&st->download_queue);
+    
+    // No thread can notify any more
+    if (ui_wake_fds[0] >= 0) {
+        close(ui_wake_fds[0]);
+        close(ui_wake_fds[1]);
+        ui_wake_fds[0] = ui_wake_fds[1] = -1;
     }
+    return saved;
+}
+
+// Free what start_session loaded and close mpv
+static void free_session(AppState *st) {
+    filter_clear(st);
+    song_index_free(&st->song_index);
+    free_search_results(st);
+    arena_free(&st->search_strings);
+    arena_free(&st->search.strings);
+    free_all_playlists(st);
+    library_close(&st->library);
+    free_local_file_index(st);
+    pthread_mutex_destroy(&st->local_files.mutex);
+    mpv_quit();
+}
 
-    mvhline(6, 0, ACS_HLINE, cols);
+// ============================================================================
+// Daemon Mode
+// ============================================================================
 
-    int list_top = 7;
-    int list_height = rows - list_top - 2;
-    if (list_height < 1) list_height = 1;
+// A control request is one line: the command and its arguments separated by
+// tabs. The reply is "OK <message>" or "ERR <message>", possibly followed by
+// more lines, and ends when the daemon closes the connection.
+
+// Fill addr with the control socket path. Returns false if it does not fit.
+static bool control_socket_addr(AppState *st, struct sockaddr_un *addr) {
+    size_t len = strlen(st->control_socket);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (len >= sizeof(addr->sun_path)) return false;
+    memcpy(addr->sun_path, st->control_socket, len + 1);
+    return true;
+}
 
-    if (st->playlist_count == 0) {
-        mvprintw(list_top + 1, 2, "No playlists yet. Press 'c' to create one.");
-        return;
-    }
-    
-    // Adjust scroll
-    if (st->add_to_playlist_selected < st->add_to_playlist_scroll) {
-        st->add_to_playlist_scroll = st->add_to_playlist_selected;
-    } else if (st->add_to_playlist_selected >= st->add_to_playlist_scroll + list_height) {
-        st->add_to_playlist_scroll = st->add_to_playlist_selected - list_height + 1;
-    }
+// Connection to a running daemon, or -1 if there is none
+static int control_connect(AppState *st) {
+    struct sockaddr_un addr;
+    if (!control_socket_addr(st, &addr)) return -1;
     
-    for (int i = 0; i < list_height && (st->add_to_playlist_scroll + i) < st->playlist_count; i++) {
-        int idx = st->add_to_playlist_scroll + i;
-        bool is_selected = (idx == st->add_to_playlist_selected);
-        
-        int y = list_top + i;
-        move(y, 0);
-        clrtoeol();
-        
-        if (is_selected) {
-            attron(A_REVERSE);
-        }
-        
-        Playlist *pl = &st->playlists[idx];
-        mvprintw(y, 0, "   %3d. %s (%d songs)", idx + 1, pl->name, pl->count);
-        
-        if (is_selected) {
-            attroff(A_REVERSE);
-        }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
 }
 
-// NEW: Draw settings view
-static void draw_settings_view(AppState *st, const char *status, int rows, int cols) {
-    (void)rows; // Suppress unused parameter warning
-    mvprintw(4, 0, "Settings");
+static bool daemon_running(AppState *st) {
+    int fd = control_connect(st);
+    if (fd < 0) return false;
+    close(fd);  // an empty request gets no reply
+    return true;
+}
 
-    if (status && status[0]) {
-        mvprintw(5, 0, ">>> %s", status);
+// Take the lock that lets one TUI or daemon run per config directory.
+// Returns the descriptor to keep open while running, or -1 with errno
+// EWOULDBLOCK if another one holds it. The lock goes away with the
+// process, so the file is never removed.
+static int take_instance_lock(AppState *st) {
+    int fd = open(st->instance_lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
     }
+    return fd;
+}
 
-    mvhline(6, 0, ACS_HLINE, cols);
-
-    int y = 8;
-    
-    // Download Path setting
-    bool is_selected = (st->settings_selected == 0);
-    
-    mvprintw(y, 2, "Download Path:");
-    y++;
-    
-    if (is_selected) {
-        attron(A_REVERSE);
-    }
-    
-    if (st->settings_editing && is_selected) {
-        // Show edit buffer with cursor
-        mvprintw(y, 4, "%-*s", cols - 8, st->settings_edit_buffer);
-        
-        // Position cursor
-        move(y, 4 + st->settings_edit_pos);
-        curs_set(1);
+// Say why take_instance_lock failed
+static void report_instance_lock(AppState *st, const char *prog) {
+    if (errno != EWOULDBLOCK) {
+        fprintf(stderr, "Cannot lock %s: %s\n", st->instance_lock, strerror(errno));
+    } else if (daemon_running(st)) {
+        fprintf(stderr, "A shellbeats daemon is running; control it with '%s status', "
+                "'%s next' and so on, or stop it with '%s quit'\n", prog, prog, prog);
     } else {
-        // Show current value
-        int max_path = cols - 8;
-        char pathbuf[1024];
-        strncpy(pathbuf, st->config.download_path, sizeof(pathbuf) - 1);
-        pathbuf[sizeof(pathbuf) - 1] = '\0';
-        
-        if ((int)strlen(pathbuf) > max_path && max_path > 3) {
-            // Truncate from the beginning to show the end of the path
-            int offset = strlen(pathbuf) - max_path + 3;
-            memmove(pathbuf + 3, pathbuf + offset, strlen(pathbuf) - offset + 1);
-            pathbuf[0] = '.';
-            pathbuf[1] = '.';
-            pathbuf[2] = '.';
-        }
-        
-        mvprintw(y, 4, "%s", pathbuf);
-        curs_set(0);
+        fprintf(stderr, "shellbeats is already running\n");
     }
-    
-    if (is_selected) {
-        attroff(A_REVERSE);
+}
+
+// Non-blocking listening socket, or -1. Only call while holding the
+// instance lock: a socket file left by a daemon that was killed is replaced.
+static int control_listen(AppState *st) {
+    struct sockaddr_un addr;
+    if (!control_socket_addr(st, &addr)) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
     
-    y += 2;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
     
-    // Help text
-    mvprintw(y, 2, "Press Enter to edit, Esc to go back");
-    y++;
-    
-    if (st->settings_editing) {
-        mvprintw(y, 2, "Editing: Enter to save, Esc to cancel");
+    unlink(st->control_socket);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
     }
+    chmod(st->control_socket, 0600);
+    return fd;
 }
 
-// NEW: Draw exit confirmation dialog when downloads are pending
-static void draw_exit_dialog(AppState *st, int pending_count) {
-    (void)st; // Suppress unused parameter warning
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-    
-    int dialog_w = 50;
-    int dialog_h = 8;
-    int start_x = (cols - dialog_w) / 2;
-    int start_y = (rows - dialog_h) / 2;
-    
-    // Draw box background
-    for (int y = start_y; y < start_y + dialog_h; y++) {
-        mvhline(y, start_x, ' ', dialog_w);
+// Video id from a watch URL, a youtu.be link or a bare id, into out
+static bool control_video_id(const char *arg, char *out, size_t out_size) {
+    const char *id = arg;
+    const char *p;
+    if ((p = strstr(arg, "youtu.be/")) != NULL) {
+        id = p + strlen("youtu.be/");
+    } else if ((p = strstr(arg, "v=")) != NULL && (p == arg || p[-1] == '?' || p[-1] == '&')) {
+        id = p + 2;
+    } else if (strchr(arg, '/')) {
+        return false;
     }
     
-    // Draw title bar
-    attron(A_REVERSE);
-    mvprintw(start_y, start_x, "%-*s", dialog_w, "");
-    mvprintw(start_y, start_x + (dialog_w - 16) / 2, " Download Queue ");
-    attroff(A_REVERSE);
+    size_t len = 0;
+    while (id[len] && (isalnum((unsigned char)id[len]) || id[len] == '-' || id[len] == '_')) len++;
+    if (len == 0 || len >= out_size) return false;
     
-    // Draw content
-    mvprintw(start_y + 2, start_x + 2, "Downloads in progress: %d remaining", pending_count);
-    mvprintw(start_y + 4, start_x + 2, "Downloads will resume on next startup.");
+    memcpy(out, id, len);
+    out[len] = '\0';
+    return true;
+}
+
+static void control_status(AppState *st, FILE *out) {
+    const char *title = now_playing_title(st);
+    if (!title) {
+        fprintf(out, "OK stopped\n");
+    } else {
+        fprintf(out, "OK %s\n", st->paused ? "paused" : "playing");
+        fprintf(out, "title: %s\n", title);
+        if (st->playing_from_playlist) {
+            Playlist *pl = &st->playlists[st->playing_playlist_idx];
+            fprintf(out, "playlist: %s (%d/%d)\n", pl->name, st->playing_index + 1, pl->count);
+        }
+    }
     
-    // Draw options
-    attron(A_BOLD);
-    mvprintw(start_y + 6, start_x + 2, "[q] Quit anyway    [Esc] Cancel");
-    attroff(A_BOLD);
+    DownloadQueue *q = &st->download_queue;
+    pthread_mutex_lock(&q->mutex);
+    int active = q->active_count, pending = q->pending_count, retrying = q->retry_count;
+    int completed = q->completed, failed = q->failed;
+    pthread_mutex_unlock(&q->mutex);
     
-    refresh();
+    fprintf(out, "downloads: %d downloading, %d queued, %d retrying, %d done, %d failed\n",
+            active, pending, retrying, completed, failed);
 }
 
-// NEW: Draw About overlay
-static void draw_about_view(AppState *st, const char *status, int rows, int cols) {
-    (void)st; // Unused
-    (void)status; // Unused
-
-    int dialog_w = 60;
-    int dialog_h = 16;
-    int start_x = (cols - dialog_w) / 2;
-    int start_y = (rows - dialog_h) / 2;
-
-    // Draw box background
-    attron(A_BOLD);
-    for (int y = start_y; y < start_y + dialog_h; y++) {
-        mvhline(y, start_x, ' ', dialog_w);
+// Same figures as the downloads view, as text
+static void control_downloads(AppState *st, FILE *out) {
+    DownloadQueue *q = &st->download_queue;
+    DownloadTask active[MAX_DOWNLOAD_WORKERS];
+    int active_count = 0;
+    DownloadTask waiting[CONTROL_LIST_MAX];
+    int waiting_count = 0;
+    char next_titles[CONTROL_LIST_MAX][128];
+    int next_count = 0;
+    
+    // Copy what is printed, so a slow client does not hold up the workers
+    pthread_mutex_lock(&q->mutex);
+    for (int i = 0; i < MAX_DOWNLOAD_WORKERS; i++) {
+        int task_idx = q->workers[i].task_idx;
+        if (q->workers[i].started && task_idx >= 0) active[active_count++] = q->tasks[task_idx];
+    }
+    for (int i = 0; i < q->retry_count && waiting_count < CONTROL_LIST_MAX; i++) {
+        waiting[waiting_count++] = q->tasks[q->retry_tasks[i]];
+    }
+    for (int i = 0; i < q->fifo_len && next_count < CONTROL_LIST_MAX; i++) {
+        int task_idx = q->pending_fifo[(q->fifo_head + i) % MAX_DOWNLOAD_QUEUE];
+        if (q->tasks[task_idx].status != DOWNLOAD_PENDING) continue;
+        snprintf(next_titles[next_count], sizeof(next_titles[0]), "%s", q->tasks[task_idx].title);
+        next_count++;
+    }
+    int pending = q->pending_count, retrying = q->retry_count;
+    int completed = q->completed, failed = q->failed;
+    pthread_mutex_unlock(&q->mutex);
+    
+    fprintf(out, "OK %d downloading, %d queued, %d retrying, %d done, %d failed\n",
+            active_count, pending, retrying, completed, failed);
+    
+    long long now = monotonic_ms();
+    for (int i = 0; i < active_count; i++) {
+        DownloadTask *task = &active[i];
+        char eta[16], elapsed[16], percent[8];
+        format_duration(task->eta, eta);
+        format_duration((int)((now - task->started_ms) / 1000), elapsed);
+        if (task->bytes_total > 0) {
+            int pct = (int)(task->bytes_done * 100 / task->bytes_total);
+            snprintf(percent, sizeof(percent), "%d%%", pct > 100 ? 100 : pct);
+        } else {
+            snprintf(percent, sizeof(percent), "--");
+        }
+        fprintf(out, "downloading %4s %6.2f MB/s  ETA %5s  %5s  %s\n", percent,
+                task->speed / (1024.0 * 1024.0), eta, elapsed, task->title);
+    }
+    
+    time_t wall = time(NULL);
+    for (int i = 0; i < waiting_count; i++) {
+        char in[16];
+        format_duration((int)(waiting[i].retry_at - wall), in);
+        fprintf(out, "retrying    %s, try %d/%d in %s  %s\n", download_error_names[waiting[i].error],
+                waiting[i].attempts + 1, DOWNLOAD_MAX_ATTEMPTS, in, waiting[i].title);
+    }
+    
+    for (int i = 0; i < next_count; i++) {
+        fprintf(out, "queued      %s\n", next_titles[i]);
+    }
+    if (pending > next_count) {
+        fprintf(out, "... and %d more\n", pending - next_count);
     }
-    attroff(A_BOLD);
-
-    // Draw border
-    attron(A_BOLD);
-    mvaddch(start_y, start_x, ACS_ULCORNER);
-    mvaddch(start_y, start_x + dialog_w - 1, ACS_URCORNER);
-    mvaddch(start_y + dialog_h - 1, start_x, ACS_LLCORNER);
-    mvaddch(start_y + dialog_h - 1, start_x + dialog_w - 1, ACS_LRCORNER);
-    mvhline(start_y, start_x + 1, ACS_HLINE, dialog_w - 2);
-    mvhline(start_y + dialog_h - 1, start_x + 1, ACS_HLINE, dialog_w - 2);
-    mvvline(start_y + 1, start_x, ACS_VLINE, dialog_h - 2);
-    mvvline(start_y + 1, start_x + dialog_w - 1, ACS_VLINE, dialog_h - 2);
-    attroff(A_BOLD);
-
-    // Title
-    attron(A_BOLD | A_REVERSE);
-    mvprintw(start_y + 2, start_x + (dialog_w - 15) / 2, " ShellBeats v0.4");
-    attroff(A_BOLD | A_REVERSE);
-
-    // Version and description
-    mvprintw(start_y + 4, start_x + (dialog_w - 28) / 2, "made by Lalo for Nami & Elia");
-    mvprintw(start_y + 6, start_x + (dialog_w - 44) / 2, "A terminal-based music player for YouTube");
-
-    // Features
-    mvprintw(start_y + 8, start_x + 4, "Features:");
-    mvprintw(start_y + 9, start_x + 6, "* Search and stream music from YouTube");
-    mvprintw(start_y + 10, start_x + 6, "* Download songs as MP3");
-    mvprintw(start_y + 11, start_x + 6, "* Create and manage playlists");
-    mvprintw(start_y + 12, start_x + 6, "* Offline playback from local files");
-
-    // Footer
-    attron(A_DIM);
-    mvprintw(start_y + 14, start_x + (dialog_w - 40) / 2, "Built with mpv, yt-dlp, and ncurses");
-    attroff(A_DIM);
-
-    refresh();
 }
 
-static void draw_ui(AppState *st, const char *status) {
-    erase();
+static void control_play(AppState *st, int argc, char **argv, FILE *out) {
+    if (argc < 2) {
+        fprintf(out, "ERR usage: play <playlist> [song number]\n");
+        return;
+    }
     
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
+    int idx = -1;
+    for (int i = 0; i < st->playlist_count; i++) {
+        if (strcasecmp(st->playlists[i].name, argv[1]) == 0) {
+            idx = i;
+            break;
+        }
+    }
+    if (idx < 0) {
+        fprintf(out, "ERR no playlist named '%s'\n", argv[1]);
+        return;
+    }
     
-    draw_header(cols, st->view);
+    ensure_playlist_loaded(st, idx);
+    Playlist *pl = &st->playlists[idx];
+    int song = argc > 2 ? atoi(argv[2]) - 1 : 0;
+    if (song < 0 || song >= pl->count) {
+        fprintf(out, "ERR '%s' has %d songs\n", pl->name, pl->count);
+        return;
+    }
     
-    switch (st->view) {
-        case VIEW_SEARCH:
-            draw_search_view(st, status, rows, cols);
-            break;
-        case VIEW_PLAYLISTS:
-            draw_playlists_view(st, status, rows, cols);
-            break;
-        case VIEW_PLAYLIST_SONGS:
-            draw_playlist_songs_view(st, status, rows, cols);
-            break;
-        case VIEW_ADD_TO_PLAYLIST:
-            draw_add_to_playlist_view(st, status, rows, cols);
-            break;
-        case VIEW_SETTINGS:
-            draw_settings_view(st, status, rows, cols);
-            break;
-        case VIEW_ABOUT:
-            draw_about_view(st, status, rows, cols);
-            break;
+    play_playlist_song(st, idx, song);
+    if (st->playing_index != song || st->playing_playlist_idx != idx) {
+        fprintf(out, "ERR cannot play song %d of '%s'\n", song + 1, pl->name);
+        return;
+    }
+    fprintf(out, "OK Playing: %s\n", pl->items[song].title);
+}
+
+static void control_enqueue(AppState *st, int argc, char **argv, FILE *out) {
+    if (argc < 2) {
+        fprintf(out, "ERR usage: enqueue <url or video id> [title]\n");
+        return;
+    }
+    if (validate_youtube_playlist_url(argv[1])) {
+        fprintf(out, "ERR playlists are imported from the TUI, not enqueued\n");
+        return;
     }
     
-    draw_now_playing(st, rows, cols);
+    char video_id[SONG_VIDEO_ID_SIZE];
+    if (!control_video_id(argv[1], video_id, sizeof(video_id))) {
+        fprintf(out, "ERR no video id in '%s'\n", argv[1]);
+        return;
+    }
     
-    refresh();
+    const char *title = argc > 2 && argv[2][0] ? argv[2] : video_id;
+    int result = add_to_download_queue(st, video_id, title, NULL);
+    if (result > 0) {
+        fprintf(out, "OK Queued: %s\n", title);
+    } else if (result == 0) {
+        fprintf(out, "OK Already downloaded or queued: %s\n", title);
+    } else {
+        fprintf(out, "ERR download queue is full\n");
+    }
 }
 
-// ============================================================================
-// YouTube Playlist Progress Callback
-// ============================================================================
+static void control_help(FILE *out) {
+    fprintf(out, "OK commands:\n");
+    fprintf(out, "status                       what is playing and the download counts\n");
+    fprintf(out, "pause                        pause or resume\n");
+    fprintf(out, "next, prev                   skip to the next or previous song\n");
+    fprintf(out, "stop                         stop playback\n");
+    fprintf(out, "playlists                    list the playlists\n");
+    fprintf(out, "play <playlist> [n]          play a playlist from its n-th song\n");
+    fprintf(out, "enqueue <url|id> [title]     download a video\n");
+    fprintf(out, "downloads                    show the download queue\n");
+    fprintf(out, "quit                         stop the daemon\n");
+}
 
-static void youtube_fetch_progress_callback(int count, const char *message, void *user_data) {
-    (void)count; // Suppress unused parameter warning
-    char *status_buf = (char *)user_data;
-    if (status_buf && message) {
-        strncpy(status_buf, message, 511);
-        status_buf[511] = '\0';
-        
-        // Redraw UI to show progress
-        if (g_app_state) {
-            draw_ui(g_app_state, status_buf);
-            refresh(); // Force screen update
+static void control_dispatch(AppState *st, int argc, char **argv, FILE *out) {
+    const char *cmd = argv[0];
+    bool playing = st->playing_index >= 0;
+    
+    if (strcmp(cmd, "ping") == 0) {
+        fprintf(out, "OK pong\n");
+    } else if (strcmp(cmd, "help") == 0) {
+        control_help(out);
+    } else if (strcmp(cmd, "status") == 0) {
+        control_status(st, out);
+    } else if (strcmp(cmd, "pause") == 0) {
+        if (!playing) {
+            fprintf(out, "ERR nothing is playing\n");
+            return;
+        }
+        mpv_toggle_pause();
+        st->paused = !st->paused;
+        fprintf(out, "OK %s\n", st->paused ? "Paused" : "Playing");
+    } else if (strcmp(cmd, "next") == 0 || strcmp(cmd, "prev") == 0) {
+        if (!playing) {
+            fprintf(out, "ERR nothing is playing\n");
+            return;
+        }
+        int before = st->playing_index;
+        if (cmd[0] == 'n') {
+            play_next(st);
+        } else {
+            play_prev(st);
+        }
+        // A song mpv already buffered is switched to by mpv itself, and
+        // playing_index follows once it reports the change
+        bool switching = cmd[0] == 'n' && st->queued_index == before + 1;
+        if (st->playing_index == before && !switching) {
+            fprintf(out, "ERR no %s song\n", cmd[0] == 'n' ? "next" : "previous");
+            return;
+        }
+        fprintf(out, "OK %s track\n", cmd[0] == 'n' ? "Next" : "Previous");
+    } else if (strcmp(cmd, "stop") == 0) {
+        if (playing) {
+            mpv_stop_playback();
+            st->playing_index = -1;
+            st->playing_from_playlist = false;
+            st->playing_playlist_idx = -1;
+            st->paused = false;
+        }
+        fprintf(out, "OK Playback stopped\n");
+    } else if (strcmp(cmd, "playlists") == 0) {
+        fprintf(out, "OK %d playlists\n", st->playlist_count);
+        for (int i = 0; i < st->playlist_count; i++) {
+            Playlist *pl = &st->playlists[i];
+            int count = pl->loaded ? pl->count : pl->stored_count;
+            if (count >= 0) {
+                fprintf(out, "%s\t%d songs\n", pl->name, count);
+            } else {
+                fprintf(out, "%s\n", pl->name);
+            }
         }
+    } else if (strcmp(cmd, "play") == 0) {
+        control_play(st, argc, argv, out);
+    } else if (strcmp(cmd, "enqueue") == 0) {
+        control_enqueue(st, argc, argv, out);
+    } else if (strcmp(cmd, "downloads") == 0) {
+        control_downloads(st, out);
+    } else if (strcmp(cmd, "quit") == 0) {
+        stop_requested = 1;
+        fprintf(out, "OK Stopping the daemon\n");
+    } else {
+        fprintf(out, "ERR unknown command '%s' (try help)\n", cmd);
     }
 }
 
-// ============================================================================
-// Input Handling
-// ============================================================================
-
-static int get_string_input(char *buf, size_t bufsz, const char *prompt) {
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-    
-    int y = rows - 1;
-    move(y, 0);
-    clrtoeol();
-    
-    attron(A_BOLD);
-    mvprintw(y, 0, "%s", prompt);
-    attroff(A_BOLD);
-    refresh();
+// Read one request from a client, answer it and close the connection
+static void control_serve(AppState *st, int fd) {
+    // A client that stalls cannot stall playback for long: the request
+    // gets one deadline however it is split up, and each reply write a second
+    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    long long deadline = monotonic_ms() + CONTROL_READ_TIMEOUT_MS;
+    
+    char line[CONTROL_REQUEST_MAX];
+    size_t len = 0;
+    bool timed_out = false;
+    while (len < sizeof(line) - 1) {
+        long long wait = deadline - monotonic_ms();
+        int ready = 0;
+        if (wait > 0) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            ready = poll(&pfd, 1, (int)wait);
+            if (ready < 0 && errno == EINTR) continue;
+        }
+        if (ready == 0) timed_out = true;
+        if (ready <= 0) break;
+        
+        ssize_t n = read(fd, line + len, sizeof(line) - 1 - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        bool complete = memchr(line + len, '\n', n) != NULL;
+        len += n;
+        if (complete) break;
+    }
+    line[len] = '\0';
     
-    int prompt_len = strlen(prompt);
-    int max_input = cols - prompt_len - 2;
-    if (max_input > (int)bufsz - 1) max_input = bufsz - 1;
-    if (max_input < 1) max_input = 1;
+    char *nl = strchr(line, '\n');
+    if (nl) *nl = '\0';
+    if (!line[0]) {
+        close(fd);  // daemon_running probing, or a client that gave up
+        return;
+    }
     
-    // Disable timeout for blocking input
-    timeout(-1);
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return;
+    }
     
-    echo();
-    curs_set(1);
-    move(y, prompt_len);
+    char *argv[CONTROL_MAX_ARGS];
+    int argc = 0;
+    for (char *p = line; argc < CONTROL_MAX_ARGS; ) {
+        argv[argc++] = p;
+        char *tab = strchr(p, '\t');
+        if (!tab) break;
+        *tab = '\0';
+        p = tab + 1;
+    }
     
-    getnstr(buf, max_input);
+    if (!nl && len == sizeof(line) - 1) {
+        fprintf(out, "ERR request too long\n");
+    } else if (!nl && timed_out) {
+        fprintf(out, "ERR request timed out\n");
+    } else {
+        control_dispatch(st, argc, argv, out);
+    }
+    fclose(out);
+}
+
+// Keep the library, download queue and mpv running without a terminal,
+// taking commands on the control socket. Returns in the parent once the
+// daemon is listening.
+static int run_daemon(AppState *st, const char *prog) {
+    char status[512] = "";
+    if (!check_dependencies(status, sizeof(status))) {
+        fprintf(stderr, "%s\n", status);
+        return 1;
+    }
     
-    noecho();
-    curs_set(0);
+    // The child inherits the lock and keeps it after the parent exits
+    int lock_fd = take_instance_lock(st);
+    if (lock_fd < 0) {
+        report_instance_lock(st, prog);
+        return 1;
+    }
     
-    // Re-enable timeout for poll-based event checking
-    timeout(100);
+    int listen_fd = control_listen(st);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", st->control_socket, strerror(errno));
+        close(lock_fd);
+        return 1;
+    }
     
-    char *trimmed = trim_whitespace(buf);
-    if (trimmed != buf) {
-        memmove(buf, trimmed, strlen(trimmed) + 1);
+    // Fork before any thread exists; clients can connect as soon as the
+    // parent has returned
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Cannot start the daemon: %s\n", strerror(errno));
+        close(listen_fd);
+        unlink(st->control_socket);
+        close(lock_fd);
+        return 1;
+    }
+    if (pid > 0) {
+        printf("shellbeats daemon started (pid %d)\n", (int)pid);
+        return 0;
     }
     
-    return strlen(buf);
-}
-
-static void show_help(void) {
-    erase();
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-    (void)cols;
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+    }
     
-    int y = 2;
-    attron(A_BOLD);
-    mvprintw(y++, 2, "ShellBeats v0.4 | Help");
-    attroff(A_BOLD);
-    y++;
+    signal(SIGPIPE, SIG_IGN);
+    install_stop_handlers();
     
-    mvprintw(y++, 4, "GLOBAL CONTROLS:");
-    mvprintw(y++, 6, "/           Search YouTube");
-    mvprintw(y++, 6, "Enter       Play selected / Open playlist");
-    mvprintw(y++, 6, "Space       Pause/Resume playback");
-    mvprintw(y++, 6, "n           Next track");
-    mvprintw(y++, 6, "p           Previous track");
-    mvprintw(y++, 6, "x           Stop playback");
-    mvprintw(y++, 6, "Up/Down/j/k Navigate list");
-    mvprintw(y++, 6, "PgUp/PgDn   Page up/down");
-    mvprintw(y++, 6, "g/G         Go to start/end");
-    mvprintw(y++, 6, "S           Settings");  // NEW
-    mvprintw(y++, 6, "h or ?      Show this help");
-    mvprintw(y++, 6, "q           Quit");
-    y++;
+    start_session(st);
     
-    mvprintw(y++, 4, "PLAYLIST CONTROLS:");
-    mvprintw(y++, 6, "f           Open playlists menu");
-    mvprintw(y++, 6, "a           Add song to playlist");
-    mvprintw(y++, 6, "c           Create new playlist");
-    mvprintw(y++, 6, "d           Remove song from playlist");
-    mvprintw(y++, 6, "x           Delete playlist");
-    mvprintw(y++, 6, "Esc         Go back");
-    y++;
+    // Start mpv now, so the first play command does not wait for it
+    mpv_start_if_needed();
     
-    mvprintw(y++, 4, "Requirements: yt-dlp, mpv");
+    while (!stop_requested) {
+        poll_pending_saves(st, status, sizeof(status));
+        service_playback(st, status, sizeof(status));
+        
+        int client;
+        while (!stop_requested && (client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+            control_serve(st, client);
+            service_playback(st, status, sizeof(status));
+        }
+        if (stop_requested) break;
+        
+        wait_for_events(st, listen_fd);
+    }
     
-    attron(A_REVERSE);
-    mvprintw(rows - 2, 2, " Press any key to continue... ");
-    attroff(A_REVERSE);
+    close(listen_fd);
+    unlink(st->control_socket);
     
-    refresh();
-    timeout(-1);
-    getch();
-    timeout(100);
+    bool saved = stop_session(st);
+    free_session(st);
+    close(lock_fd);
+    if (!saved) {
+        fprintf(stderr, "Could not save playlist changes in %s\n", st->config_dir);
+        return 1;
+    }
+    return 0;
 }
 
-static bool check_dependencies(char *errmsg, size_t errsz) {
-    FILE *fp = popen("which yt-dlp 2>/dev/null", "r");
-    if (fp) {
-        char buf[256];
-        bool found = (fgets(buf, sizeof(buf), fp) != NULL && buf[0] == '/');
-        pclose(fp);
-        if (!found) {
-            snprintf(errmsg, errsz, "yt-dlp not found! Install with: pip install yt-dlp");
-            return false;
+// Send one command to the daemon and print its reply. Returns the exit status.
+static int control_client(AppState *st, const char *prog, int argc, char **argv) {
+    char request[CONTROL_REQUEST_MAX];
+    size_t len = 0;
+    
+    if (argc > CONTROL_MAX_ARGS) {
+        fprintf(stderr, "Too many arguments\n");
+        return 1;
+    }
+    for (int i = 0; i < argc; i++) {
+        if (strpbrk(argv[i], "\t\n")) {
+            fprintf(stderr, "Arguments cannot contain tabs or newlines\n");
+            return 1;
         }
+        int n = snprintf(request + len, sizeof(request) - len, "%s%s", i > 0 ? "\t" : "", argv[i]);
+        if (n < 0 || (size_t)n >= sizeof(request) - len - 1) {
+            fprintf(stderr, "Request too long\n");
+            return 1;
+        }
+        len += n;
     }
+    request[len++] = '\n';
     
-    fp = popen("which mpv 2>/dev/null", "r");
-    if (fp) {
-        char buf[256];
-        bool found = (fgets(buf, sizeof(buf), fp) != NULL && buf[0] == '/');
-        pclose(fp);
-        if (!found) {
-            snprintf(errmsg, errsz, "mpv not found! Install with: apt install mpv");
-            return false;
+    int fd = control_connect(st);
+    if (fd < 0) {
+        fprintf(stderr, "No shellbeats daemon is running (start one with %s --daemon)\n", prog);
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    for (size_t sent = 0; sent < len; ) {
+        ssize_t n = write(fd, request + sent, len - sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Cannot talk to the daemon: %s\n", strerror(errno));
+            close(fd);
+            return 1;
         }
+        sent += n;
     }
+    shutdown(fd, SHUT_WR);
     
-    return true;
+    FILE *in = fdopen(fd, "r");
+    if (!in) {
+        close(fd);
+        return 1;
+    }
+    
+    // The first line says whether it worked; the rest goes to the same stream
+    char *line = NULL;
+    size_t cap = 0;
+    int result = 1;
+    FILE *dest = stderr;
+    if (getline(&line, &cap, in) == -1) {
+        fprintf(stderr, "The daemon closed the connection without replying\n");
+    } else {
+        const char *msg = line;
+        if (strncmp(line, "OK", 2) == 0) {
+            result = 0;
+            dest = stdout;
+            msg = line + 2;
+        } else if (strncmp(line, "ERR", 3) == 0) {
+            msg = line + 3;
+        }
+        if (*msg == ' ') msg++;
+        if (*msg && *msg != '\n') fputs(msg, dest);
+        
+        while (getline(&line, &cap, in) != -1) {
+            fputs(line, dest);
+        }
+    }
+    
+    free(line);
+    fclose(in);
+    return result;
 }
 
 // ============================================================================
 // Main
 // ============================================================================
 
-int main(void) {
+static void print_usage(const char *prog) {
+    printf("Usage: %s [option]\n", prog);
+    printf("       %s <command> [args]   control a running daemon\n\n", prog);
+    printf("  --daemon        keep playing and downloading in the background\n");
+    printf("  --import-json   convert the JSON playlists into ~/%s/%s\n", CONFIG_DIR, LIBRARY_FILE);
+    printf("                  (add --force to replace an existing library)\n");
+    printf("  --export-json   write the library back out as JSON playlists\n");
+#ifdef DEBUG
+    printf("  --perf-dump     write hot-path timings to ~/%s/%s on exit\n", CONFIG_DIR, PERF_DUMP_FILE);
+#endif
+    printf("  -h, --help      show this help\n\n");
+    printf("Commands: status, pause, next, prev, stop, playlists, play <playlist> [n],\n");
+    printf("          enqueue <url|id> [title], downloads, quit (%s help for details)\n", prog);
+}
+
+// bench.c includes this file for the functions and brings its own main()
+#ifndef SHELLBEATS_NO_MAIN
+int main(int argc, char **argv) {
     setlocale(LC_ALL, "");
     
-    AppState st = {0};
+    // Too big for the stack (search results, download queue, paths)
+    static AppState st;
     st.playing_index = -1;
+    st.queued_index = -1;
     st.playing_playlist_idx = -1;
     st.current_playlist_idx = -1;
     st.view = VIEW_SEARCH;
     
-    // NEW: Initialize download queue mutex
-    pthread_mutex_init(&st.download_queue.mutex, NULL);
-    st.download_queue.current_idx = -1;
+    // NEW: Initialize download queue
+    init_download_queue(&st.download_queue);
+    pthread_mutex_init(&st.local_files.mutex, NULL);
+    pthread_mutex_init(&st.import.mutex, NULL);
+    pthread_mutex_init(&st.search.mutex, NULL);
+    if (pipe2(ui_wake_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        ui_wake_fds[0] = ui_wake_fds[1] = -1;
+    }
+    st.import.playlist_idx = -1;
     g_app_state = &st;
     
     // Initialize config directories
@@ -2448,28 +8808,71 @@ int main(void) {
         return 1;
     }
     
+    // "shellbeats next" and the like only talk to the daemon; skip the rest
+    // of the startup
+    if (argc > 1 && argv[1][0] != '-') {
+        return control_client(&st, argv[0], argc - 1, argv + 1);
+    }
+    
     // NEW: Load configuration
     load_config(&st);
     
-    // Load playlists
-    load_playlists(&st);
+    // library.bin, if there is one, holds the playlists
+    st.library.fd = -1;
+    st.library.enabled = library_open(&st.library, st.library_file);
+    bool library_unreadable = !st.library.enabled && file_exists(st.library_file);
     
-    // NEW: Load pending downloads from previous session
-    load_download_queue(&st);
+    bool daemon_mode = false;
+    bool force = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--force") == 0) force = true;
+    }
     
-    // NEW: Start download thread if there are pending downloads
-    if (get_pending_download_count(&st) > 0) {
-        start_download_thread(&st);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = true;
+        } else if (strcmp(argv[i], "--force") == 0) {
+            // Read above; only changes --import-json
+        } else if (strcmp(argv[i], "--import-json") == 0) {
+            return import_json_library(&st, force);
+        } else if (strcmp(argv[i], "--export-json") == 0) {
+            return export_json_library(&st);
+#ifdef DEBUG
+        } else if (strcmp(argv[i], "--perf-dump") == 0) {
+            perf_dump_on_exit = true;
+#endif
+        } else {
+            print_usage(argv[0]);
+            return strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+    
+    if (daemon_mode) {
+        return run_daemon(&st, argv[0]);
+    }
+    
+    // One TUI or daemon per config directory: they would drive the same
+    // mpv and download queue and write the same playlists
+    int lock_fd = take_instance_lock(&st);
+    if (lock_fd < 0) {
+        report_instance_lock(&st, argv[0]);
+        return 1;
     }
     
+    start_session(&st);
+    
     initscr();
     cbreak();
     noecho();
     keypad(stdscr, TRUE);
     curs_set(0);
     
-    // Set timeout for non-blocking input (for poll-based event checking)
-    timeout(100); // 100ms timeout
+    // Flush stdscr once so getch() has nothing of its own to repaint over
+    // the region windows
+    refresh();
+    
+    // Non-blocking input: the main loop sleeps in poll() and drains keys
+    timeout(0);
     
     char status[512] = "";
     
@@ -2482,12 +8885,24 @@ int main(void) {
         return 1;
     }
     
-    snprintf(status, sizeof(status), "Press / to search, d to download, f for playlists, h for help.");
+    if (library_unreadable) {
+        snprintf(status, sizeof(status), "%s is unreadable, using the JSON playlists",
+                 LIBRARY_FILE);
+    } else {
+        snprintf(status, sizeof(status), "Press / to search, d to download, f for playlists, h for help.");
+    }
     draw_ui(&st, status);
     
+    // Quit through the normal exit path below on SIGTERM, SIGINT and SIGHUP
+    install_stop_handlers();
     bool running = true;
     
-    while (running) {
+    while (running && !stop_requested) {
+        // Pick up songs from a running playlist import
+        poll_youtube_import(&st, status, sizeof(status));
+        poll_search(&st, status, sizeof(status));
+        poll_pending_saves(&st, status, sizeof(status));
+        
         // NEW: Update spinner for download animation
         time_t now = time(NULL);
         if (now != st.last_spinner_update) {
@@ -2495,45 +8910,15 @@ int main(void) {
             st.last_spinner_update = now;
         }
         
-        // Check for track end via mpv IPC
-        // Only check if we've been playing for at least 3 seconds
-        if (st.playing_index >= 0 && mpv_ipc_fd >= 0) {
-            if (now - st.playback_started >= 3) {
-                if (mpv_check_track_end()) {
-                    // Auto-play next track
-                    play_next(&st);
-                    if (st.playing_index >= 0) {
-                        const char *title = NULL;
-                        if (st.playing_from_playlist && st.playing_playlist_idx >= 0) {
-                            Playlist *pl = &st.playlists[st.playing_playlist_idx];
-                            if (st.playing_index < pl->count) {
-                                title = pl->items[st.playing_index].title;
-                            }
-                        } else if (st.playing_index < st.search_count) {
-                            title = st.search_results[st.playing_index].title;
-                        }
-                        if (title) {
-                            snprintf(status, sizeof(status), "Auto-playing: %s", title);
-                        }
-                    } else {
-                        snprintf(status, sizeof(status), "Playback finished");
-                    }
-                    draw_ui(&st, status);
-                }
-            } else {
-                // During grace period, still drain the socket buffer
-                char drain_buf[4096];
-                while (read(mpv_ipc_fd, drain_buf, sizeof(drain_buf)) > 0) {
-                    // Discard data during grace period
-                }
-            }
-        }
+        service_playback(&st, status, sizeof(status));
         
         int ch = getch();
 
         if (ch == ERR) {
-            // Timeout - redraw UI to update spinner and download status
+            // All pending input handled: repaint once, then sleep until
+            // the next key, mpv message, worker notification or spinner tick
             draw_ui(&st, status);
+            wait_for_events(&st, STDIN_FILENO);
             continue;
         }
         
@@ -2554,13 +8939,11 @@ int main(void) {
                 
                 case '\n':
                 case KEY_ENTER: // Save
-                    strncpy(st.config.download_path, st.settings_edit_buffer, 
-                            sizeof(st.config.download_path) - 1);
-                    st.config.download_path[sizeof(st.config.download_path) - 1] = '\0';
-                    save_config(&st);
-                    st.settings_editing = false;
-                    curs_set(0);
-                    snprintf(status, sizeof(status), "Download path saved");
+                    if (setting_set_value(&st, (SettingId)st.settings_selected,
+                                          st.settings_edit_buffer, status, sizeof(status))) {
+                        st.settings_editing = false;
+                        curs_set(0);
+                    }
                     break;
                 
                 case KEY_BACKSPACE:
@@ -2613,10 +8996,26 @@ int main(void) {
                     }
                     break;
             }
-            draw_ui(&st, status);
             continue;
         }
         
+        // Typing a filter: keys edit the pattern, arrows move through matches
+        if (st.filter.editing) {
+            filter_handle_key(&st, ch, list_height, status, sizeof(status));
+            continue;
+        }
+        
+        // A kept filter: moving goes through the matches, Esc drops it
+        if (filter_shown(&st)) {
+            filter_sync(&st);
+            if (ch == 27) {
+                filter_clear(&st);
+                snprintf(status, sizeof(status), "Filter cleared");
+                continue;
+            }
+            if (filter_move(&st, ch, list_height, true)) continue;
+        }
+        
         // Global keys
         switch (ch) {
             case 'q': {
@@ -2626,7 +9025,7 @@ int main(void) {
                     draw_exit_dialog(&st, pending);
                     timeout(-1);
                     int confirm = getch();
-                    timeout(100);
+                    timeout(0);
                     if (confirm == 'q') {
                         running = false;
                     }
@@ -2638,7 +9037,7 @@ int main(void) {
             }
             
             case ' ':
-                if (st.playing_index >= 0 && file_exists(IPC_SOCKET)) {
+                if (st.playing_index >= 0 && (mpv_ipc_fd >= 0 || mpv_pid > 0)) {
                     mpv_toggle_pause();
                     st.paused = !st.paused;
                     snprintf(status, sizeof(status), st.paused ? "Paused" : "Playing");
@@ -2669,7 +9068,7 @@ int main(void) {
                 draw_ui(&st, status);
                 timeout(-1);
                 getch(); // Wait for any key
-                timeout(100);
+                timeout(0);
                 st.view = VIEW_SEARCH;
                 break;
 
@@ -2690,13 +9089,36 @@ int main(void) {
                 } else if (st.view == VIEW_ABOUT) {
                     st.view = VIEW_SEARCH;
                     status[0] = '\0';
+                } else if (st.view == VIEW_DOWNLOADS) {
+                    st.view = st.downloads_return_view;
+                    status[0] = '\0';
                 }
                 break;
             
+            case 'w':
+                // Not from the add-to-playlist picker, which holds a song
+                if (st.view == VIEW_DOWNLOADS) {
+                    st.view = st.downloads_return_view;
+                } else if (st.view == VIEW_SEARCH || st.view == VIEW_PLAYLISTS ||
+                           st.view == VIEW_PLAYLIST_SONGS) {
+                    st.downloads_return_view = st.view;
+                    st.view = VIEW_DOWNLOADS;
+                }
+                status[0] = '\0';
+                continue;
+            
             case KEY_RESIZE:
-                clear();
+                // draw_ui lays the windows out again for the new size
+                ui_invalidate();
                 break;
             
+#ifdef DEBUG
+            case 'P':
+                st.perf_overlay = !st.perf_overlay;
+                ui_invalidate();  // uncover what the overlay hid
+                continue;
+#endif
+            
             default:
                 break;
         }
@@ -2749,28 +9171,48 @@ int main(void) {
                         }
                         break;
                     
+                    case 'F':
+                        if (st.search_count > 0) {
+                            if (filter_shown(&st)) {
+                                st.filter.editing = true;
+                            } else {
+                                filter_start(&st);
+                            }
+                            filter_status(&st, status, sizeof(status));
+                        } else {
+                            snprintf(status, sizeof(status), "Nothing to filter");
+                        }
+                        break;
+                    
                     case '/':
                     case 's': {
+                        if (filter_shown(&st)) filter_clear(&st);
                         char q[256] = {0};
                         int len = get_string_input(q, sizeof(q), "Search: ");
                         if (len > 0) {
-                            snprintf(status, sizeof(status), "Searching: %s ...", q);
-                            draw_ui(&st, status);
-                            
-                            int r = run_search(&st, q);
-                            if (r < 0) {
-                                snprintf(status, sizeof(status), "Search error!");
-                            } else if (r == 0) {
-                                snprintf(status, sizeof(status), "No results for: %s", q);
-                            } else {
-                                snprintf(status, sizeof(status), "Found %d results for: %s", r, q);
-                            }
+                            start_local_search(&st, q, status, sizeof(status));
                         } else {
                             snprintf(status, sizeof(status), "Search cancelled");
                         }
                         break;
                     }
                     
+                    // The same query on YouTube
+                    case 'o': {
+                        if (filter_shown(&st)) filter_clear(&st);
+                        char q[256];
+                        snprintf(q, sizeof(q), "%s", st.query);
+                        if (!q[0]) {
+                            int len = get_string_input(q, sizeof(q), "Search YouTube: ");
+                            if (len <= 0) {
+                                snprintf(status, sizeof(status), "Search cancelled");
+                                break;
+                            }
+                        }
+                        start_search(&st, q, status, sizeof(status));
+                        break;
+                    }
+                    
                     case 'x':
                         if (st.playing_index >= 0) {
                             mpv_stop_playback();
@@ -2876,7 +9318,7 @@ int main(void) {
                     case KEY_ENTER:
                         if (st.playlist_count > 0) {
                             st.current_playlist_idx = st.playlist_selected;
-                            load_playlist_songs(&st, st.current_playlist_idx);
+                            ensure_playlist_loaded(&st, st.current_playlist_idx);
                             st.playlist_song_selected = 0;
                             st.playlist_song_scroll = 0;
                             st.view = VIEW_PLAYLIST_SONGS;
@@ -2928,6 +9370,16 @@ int main(void) {
                     
                     // NEW: Add YouTube playlist
                     case 'p': {
+                        if (st.import.running) {
+                            char confirm[8] = {0};
+                            get_string_input(confirm, sizeof(confirm), "Cancel playlist import? (y/n): ");
+                            if (confirm[0] == 'y' || confirm[0] == 'Y') {
+                                cancel_youtube_import(&st);
+                                snprintf(status, sizeof(status), "Cancelling import...");
+                            }
+                            break;
+                        }
+                        
                         char url[512] = {0};
                         int len = get_string_input(url, sizeof(url), "YouTube playlist URL: ");
                         if (len > 0) {
@@ -2936,25 +9388,9 @@ int main(void) {
                                 break;
                             }
 
-                            snprintf(status, sizeof(status), "Validating URL...");
-                            draw_ui(&st, status);
-
-                            char fetched_title[256] = {0};
-                            Song temp_songs[MAX_PLAYLIST_ITEMS];
-                            int fetched = fetch_youtube_playlist(url, temp_songs, MAX_PLAYLIST_ITEMS, 
-                                                                 fetched_title, sizeof(fetched_title),
-                                                                 youtube_fetch_progress_callback, status);
-                            if (fetched <= 0) {
-                                snprintf(status, sizeof(status), "Failed to fetch playlist");
-                                break;
-                            }
-
-                            char playlist_name[256];
-                            int name_len = get_string_input(playlist_name, sizeof(playlist_name), "Playlist name: ");
-                            if (name_len == 0) {
-                                strncpy(playlist_name, fetched_title, sizeof(playlist_name) - 1);
-                                playlist_name[sizeof(playlist_name) - 1] = '\0';
-                            }
+                            char playlist_name[256] = {0};
+                            get_string_input(playlist_name, sizeof(playlist_name),
+                                             "Playlist name (empty = YouTube title): ");
 
                             char mode[8] = {0};
                             while (1) {
@@ -2965,30 +9401,11 @@ int main(void) {
                             }
                             bool stream_only = (mode[0] == 's' || mode[0] == 'S');
 
-                            int idx = create_playlist(&st, playlist_name, true);
-                            if (idx < 0) {
-                                snprintf(status, sizeof(status), "Failed to create playlist");
-                                for (int i = 0; i < fetched; i++) {
-                                    free(temp_songs[i].title);
-                                    free(temp_songs[i].video_id);
-                                    free(temp_songs[i].url);
-                                }
-                                break;
-                            }
-
-                            Playlist *pl = &st.playlists[idx];
-                            for (int i = 0; i < fetched; i++) {
-                                pl->items[i] = temp_songs[i];
-                                pl->count++;
-                            }
-                            save_playlist(&st, idx);
-
-                            if (!stream_only) {
-                                for (int i = 0; i < pl->count; i++) {
-                                    add_to_download_queue(&st, pl->items[i].video_id, pl->items[i].title, pl->name);
-                                }
+                            if (start_youtube_import(&st, url, playlist_name, stream_only)) {
+                                snprintf(status, sizeof(status), "Fetching playlist...");
+                            } else {
+                                snprintf(status, sizeof(status), "Failed to start import");
                             }
-                            status[0] = '\0';
                         } else {
                             snprintf(status, sizeof(status), "Cancelled");
                         }
@@ -2998,30 +9415,16 @@ int main(void) {
                     // NEW: Download entire playlist
                     case 'd':
                         if (st.playlist_count > 0) {
-                            Playlist *pl = &st.playlists[st.playlist_selected];
-                            
                             // Make sure songs are loaded
-                            if (pl->count == 0) {
-                                load_playlist_songs(&st, st.playlist_selected);
-                            }
+                            ensure_playlist_loaded(&st, st.playlist_selected);
+                            Playlist *pl = &st.playlists[st.playlist_selected];
                             
-                            int added = 0;
                             int skipped = 0;
+                            int added = add_playlist_to_download_queue(&st, pl, &skipped);
                             
-                            for (int i = 0; i < pl->count; i++) {
-                                int result = add_to_download_queue(&st, 
-                                    pl->items[i].video_id,
-                                    pl->items[i].title,
-                                    pl->name);
-                                
-                                if (result > 0) {
-                                    added++;
-                                } else if (result == 0) {
-                                    skipped++;
-                                }
-                            }
-                            
-                            if (added > 0) {
+                            if (added < 0) {
+                                snprintf(status, sizeof(status), "Download queue is full");
+                            } else if (added > 0) {
                                 snprintf(status, sizeof(status), "Queued %d songs (%d already downloaded)", 
                                          added, skipped);
                             } else if (skipped > 0) {
@@ -3094,6 +9497,19 @@ int main(void) {
                         }
                         break;
                     
+                    case 'F':
+                        if (pl && pl->count > 0) {
+                            if (filter_shown(&st)) {
+                                st.filter.editing = true;
+                            } else {
+                                filter_start(&st);
+                            }
+                            filter_status(&st, status, sizeof(status));
+                        } else {
+                            snprintf(status, sizeof(status), "Nothing to filter");
+                        }
+                        break;
+                    
                     // Remove song with 'r' (was 'd')
                     case 'r':
                         if (pl && pl->count > 0) {
@@ -3112,13 +9528,10 @@ int main(void) {
                     
                     case 'D':
                         if (pl && pl->is_youtube_playlist && pl->count > 0) {
-                            int added = 0;
-                            for (int i = 0; i < pl->count; i++) {
-                                int result = add_to_download_queue(&st, pl->items[i].video_id, 
-                                                                   pl->items[i].title, pl->name);
-                                if (result > 0) added++;
-                            }
-                            if (added > 0) {
+                            int added = add_playlist_to_download_queue(&st, pl, NULL);
+                            if (added < 0) {
+                                snprintf(status, sizeof(status), "Download queue is full");
+                            } else if (added > 0) {
                                 snprintf(status, sizeof(status), "Queued %d songs", added);
                             } else {
                                 snprintf(status, sizeof(status), "All songs already queued or downloaded");
@@ -3200,26 +9613,23 @@ int main(void) {
                 switch (ch) {
                     case KEY_UP:
                     case 'k':
-                        // For now only one setting, but prepared for more
                         if (st.settings_selected > 0) st.settings_selected--;
                         break;
                     
                     case KEY_DOWN:
                     case 'j':
-                        // For now only one setting
+                        if (st.settings_selected + 1 < SETTING_COUNT) st.settings_selected++;
                         break;
                     
                     case '\n':
                     case KEY_ENTER:
                         // Enter edit mode
-                        if (st.settings_selected == 0) {
-                            st.settings_editing = true;
-                            strncpy(st.settings_edit_buffer, st.config.download_path,
-                                    sizeof(st.settings_edit_buffer) - 1);
-                            st.settings_edit_buffer[sizeof(st.settings_edit_buffer) - 1] = '\0';
-                            st.settings_edit_pos = strlen(st.settings_edit_buffer);
-                            snprintf(status, sizeof(status), "Editing download path...");
-                        }
+                        st.settings_editing = true;
+                        setting_get_value(&st, (SettingId)st.settings_selected,
+                                          st.settings_edit_buffer, sizeof(st.settings_edit_buffer));
+                        st.settings_edit_pos = strlen(st.settings_edit_buffer);
+                        snprintf(status, sizeof(status), "Editing %s...",
+                                 setting_label((SettingId)st.settings_selected));
                         break;
                 }
                 break;
@@ -3229,21 +9639,20 @@ int main(void) {
                 // About view doesn't handle any keys (just closes on any key)
                 break;
             }
+            
+            case VIEW_DOWNLOADS:
+                break;
         }
-
-        draw_ui(&st, status);
     }
     
-    // NEW: Stop download thread
-    stop_download_thread(&st);
-    pthread_mutex_destroy(&st.download_queue.mutex);
+    bool saved = stop_session(&st);
     
+    ui_shutdown();
     endwin();
     
-    // Cleanup
-    free_search_results(&st);
-    free_all_playlists(&st);
-    mpv_quit();
-    
-    return 0;
+    if (!saved) fprintf(stderr, "Could not save playlist changes in %s\n", st.config_dir);
+    free_session(&st);
+    close(lock_fd);
+    return saved ? 0 : 1;
 }
+#endif
@@ -1,115 +1,331 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "youtube_playlist.h"
 
-int fetch_youtube_playlist(const char *url, Song *songs, int max_songs,
-                           char *playlist_title, size_t title_size,
-                           progress_callback_t progress_callback, void *callback_data) {
-    if (!url || !songs || max_songs <= 0 || !playlist_title || title_size == 0) 
-        return -1;
+// ============================================================================
+// yt-dlp Process Helpers
+// ============================================================================
 
-    // Report: Fetching playlist title
-    if (progress_callback) {
-        progress_callback(0, "Fetching playlist info...", callback_data);
+void ytdlp_process_init(YtdlpProcess *proc) {
+    pthread_mutex_init(&proc->lock, NULL);
+    proc->pid = -1;
+    proc->cancelled = false;
+}
+
+void ytdlp_process_destroy(YtdlpProcess *proc) {
+    pthread_mutex_destroy(&proc->lock);
+}
+
+FILE *ytdlp_spawn(const char *cmd, YtdlpProcess *proc) {
+    int fds[2];
+    if (pipe(fds) != 0) return NULL;
+
+    // The child may only make async-signal-safe calls before exec (another
+    // thread can hold the malloc lock), so its argv is built here
+    char *const argv[] = {"sh", "-c", (char *)cmd, NULL};
+
+    // Hold the lock across fork so a concurrent cancel either prevents the
+    // spawn or sees the new pid
+    pthread_mutex_lock(&proc->lock);
+
+    if (proc->cancelled) {
+        pthread_mutex_unlock(&proc->lock);
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
     }
 
-    char title_cmd[2048];
-    snprintf(title_cmd, sizeof(title_cmd),
-             "yt-dlp --flat-playlist --quiet --no-warnings "
-             "--print '%%(playlist_title)s' '%s' 2>/dev/null", url);
-
-    FILE *title_fp = popen(title_cmd, "r");
-    if (!title_fp) return -1;
-
-    char *title_line = NULL;
-    size_t title_cap = 0;
-    strcpy(playlist_title, "YouTube Playlist");
-
-    if (getline(&title_line, &title_cap, title_fp) != -1) {
-        size_t len = strlen(title_line);
-        while (len > 0 && (title_line[len-1] == '\n' || title_line[len-1] == '\r'))
-            title_line[--len] = '\0';
-        if (len > 0) {
-            strncpy(playlist_title, title_line, title_size - 1);
-            playlist_title[title_size - 1] = '\0';
-        }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Own process group, so cancel kills the shell and yt-dlp together
+        setpgid(0, 0);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv("/bin/sh", argv);
+        _exit(127);
     }
-    free(title_line);
-    pclose(title_fp);
 
-    // Report: Fetching songs
-    if (progress_callback) {
-        progress_callback(0, "Fetching songs...", callback_data);
+    close(fds[1]);
+
+    if (pid < 0) {
+        pthread_mutex_unlock(&proc->lock);
+        close(fds[0]);
+        return NULL;
+    }
+
+    setpgid(pid, pid);  // also set from the parent to avoid racing the child
+    proc->pid = pid;
+    pthread_mutex_unlock(&proc->lock);
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    FILE *fp = fdopen(fds[0], "r");
+    if (!fp) {
+        close(fds[0]);
+        ytdlp_cancel(proc);
+        ytdlp_finish(NULL, proc);
+    }
+    return fp;
+}
+
+int ytdlp_finish(FILE *fp, YtdlpProcess *proc) {
+    if (fp) fclose(fp);
+
+    pthread_mutex_lock(&proc->lock);
+    pid_t pid = proc->pid;
+    pthread_mutex_unlock(&proc->lock);
+
+    if (pid <= 0) return -1;
+
+    int wstatus = 0;
+    pid_t r;
+    do {
+        r = waitpid(pid, &wstatus, 0);
+    } while (r < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&proc->lock);
+    proc->pid = -1;
+    pthread_mutex_unlock(&proc->lock);
+
+    if (r == pid && WIFEXITED(wstatus)) return WEXITSTATUS(wstatus);
+    return -1;
+}
+
+void ytdlp_cancel(YtdlpProcess *proc) {
+    pthread_mutex_lock(&proc->lock);
+    proc->cancelled = true;
+    if (proc->pid > 0) {
+        kill(-proc->pid, SIGTERM);
+    }
+    pthread_mutex_unlock(&proc->lock);
+}
+
+// ============================================================================
+// Songs
+// ============================================================================
+
+bool song_set_video_id(Song *song, const char *id) {
+    size_t len = strlen(id);
+    if (len == 0 || len >= sizeof(song->video_id)) return false;
+    memcpy(song->video_id, id, len + 1);
+    return true;
+}
+
+void youtube_watch_url(const char *video_id, char *out, size_t out_size) {
+    snprintf(out, out_size, "https://www.youtube.com/watch?v=%s", video_id);
+}
+
+// ============================================================================
+// Playlist Fetching
+// ============================================================================
+
+static void strip_newline(char *line) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+        line[--len] = '\0';
+}
+
+// Last "|||" separator in line, or NULL
+static char *find_last_separator(char *line) {
+    char *last = NULL;
+    for (char *p = strstr(line, "|||"); p; p = strstr(p + 3, "|||"))
+        last = p;
+    return last;
+}
+
+// Split one "playlist_title|||title|||id|||duration" line in place.
+// id and duration are taken from the right and the playlist title from the
+// left, so a song title containing "|||" stays intact.
+static bool parse_playlist_line(char *line, char **playlist_title, char **title,
+                                char **video_id, int *duration) {
+    if (!line[0] || strncmp(line, "ERROR", 5) == 0) return false;
+
+    char *first = strstr(line, "|||");
+    char *last = find_last_separator(line);
+    if (!first || last == first) return false;
+    *last = '\0';
+
+    char *id_sep = find_last_separator(line);
+    if (!id_sep || id_sep == first) return false;
+    *id_sep = '\0';
+    *first = '\0';
+
+    *playlist_title = line;
+    *title = first + 3;
+    *video_id = id_sep + 3;
+    *duration = atoi(last + 3);
+
+    return (*video_id)[0] != '\0';
+}
+
+int stream_youtube_playlist(const char *url, YtdlpProcess *proc,
+                            playlist_title_callback_t on_title,
+                            playlist_song_callback_t on_song, void *user_data) {
+    if (!url || !on_song) return -1;
+
+    YtdlpProcess local_proc;
+    bool own_proc = (proc == NULL);
+    if (own_proc) {
+        ytdlp_process_init(&local_proc);
+        proc = &local_proc;
     }
 
+    // One invocation prints the playlist title with every entry; the title
+    // is taken from the first record
     char cmd[2048];
     snprintf(cmd, sizeof(cmd),
              "yt-dlp --flat-playlist --quiet --no-warnings "
-             "--print '%%(title)s|||%%(id)s|||%%(duration)s' "
+             "--print '%%(playlist_title)s|||%%(title)s|||%%(id)s|||%%(duration)s' "
              "'%s' 2>/dev/null", url);
 
-    FILE *fp = popen(cmd, "r");
-    if (!fp) return -1;
+    int count = -1;
+    FILE *fp = ytdlp_spawn(cmd, proc);
+    if (!fp) goto out;
 
     char *line = NULL;
     size_t cap = 0;
-    int count = 0;
+    bool title_reported = false;
 
-    while (count < max_songs && getline(&line, &cap, fp) != -1) {
-        size_t len = strlen(line);
-        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
-            line[--len] = '\0';
+    count = 0;
 
-        if (!line[0] || strncmp(line, "ERROR", 5) == 0) continue;
+    while (getline(&line, &cap, fp) != -1) {
+        strip_newline(line);
 
-        char *sep1 = strstr(line, "|||");
-        if (!sep1) continue;
-        *sep1 = '\0';
-        char *sep2 = strstr(sep1 + 3, "|||");
-        if (!sep2) continue;
-        *sep2 = '\0';
+        char *playlist_title, *title, *video_id;
+        int duration;
+        if (!parse_playlist_line(line, &playlist_title, &title, &video_id, &duration)) {
+            continue;
+        }
 
-        const char *title = line;
-        const char *video_id = sep1 + 3;
-        const char *duration_str = sep2 + 3;
+        if (!title_reported) {
+            title_reported = true;
+            if (on_title) {
+                bool usable = playlist_title[0] && strcmp(playlist_title, "NA") != 0;
+                on_title(usable ? playlist_title : "YouTube Playlist", user_data);
+            }
+        }
 
-        if (!video_id[0]) continue;
+        Song song = {
+            .title = title,
+            .duration = duration,
+        };
+        if (!song_set_video_id(&song, video_id)) continue;
 
-        songs[count].title = strdup(title);
-        songs[count].video_id = strdup(video_id);
-        songs[count].url = malloc(256);
-        if (songs[count].url) {
-            snprintf(songs[count].url, 256, "https://www.youtube.com/watch?v=%s", video_id);
-        }
-        songs[count].duration = atoi(duration_str);
-
-        if (songs[count].title && songs[count].video_id && songs[count].url) {
-            count++;
-            // Report progress every 10 songs
-            if (progress_callback && (count % 10 == 0 || count == 1)) {
-                char msg[128];
-                snprintf(msg, sizeof(msg), "Fetched %d songs...", count);
-                progress_callback(count, msg, callback_data);
-            }
-        } else {
-            free(songs[count].title);
-            free(songs[count].video_id);
-            free(songs[count].url);
+        count++;
+        if (!on_song(&song, user_data)) {
+            ytdlp_cancel(proc);
+            break;
         }
     }
 
     free(line);
-    pclose(fp);
-    
+
+    pthread_mutex_lock(&proc->lock);
+    bool cancelled = proc->cancelled;
+    pthread_mutex_unlock(&proc->lock);
+
+    // A fetch that was cancelled exits nonzero too; otherwise a failing
+    // yt-dlp means the list is incomplete, whatever it printed
+    if (ytdlp_finish(fp, proc) != 0 && !cancelled) {
+        count = -1;
+    }
+
+    if (!title_reported && on_title) {
+        on_title("YouTube Playlist", user_data);
+    }
+
+out:
+    if (own_proc) {
+        ytdlp_process_destroy(&local_proc);
+    }
+    return count;
+}
+
+// Collects streamed entries into the caller's array for fetch_youtube_playlist
+typedef struct {
+    Song *songs;
+    int max_songs;
+    int count;
+    char *playlist_title;
+    size_t title_size;
+    progress_callback_t progress_callback;
+    void *callback_data;
+} FetchCollector;
+
+static void collect_title(const char *title, void *user_data) {
+    FetchCollector *c = user_data;
+
+    strncpy(c->playlist_title, title, c->title_size - 1);
+    c->playlist_title[c->title_size - 1] = '\0';
+
+    // Report: Fetching songs
+    if (c->progress_callback) {
+        c->progress_callback(0, "Fetching songs...", c->callback_data);
+    }
+}
+
+static bool collect_song(const Song *song, void *user_data) {
+    FetchCollector *c = user_data;
+    Song *dst = &c->songs[c->count];
+
+    *dst = *song;
+    dst->title = strdup(song->title);
+
+    if (dst->title) {
+        c->count++;
+        // Report progress every 10 songs
+        if (c->progress_callback && (c->count % 10 == 0 || c->count == 1)) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Fetched %d songs...", c->count);
+            c->progress_callback(c->count, msg, c->callback_data);
+        }
+    }
+
+    return c->count < c->max_songs;
+}
+
+int fetch_youtube_playlist(const char *url, Song *songs, int max_songs,
+                           char *playlist_title, size_t title_size,
+                           progress_callback_t progress_callback, void *callback_data) {
+    if (!url || !songs || max_songs <= 0 || !playlist_title || title_size == 0)
+        return -1;
+
+    // Report: Fetching playlist title
+    if (progress_callback) {
+        progress_callback(0, "Fetching playlist info...", callback_data);
+    }
+
+    strncpy(playlist_title, "YouTube Playlist", title_size - 1);
+    playlist_title[title_size - 1] = '\0';
+
+    FetchCollector c = {
+        .songs = songs,
+        .max_songs = max_songs,
+        .count = 0,
+        .playlist_title = playlist_title,
+        .title_size = title_size,
+        .progress_callback = progress_callback,
+        .callback_data = callback_data,
+    };
+
+    if (stream_youtube_playlist(url, NULL, collect_title, collect_song, &c) < 0) {
+        return -1;
+    }
+
     // Report: Complete
-    if (progress_callback && count > 0) {
+    if (progress_callback && c.count > 0) {
         char msg[128];
-        snprintf(msg, sizeof(msg), "Completed! Fetched %d songs", count);
-        progress_callback(count, msg, callback_data);
+        snprintf(msg, sizeof(msg), "Completed! Fetched %d songs", c.count);
+        progress_callback(c.count, msg, callback_data);
     }
-    
-    return count;
+
+    return c.count;
 }
 
 bool validate_youtube_playlist_url(const char *url) {
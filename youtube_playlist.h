@@ -1,24 +1,75 @@
 #ifndef YOUTUBE_PLAYLIST_H
 #define YOUTUBE_PLAYLIST_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
 
+// YouTube video ids are 11 characters
+#define SONG_VIDEO_ID_SIZE 16
+#define SONG_URL_SIZE 64
+
+// The watch URL is not stored; build it with youtube_watch_url when needed.
+// Who owns title depends on the list holding the song.
 typedef struct {
     char *title;
-    char *video_id;
-    char *url;
+    char video_id[SONG_VIDEO_ID_SIZE];
     int duration;
 } Song;
 
+// Copy id into song->video_id. Returns false if it is empty or too long.
+bool song_set_video_id(Song *song, const char *id);
+
+// "https://www.youtube.com/watch?v=<id>" into out (SONG_URL_SIZE is enough)
+void youtube_watch_url(const char *video_id, char *out, size_t out_size);
+
 // Callback function type for progress updates
 // Parameters: current_count, message, user_data
 typedef void (*progress_callback_t)(int current_count, const char *message, void *user_data);
 
-int fetch_youtube_playlist(const char *url, Song *songs, int max_songs, 
+// Callbacks for streaming fetches. The Song passed to a song callback only
+// lives for the duration of the call; copy what you need.
+// Return false from a song callback to stop the fetch.
+typedef void (*playlist_title_callback_t)(const char *title, void *user_data);
+typedef bool (*playlist_song_callback_t)(const Song *song, void *user_data);
+
+// A running yt-dlp child, so another thread can cancel it
+typedef struct {
+    pthread_mutex_t lock;
+    pid_t pid;        // -1 when nothing is running
+    bool cancelled;
+} YtdlpProcess;
+
+void ytdlp_process_init(YtdlpProcess *proc);
+void ytdlp_process_destroy(YtdlpProcess *proc);
+
+// Run a shell command in its own process group and return its stdout.
+// Returns NULL on failure or if the process was already cancelled.
+FILE *ytdlp_spawn(const char *cmd, YtdlpProcess *proc);
+
+// Close the stream returned by ytdlp_spawn and reap the child.
+// Returns the exit status, or -1 if it did not exit normally.
+int ytdlp_finish(FILE *fp, YtdlpProcess *proc);
+
+// Kill the running child (if any); later spawns on proc fail until re-init
+void ytdlp_cancel(YtdlpProcess *proc);
+
+// Fill songs with up to max_songs entries; each title is malloc'd and must
+// be freed by the caller
+int fetch_youtube_playlist(const char *url, Song *songs, int max_songs,
                            char *playlist_title, size_t title_size,
                            progress_callback_t progress_callback, void *callback_data);
 
+// Fetch a playlist, reporting the title and each entry as soon as yt-dlp
+// prints it. proc may be NULL if the fetch never needs to be cancelled.
+// Returns the number of songs reported, or -1 on error. yt-dlp exiting
+// with an error counts as one even if some songs were reported first.
+int stream_youtube_playlist(const char *url, YtdlpProcess *proc,
+                            playlist_title_callback_t on_title,
+                            playlist_song_callback_t on_song, void *user_data);
+
 bool validate_youtube_playlist_url(const char *url);
 
 #endif